@@ -0,0 +1,386 @@
+/*
+ * Replay an allocation trace against the allocation cache.
+ *
+ * Usage: gpuarray-alloc-replay [-b block_size] [-M max_block_size]
+ *                              [-L large_threshold] [-f frag_size]
+ *                              [-m memory] [-n samples] trace
+ *
+ * Traces are recorded by running a program with GPUARRAY_ALLOC_TRACE
+ * set to a file name (see src/util/alloc_trace.h for the format).
+ *
+ * The defaults for the allocator settings are the ones used by the
+ * cuda backend (see gpucontext_alloc_policy in gpuarray/buffer.h).
+ *
+ * The allocations are replayed with the given allocator settings on
+ * fake memory so that traces from big devices can be replayed
+ * anywhere.  If a memory size is given with -m, raw allocations over
+ * that limit fail like they would on a device of that size.
+ *
+ * This prints the memory in use, reserved from the raw allocator and
+ * the fragmentation of the cache (1 - largest free block / cached
+ * bytes) at regular points of the trace and then a summary with the
+ * peaks and the time spent in the allocator.
+ *
+ * Sizes can have a K, M or G suffix.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util/alloc_trace.h"
+#include "util/suballoc.h"
+
+typedef struct _fake_mem {
+  size_t limit;
+  size_t used;
+  size_t peak;
+  size_t next;
+  size_t raw_allocs;
+  size_t raw_fails;
+} fake_mem;
+
+static int fake_raw_alloc(void *ud, size_t sz, size_t *ptr) {
+  fake_mem *m = (fake_mem *)ud;
+  if (m->limit != 0 && m->used + sz > m->limit) {
+    m->raw_fails++;
+    return GA_MEMORY_ERROR;
+  }
+  /* Addresses are only used for arithmetic, never reuse them */
+  *ptr = m->next;
+  m->next += sz;
+  m->used += sz;
+  if (m->used > m->peak)
+    m->peak = m->used;
+  m->raw_allocs++;
+  return GA_NO_ERROR;
+}
+
+static void fake_raw_free(void *ud, size_t ptr, size_t sz) {
+  ((fake_mem *)ud)->used -= sz;
+}
+
+static sa_block *fake_block_new(void *ud, size_t ptr, size_t sz) {
+  return malloc(sizeof(sa_block));
+}
+
+static void fake_block_free(void *ud, sa_block *b) {
+  free(b);
+}
+
+static const suballoc_ops fake_ops = {
+  fake_raw_alloc,
+  fake_raw_free,
+  fake_block_new,
+  fake_block_free,
+  NULL,
+  NULL,
+};
+
+/* One allocator per context of the trace */
+typedef struct _replay_ctx {
+  uint64_t id;
+  suballoc *sa;
+} replay_ctx;
+
+/* Live buffers, by (context, buffer) */
+typedef struct _live_buf {
+  struct _live_buf *next;
+  uint64_t ctx;
+  uint64_t buf;
+  replay_ctx *rc;
+  sa_block *b;
+} live_buf;
+
+#define NBUCKETS (1 << 16)
+
+static live_buf *live[NBUCKETS];
+static replay_ctx *ctxs;
+static size_t nctxs;
+
+static fake_mem mem;
+static gpucontext_alloc_policy policy = {
+  4 * 1024 * 1024,
+  64 * 1024 * 1024,
+  16 * 1024 * 1024,
+};
+static size_t frag_size = 64;
+
+static size_t bucket(uint64_t ctx, uint64_t buf) {
+  uint64_t h = (ctx ^ (buf * 0x9E3779B97F4A7C15ULL));
+  return (size_t)((h ^ (h >> 29)) & (NBUCKETS - 1));
+}
+
+static live_buf **find_buf(uint64_t ctx, uint64_t buf) {
+  live_buf **p = &live[bucket(ctx, buf)];
+  while (*p != NULL && ((*p)->ctx != ctx || (*p)->buf != buf))
+    p = &(*p)->next;
+  return p;
+}
+
+static replay_ctx *get_ctx(uint64_t id) {
+  replay_ctx *tmp;
+  size_t i;
+
+  for (i = 0; i < nctxs; i++)
+    if (ctxs[i].id == id)
+      return &ctxs[i];
+  /* Pointers to the contexts are kept in live_buf so this can't move */
+  if (nctxs == 64) {
+    fprintf(stderr, "Too many contexts in trace\n");
+    exit(1);
+  }
+  if (ctxs == NULL) {
+    ctxs = calloc(64, sizeof(replay_ctx));
+    if (ctxs == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  tmp = &ctxs[nctxs++];
+  tmp->id = id;
+  tmp->sa = suballoc_new(&fake_ops, &mem, policy.block_size, frag_size,
+                         global_err);
+  if (tmp->sa == NULL ||
+      suballoc_set_policy(tmp->sa, &policy, global_err) != GA_NO_ERROR) {
+    fprintf(stderr, "%s\n", global_err->msg);
+    exit(1);
+  }
+  return tmp;
+}
+
+static double now(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static size_t get_size(const char *s) {
+  char *end;
+  double v = strtod(s, &end);
+  switch (*end) {
+  case 'k': case 'K': v *= 1024.0; end++; break;
+  case 'm': case 'M': v *= 1024.0 * 1024.0; end++; break;
+  case 'g': case 'G': v *= 1024.0 * 1024.0 * 1024.0; end++; break;
+  }
+  if (*end != '\0' || v < 0) {
+    fprintf(stderr, "Invalid size: %s\n", s);
+    exit(2);
+  }
+  return (size_t)v;
+}
+
+static alloc_trace_rec *load(const char *fname, size_t *n) {
+  FILE *f = fopen(fname, "rb");
+  char magic[8];
+  alloc_trace_rec *recs = NULL;
+  size_t a = 0;
+
+  *n = 0;
+  if (f == NULL) {
+    perror(fname);
+    return NULL;
+  }
+  if (fread(magic, 8, 1, f) != 1 ||
+      memcmp(magic, ALLOC_TRACE_MAGIC, 8) != 0) {
+    fprintf(stderr, "%s: not an allocation trace\n", fname);
+    fclose(f);
+    return NULL;
+  }
+  for (;;) {
+    if (*n == a) {
+      a = a ? a * 2 : 4096;
+      recs = realloc(recs, a * sizeof(alloc_trace_rec));
+      if (recs == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+      }
+    }
+    if (fread(&recs[*n], sizeof(alloc_trace_rec), 1, f) != 1)
+      break;
+    (*n)++;
+  }
+  /* A trace can be cut short if the program crashed */
+  if (!feof(f) || ftell(f) != (long)(8 + *n * sizeof(alloc_trace_rec)))
+    fprintf(stderr, "%s: ignoring incomplete record at the end\n", fname);
+  fclose(f);
+  return recs;
+}
+
+static void total_stats(gpucontext_memstats *st) {
+  gpucontext_memstats tmp;
+  size_t i;
+
+  memset(st, 0, sizeof(*st));
+  for (i = 0; i < nctxs; i++) {
+    suballoc_stats(ctxs[i].sa, &tmp);
+    st->live_bytes += tmp.live_bytes;
+    st->cached_bytes += tmp.cached_bytes;
+    st->reserved_bytes += tmp.reserved_bytes;
+    st->largest_free += tmp.largest_free;
+    st->allocs += tmp.allocs;
+    st->frees += tmp.frees;
+    st->splits += tmp.splits;
+    st->merges += tmp.merges;
+  }
+}
+
+static double frag(const gpucontext_memstats *st) {
+  if (st->cached_bytes == 0)
+    return 0.0;
+  return 1.0 - (double)st->largest_free / st->cached_bytes;
+}
+
+#define MB(x) ((x) / 1048576.0)
+
+int main(int argc, char *argv[]) {
+  gpucontext_memstats st;
+  alloc_trace_rec *recs;
+  live_buf **p, *lb;
+  replay_ctx *rc;
+  size_t n, i, samples = 20, next_sample = 0;
+  size_t peak_live = 0, failed = 0, unknown = 0, nsamples = 0;
+  double t, t_total = 0, t_max = 0, frag_sum = 0;
+  int c;
+
+  for (c = 1; c < argc && argv[c][0] == '-'; c++) {
+    if (argv[c][1] != '\0' && argv[c][2] == '\0' && c + 1 < argc) {
+      switch (argv[c][1]) {
+      case 'b': policy.block_size = get_size(argv[++c]); continue;
+      case 'M': policy.max_block_size = get_size(argv[++c]); continue;
+      case 'L': policy.large_threshold = get_size(argv[++c]); continue;
+      case 'f': frag_size = get_size(argv[++c]); continue;
+      case 'm': mem.limit = get_size(argv[++c]); continue;
+      case 'n': samples = get_size(argv[++c]); continue;
+      }
+    }
+    break;
+  }
+  if (c != argc - 1) {
+    fprintf(stderr, "Usage: %s [-b block_size] [-M max_block_size] "
+            "[-L large_threshold] [-f frag_size] [-m memory] "
+            "[-n samples] trace\n", argv[0]);
+    return 2;
+  }
+
+  if (policy.block_size == 0 || policy.max_block_size < policy.block_size) {
+    fprintf(stderr, "Need 0 < block_size <= max_block_size\n");
+    return 2;
+  }
+
+  recs = load(argv[c], &n);
+  if (recs == NULL)
+    return 1;
+  if (n == 0) {
+    fprintf(stderr, "%s: empty trace\n", argv[c]);
+    return 1;
+  }
+
+  printf("block size %zu-%zu, large threshold %zu, frag size %zu",
+         policy.block_size, policy.max_block_size, policy.large_threshold,
+         frag_size);
+  if (mem.limit != 0)
+    printf(", memory %.1f MB", MB(mem.limit));
+  printf("\n\n%10s %14s %14s %14s %8s\n", "time (s)", "live (MB)",
+         "reserved (MB)", "cached (MB)", "frag");
+
+  for (i = 0; i < n; i++) {
+    const alloc_trace_rec *r = &recs[i];
+    p = find_buf(r->ctx, r->buf);
+    if (r->op == ALLOC_TRACE_ALLOC) {
+      if (*p != NULL) {
+        /* The trace is missing a release, assume it happened */
+        unknown++;
+        if ((*p)->b != NULL)
+          suballoc_free((*p)->rc->sa, (*p)->b);
+        lb = *p;
+      } else {
+        lb = malloc(sizeof(live_buf));
+        if (lb == NULL) {
+          fprintf(stderr, "Out of memory\n");
+          return 1;
+        }
+        lb->next = NULL;
+        lb->ctx = r->ctx;
+        lb->buf = r->buf;
+      }
+      rc = get_ctx(r->ctx);
+      lb->rc = rc;
+      t = now();
+      lb->b = suballoc_alloc(rc->sa, (size_t)r->size);
+      t = now() - t;
+      /* Failed allocations are kept with a NULL block so that their
+         release is not reported as unmatched */
+      if (lb->b == NULL)
+        failed++;
+      *p = lb;
+    } else if (r->op == ALLOC_TRACE_FREE) {
+      if (*p == NULL) {
+        /* Released a buffer we don't know about */
+        unknown++;
+        continue;
+      }
+      lb = *p;
+      t = now();
+      if (lb->b != NULL)
+        suballoc_free(lb->rc->sa, lb->b);
+      t = now() - t;
+      *p = lb->next;
+      free(lb);
+    } else {
+      fprintf(stderr, "Unknown operation %u in record %zu\n", r->op, i);
+      return 1;
+    }
+    t_total += t;
+    if (t > t_max)
+      t_max = t;
+
+    total_stats(&st);
+    if (st.live_bytes > peak_live)
+      peak_live = st.live_bytes;
+    if (i == next_sample || i == n - 1) {
+      frag_sum += frag(&st);
+      nsamples++;
+      printf("%10.3f %14.1f %14.1f %14.1f %8.3f\n", r->time * 1e-9,
+             MB(st.live_bytes), MB(st.reserved_bytes),
+             MB(st.cached_bytes), frag(&st));
+      next_sample = samples ? (nsamples * n) / samples : n;
+    }
+  }
+
+  total_stats(&st);
+  printf("\n%zu operations in %zu context(s)\n", n, nctxs);
+  printf("peak live        %12.1f MB\n", MB(peak_live));
+  printf("peak reserved    %12.1f MB (x%.2f)\n", MB(mem.peak),
+         peak_live ? (double)mem.peak / peak_live : 0.0);
+  printf("raw allocations  %12zu (%zu failed)\n", mem.raw_allocs,
+         mem.raw_fails);
+  printf("splits / merges  %12zu / %zu\n", st.splits, st.merges);
+  printf("fragmentation    %12.3f (average of samples)\n",
+         nsamples ? frag_sum / nsamples : 0.0);
+  printf("allocator time   %12.3f ms (%.1f ns/op, max %.1f us)\n",
+         t_total * 1e3, t_total * 1e9 / n, t_max * 1e6);
+  if (failed)
+    printf("failed allocs    %12zu\n", failed);
+  if (unknown)
+    printf("unmatched ops    %12zu\n", unknown);
+
+  for (i = 0; i < NBUCKETS; i++) {
+    while (live[i] != NULL) {
+      lb = live[i];
+      live[i] = lb->next;
+      if (lb->b != NULL)
+        suballoc_free(lb->rc->sa, lb->b);
+      free(lb);
+    }
+  }
+  for (i = 0; i < nctxs; i++)
+    suballoc_destroy(ctxs[i].sa);
+  free(ctxs);
+  free(recs);
+  return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * Fill a kernel disk cache ahead of time for a list of architectures.
+ *
+ * Usage: gpuarray-precompile -o cache_dir -a arch [-a arch ...]
+ *                            [-v version] [-j jobs] [-p] [-c]
+ *                            [-m manifest ...] [source ...]
+ *
+ * The kernels come from preload manifests (see GPUARRAY_CACHE_PRELOAD
+ * in gpuarray/buffer.h) which hold the full sources as the library
+ * builds them, or from source files.  A source file is taken as is,
+ * with -c it gets the same preamble as GA_USE_CLUDA kernels.
+ *
+ * Architectures are given like "compute_35" or just "35", possibly as
+ * a comma-separated list.  The version is the cuda version of the
+ * machines that will use the cache, like "80" for 8.0 (it is part of
+ * the cache keys).  It defaults to GPUARRAY_CUDA_VERSION.
+ *
+ * The kernels are compiled with NVRTC by `jobs` threads (the number of
+ * processors by default) and no device is needed.  Since linking needs
+ * a device, the entries hold PTX that the driver finishes compiling
+ * when it is loaded.
+ *
+ * With -p the cache is a pack (GPUARRAY_CACHE_FORMAT=pack).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "private_cuda.h"
+#include "util/workq.h"
+
+typedef struct _pc_job {
+  work w; /* Keep first */
+  const char *arch;
+  strb *src;
+  strb bin;
+  strb log;
+  error e;
+  int res;
+} pc_job;
+
+static strb **srcs;
+static size_t nsrcs;
+static size_t asrcs;
+
+static char (*archs)[64];
+static size_t narchs;
+
+static int add_src(const strb *src) {
+  strb **tmp;
+  strb *s;
+  size_t i;
+
+  for (i = 0; i < nsrcs; i++)
+    if (srcs[i]->l == src->l && memcmp(srcs[i]->s, src->s, src->l) == 0)
+      return 0;
+  if (nsrcs == asrcs) {
+    asrcs = asrcs ? asrcs * 2 : 16;
+    tmp = realloc(srcs, asrcs * sizeof(strb *));
+    if (tmp == NULL)
+      return -1;
+    srcs = tmp;
+  }
+  s = strb_alloc(src->l);
+  if (s == NULL)
+    return -1;
+  strb_appendb(s, src);
+  srcs[nsrcs++] = s;
+  return 0;
+}
+
+static int oom;
+
+static void manifest_src(void *ud, const strb *src) {
+  if (add_src(src))
+    oom = 1;
+}
+
+static int load_source(const char *fname, int cluda) {
+  strb src = STRB_STATIC_INIT;
+  char buf[4096];
+  FILE *f;
+  size_t n;
+  int res;
+
+  f = fopen(fname, "rb");
+  if (f == NULL) {
+    perror(fname);
+    return -1;
+  }
+  if (cluda)
+    cuda_precompile_preamble(&src);
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    strb_appendn(&src, buf, n);
+  fclose(f);
+  /* Sources are NUL-terminated in the keys */
+  strb_append0(&src);
+  if (strb_error(&src)) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  res = add_src(&src);
+  strb_clear(&src);
+  if (res)
+    fprintf(stderr, "Out of memory\n");
+  return res;
+}
+
+static int add_archs(const char *list) {
+  char (*tmp)[64];
+  const char *end;
+  size_t l;
+
+  while (*list != '\0') {
+    end = strchr(list, ',');
+    if (end == NULL)
+      end = list + strlen(list);
+    l = end - list;
+    tmp = realloc(archs, (narchs + 1) * sizeof(*archs));
+    if (tmp == NULL)
+      return -1;
+    archs = tmp;
+    if (l > 0 && list[0] >= '0' && list[0] <= '9') {
+      if (l > 8)
+        return -1;
+      strcpy(archs[narchs], ARCH_PREFIX);
+      strncat(archs[narchs], list, l);
+    } else {
+      if (l == 0 || l > 63)
+        return -1;
+      memset(archs[narchs], 0, 64);
+      memcpy(archs[narchs], list, l);
+    }
+    narchs++;
+    list = *end ? end + 1 : end;
+  }
+  return 0;
+}
+
+static void compile_job(work *w) {
+  pc_job *j = (pc_job *)w;
+  j->res = cuda_precompile(j->arch, j->src, &j->bin, &j->log, &j->e);
+}
+
+int main(int argc, char *argv[]) {
+  const char *out = NULL;
+  const char *ver = getenv("GPUARRAY_CUDA_VERSION");
+  const char *manifests[64];
+  size_t nmanifests = 0;
+  unsigned int threads = ga_ncpus();
+  int pack = 0, cluda = 0;
+  size_t i, nfiles, njobs, failed = 0;
+  pc_job *jobs;
+  workq *q = NULL;
+  cache *c;
+  int a;
+
+  for (a = 1; a < argc && argv[a][0] == '-'; a++) {
+    if (argv[a][1] != '\0' && argv[a][2] == '\0') {
+      switch (argv[a][1]) {
+      case 'p': pack = 1; continue;
+      case 'c': cluda = 1; continue;
+      }
+      if (a + 1 < argc) {
+        switch (argv[a][1]) {
+        case 'o': out = argv[++a]; continue;
+        case 'v': ver = argv[++a]; continue;
+        case 'j': threads = (unsigned int)strtoul(argv[++a], NULL, 10);
+          continue;
+        case 'a':
+          if (add_archs(argv[++a])) {
+            fprintf(stderr, "Invalid architecture list: %s\n", argv[a]);
+            return 2;
+          }
+          continue;
+        case 'm':
+          if (nmanifests == 64) {
+            fprintf(stderr, "Too many manifests\n");
+            return 2;
+          }
+          manifests[nmanifests++] = argv[++a];
+          continue;
+        }
+      }
+    }
+    break;
+  }
+  nfiles = argc - a;
+  if (out == NULL || narchs == 0 || nmanifests + nfiles == 0) {
+    fprintf(stderr, "Usage: %s -o cache_dir -a arch [-a arch ...] "
+            "[-v version] [-j jobs] [-p] [-c] [-m manifest ...] "
+            "[source ...]\n", argv[0]);
+    return 2;
+  }
+  if (ver == NULL || strlen(ver) != 2) {
+    fprintf(stderr, "Need a cuda version like 80 (with -v or "
+            "GPUARRAY_CUDA_VERSION)\n");
+    return 2;
+  }
+
+  if (cuda_precompile_setup(ver[0] - '0', ver[1] - '0', global_err)
+      != GA_NO_ERROR) {
+    fprintf(stderr, "%s\n", global_err->msg);
+    return 1;
+  }
+
+  for (i = 0; i < nmanifests; i++) {
+    if (cuda_manifest_sources(manifests[i], manifest_src, NULL)) {
+      perror(manifests[i]);
+      return 1;
+    }
+    if (oom) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+  }
+  for (; a < argc; a++)
+    if (load_source(argv[a], cluda))
+      return 1;
+
+  c = cuda_precompile_cache(out, pack, global_err);
+  if (c == NULL) {
+    fprintf(stderr, "%s: %s\n", out, global_err->msg);
+    return 1;
+  }
+
+  njobs = nsrcs * narchs;
+  jobs = calloc(njobs, sizeof(pc_job));
+  if (jobs == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  if (threads > 1) {
+    q = workq_new(threads, global_err);
+    if (q == NULL) {
+      fprintf(stderr, "%s\n", global_err->msg);
+      return 1;
+    }
+  }
+  for (i = 0; i < njobs; i++) {
+    jobs[i].arch = archs[i % narchs];
+    jobs[i].src = srcs[i / narchs];
+    workq_submit(q, &jobs[i].w, compile_job);
+  }
+
+  /* The cache is only used from here */
+  for (i = 0; i < njobs; i++) {
+    pc_job *j = &jobs[i];
+    workq_wait(q, &j->w);
+    if (j->res == GA_NO_ERROR)
+      j->res = cuda_precompile_store(c, ver[0] - '0', ver[1] - '0', j->arch,
+                                     j->src, &j->bin, &j->e);
+    if (j->res != GA_NO_ERROR) {
+      failed++;
+      fprintf(stderr, "Kernel %zu for %s: %s\n", i / narchs, j->arch,
+              j->e.msg);
+      if (j->log.l != 0)
+        fprintf(stderr, "%.*s\n", (int)j->log.l, j->log.s);
+    }
+    strb_clear(&j->bin);
+    strb_clear(&j->log);
+  }
+  if (q != NULL)
+    workq_free(q);
+  cache_destroy(c);
+
+  printf("%zu kernels, %zu architectures, %zu entries added, %zu failed\n",
+         nsrcs, narchs, njobs - failed, failed);
+  return failed ? 1 : 0;
+}
@@ -37,6 +37,14 @@ cdef extern from "gpuarray/elemwise.h":
 
     cdef int GE_NOADDR64
     cdef int GE_CONVERT_F16
+    cdef int GE_PRECOMPILE
+
+    int GpuElemwise_built(_GpuElemwise *ge, int variant, unsigned int nd)
+
+    cdef int GE_VARIANT_CONTIG
+    cdef int GE_VARIANT_BASIC
+    cdef int GE_VARIANT_BASIC_32
+    cdef int GE_VARIANT_CONTIG_VEC
 
     cdef int GE_BROADCAST
     cdef int GE_NOCOLLAPSE
@@ -193,3 +201,26 @@ cdef class GpuElemwise:
         err = GpuElemwise_call(self.ge, self.callbuf, GE_BROADCAST if kwargs.get('broadcast', True) else 0)
         if err != GA_NO_ERROR:
             raise get_exc(err)("Could not call GpuElemwise")
+
+    property built_variants:
+        """
+        Kernels that were compiled for this operation so far.
+
+        This is a list of (kind, nd) tuples where kind is one of
+        'contig', 'contig_vec', 'basic' or 'basic_32' (nd is 0 for
+        'contig' and 'contig_vec').
+        """
+        def __get__(self):
+            cdef unsigned int nd
+            res = []
+            if GpuElemwise_built(self.ge, GE_VARIANT_CONTIG, 0):
+                res.append(('contig', 0))
+            if GpuElemwise_built(self.ge, GE_VARIANT_CONTIG_VEC, 0):
+                res.append(('contig_vec', 0))
+            # Arrays can't have more dimensions than this in numpy
+            for nd in range(1, 33):
+                if GpuElemwise_built(self.ge, GE_VARIANT_BASIC, nd):
+                    res.append(('basic', nd))
+                if GpuElemwise_built(self.ge, GE_VARIANT_BASIC_32, nd):
+                    res.append(('basic_32', nd))
+            return res
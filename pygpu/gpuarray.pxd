@@ -71,6 +71,8 @@ cdef extern from "gpuarray/buffer.h":
         pass
     ctypedef struct gpukernel:
         pass
+    ctypedef struct gpuevent:
+        pass
 
     int gpu_get_platform_count(const char* name, unsigned int* platcount)
     int gpu_get_device_count(const char* name, unsigned int platform, unsigned int* devcount)
@@ -83,6 +85,10 @@ cdef extern from "gpuarray/buffer.h":
     gpucontext *gpudata_context(gpudata *)
     gpucontext *gpukernel_context(gpukernel *)
 
+    int gpuevent_wait(gpuevent *ev) nogil
+    int gpuevent_query(gpuevent *ev, int *done)
+    void gpuevent_release(gpuevent *ev) nogil
+
     int GA_CTX_DEFAULT
     int GA_CTX_MULTI_THREAD
     int GA_CTX_SINGLE_THREAD
@@ -105,6 +111,46 @@ cdef extern from "gpuarray/buffer.h":
     int GA_CTX_PROP_MAXGSIZE1
     int GA_CTX_PROP_MAXGSIZE2
     int GA_CTX_PROP_LARGEST_MEMBLOCK
+    int GA_CTX_PROP_MEMSTATS
+
+    ctypedef struct gpucontext_memstats:
+        size_t live_bytes
+        size_t cached_bytes
+        size_t peak_bytes
+        size_t reserved_bytes
+        size_t blocks
+        size_t free_blocks
+        size_t largest_free
+        size_t allocs
+        size_t frees
+        size_t splits
+        size_t merges
+
+    int GA_CTX_PROP_ALLOC_POLICY
+
+    ctypedef struct gpucontext_alloc_policy:
+        size_t block_size
+        size_t max_block_size
+        size_t large_threshold
+
+    int gpucontext_set_alloc_policy(gpucontext *ctx,
+                                    const gpucontext_alloc_policy *policy)
+
+    int GA_CTX_PROP_CACHESTATS
+
+    ctypedef struct gpucache_stats:
+        size_t hits
+        size_t misses
+        size_t inserts
+        size_t evictions
+        size_t bytes_read
+        size_t bytes_written
+        double io_time
+
+    ctypedef struct gpucontext_cachestats:
+        gpucache_stats kernel
+        gpucache_stats disk
+        gpucache_stats extcopy
 
     int GA_BUFFER_PROP_SIZE
 
@@ -188,6 +234,10 @@ cdef extern from "gpuarray/array.h":
     int GpuArray_move(_GpuArray *dst, _GpuArray *src)
     int GpuArray_write(_GpuArray *dst, void *src, size_t src_sz) nogil
     int GpuArray_read(void *dst, size_t dst_sz, _GpuArray *src) nogil
+    int GpuArray_write_async(_GpuArray *dst, void *src, size_t src_sz,
+                             gpuevent **ev) nogil
+    int GpuArray_read_async(void *dst, size_t dst_sz, _GpuArray *src,
+                            gpuevent **ev) nogil
     int GpuArray_memset(_GpuArray *a, int data)
     int GpuArray_copy(_GpuArray *res, _GpuArray *a, ga_order order)
 
@@ -1152,6 +1152,128 @@ cdef class GpuContext:
             ctx_property(self, GA_CTX_PROP_LARGEST_MEMBLOCK, &res)
             return res
 
+    property memstats:
+        """
+        Statistics on the memory allocations of this context.
+
+        This is a dict with the following keys: live_bytes,
+        cached_bytes, peak_bytes, reserved_bytes, blocks, free_blocks,
+        largest_free, allocs, frees, splits and merges.  See
+        gpucontext_memstats in gpuarray/buffer.h for their meaning.
+
+        Only supported for the cuda backend.
+        """
+        def __get__(self):
+            cdef gpucontext_memstats res
+            ctx_property(self, GA_CTX_PROP_MEMSTATS, &res)
+            return res
+
+    property alloc_policy:
+        """
+        Allocation cache policy of this context.
+
+        This is a dict with the following keys: block_size,
+        max_block_size and large_threshold.  See
+        gpucontext_alloc_policy in gpuarray/buffer.h for their
+        meaning.  Assign a dict with the same keys to change it.
+
+        Only supported for the cuda backend.
+        """
+        def __get__(self):
+            cdef gpucontext_alloc_policy res
+            ctx_property(self, GA_CTX_PROP_ALLOC_POLICY, &res)
+            return res
+
+        def __set__(self, policy):
+            cdef gpucontext_alloc_policy p = policy
+            cdef int err
+            err = gpucontext_set_alloc_policy(self.ctx, &p)
+            if err != GA_NO_ERROR:
+                raise get_exc(err), gpucontext_error(self.ctx, err)
+
+    property cachestats:
+        """
+        Statistics on the kernel caches of this context.
+
+        This is a dict with the keys kernel, disk and extcopy, one per
+        cache.  Each value is a dict with the following keys: hits,
+        misses, inserts, evictions, bytes_read, bytes_written and
+        io_time.  See gpucache_stats in gpuarray/buffer.h for their
+        meaning.
+        """
+        def __get__(self):
+            cdef gpucontext_cachestats res
+            ctx_property(self, GA_CTX_PROP_CACHESTATS, &res)
+            return res
+
+
+cdef class GpuEvent:
+    """
+    Completion of an asynchronous transfer.
+
+    This is returned by :meth:`GpuArray.write` and :meth:`GpuArray.read`
+    when called with `non_blocking=True`.  The host array of the
+    transfer must not be used until :meth:`wait` returned or
+    :meth:`done` returned True.
+
+    Releasing the event waits for the transfer.
+    """
+    cdef gpuevent *ev
+    cdef GpuContext context
+    # Keeps the host memory alive until the transfer is done
+    cdef object host
+
+    def __dealloc__(self):
+        if self.ev != NULL:
+            with nogil:
+                gpuevent_release(self.ev)
+
+    def wait(self):
+        """
+        Wait for the transfer to be done.
+        """
+        cdef int err
+        with nogil:
+            err = gpuevent_wait(self.ev)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), gpucontext_error(self.context.ctx, err)
+
+    def done(self):
+        """
+        Return True if the transfer is done, without waiting.
+        """
+        cdef int err
+        cdef int d
+        err = gpuevent_query(self.ev, &d)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), gpucontext_error(self.context.ctx, err)
+        return d != 0
+
+
+cdef GpuEvent array_write_async(GpuArray a, void *src, size_t sz,
+                                object host):
+    cdef int err
+    cdef GpuEvent res = GpuEvent.__new__(GpuEvent)
+    res.context = a.context
+    res.host = host
+    with nogil:
+        err = GpuArray_write_async(&a.ga, src, sz, &res.ev)
+    if err != GA_NO_ERROR:
+        raise get_exc(err), GpuArray_error(&a.ga, err)
+    return res
+
+cdef GpuEvent array_read_async(void *dst, size_t sz, GpuArray src,
+                               object host):
+    cdef int err
+    cdef GpuEvent res = GpuEvent.__new__(GpuEvent)
+    res.context = src.context
+    res.host = host
+    with nogil:
+        err = GpuArray_read_async(dst, sz, &src.ga, &res.ev)
+    if err != GA_NO_ERROR:
+        raise get_exc(err), GpuArray_error(&src.ga, err)
+    return res
+
 
 cdef class flags(object):
     cdef int fl
@@ -1565,7 +1687,7 @@ cdef class GpuArray:
         else:
             raise IndexError, "cannot index with: %s" % (key,)
 
-    def write(self, np.ndarray src not None):
+    def write(self, np.ndarray src not None, non_blocking=False):
         """Writes host's Numpy array to device's GpuArray.
 
         This method is as fast as or even faster than :ref:asarray, because it
@@ -1580,6 +1702,12 @@ cdef class GpuArray:
 
         :param src: source array in host
         :type src: np.ndarray
+        :param non_blocking: return without waiting for the transfer
+        :type non_blocking: bool
+
+        :returns: a :class:`GpuEvent` for the transfer if `non_blocking`
+            is True, in which case `src` must not be modified until it
+            is done
 
         :raises ValueError: If this GpuArray is not compatible with `src` or
             if it is not well behaved or contiguous.
@@ -1602,9 +1730,11 @@ cdef class GpuArray:
             sz *= self.ga.dimensions[i]
         if sz != npsz:
             raise ValueError, "GpuArray and Numpy array do not have the same size in bytes"
+        if non_blocking:
+            return array_write_async(self, np.PyArray_DATA(src), sz, src)
         array_write(self, np.PyArray_DATA(src), sz)
 
-    def read(self, np.ndarray dst not None):
+    def read(self, np.ndarray dst not None, non_blocking=False):
         """Reads from this GpuArray into host's Numpy array.
 
         This method is as fast as or even faster than :ref:__array__ method and
@@ -1619,6 +1749,12 @@ cdef class GpuArray:
 
         :param dst: destination array in host
         :type dst: np.ndarray
+        :param non_blocking: return without waiting for the transfer
+        :type non_blocking: bool
+
+        :returns: a :class:`GpuEvent` for the transfer if `non_blocking`
+            is True, in which case the content of `dst` is only valid
+            once it is done
 
         :raises ValueError: If this GpuArray is not compatible with `src` or
             if `dst` is not well behaved.
@@ -1638,6 +1774,8 @@ cdef class GpuArray:
             sz *= self.ga.dimensions[i]
         if sz != npsz:
             raise ValueError, "GpuArray and Numpy array do not have the same size in bytes"
+        if non_blocking:
+            return array_read_async(np.PyArray_DATA(dst), sz, self, dst)
         array_read(np.PyArray_DATA(dst), sz, self)
 
     def get_ipc_handle(self):
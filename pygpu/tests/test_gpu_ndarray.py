@@ -401,6 +401,22 @@ class WriteReadTest(unittest.TestCase):
         self.cpu = numpy.ndarray((3, 4, 2, 5), dtype="float32", order='C')
         self.assertRaises(ValueError, self.gpu.read, self.cpu[:, :, 0, :])
 
+    def test_write_read_non_blocking(self):
+        ev = self.gpu.write(self.cpu, non_blocking=True)
+        ev.wait()
+        assert ev.done()
+
+        res = numpy.zeros_like(self.cpu)
+        ev = self.gpu.read(res, non_blocking=True)
+        while not ev.done():
+            pass
+        assert numpy.allclose(self.cpu, res)
+
+        # Dropping the event waits for the transfer
+        res = numpy.zeros_like(self.cpu)
+        self.gpu.read(res, non_blocking=True)
+        assert numpy.allclose(self.cpu, res)
+
 def test_copy_view():
     for shp in [(5,), (6, 7), (4, 8, 9), (1, 8, 9)]:
         for dtype in dtypes_all:
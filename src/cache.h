@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <gpuarray/config.h>
+#include <gpuarray/buffer.h>
 #include "private_config.h"
 #include "util/strb.h"
 #include "util/error.h"
@@ -14,12 +15,20 @@ typedef int (*cache_eq_fn)(cache_key_t, cache_key_t);
 typedef uint32_t (*cache_hash_fn)(cache_key_t);
 typedef void (*cache_freek_fn)(cache_key_t);
 typedef void (*cache_freev_fn)(cache_value_t);
+typedef cache_value_t (*cache_refv_fn)(cache_value_t);
 
 typedef int (*kwrite_fn)(strb *res, cache_key_t key);
 typedef int (*vwrite_fn)(strb *res, cache_value_t val);
 typedef cache_key_t (*kread_fn)(const strb *b);
 typedef cache_value_t (*vread_fn)(const strb *b);
 
+/* 128-bit fingerprint of a key */
+typedef struct _cache_fp {
+  uint64_t h[2];
+} cache_fp;
+
+typedef void (*kfp_fn)(cache_key_t key, cache_fp *fp);
+
 typedef struct _cache cache;
 
 struct _cache {
@@ -69,10 +78,19 @@ struct _cache {
    * This must NOT free the passed in pointer.
    */
   void (*destroy)(cache *c);
+
+  /**
+   * Fill `st` with the statistics of the cache.
+   *
+   * This is optional, if NULL `stats` is used instead.
+   */
+  void (*get_stats)(cache *c, gpucache_stats *st);
   cache_eq_fn keq;
   cache_hash_fn khash;
   cache_freek_fn kfree;
   cache_freev_fn vfree;
+  /* Maintained by the implementations */
+  gpucache_stats stats;
   /* Extra data goes here depending on cache type */
 };
 
@@ -87,11 +105,108 @@ cache *cache_twoq(size_t hot_size, size_t warm_size,
                   cache_freek_fn kfree, cache_freev_fn vfree,
                   error *e);
 
+/*
+ * A cache of `size` entries that resists scans: entries that are only
+ * looked up once don't push out the ones that are looked up often.
+ *
+ * This is W-TinyLFU.  Entries are admitted from a small recency window
+ * based on an estimate of how often their key was looked up.  The
+ * estimate counts lookups with get, so the value added after a miss
+ * is judged by the lookups of its key before it was added.
+ */
+cache *cache_tinylfu(size_t size, cache_eq_fn keq, cache_hash_fn khash,
+                     cache_freek_fn kfree, cache_freev_fn vfree,
+                     error *e);
+
 cache *cache_disk(const char *dirpath, cache *mem,
                   kwrite_fn kwrite, vwrite_fn vwrite,
                   kread_fn kread, vread_fn vread,
                   error *e);
 
+/*
+ * Like cache_disk(), but all the entries are in a single file that is
+ * mapped in memory.  Lookups don't need any system calls unless the
+ * entry is missing.
+ */
+cache *cache_disk_pack(const char *dirpath, cache *mem,
+                       kwrite_fn kwrite, vwrite_fn vwrite,
+                       kread_fn kread, vread_fn vread,
+                       error *e);
+
+/*
+ * Remove the least recently used entries of a disk cache so that it
+ * is under `max_size` bytes and `max_entries` entries (0 for no
+ * limit).  This is safe to do while other processes use the cache.
+ *
+ * For a pack (cache_disk_pack()) the oldest entries are removed
+ * instead and the file is compacted.
+ *
+ * The collection is skipped if one was started by any process in the
+ * last `interval` seconds (0 to always do it) or is in progress.
+ *
+ * Errors are ignored, the collection is best effort.
+ */
+int cache_disk_gc(cache *c, size_t max_size, size_t max_entries,
+                  unsigned int interval);
+
+/*
+ * Place the entries of a disk cache by the fingerprints of their keys
+ * instead of hashing the serialized keys.  The keys are still
+ * compared in full, two keys with the same fingerprint end up in the
+ * same file (with cache_disk(), where the last one added wins) or the
+ * same slot (with cache_disk_pack(), where both are kept).
+ *
+ * This must be done before the cache is used.  Entries added without
+ * it (or with a different function) are not found.
+ */
+void cache_disk_fingerprint(cache *c, kfp_fn kfp);
+
+/*
+ * A cache that can be used from multiple threads.
+ *
+ * The keys are spread by hash over the `n` caches in `parts`, each
+ * behind its own lock, so that threads working on different keys
+ * rarely wait on each other.  The parts must all use the same key and
+ * value functions.  They are taken over if this succeeds.
+ *
+ * Each part does its own replacement, so the size limits and the
+ * recency order are per part.
+ *
+ * A value returned by get could be evicted and freed by another
+ * thread right away.  So if `vref` is not NULL, it is called on the
+ * value found by a lookup while the lock is held and what it returns
+ * is given to the caller instead.  It can take a reference or make a
+ * copy that the caller then owns.  If it returns NULL, the lookup is
+ * a miss.
+ *
+ * Returns NULL on error.
+ */
+cache *cache_striped(cache **parts, unsigned int n, cache_refv_fn vref,
+                     error *e);
+
+/*
+ * Write the fingerprint of the key of each lookup in `c` to the file
+ * at `path` (appending), one per line in hex.  This is meant to record
+ * key streams for tests/bench_cache_policy.
+ *
+ * `c` is taken over if this succeeds.
+ */
+cache *cache_trace(cache *c, const char *path, kfp_fn kfp, error *e);
+
+/*
+ * Open a disk cache configured by the environment.
+ *
+ * GPUARRAY_CACHE_FORMAT=pack selects cache_disk_pack(), otherwise
+ * this is cache_disk().  The cache is then collected (at most once an
+ * hour) with limits of 1GB and 100000 entries which can be changed
+ * with GPUARRAY_CACHE_SIZE (bytes, with an optional K, M or G suffix)
+ * and GPUARRAY_CACHE_ENTRIES.
+ */
+cache *cache_disk_env(const char *dirpath, cache *mem,
+                      kwrite_fn kwrite, vwrite_fn vwrite,
+                      kread_fn kread, vread_fn vread,
+                      error *e);
+
 /* API functions */
 static inline int cache_add(cache *c, cache_key_t k, cache_value_t v) {
   return c->add(c, k, v);
@@ -105,6 +220,16 @@ static inline cache_value_t cache_get(cache *c, cache_key_t k) {
   return c->get(c, k);
 }
 
+/* Statistics of a cache, which may be NULL */
+static inline void cache_get_stats(cache *c, gpucache_stats *st) {
+  if (c == NULL)
+    memset(st, 0, sizeof(*st));
+  else if (c->get_stats != NULL)
+    c->get_stats(c, st);
+  else
+    *st = c->stats;
+}
+
 static inline void cache_destroy(cache *c) {
   c->destroy(c);
   free(c);
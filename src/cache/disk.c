@@ -1,7 +1,9 @@
 #define _CRT_SECURE_NO_WARNINGS
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "private_config.h"
 
@@ -16,6 +18,11 @@
 #include <io.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/utime.h>
+
+#ifndef S_ISREG
+#define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+#endif
 
 struct timezone;
 
@@ -55,10 +62,15 @@ static int gettimeofday(struct timeval *tp, struct timezone *tzp) {
 #define lstat _stat64
 #define fstat _fstat64
 #define stat __stat64
+#define utime _utime
 
 #else
 #define PATH_MAX 1024
+#include <dirent.h>
 #include <unistd.h>
+#include <utime.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 
@@ -70,8 +82,37 @@ static int gettimeofday(struct timeval *tp, struct timezone *tzp) {
 
 #include "cache.h"
 #include "util/skein.h"
+#include "util/xxhash.h"
 
 #define HEXP_LEN (128 + 2)
+/* Length of the directory and file parts of an entry path */
+#define HEXP_DIR_LEN 4
+#define HEXP_FILE_LEN (HEXP_LEN - HEXP_DIR_LEN - 2)
+
+/*
+ * The modification time of an entry is its last use.  It is updated
+ * on hits if it is older than this (in seconds) to avoid a write for
+ * every lookup.
+ */
+#define TOUCH_INTERVAL 60
+
+/* The collection removes entries until the cache is this fraction of
+   the limits so that it doesn't run again right away */
+#define GC_LOW_WATER(x) ((x) - (x) / 10)
+
+/* A lock or temporary file older than this (in seconds) was left by
+   a dead process */
+#define STALE_AGE 3600
+
+#define GC_LOCK "gc.lock"
+#define GC_STAMP "gc.stamp"
+
+/* Defaults for cache_disk_env() */
+#define ENV_MAX_SIZE (1024 * 1024 * 1024)
+#define ENV_MAX_ENTRIES 100000
+#define ENV_GC_INTERVAL (60 * 60)
+
+typedef struct _pack pack;
 
 typedef struct _disk_cache {
   cache c;
@@ -80,10 +121,20 @@ typedef struct _disk_cache {
   vwrite_fn vwrite;
   kread_fn kread;
   vread_fn vread;
+  kfp_fn kfp; /* NULL to hash the serialized keys */
   const char *dirp;
+  /* NULL for the directory layout */
+  pack *pack;
 } disk_cache;
 
 
+/* Wall time in seconds for the statistics */
+static double io_clock(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
 /* Convert unsigned long long from network to host order */
 static unsigned long long ntohull(const char *_in) {
   const unsigned char *in = (const unsigned char *)_in;
@@ -156,6 +207,25 @@ static int unlinkp(const char *dirp, const char *rpath) {
   return unlink(path);
 }
 
+static int statp(const char *dirp, const char *rpath, struct stat *st) {
+  char path[PATH_MAX];
+
+  if (catp(path, dirp, rpath))
+    return -1;
+
+  return lstat(path, st);
+}
+
+/* Set the modification time of a file to now */
+static int touchp(const char *dirp, const char *rpath) {
+  char path[PATH_MAX];
+
+  if (catp(path, dirp, rpath))
+    return -1;
+
+  return utime(path, NULL);
+}
+
 static int renamep(const char *dirp, const char *ropath, const char *rnpath) {
   char opath[PATH_MAX];
   char npath[PATH_MAX];
@@ -214,10 +284,21 @@ int ensurep(const char *dirp, const char *rpath) {
 static int key_path(disk_cache *c, const cache_key_t key, char *out) {
   strb kb = STRB_STATIC_INIT;
   unsigned char hash[64];
+  cache_fp fp;
   int i;
 
-  if (c->kwrite(&kb, key)) return -1;
-  if (Skein_512((unsigned char *)kb.s, kb.l, hash)) return -1;
+  if (c->kfp != NULL) {
+    /* Still spread over the same layout */
+    c->kfp(key, &fp);
+    if (Skein_512((unsigned char *)&fp, sizeof(fp), hash)) return -1;
+  } else {
+    if (c->kwrite(&kb, key)) return -1;
+    if (Skein_512((unsigned char *)kb.s, kb.l, hash)) {
+      strb_clear(&kb);
+      return -1;
+    }
+    strb_clear(&kb);
+  }
   if (snprintf(out, 10, "%02x%02x/%02x%02x",
                hash[0], hash[1], hash[2], hash[3]) != 9)
     return -1;
@@ -261,6 +342,8 @@ static int write_entry(disk_cache *c, const cache_key_t k,
   }
 
   err = strb_write(fd, &b);
+  if (!err)
+    c->c.stats.bytes_written += b.l;
   strb_clear(&b);
   close(fd);
   if (err) {
@@ -302,13 +385,19 @@ static int find_entry(disk_cache *c, const cache_key_t key,
     return 0;
   }
 
-  if (!(st.st_mode & S_IFREG)) {
+  if (!S_ISREG(st.st_mode)) {
     close(fd);
     return 0;
   }
 
   strb_read(&b, fd, st.st_size);
   close(fd);
+  c->c.stats.bytes_read += b.l;
+
+  /* Mark the use for the collection.  This fails for entries of
+     other users that we can't write, which is fine. */
+  if (st.st_mtime + TOUCH_INTERVAL < time(NULL))
+    touchp(c->dirp, hexp);
 
   if (strb_error(&b) || b.l < 16) {
     strb_clear(&b);
@@ -355,9 +444,12 @@ static int find_entry(disk_cache *c, const cache_key_t key,
 
 static int disk_add(cache *_c, cache_key_t k, cache_value_t v) {
   disk_cache *c = (disk_cache *)_c;
+  double t = io_clock();
 
   /* Ignore write errors */
   write_entry(c, k, v);
+  c->c.stats.io_time += io_clock() - t;
+  c->c.stats.inserts++;
 
   return cache_add(c->mem, k, v);
 }
@@ -377,15 +469,24 @@ static cache_value_t disk_get(cache *_c, const cache_key_t key) {
   disk_cache *c = (disk_cache *)_c;
   cache_key_t k;
   cache_value_t v;
+  double t;
+  int found;
 
   v = cache_get(c->mem, key);
-  if (v != NULL)
+  if (v != NULL) {
+    c->c.stats.hits++;
     return v;
+  }
 
-  if (find_entry(c, key, &k, &v)) {
+  t = io_clock();
+  found = find_entry(c, key, &k, &v);
+  c->c.stats.io_time += io_clock() - t;
+  if (found) {
+    c->c.stats.hits++;
     if (cache_add(c->mem, k, v)) return NULL;
     return v;
   }
+  c->c.stats.misses++;
   return NULL;
 }
 
@@ -395,9 +496,937 @@ static void disk_destroy(cache *_c) {
   free((void *)c->dirp);
 }
 
-cache *cache_disk(const char *dirpath, cache *mem,
-                  kwrite_fn kwrite, vwrite_fn vwrite,
-                  kread_fn kread, vread_fn vread, error *e) {
+/*
+ * Collection of old entries.
+ *
+ * The entries are the files with a name of HEXP_FILE_LEN hex digits
+ * in the directories with a name of HEXP_DIR_LEN hex digits.  A first
+ * pass gathers the size and last use of every entry to figure out the
+ * cutoff time below which entries have to go.  A second pass removes
+ * them, checking the time again so that entries used in between by
+ * another process stay.  Removing an entry that another process is
+ * reading is fine: the open file stays valid for it.  Writes go
+ * through a temporary file and a rename so they are never seen
+ * partially.
+ */
+typedef int (*walk_fn)(disk_cache *c, const char *rpath,
+                       const struct stat *st, void *arg);
+
+static int is_hex(const char *s, size_t len) {
+  size_t i;
+  if (strlen(s) != len)
+    return 0;
+  for (i = 0; i < len; i++)
+    if (!isxdigit((unsigned char)s[i]))
+      return 0;
+  return 1;
+}
+
+/* Calls fn for every entry with a matching name in directory rdir */
+#ifdef _WIN32
+static int walk_dir(disk_cache *c, const char *rdir, size_t len,
+                    int (*fn)(disk_cache *, const char *, void *),
+                    void *arg) {
+  char path[PATH_MAX];
+  WIN32_FIND_DATAA fd;
+  HANDLE h;
+
+  if (catp(path, c->dirp, rdir) || strlcat(path, "*", PATH_MAX) >= PATH_MAX)
+    return -1;
+  h = FindFirstFileA(path, &fd);
+  if (h == INVALID_HANDLE_VALUE)
+    return -1;
+  do {
+    if (is_hex(fd.cFileName, len) && fn(c, fd.cFileName, arg))
+      break;
+  } while (FindNextFileA(h, &fd));
+  FindClose(h);
+  return 0;
+}
+#else
+static int walk_dir(disk_cache *c, const char *rdir, size_t len,
+                    int (*fn)(disk_cache *, const char *, void *),
+                    void *arg) {
+  char path[PATH_MAX];
+  struct dirent *e;
+  DIR *d;
+
+  if (catp(path, c->dirp, rdir))
+    return -1;
+  d = opendir(path);
+  if (d == NULL)
+    return -1;
+  while ((e = readdir(d)) != NULL) {
+    if (is_hex(e->d_name, len) && fn(c, e->d_name, arg))
+      break;
+  }
+  closedir(d);
+  return 0;
+}
+#endif
+
+typedef struct _walk_state {
+  walk_fn fn;
+  void *arg;
+  char rpath[HEXP_LEN];
+} walk_state;
+
+static int walk_file(disk_cache *c, const char *name, void *arg) {
+  walk_state *w = (walk_state *)arg;
+  struct stat st;
+
+  memcpy(w->rpath + HEXP_DIR_LEN + 1, name, HEXP_FILE_LEN + 1);
+  if (statp(c->dirp, w->rpath, &st) || !S_ISREG(st.st_mode))
+    return 0;
+  return w->fn(c, w->rpath, &st, w->arg);
+}
+
+static int walk_subdir(disk_cache *c, const char *name, void *arg) {
+  walk_state *w = (walk_state *)arg;
+
+  memcpy(w->rpath, name, HEXP_DIR_LEN);
+  w->rpath[HEXP_DIR_LEN] = '/';
+  w->rpath[HEXP_DIR_LEN + 1] = '\0';
+  walk_dir(c, w->rpath, HEXP_FILE_LEN, walk_file, w);
+  return 0;
+}
+
+static int walk_entries(disk_cache *c, walk_fn fn, void *arg) {
+  walk_state w;
+
+  w.fn = fn;
+  w.arg = arg;
+  return walk_dir(c, "", HEXP_DIR_LEN, walk_subdir, &w);
+}
+
+typedef struct _gc_entry {
+  time_t t;
+  size_t sz;
+} gc_entry;
+
+typedef struct _gc_scan {
+  gc_entry *e;
+  size_t n;
+  size_t alloc;
+  size_t total;
+} gc_scan;
+
+static int gc_collect(disk_cache *c, const char *rpath, const struct stat *st,
+                      void *arg) {
+  gc_scan *s = (gc_scan *)arg;
+  gc_entry *tmp;
+
+  if (s->n == s->alloc) {
+    tmp = realloc(s->e, sizeof(*tmp) * (s->alloc ? s->alloc * 2 : 1024));
+    if (tmp == NULL)
+      return 1;
+    s->e = tmp;
+    s->alloc = s->alloc ? s->alloc * 2 : 1024;
+  }
+  s->e[s->n].t = st->st_mtime;
+  s->e[s->n].sz = (size_t)st->st_size;
+  s->n++;
+  s->total += (size_t)st->st_size;
+  return 0;
+}
+
+static int gc_remove(disk_cache *c, const char *rpath, const struct stat *st,
+                     void *arg) {
+  if (st->st_mtime <= *(time_t *)arg && unlinkp(c->dirp, rpath) == 0)
+    c->c.stats.evictions++;
+  return 0;
+}
+
+static int gc_entry_cmp(const void *a, const void *b) {
+  const gc_entry *ea = (const gc_entry *)a;
+  const gc_entry *eb = (const gc_entry *)b;
+  return (ea->t > eb->t) - (ea->t < eb->t);
+}
+
+/* Remove the temporary files of dead writers */
+static int gc_tmp(disk_cache *c, const char *name, void *arg) {
+  char rpath[32];
+  struct stat st;
+
+  if (strlen(name) != 12 || strncmp(name, "tmp.", 4) != 0)
+    return 0;
+  strlcpy(rpath, name, sizeof(rpath));
+  if (statp(c->dirp, rpath, &st) == 0 &&
+      st.st_mtime + STALE_AGE < *(time_t *)arg)
+    unlinkp(c->dirp, rpath);
+  return 0;
+}
+
+#ifdef _WIN32
+static int walk_tmp(disk_cache *c, time_t now) {
+  char path[PATH_MAX];
+  WIN32_FIND_DATAA fd;
+  HANDLE h;
+
+  if (catp(path, c->dirp, "tmp.*"))
+    return -1;
+  h = FindFirstFileA(path, &fd);
+  if (h == INVALID_HANDLE_VALUE)
+    return -1;
+  do {
+    gc_tmp(c, fd.cFileName, &now);
+  } while (FindNextFileA(h, &fd));
+  FindClose(h);
+  return 0;
+}
+#else
+static int walk_tmp(disk_cache *c, time_t now) {
+  struct dirent *e;
+  DIR *d;
+
+  d = opendir(c->dirp);
+  if (d == NULL)
+    return -1;
+  while ((e = readdir(d)) != NULL)
+    gc_tmp(c, e->d_name, &now);
+  closedir(d);
+  return 0;
+}
+#endif
+
+/* Only one process collects at a time */
+static int gc_lock(disk_cache *c, time_t now) {
+  struct stat st;
+  int fd;
+
+  fd = openp(c->dirp, GC_LOCK, O_WRONLY|O_CREAT|O_EXCL, 0666);
+  if (fd == -1 && errno == EEXIST &&
+      statp(c->dirp, GC_LOCK, &st) == 0 && st.st_mtime + STALE_AGE < now) {
+    unlinkp(c->dirp, GC_LOCK);
+    fd = openp(c->dirp, GC_LOCK, O_WRONLY|O_CREAT|O_EXCL, 0666);
+  }
+  if (fd == -1)
+    return -1;
+  close(fd);
+  return 0;
+}
+
+static void dir_gc(disk_cache *c, size_t max_size, size_t max_entries) {
+  gc_scan s;
+  time_t cutoff;
+  size_t size, entries, i;
+
+  memset(&s, 0, sizeof(s));
+  walk_entries(c, gc_collect, &s);
+
+  if ((max_size == 0 || s.total <= max_size) &&
+      (max_entries == 0 || s.n <= max_entries))
+    goto done;
+
+  qsort(s.e, s.n, sizeof(*s.e), gc_entry_cmp);
+  size = s.total;
+  entries = s.n;
+  cutoff = 0;
+  for (i = 0; i < s.n; i++) {
+    if ((max_size == 0 || size <= GC_LOW_WATER(max_size)) &&
+        (max_entries == 0 || entries <= GC_LOW_WATER(max_entries)))
+      break;
+    size -= s.e[i].sz;
+    entries--;
+    cutoff = s.e[i].t;
+  }
+  walk_entries(c, gc_remove, &cutoff);
+
+ done:
+  free(s.e);
+}
+
+static void pack_gc(disk_cache *c, size_t max_size, size_t max_entries);
+
+int cache_disk_gc(cache *_c, size_t max_size, size_t max_entries,
+                  unsigned int interval) {
+  disk_cache *c = (disk_cache *)_c;
+  struct stat st;
+  time_t now = time(NULL);
+  int fd;
+
+  /* A pack may also need to be rewritten to drop removed entries */
+  if (c->pack == NULL && max_size == 0 && max_entries == 0)
+    return 0;
+
+  if (interval != 0 && statp(c->dirp, GC_STAMP, &st) == 0 &&
+      st.st_mtime + (time_t)interval > now)
+    return 0;
+
+  if (gc_lock(c, now))
+    return 0;
+
+  /* Mark the start so that others don't start a collection */
+  fd = openp(c->dirp, GC_STAMP, O_WRONLY|O_CREAT, 0666);
+  if (fd != -1)
+    close(fd);
+  touchp(c->dirp, GC_STAMP);
+
+  walk_tmp(c, now);
+
+  if (c->pack != NULL)
+    pack_gc(c, max_size, max_entries);
+  else
+    dir_gc(c, max_size, max_entries);
+
+  unlinkp(c->dirp, GC_LOCK);
+  return 0;
+}
+
+/*
+ * Pack layout.
+ *
+ * All the entries are in a single file, PACK_NAME, that starts with
+ * a header (PACK_MAGIC and the version) followed by records:
+ *
+ *   klen (4 bytes) | vlen (4 bytes) | hash (4 bytes) | check (4 bytes)
+ *   key (klen bytes) | value (vlen bytes) | padding to PACK_ALIGN
+ *
+ * All integers are big endian.  The hash is of the key bytes and the
+ * check covers the rest of the header and the data so that partial
+ * records are detected.  A vlen of PACK_DELETED marks the removal of
+ * the key and has no value bytes.
+ *
+ * The file is mapped in memory and indexed in a hash table when the
+ * cache is opened.  A lookup is a probe in the table, and the key and
+ * value are read directly from the mapping.  Records are appended
+ * with a single write() in append mode which keeps the records of
+ * concurrent writers apart.  On a miss, the records appended by other
+ * processes since the last look are mapped and indexed.
+ *
+ * The file is only rewritten by the collection, under its lock, to a
+ * temporary file that is renamed over the old one.  Mappings of the
+ * old file stay valid.  Writers hold a shared lock on the file while
+ * they check that it is the current one and append to it, and the
+ * collection holds an exclusive lock until it is replaced so that no
+ * record goes to the old file after it was copied.
+ */
+#define PACK_NAME "kernels.pack"
+#define PACK_MAGIC "GAPACK\0\0"
+#define PACK_VERSION 1
+#define PACK_HDR 16
+#define PACK_REC_HDR 16
+#define PACK_ALIGN 8
+#define PACK_DELETED 0xffffffffU
+#define PACK_SEED 0x7061636b
+
+typedef struct _pack_slot {
+  size_t off;  /* Offset of the last record for the key, 0 if empty */
+  uint32_t h;
+} pack_slot;
+
+struct _pack {
+  int fd;
+  int rdonly;
+  /* A record could not be read, nothing after it is visible until
+     the file is rewritten */
+  int bad;
+  char *map;
+  size_t map_sz;
+  size_t end;  /* Records are indexed up to here */
+  dev_t dev;
+  ino_t ino;
+#ifdef _WIN32
+  HANDLE mh;
+#endif
+  pack_slot *idx;
+  size_t idx_sz;  /* Always a power of 2 */
+  size_t used;
+};
+
+static uint32_t get32(const char *_in) {
+  const unsigned char *in = (const unsigned char *)_in;
+  return ((uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 |
+          (uint32_t)in[2] << 8 | (uint32_t)in[3]);
+}
+
+static void put32(uint32_t in, char *out) {
+  out[0] = (unsigned char)(in >> 24);
+  out[1] = (unsigned char)(in >> 16);
+  out[2] = (unsigned char)(in >> 8);
+  out[3] = (unsigned char)(in);
+}
+
+static size_t rec_data(uint32_t kl, uint32_t vl) {
+  return (size_t)kl + (vl == PACK_DELETED ? 0 : vl);
+}
+
+static size_t rec_len(uint32_t kl, uint32_t vl) {
+  size_t l = PACK_REC_HDR + rec_data(kl, vl);
+  return (l + PACK_ALIGN - 1) & ~(size_t)(PACK_ALIGN - 1);
+}
+
+static uint32_t rec_check(const char *rec) {
+  XXH32_state_t st;
+  XXH32_reset(&st, PACK_SEED);
+  XXH32_update(&st, rec, 12);
+  XXH32_update(&st, rec + PACK_REC_HDR, rec_data(get32(rec), get32(rec + 4)));
+  return XXH32_digest(&st);
+}
+
+/* Fails if the new path exists */
+static int linkp(const char *dirp, const char *ropath, const char *rnpath) {
+#ifdef _WIN32
+  /* On windows rename doesn't replace an existing file */
+  return renamep(dirp, ropath, rnpath);
+#else
+  char opath[PATH_MAX];
+  char npath[PATH_MAX];
+
+  if (catp(opath, dirp, ropath))
+    return -1;
+  if (catp(npath, dirp, rnpath))
+    return -1;
+
+  return link(opath, npath);
+#endif
+}
+
+/* Where locking isn't supported this fails and we go on without it */
+static int pack_lock(pack *p, int excl) {
+#ifdef _WIN32
+  OVERLAPPED ov;
+
+  memset(&ov, 0, sizeof(ov));
+  return LockFileEx((HANDLE)_get_osfhandle(p->fd),
+                    excl ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0,
+                    MAXDWORD, MAXDWORD, &ov) ? 0 : -1;
+#else
+  return flock(p->fd, excl ? LOCK_EX : LOCK_SH);
+#endif
+}
+
+static void pack_unlock(pack *p) {
+#ifdef _WIN32
+  OVERLAPPED ov;
+
+  memset(&ov, 0, sizeof(ov));
+  UnlockFileEx((HANDLE)_get_osfhandle(p->fd), 0, MAXDWORD, MAXDWORD, &ov);
+#else
+  flock(p->fd, LOCK_UN);
+#endif
+}
+
+static void pack_unmap(pack *p) {
+  if (p->map == NULL)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(p->map);
+  CloseHandle(p->mh);
+#else
+  munmap(p->map, p->map_sz);
+#endif
+  p->map = NULL;
+  p->map_sz = 0;
+}
+
+/* Map the first sz bytes of the file, replacing the current mapping */
+static int pack_map(pack *p, size_t sz) {
+  char *m;
+#ifdef _WIN32
+  HANDLE mh;
+
+  mh = CreateFileMapping((HANDLE)_get_osfhandle(p->fd), NULL, PAGE_READONLY,
+                         0, 0, NULL);
+  if (mh == NULL)
+    return -1;
+  m = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, sz);
+  if (m == NULL) {
+    CloseHandle(mh);
+    return -1;
+  }
+#else
+  m = mmap(NULL, sz, PROT_READ, MAP_SHARED, p->fd, 0);
+  if (m == MAP_FAILED)
+    return -1;
+#endif
+  pack_unmap(p);
+  p->map = m;
+  p->map_sz = sz;
+#ifdef _WIN32
+  p->mh = mh;
+#endif
+  return 0;
+}
+
+/* Returns the slot for the key, which is empty if it's not there */
+static size_t pack_probe(pack *p, uint32_t h, const char *k, size_t kl) {
+  size_t mask = p->idx_sz - 1;
+  const char *rec;
+  size_t i;
+
+  for (i = h & mask; p->idx[i].off != 0; i = (i + 1) & mask) {
+    if (p->idx[i].h != h)
+      continue;
+    rec = p->map + p->idx[i].off;
+    if (get32(rec) == kl && memcmp(rec + PACK_REC_HDR, k, kl) == 0)
+      break;
+  }
+  return i;
+}
+
+static size_t pack_lookup(pack *p, uint32_t h, const char *k, size_t kl) {
+  if (p->idx_sz == 0)
+    return 0;
+  return p->idx[pack_probe(p, h, k, kl)].off;
+}
+
+static int pack_grow(pack *p) {
+  pack_slot *old = p->idx;
+  size_t old_sz = p->idx_sz;
+  size_t mask, i, j;
+
+  p->idx_sz = old_sz ? old_sz * 2 : 256;
+  p->idx = calloc(p->idx_sz, sizeof(*p->idx));
+  if (p->idx == NULL) {
+    p->idx = old;
+    p->idx_sz = old_sz;
+    return -1;
+  }
+  mask = p->idx_sz - 1;
+  for (i = 0; i < old_sz; i++) {
+    if (old[i].off == 0)
+      continue;
+    for (j = old[i].h & mask; p->idx[j].off != 0; j = (j + 1) & mask);
+    p->idx[j] = old[i];
+  }
+  free(old);
+  return 0;
+}
+
+/* Index the complete records after p->end */
+static void pack_scan(pack *p) {
+  const char *rec;
+  uint32_t kl, vl;
+  size_t avail, len, i;
+
+  while (!p->bad && p->map_sz - p->end >= PACK_REC_HDR) {
+    rec = p->map + p->end;
+    avail = p->map_sz - p->end;
+    kl = get32(rec);
+    vl = get32(rec + 4);
+    /* This may be a record that is still being written */
+    if (kl > avail || (vl != PACK_DELETED && vl > avail - kl) ||
+        rec_len(kl, vl) > avail)
+      break;
+    len = rec_len(kl, vl);
+    if (get32(rec + 12) != rec_check(rec)) {
+      p->bad = 1;
+      break;
+    }
+    if (p->used + 1 > p->idx_sz / 2 && pack_grow(p))
+      break;
+    i = pack_probe(p, get32(rec + 8), rec + PACK_REC_HDR, kl);
+    if (p->idx[i].off == 0)
+      p->used++;
+    p->idx[i].off = p->end;
+    p->idx[i].h = get32(rec + 8);
+    p->end += len;
+  }
+}
+
+static int pack_open(disk_cache *c) {
+  pack *p = c->pack;
+  struct stat st;
+
+  p->rdonly = 0;
+  p->fd = openp(c->dirp, PACK_NAME, O_RDWR|O_APPEND|O_BINARY, 0);
+  if (p->fd == -1 && errno == EACCES) {
+    /* A shared cache that we can't write to */
+    p->rdonly = 1;
+    p->fd = openp(c->dirp, PACK_NAME, O_RDONLY|O_BINARY, 0);
+  }
+  if (p->fd == -1)
+    return -1;
+
+  if (fstat(p->fd, &st) || st.st_size < PACK_HDR ||
+      pack_map(p, (size_t)st.st_size)) {
+    close(p->fd);
+    p->fd = -1;
+    return -1;
+  }
+  p->dev = st.st_dev;
+  p->ino = st.st_ino;
+  p->end = PACK_HDR;
+  p->bad = (memcmp(p->map, PACK_MAGIC, 8) != 0 ||
+            get32(p->map + 8) != PACK_VERSION);
+  pack_scan(p);
+  return 0;
+}
+
+static void pack_close(pack *p) {
+  pack_unmap(p);
+  if (p->fd != -1)
+    close(p->fd);
+  p->fd = -1;
+  free(p->idx);
+  p->idx = NULL;
+  p->idx_sz = 0;
+  p->used = 0;
+}
+
+/* Write an empty pack, unless there is one already */
+static void pack_create(disk_cache *c) {
+  char tmp_path[] = "tmp.XXXXXXXX";
+  char hdr[PACK_HDR];
+  int fd, err;
+
+  memset(hdr, 0, PACK_HDR);
+  memcpy(hdr, PACK_MAGIC, 8);
+  put32(PACK_VERSION, hdr + 8);
+
+  fd = mkstempp(c->dirp, tmp_path);
+  if (fd == -1)
+    return;
+  err = (write(fd, hdr, PACK_HDR) != PACK_HDR);
+  close(fd);
+  if (!err)
+    linkp(c->dirp, tmp_path, PACK_NAME);
+  unlinkp(c->dirp, tmp_path);
+}
+
+/* Make sure that we have the current file open.  `changed` is set if
+   it had to be (re)opened. */
+static int pack_reopen(disk_cache *c, int *changed) {
+  pack *p = c->pack;
+  struct stat st;
+
+  *changed = 0;
+  if (statp(c->dirp, PACK_NAME, &st)) {
+    if (errno != ENOENT)
+      return -1;
+    pack_create(c);
+    if (statp(c->dirp, PACK_NAME, &st))
+      return -1;
+  }
+  if (p->fd != -1 && st.st_dev == p->dev && st.st_ino == p->ino)
+    return 0;
+  pack_close(p);
+  *changed = 1;
+  return pack_open(c);
+}
+
+/* Index the records added by other processes.  Returns 1 if there
+   were any. */
+static int pack_refresh(disk_cache *c) {
+  pack *p = c->pack;
+  struct stat st;
+  size_t end = p->end;
+  int changed;
+
+  if (pack_reopen(c, &changed))
+    return 0;
+  if (changed)
+    return 1;
+  if (fstat(p->fd, &st) || (size_t)st.st_size <= p->map_sz ||
+      pack_map(p, (size_t)st.st_size))
+    return 0;
+  pack_scan(p);
+  return p->end != end;
+}
+
+/*
+ * Get the current file, locked for appending if possible.  Closing
+ * the file releases the lock.  This gives up on the lock after a few
+ * collections replaced the file while we were waiting.
+ */
+static int pack_begin_append(disk_cache *c, int *locked) {
+  pack *p = c->pack;
+  int changed, i;
+
+  *locked = 0;
+  for (i = 0; i < 3; i++) {
+    if (pack_reopen(c, &changed) || p->rdonly || p->bad)
+      return -1;
+    if (pack_lock(p, 0))
+      return 0;
+    /* The collection may have replaced the file while we waited */
+    if (pack_reopen(c, &changed)) {
+      if (!changed)
+        pack_unlock(p);
+      return -1;
+    }
+    if (!changed) {
+      *locked = 1;
+      return 0;
+    }
+  }
+  return (p->rdonly || p->bad) ? -1 : 0;
+}
+
+/* Hash for the index, `kb` is the serialized key */
+static uint32_t pack_hash(disk_cache *c, const cache_key_t k, const char *kb,
+                          size_t kl) {
+  cache_fp fp;
+
+  if (c->kfp == NULL)
+    return XXH32(kb, kl, PACK_SEED);
+  c->kfp(k, &fp);
+  return (uint32_t)fp.h[0];
+}
+
+/* Append a record for the key, a removal if v is NULL */
+static int pack_append(disk_cache *c, const cache_key_t k,
+                       const cache_value_t v) {
+  pack *p = c->pack;
+  strb b = STRB_STATIC_INIT;
+  size_t kl, vl;
+  int locked, err;
+
+  if (strb_ensure(&b, PACK_REC_HDR)) return -1;
+  b.l = PACK_REC_HDR;
+  c->kwrite(&b, k);
+  kl = b.l - PACK_REC_HDR;
+  vl = PACK_DELETED;
+  if (v != NULL) {
+    c->vwrite(&b, v);
+    vl = b.l - kl - PACK_REC_HDR;
+  }
+  while (b.l % PACK_ALIGN)
+    strb_appendc(&b, '\0');
+  if (strb_error(&b) || kl >= PACK_DELETED ||
+      (v != NULL && vl >= PACK_DELETED)) {
+    strb_clear(&b);
+    return -1;
+  }
+  put32((uint32_t)kl, b.s);
+  put32((uint32_t)vl, b.s + 4);
+  put32(pack_hash(c, k, b.s + PACK_REC_HDR, kl), b.s + 8);
+  put32(rec_check(b.s), b.s + 12);
+
+  err = pack_begin_append(c, &locked);
+  if (!err)
+    err = strb_write(p->fd, &b);
+  if (!err)
+    c->c.stats.bytes_written += b.l;
+  if (locked)
+    pack_unlock(p);
+  strb_clear(&b);
+  return err;
+}
+
+static int pack_find(disk_cache *c, const cache_key_t key,
+                     cache_key_t *_k, cache_value_t *_v) {
+  pack *p = c->pack;
+  strb kb = STRB_STATIC_INIT;
+  strb b;
+  const char *rec;
+  cache_key_t k;
+  uint32_t h;
+  size_t off;
+
+  c->kwrite(&kb, key);
+  if (strb_error(&kb)) {
+    strb_clear(&kb);
+    return 0;
+  }
+  h = pack_hash(c, key, kb.s, kb.l);
+  off = pack_lookup(p, h, kb.s, kb.l);
+  if (off == 0 && pack_refresh(c))
+    off = pack_lookup(p, h, kb.s, kb.l);
+  strb_clear(&kb);
+  if (off == 0)
+    return 0;
+
+  rec = p->map + off;
+  if (get32(rec + 4) == PACK_DELETED)
+    return 0;
+
+  /* This points into the mapping, there is no copy */
+  b.s = (char *)rec + PACK_REC_HDR;
+  b.l = get32(rec);
+  b.a = 0;
+  k = c->kread(&b);
+  if (k == NULL)
+    return 0;
+  c->c.stats.bytes_read += b.l;
+  b.s += b.l;
+  b.l = get32(rec + 4);
+  c->c.stats.bytes_read += b.l;
+  *_v = c->vread(&b);
+  if (*_v == NULL) {
+    c->c.kfree(k);
+    return 0;
+  }
+  *_k = k;
+  return 1;
+}
+
+static int pack_add(cache *_c, cache_key_t k, cache_value_t v) {
+  disk_cache *c = (disk_cache *)_c;
+  double t = io_clock();
+
+  /* Ignore write errors */
+  pack_append(c, k, v);
+  c->c.stats.io_time += io_clock() - t;
+  c->c.stats.inserts++;
+
+  return cache_add(c->mem, k, v);
+}
+
+static int pack_del(cache *_c, const cache_key_t key) {
+  disk_cache *c = (disk_cache *)_c;
+
+  cache_del(c->mem, key);
+
+  return (pack_append(c, key, NULL) == 0);
+}
+
+static cache_value_t pack_get(cache *_c, const cache_key_t key) {
+  disk_cache *c = (disk_cache *)_c;
+  cache_key_t k;
+  cache_value_t v;
+  double t;
+  int found;
+
+  v = cache_get(c->mem, key);
+  if (v != NULL) {
+    c->c.stats.hits++;
+    return v;
+  }
+
+  t = io_clock();
+  found = pack_find(c, key, &k, &v);
+  c->c.stats.io_time += io_clock() - t;
+  if (found) {
+    c->c.stats.hits++;
+    if (cache_add(c->mem, k, v)) return NULL;
+    return v;
+  }
+  c->c.stats.misses++;
+  return NULL;
+}
+
+static void pack_destroy(cache *_c) {
+  disk_cache *c = (disk_cache *)_c;
+  pack_close(c->pack);
+  free(c->pack);
+  disk_destroy(_c);
+}
+
+static int size_cmp(const void *a, const void *b) {
+  size_t sa = *(const size_t *)a;
+  size_t sb = *(const size_t *)b;
+  return (sa > sb) - (sa < sb);
+}
+
+/*
+ * Rewrite the pack without the removed and replaced entries, and the
+ * oldest entries if it is over the limits.  There is no record of the
+ * use of entries in a pack so they go in the order they were added.
+ * Other processes wait to append until the new file is in place.
+ */
+static void pack_gc(disk_cache *c, size_t max_size, size_t max_entries) {
+  pack *p = c->pack;
+  char tmp_path[] = "tmp.XXXXXXXX";
+  char hdr[PACK_HDR];
+  size_t *offs;
+  size_t live, live_size, size, entries, n, i;
+  const char *rec;
+  strb b;
+  int fd, err, locked, replaced = 0;
+
+  pack_refresh(c);
+  if (p->fd == -1 || p->rdonly)
+    return;
+  locked = (pack_lock(p, 1) == 0);
+  /* Get the records appended before we had the lock */
+  pack_refresh(c);
+
+  offs = malloc(sizeof(*offs) * (p->used + 1));
+  if (offs == NULL)
+    goto done;
+  live = 0;
+  live_size = PACK_HDR;
+  for (i = 0; i < p->idx_sz; i++) {
+    if (p->idx[i].off == 0)
+      continue;
+    rec = p->map + p->idx[i].off;
+    if (get32(rec + 4) == PACK_DELETED)
+      continue;
+    offs[live++] = p->idx[i].off;
+    live_size += rec_len(get32(rec), get32(rec + 4));
+  }
+
+  /* Rewrite if over the limits or if more than half is garbage */
+  if (!p->bad && (max_size == 0 || p->map_sz <= max_size) &&
+      (max_entries == 0 || live <= max_entries) &&
+      p->end - live_size <= live_size)
+    goto done;
+
+  /* Keep the most recently added entries */
+  qsort(offs, live, sizeof(*offs), size_cmp);
+  size = PACK_HDR;
+  entries = 0;
+  for (n = live; n > 0; n--) {
+    rec = p->map + offs[n - 1];
+    size += rec_len(get32(rec), get32(rec + 4));
+    entries++;
+    if ((max_size != 0 && size > GC_LOW_WATER(max_size)) ||
+        (max_entries != 0 && entries > GC_LOW_WATER(max_entries)))
+      break;
+  }
+
+  fd = mkstempp(c->dirp, tmp_path);
+  if (fd == -1)
+    goto done;
+  memset(hdr, 0, PACK_HDR);
+  memcpy(hdr, PACK_MAGIC, 8);
+  put32(PACK_VERSION, hdr + 8);
+  err = (write(fd, hdr, PACK_HDR) != PACK_HDR);
+  for (i = n; !err && i < live; i++) {
+    rec = p->map + offs[i];
+    b.s = (char *)rec;
+    b.l = rec_len(get32(rec), get32(rec + 4));
+    b.a = 0;
+    err = strb_write(fd, &b);
+  }
+  close(fd);
+  if (err || renamep(c->dirp, tmp_path, PACK_NAME)) {
+    unlinkp(c->dirp, tmp_path);
+  } else {
+    c->c.stats.evictions += n;
+    replaced = 1;
+  }
+
+ done:
+  if (locked)
+    pack_unlock(p);
+  if (replaced)
+    pack_refresh(c);
+  free(offs);
+}
+
+static void env_limits(size_t *max_size, size_t *max_entries) {
+  const char *v;
+  char *end;
+  unsigned long long n;
+
+  v = getenv("GPUARRAY_CACHE_SIZE");
+  if (v != NULL) {
+    n = strtoull(v, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': n *= 1024;
+      /* fallthrough */
+    case 'M': case 'm': n *= 1024;
+      /* fallthrough */
+    case 'K': case 'k': n *= 1024;
+      end++;
+    }
+    if (end != v && *end == '\0')
+      *max_size = (size_t)n;
+  }
+  v = getenv("GPUARRAY_CACHE_ENTRIES");
+  if (v != NULL) {
+    n = strtoull(v, &end, 10);
+    if (end != v && *end == '\0')
+      *max_entries = (size_t)n;
+  }
+}
+
+static disk_cache *disk_alloc(const char *dirpath, cache *mem,
+                              kwrite_fn kwrite, vwrite_fn vwrite,
+                              kread_fn kread, vread_fn vread, error *e) {
   struct stat st;
   disk_cache *res;
   char *dirp;
@@ -462,13 +1491,79 @@ cache *cache_disk(const char *dirpath, cache *mem,
   res->vwrite = vwrite;
   res->kread = kread;
   res->vread = vread;
-  res->c.add = disk_add;
-  res->c.del = disk_del;
-  res->c.get = disk_get;
-  res->c.destroy = disk_destroy;
   res->c.keq = mem->keq;
   res->c.khash = mem->khash;
   res->c.kfree = mem->kfree;
   res->c.vfree = mem->vfree;
+  return res;
+}
+
+void cache_disk_fingerprint(cache *c, kfp_fn kfp) {
+  ((disk_cache *)c)->kfp = kfp;
+}
+
+cache *cache_disk(const char *dirpath, cache *mem,
+                  kwrite_fn kwrite, vwrite_fn vwrite,
+                  kread_fn kread, vread_fn vread, error *e) {
+  disk_cache *res;
+
+  res = disk_alloc(dirpath, mem, kwrite, vwrite, kread, vread, e);
+  if (res == NULL)
+    return NULL;
+
+  res->c.add = disk_add;
+  res->c.del = disk_del;
+  res->c.get = disk_get;
+  res->c.destroy = disk_destroy;
+  return (cache *)res;
+}
+
+cache *cache_disk_pack(const char *dirpath, cache *mem,
+                       kwrite_fn kwrite, vwrite_fn vwrite,
+                       kread_fn kread, vread_fn vread, error *e) {
+  disk_cache *res;
+  int changed;
+
+  res = disk_alloc(dirpath, mem, kwrite, vwrite, kread, vread, e);
+  if (res == NULL)
+    return NULL;
+
+  res->pack = calloc(sizeof(*res->pack), 1);
+  if (res->pack == NULL) {
+    error_sys(e, "calloc");
+    free((void *)res->dirp);
+    free(res);
+    return NULL;
+  }
+  res->pack->fd = -1;
+
+  /* If this fails, we try again on the next miss */
+  pack_reopen(res, &changed);
+
+  res->c.add = pack_add;
+  res->c.del = pack_del;
+  res->c.get = pack_get;
+  res->c.destroy = pack_destroy;
   return (cache *)res;
 }
+
+cache *cache_disk_env(const char *dirpath, cache *mem,
+                      kwrite_fn kwrite, vwrite_fn vwrite,
+                      kread_fn kread, vread_fn vread, error *e) {
+  const char *format;
+  size_t max_size = ENV_MAX_SIZE;
+  size_t max_entries = ENV_MAX_ENTRIES;
+  cache *res;
+
+  format = getenv("GPUARRAY_CACHE_FORMAT");
+  if (format != NULL && strcmp(format, "pack") == 0)
+    res = cache_disk_pack(dirpath, mem, kwrite, vwrite, kread, vread, e);
+  else
+    res = cache_disk(dirpath, mem, kwrite, vwrite, kread, vread, e);
+  if (res == NULL)
+    return NULL;
+
+  env_limits(&max_size, &max_entries);
+  cache_disk_gc(res, max_size, max_entries, ENV_GC_INTERVAL);
+  return res;
+}
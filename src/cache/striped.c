@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "util/thread.h"
+
+typedef struct _stripe {
+  ga_mutex lock;
+  cache *c;
+} stripe;
+
+typedef struct _striped_cache {
+  cache c;
+  cache_refv_fn vref;
+  unsigned int n;
+  stripe *s;
+} striped_cache;
+
+static stripe *pick(striped_cache *c, const cache_key_t k) {
+  /* The parts index their buckets with the low bits of the hash, so
+     mix it and take the high bits to choose the part */
+  uint32_t h = c->c.khash(k) * 2654435761U;
+  return &c->s[((uint64_t)h * c->n) >> 32];
+}
+
+static int striped_add(cache *_c, cache_key_t k, cache_value_t v) {
+  stripe *s = pick((striped_cache *)_c, k);
+  int res;
+
+  ga_mutex_lock(&s->lock);
+  res = cache_add(s->c, k, v);
+  ga_mutex_unlock(&s->lock);
+  return res;
+}
+
+static int striped_del(cache *_c, const cache_key_t k) {
+  stripe *s = pick((striped_cache *)_c, k);
+  int res;
+
+  ga_mutex_lock(&s->lock);
+  res = cache_del(s->c, k);
+  ga_mutex_unlock(&s->lock);
+  return res;
+}
+
+static cache_value_t striped_get(cache *_c, const cache_key_t k) {
+  striped_cache *c = (striped_cache *)_c;
+  stripe *s = pick(c, k);
+  cache_value_t res;
+
+  ga_mutex_lock(&s->lock);
+  res = cache_get(s->c, k);
+  if (res != NULL && c->vref != NULL)
+    res = c->vref(res);
+  ga_mutex_unlock(&s->lock);
+  return res;
+}
+
+static void striped_stats(cache *_c, gpucache_stats *st) {
+  striped_cache *c = (striped_cache *)_c;
+  gpucache_stats part;
+  unsigned int i;
+
+  memset(st, 0, sizeof(*st));
+  for (i = 0; i < c->n; i++) {
+    ga_mutex_lock(&c->s[i].lock);
+    cache_get_stats(c->s[i].c, &part);
+    ga_mutex_unlock(&c->s[i].lock);
+    st->hits += part.hits;
+    st->misses += part.misses;
+    st->inserts += part.inserts;
+    st->evictions += part.evictions;
+    st->bytes_read += part.bytes_read;
+    st->bytes_written += part.bytes_written;
+    st->io_time += part.io_time;
+  }
+}
+
+static void striped_destroy(cache *_c) {
+  striped_cache *c = (striped_cache *)_c;
+  unsigned int i;
+
+  for (i = 0; i < c->n; i++) {
+    cache_destroy(c->s[i].c);
+    ga_mutex_destroy(&c->s[i].lock);
+  }
+  free(c->s);
+}
+
+cache *cache_striped(cache **parts, unsigned int n, cache_refv_fn vref,
+                     error *e) {
+  striped_cache *res;
+  unsigned int i;
+
+  if (n == 0) {
+    error_set(e, GA_VALUE_ERROR, "cache_striped: no parts");
+    return NULL;
+  }
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL) {
+    error_sys(e, "calloc");
+    return NULL;
+  }
+  res->s = calloc(n, sizeof(stripe));
+  if (res->s == NULL) {
+    free(res);
+    error_sys(e, "calloc");
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    if (ga_mutex_init(&res->s[i].lock)) {
+      while (i > 0)
+        ga_mutex_destroy(&res->s[--i].lock);
+      free(res->s);
+      free(res);
+      error_set(e, GA_SYS_ERROR, "Could not create mutex");
+      return NULL;
+    }
+    res->s[i].c = parts[i];
+  }
+  res->n = n;
+  res->vref = vref;
+
+  res->c.add = striped_add;
+  res->c.del = striped_del;
+  res->c.get = striped_get;
+  res->c.destroy = striped_destroy;
+  res->c.get_stats = striped_stats;
+  res->c.keq = parts[0]->keq;
+  res->c.khash = parts[0]->khash;
+  res->c.kfree = parts[0]->kfree;
+  res->c.vfree = parts[0]->vfree;
+  return (cache *)res;
+}
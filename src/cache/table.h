@@ -0,0 +1,317 @@
+#ifndef CACHE_TABLE_H
+#define CACHE_TABLE_H
+
+#include <stdlib.h>
+
+#include "cache.h"
+
+/*
+ * Storage shared by the in-memory caches (lru.c and twoq.c).
+ *
+ * The entries live in nodes that are carved from a single array (the
+ * arena) and are referred to by index.  Freed nodes are chained on a
+ * free list and the arena only grows (with realloc(), which is why
+ * there are no pointers to nodes) if a cache has no size limit.
+ *
+ * Lookups go through an open-addressing table with Robin Hood
+ * hashing.  Each slot holds the key, its hash and the index of its
+ * node, so a probe only reads the slot array and calls the key
+ * comparison when the hashes match.  The list links stay in the node
+ * so moving slots around doesn't disturb the lists.
+ *
+ * The table is kept at most half full.  With more, lookups of cached
+ * keys start missing their home slot often enough that the
+ * mispredicted branches cost more than the chained buckets this
+ * replaces (see tests/bench_cache.c).
+ *
+ * The caches order their nodes in doubly linked lists through `prev`
+ * and `next`.
+ */
+
+#define NIL ((uint32_t)-1)
+
+typedef struct _node node;
+typedef struct _list list;
+typedef struct _slot slot;
+typedef struct _table table;
+
+struct _node {
+  cache_value_t val;
+  uint32_t hash;
+  uint32_t prev;
+  uint32_t next; /* also links the free list */
+  int temp; /* for cache_twoq() */
+};
+
+struct _slot {
+  cache_key_t key;
+  uint32_t hash;
+  uint32_t node; /* NIL if empty */
+};
+
+struct _table {
+  slot *slots;
+  size_t mask; /* number of slots - 1 */
+  node *nodes;
+  uint32_t nnodes; /* size of the arena */
+  uint32_t used; /* nodes that were handed out at least once */
+  uint32_t free;
+  size_t size;
+};
+
+#define NODE(t, n) (&(t)->nodes[n])
+
+static inline size_t roundup2(size_t s) {
+  s--;
+  s |= s >> 1;
+  s |= s >> 2;
+  s |= s >> 4;
+  s |= s >> 8;
+  s |= s >> 16;
+  if (sizeof(size_t) >= 8)
+    s |= s >> 32;
+  s++;
+  return s;
+}
+
+static inline size_t table_nslots(size_t size) {
+  return roundup2(size * 2);
+}
+
+static inline int table_init(table *t, size_t size, error *e) {
+  size_t i, n;
+
+  if (size < 8)
+    size = 8;
+  n = table_nslots(size);
+  t->slots = malloc(n * sizeof(slot));
+  t->nodes = malloc(size * sizeof(node));
+  if (t->slots == NULL || t->nodes == NULL) {
+    free(t->slots);
+    free(t->nodes);
+    error_sys(e, "malloc");
+    return -1;
+  }
+  for (i = 0; i < n; i++)
+    t->slots[i].node = NIL;
+  t->mask = n - 1;
+  t->nnodes = (uint32_t)size;
+  t->used = 0;
+  t->free = NIL;
+  t->size = 0;
+  return 0;
+}
+
+static inline void table_clear(table *t, cache_freek_fn kfree,
+                               cache_freev_fn vfree) {
+  size_t i;
+
+  for (i = 0; i <= t->mask; i++) {
+    if (t->slots[i].node != NIL) {
+      kfree(t->slots[i].key);
+      vfree(NODE(t, t->slots[i].node)->val);
+    }
+  }
+  free(t->slots);
+  free(t->nodes);
+  t->slots = NULL;
+  t->nodes = NULL;
+  t->mask = 0;
+  t->size = 0;
+}
+
+/* Distance of the entry in slot `i` from its home slot */
+static inline size_t slot_dist(table *t, size_t i) {
+  return (i - (t->slots[i].hash & t->mask)) & t->mask;
+}
+
+/* Returns the node that holds `key` (whose hash is `h`) or NIL */
+static inline uint32_t table_findh(table *t, const cache_key_t key,
+                                   uint32_t h, cache_eq_fn keq) {
+  size_t i = h & t->mask;
+  size_t d = 0;
+
+  for (;;) {
+    if (t->slots[i].hash == h && t->slots[i].node != NIL &&
+        keq(t->slots[i].key, key))
+      return t->slots[i].node;
+    /* It would have taken the place of anything closer to home */
+    if (t->slots[i].node == NIL || slot_dist(t, i) < d)
+      return NIL;
+    i = (i + 1) & t->mask;
+    d++;
+  }
+}
+
+/* Returns the node that holds `key` or NIL */
+static inline uint32_t table_find(table *t, const cache_key_t key,
+                                  cache_eq_fn keq, cache_hash_fn khash) {
+  return table_findh(t, key, khash(key), keq);
+}
+
+static inline void slot_insert(table *t, slot s) {
+  size_t i = s.hash & t->mask;
+  size_t d = 0, e;
+  slot tmp;
+
+  while (t->slots[i].node != NIL) {
+    /* Take the place of entries that are closer to home */
+    e = slot_dist(t, i);
+    if (e < d) {
+      tmp = t->slots[i];
+      t->slots[i] = s;
+      s = tmp;
+      d = e;
+    }
+    i = (i + 1) & t->mask;
+    d++;
+  }
+  t->slots[i] = s;
+}
+
+static inline int table_grow(table *t) {
+  slot *old = t->slots;
+  size_t n = (t->mask + 1) * 2;
+  size_t i;
+
+  t->slots = malloc(n * sizeof(slot));
+  if (t->slots == NULL) {
+    t->slots = old;
+    return -1;
+  }
+  for (i = 0; i < n; i++)
+    t->slots[i].node = NIL;
+  n = t->mask + 1;
+  t->mask = t->mask * 2 + 1;
+  for (i = 0; i < n; i++)
+    if (old[i].node != NIL)
+      slot_insert(t, old[i]);
+  free(old);
+  return 0;
+}
+
+static inline uint32_t node_new(table *t) {
+  node *tmp;
+  uint32_t n;
+
+  if (t->free != NIL) {
+    n = t->free;
+    t->free = NODE(t, n)->next;
+    return n;
+  }
+  if (t->used == t->nnodes) {
+    tmp = realloc(t->nodes, (size_t)t->nnodes * 2 * sizeof(node));
+    if (tmp == NULL)
+      return NIL;
+    t->nodes = tmp;
+    t->nnodes *= 2;
+  }
+  return t->used++;
+}
+
+/*
+ * Add an entry without checking if the key is already there.
+ *
+ * Returns the node or NIL if out of memory.
+ */
+static inline uint32_t table_add(table *t, const cache_key_t key,
+                                 const cache_value_t val,
+                                 cache_hash_fn khash) {
+  slot s;
+  node *nd;
+  uint32_t n;
+
+  if (t->size + 1 > (t->mask + 1) / 2 && table_grow(t))
+    return NIL;
+  n = node_new(t);
+  if (n == NIL)
+    return NIL;
+  nd = NODE(t, n);
+  nd->val = val;
+  nd->hash = khash(key);
+  nd->prev = NIL;
+  nd->next = NIL;
+  nd->temp = 0;
+  s.key = key;
+  s.hash = nd->hash;
+  s.node = n;
+  slot_insert(t, s);
+  t->size++;
+  return n;
+}
+
+/* Remove node `n` (which must not be in a list) and free its data */
+static inline void table_del(table *t, uint32_t n, cache_freek_fn kfree,
+                             cache_freev_fn vfree) {
+  node *nd = NODE(t, n);
+  size_t i = nd->hash & t->mask;
+  size_t j;
+
+  while (t->slots[i].node != n)
+    i = (i + 1) & t->mask;
+  kfree(t->slots[i].key);
+  /* Shift the following entries back to keep the probes short */
+  for (;;) {
+    j = (i + 1) & t->mask;
+    if (t->slots[j].node == NIL || slot_dist(t, j) == 0)
+      break;
+    t->slots[i] = t->slots[j];
+    i = j;
+  }
+  t->slots[i].node = NIL;
+  vfree(nd->val);
+  nd->next = t->free;
+  t->free = n;
+  t->size--;
+}
+
+struct _list {
+  uint32_t head;
+  uint32_t tail;
+  size_t size;
+};
+
+static inline void list_init(list *l) {
+  l->head = NIL;
+  l->tail = NIL;
+  l->size = 0;
+}
+
+static inline void list_remove(table *t, list *l, uint32_t n) {
+  node *nd = NODE(t, n);
+
+  if (nd->prev != NIL)
+    NODE(t, nd->prev)->next = nd->next;
+  else
+    l->head = nd->next;
+  if (nd->next != NIL)
+    NODE(t, nd->next)->prev = nd->prev;
+  else
+    l->tail = nd->prev;
+  nd->prev = NIL;
+  nd->next = NIL;
+  l->size--;
+}
+
+static inline uint32_t list_pop(table *t, list *l) {
+  uint32_t n = l->head;
+
+  if (n != NIL)
+    list_remove(t, l, n);
+  return n;
+}
+
+static inline void list_push(table *t, list *l, uint32_t n) {
+  node *nd = NODE(t, n);
+
+  nd->next = NIL;
+  nd->prev = l->tail;
+  if (l->tail != NIL)
+    NODE(t, l->tail)->next = n;
+  else
+    l->head = n;
+  l->tail = n;
+  l->size++;
+}
+
+#endif
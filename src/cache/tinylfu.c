@@ -0,0 +1,291 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gpuarray/error.h>
+
+#include "cache.h"
+#include "cache/table.h"
+#include "private_config.h"
+
+/*
+ * W-TinyLFU (Einziger, Friedman and Manes, "TinyLFU: A Highly
+ * Efficient Cache Admission Policy").
+ *
+ * New entries go to an LRU window of 1% of the entries.  What falls
+ * out of the window only stays if its key was looked up more often
+ * than the entry the main cache would evict for it.  The main
+ * cache is a segmented LRU: entries start in probation and move to
+ * protected (80% of the main cache) on their next hit.
+ *
+ * The lookup counts of all keys, cached or not, are estimated with a
+ * count-min sketch of 4-bit counters.  They are halved every 10 *
+ * size lookups so that old popularity fades.  Only hashes are kept, so
+ * unlike ARC this doesn't hold on to the keys of evicted entries.
+ */
+
+typedef struct _tinylfu_cache tinylfu_cache;
+
+#define WINDOW 0
+#define PROBATION 1
+#define PROTECTED 2
+
+#define SKETCH_ROWS 4
+#define SKETCH_MAX 15
+
+static const uint32_t sketch_seeds[SKETCH_ROWS] = {
+  0x9E3779B1U, 0x85EBCA77U, 0xC2B2AE3DU, 0x27D4EB2FU
+};
+
+struct _tinylfu_cache {
+  cache c;
+  table data;
+  list window;
+  list probation;
+  list protected;
+  size_t size;
+  size_t window_size;
+  size_t protected_size;
+  /* SKETCH_ROWS rows of 2^(32 - shift) counters */
+  uint8_t *sketch;
+  unsigned int shift;
+  size_t lookups;
+  size_t sample_size;
+};
+
+static inline uint8_t *sketch_counter(tinylfu_cache *c, unsigned int row,
+                                      uint32_t h) {
+  return &c->sketch[((size_t)row << (32 - c->shift)) +
+                    ((h * sketch_seeds[row]) >> c->shift)];
+}
+
+static uint8_t sketch_get(tinylfu_cache *c, uint32_t h) {
+  uint8_t res = SKETCH_MAX;
+  uint8_t *v;
+  unsigned int i;
+
+  for (i = 0; i < SKETCH_ROWS; i++) {
+    v = sketch_counter(c, i, h);
+    if (*v < res)
+      res = *v;
+  }
+  return res;
+}
+
+static void sketch_inc(tinylfu_cache *c, uint32_t h) {
+  uint8_t *v;
+  size_t i;
+
+  for (i = 0; i < SKETCH_ROWS; i++) {
+    v = sketch_counter(c, i, h);
+    if (*v < SKETCH_MAX)
+      (*v)++;
+  }
+  if (++c->lookups == c->sample_size) {
+    for (i = 0; i < ((size_t)SKETCH_ROWS << (32 - c->shift)); i++)
+      c->sketch[i] >>= 1;
+    c->lookups /= 2;
+  }
+}
+
+static inline list *tinylfu_list(tinylfu_cache *c, uint32_t n) {
+  switch (NODE(&c->data, n)->temp) {
+  case WINDOW:
+    return &c->window;
+  case PROBATION:
+    return &c->probation;
+  case PROTECTED:
+    return &c->protected;
+  default:
+    assert(0 && "node segment is not within expected values");
+    return NULL;
+  }
+}
+
+static void tinylfu_evict(tinylfu_cache *c, uint32_t n) {
+  list_remove(&c->data, tinylfu_list(c, n), n);
+  table_del(&c->data, n, c->c.kfree, c->c.vfree);
+  c->c.stats.evictions++;
+}
+
+/*
+ * Move what overflows the window to the end of probation, then evict
+ * until the cache fits.  Each time the oldest of the entries that
+ * came from the window is compared to the head of probation and the
+ * one whose key was looked up less often goes.  Ties go to the entry
+ * in the main cache, so a loop over more keys than fit keeps part of
+ * them cached.
+ */
+static inline void tinylfu_prune(tinylfu_cache *c) {
+  uint32_t cand = NIL, victim, n;
+
+  while (c->window.size > c->window_size) {
+    n = list_pop(&c->data, &c->window);
+    NODE(&c->data, n)->temp = PROBATION;
+    list_push(&c->data, &c->probation, n);
+    if (cand == NIL)
+      cand = n;
+  }
+  while (c->data.size > c->size) {
+    victim = c->probation.head;
+    if (victim == NIL)
+      victim = c->protected.head;
+    if (victim == NIL)
+      victim = c->window.head;
+    if (cand == NIL || cand == victim) {
+      if (cand == victim)
+        cand = NODE(&c->data, cand)->next;
+      tinylfu_evict(c, victim);
+    } else if (sketch_get(c, NODE(&c->data, cand)->hash) >
+               sketch_get(c, NODE(&c->data, victim)->hash)) {
+      tinylfu_evict(c, victim);
+    } else {
+      n = cand;
+      cand = NODE(&c->data, cand)->next;
+      tinylfu_evict(c, n);
+    }
+  }
+}
+
+/* Keep the protected segment within its share of the main cache */
+static inline void tinylfu_demote(tinylfu_cache *c) {
+  uint32_t n;
+
+  while (c->protected.size > c->protected_size) {
+    n = list_pop(&c->data, &c->protected);
+    NODE(&c->data, n)->temp = PROBATION;
+    list_push(&c->data, &c->probation, n);
+  }
+}
+
+static int tinylfu_del(cache *_c, const cache_key_t k) {
+  tinylfu_cache *c = (tinylfu_cache *)_c;
+  uint32_t n = table_find(&c->data, k, c->c.keq, c->c.khash);
+  if (n != NIL) {
+    list_remove(&c->data, tinylfu_list(c, n), n);
+    table_del(&c->data, n, c->c.kfree, c->c.vfree);
+    return 1;
+  }
+  return 0;
+}
+
+static int tinylfu_add(cache *_c, cache_key_t key, cache_value_t val) {
+  tinylfu_cache *c = (tinylfu_cache *)_c;
+  uint32_t n;
+
+  /* The lookup that missed before this was already counted */
+  tinylfu_del(_c, key);
+  n = table_add(&c->data, key, val, c->c.khash);
+  if (n == NIL) {
+    c->c.kfree(key);
+    c->c.vfree(val);
+    return -1;
+  }
+  NODE(&c->data, n)->temp = WINDOW;
+  list_push(&c->data, &c->window, n);
+  c->c.stats.inserts++;
+  tinylfu_prune(c);
+  return 0;
+}
+
+static cache_value_t tinylfu_get(cache *_c, const cache_key_t key) {
+  tinylfu_cache *c = (tinylfu_cache *)_c;
+  uint32_t h = c->c.khash(key);
+  uint32_t n = table_findh(&c->data, key, h, c->c.keq);
+
+  sketch_inc(c, h);
+  if (n == NIL) {
+    c->c.stats.misses++;
+    return NULL;
+  }
+  c->c.stats.hits++;
+  switch (NODE(&c->data, n)->temp) {
+  case WINDOW:
+    list_remove(&c->data, &c->window, n);
+    list_push(&c->data, &c->window, n);
+    break;
+  case PROBATION:
+    list_remove(&c->data, &c->probation, n);
+    NODE(&c->data, n)->temp = PROTECTED;
+    list_push(&c->data, &c->protected, n);
+    tinylfu_demote(c);
+    break;
+  case PROTECTED:
+    list_remove(&c->data, &c->protected, n);
+    list_push(&c->data, &c->protected, n);
+    break;
+  default:
+    assert(0 && "node segment is not within expected values");
+  }
+  return NODE(&c->data, n)->val;
+}
+
+static void tinylfu_destroy(cache *_c) {
+  tinylfu_cache *c = (tinylfu_cache *)_c;
+  table_clear(&c->data, c->c.kfree, c->c.vfree);
+  list_init(&c->window);
+  list_init(&c->probation);
+  list_init(&c->protected);
+  free(c->sketch);
+}
+
+cache *cache_tinylfu(size_t size, cache_eq_fn keq, cache_hash_fn khash,
+                     cache_freek_fn kfree, cache_freev_fn vfree,
+                     error *e) {
+  tinylfu_cache *res;
+  size_t width;
+
+  if (size < 2) {
+    error_set(e, GA_VALUE_ERROR, "cache_tinylfu: size is less than 2");
+    return NULL;
+  }
+
+  res = malloc(sizeof(*res));
+  if (res == NULL) {
+    error_sys(e, "malloc");
+    return NULL;
+  }
+
+  /* One more since entries are added before pruning */
+  if (table_init(&res->data, size+1, e)) {
+    free(res);
+    return NULL;
+  }
+  /* Enough counters that the keys seen between two halvings (up to 10
+     per entry) rarely share all of theirs */
+  res->shift = 32 - 4;
+  for (width = 16; width < size * 4; width *= 2)
+    res->shift--;
+  res->sketch = calloc(SKETCH_ROWS * width, 1);
+  if (res->sketch == NULL) {
+    table_clear(&res->data, kfree, vfree);
+    free(res);
+    error_sys(e, "calloc");
+    return NULL;
+  }
+  res->lookups = 0;
+  res->sample_size = 10 * size;
+
+  list_init(&res->window);
+  list_init(&res->probation);
+  list_init(&res->protected);
+  /* 1% for the window and 80% of the rest protected */
+  res->size = size;
+  res->window_size = size / 100;
+  if (res->window_size == 0)
+    res->window_size = 1;
+  res->protected_size = (size - res->window_size) -
+    (size - res->window_size) / 5;
+
+  res->c.add = tinylfu_add;
+  res->c.del = tinylfu_del;
+  res->c.get = tinylfu_get;
+  res->c.destroy = tinylfu_destroy;
+  res->c.get_stats = NULL;
+  res->c.keq = keq;
+  res->c.khash = khash;
+  res->c.kfree = kfree;
+  res->c.vfree = vfree;
+  memset(&res->c.stats, 0, sizeof(res->c.stats));
+  return (cache *)res;
+}
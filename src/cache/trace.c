@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cache.h"
+
+typedef struct _trace_cache {
+  cache c;
+  cache *inner;
+  kfp_fn kfp;
+  FILE *f;
+} trace_cache;
+
+static int trace_add(cache *_c, cache_key_t k, cache_value_t v) {
+  return cache_add(((trace_cache *)_c)->inner, k, v);
+}
+
+static int trace_del(cache *_c, const cache_key_t k) {
+  return cache_del(((trace_cache *)_c)->inner, k);
+}
+
+static cache_value_t trace_get(cache *_c, const cache_key_t k) {
+  trace_cache *c = (trace_cache *)_c;
+  cache_fp fp;
+
+  c->kfp(k, &fp);
+  /* A single call so that lines from different threads don't mix */
+  fprintf(c->f, "%016llx%016llx\n", (unsigned long long)fp.h[0],
+          (unsigned long long)fp.h[1]);
+  return cache_get(c->inner, k);
+}
+
+static void trace_stats(cache *_c, gpucache_stats *st) {
+  cache_get_stats(((trace_cache *)_c)->inner, st);
+}
+
+static void trace_destroy(cache *_c) {
+  trace_cache *c = (trace_cache *)_c;
+  cache_destroy(c->inner);
+  fclose(c->f);
+}
+
+cache *cache_trace(cache *c, const char *path, kfp_fn kfp, error *e) {
+  trace_cache *res;
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL) {
+    error_sys(e, "calloc");
+    return NULL;
+  }
+  res->f = fopen(path, "a");
+  if (res->f == NULL) {
+    free(res);
+    error_sys(e, "fopen");
+    return NULL;
+  }
+  /* Keep what was written if the process doesn't exit cleanly */
+  setvbuf(res->f, NULL, _IOLBF, 0);
+  res->inner = c;
+  res->kfp = kfp;
+
+  res->c.add = trace_add;
+  res->c.del = trace_del;
+  res->c.get = trace_get;
+  res->c.destroy = trace_destroy;
+  res->c.get_stats = trace_stats;
+  res->c.keq = c->keq;
+  res->c.khash = c->khash;
+  res->c.kfree = c->kfree;
+  res->c.vfree = c->vfree;
+  return (cache *)res;
+}
@@ -505,6 +505,38 @@ GPUARRAY_PUBLIC int GpuArray_write(GpuArray *dst, const void *src,
 GPUARRAY_PUBLIC int GpuArray_read(void *dst, size_t dst_sz,
                                   const GpuArray *src);
 
+/**
+ * Start a copy of data from the host memory to the device memory.
+ *
+ * See gpudata_write_async() for the details.
+ *
+ * \param dst destination array (must be contiguous)
+ * \param src source host memory (contiguous block)
+ * \param src_sz size of data to copy (in bytes)
+ * \param ev returns the completion event
+ *
+ * \return GA_NO_ERROR if the operation was succesful.
+ * \return an error code otherwise
+ */
+GPUARRAY_PUBLIC int GpuArray_write_async(GpuArray *dst, const void *src,
+                                         size_t src_sz, gpuevent **ev);
+
+/**
+ * Start a copy of data from the device memory to the host memory.
+ *
+ * See gpudata_read_async() for the details.
+ *
+ * \param dst destination host memory (contiguous block)
+ * \param dst_sz size of data to copy (in bytes)
+ * \param src source array (must be contiguous)
+ * \param ev returns the completion event
+ *
+ * \return GA_NO_ERROR if the operation was succesful.
+ * \return an error code otherwise
+ */
+GPUARRAY_PUBLIC int GpuArray_read_async(void *dst, size_t dst_sz,
+                                        const GpuArray *src, gpuevent **ev);
+
 /**
  * Set all of an array's data to a byte pattern.
  *
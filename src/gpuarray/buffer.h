@@ -43,6 +43,13 @@ struct _gpukernel;
  */
 typedef struct _gpukernel gpukernel;
 
+struct _gpuevent;
+
+/**
+ * Opaque struct for the completion of an asynchronous transfer.
+ */
+typedef struct _gpuevent gpuevent;
+
 /**
  * \brief Gets information about the number of available platforms for the
  * backend specified in `name`.
@@ -73,6 +80,17 @@ GPUARRAY_PUBLIC int gpu_get_device_count(const char* name,
  *
  * \warning This function is not thread-safe.
  *
+ * With the cuda backend, if the disk cache is enabled (with
+ * GPUARRAY_CACHE_PATH) and GPUARRAY_CACHE_PRELOAD is set to a value
+ * other than 0, the kernels used by previous processes are recorded
+ * in the cache directory and new contexts start loading them in the
+ * background.
+ *
+ * With the cuda backend, if GPUARRAY_CACHE_TRACE names a file, the
+ * fingerprint of the source of each kernel looked up in the kernel
+ * cache is appended to it, one per line.  These traces can be fed to
+ * tests/bench_cache_policy to compare cache policies.
+ *
  * \param name the backend name.
  * \param dev the device number.  The precise meaning of the device
  *            number is backend-dependent
@@ -99,9 +117,22 @@ GPUARRAY_PUBLIC gpucontext *gpucontext_init(const char *name, int dev,
 #define GA_CTX_DEFAULT       0x00
 
 /**
- * Optimize parameters for multi-thread performance.
+ * Allow the context to be used from multiple threads at once.
+ *
+ * Buffer allocation and release, kernel creation and the caches are
+ * then safe to use concurrently and the caches are split to reduce
+ * contention.  Each buffer and the arguments set with
+ * gpukernel_setarg() must still be used by one thread at a time.
+ * Kernels can be shared if the arguments are passed to
+ * gpukernel_call().
  *
- * May decrease overall performance in single-thread scenarios.
+ * The context keeps a single error message.  The error codes that are
+ * returned stay reliable but when threads fail at the same time the
+ * message from gpucontext_error() may belong to another thread's
+ * error or be a mix of both.
+ *
+ * Only implemented for cuda.  May decrease overall performance in
+ * single-thread scenarios.
  */
 #define GA_CTX_MULTI_THREAD  0x01
 
@@ -170,7 +201,8 @@ GPUARRAY_PUBLIC int gpucontext_property(gpucontext *ctx, int prop_id,
  *
  * If you need to get a description of a error that occurred during
  * context creation, call this function using NULL as the context.
- * This version of the call is not thread-safe.
+ * This version of the call is not thread-safe.  See
+ * GA_CTX_MULTI_THREAD for the messages of shared contexts.
  *
  * \param ctx the context in which the error occured
  * \param err error code
@@ -179,6 +211,41 @@ GPUARRAY_PUBLIC int gpucontext_property(gpucontext *ctx, int prop_id,
  */
 GPUARRAY_PUBLIC const char *gpucontext_error(gpucontext *ctx, int err);
 
+/**
+ * Release the cached memory of a context.
+ *
+ * Give back to the driver the memory that the context keeps around
+ * for reuse and that isn't used by any buffer.  This is useful to
+ * shrink the memory footprint of long-running programs between
+ * phases of work.  Memory in use by live buffers is not affected.
+ *
+ * \param ctx a context pointer
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpucontext_trim_cache(gpucontext *ctx);
+
+struct _gpucontext_alloc_policy;
+
+/**
+ * Change the allocation policy of a context.
+ *
+ * This controls how the allocation cache gets memory from the driver
+ * (see gpucontext_alloc_policy).  It can be changed at any time and
+ * the current values are available through the
+ * GA_CTX_PROP_ALLOC_POLICY property.
+ *
+ * This is only supported for the cuda backend when the allocation
+ * cache is enabled.
+ *
+ * \param ctx a context pointer
+ * \param policy the new policy
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpucontext_set_alloc_policy(
+  gpucontext *ctx, const struct _gpucontext_alloc_policy *policy);
+
 /**
  * Allocates a buffer of size `sz` in context `ctx`.
  *
@@ -390,6 +457,75 @@ GPUARRAY_PUBLIC int gpudata_memset(gpudata *dst, size_t dstoff, int data);
  */
 GPUARRAY_PUBLIC int gpudata_sync(gpudata *b);
 
+/**
+ * Start a transfer of data from a buffer to memory.
+ *
+ * This is like gpudata_read() except that it returns without waiting
+ * for the transfer to be done.  The content of `dst` is only valid
+ * once gpuevent_wait() or gpuevent_query() reported the completion of
+ * the returned event.
+ *
+ * \param dst destination in memory
+ * \param src source buffer
+ * \param srcoff offset inside the source buffer
+ * \param sz size of data to copy (in bytes)
+ * \param ev returns the completion event, to release with
+ *           gpuevent_release()
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpudata_read_async(void *dst,
+                                       gpudata *src, size_t srcoff,
+                                       size_t sz, gpuevent **ev);
+
+/**
+ * Start a transfer of data from memory to a buffer.
+ *
+ * This is like gpudata_write() except that it may return before the
+ * transfer is done.  `src` must not be modified until the completion
+ * of the returned event.
+ *
+ * \param dst destination buffer
+ * \param dstoff offset inside the destination buffer
+ * \param src source in memory
+ * \param sz size of data to copy (in bytes)
+ * \param ev returns the completion event, to release with
+ *           gpuevent_release()
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpudata_write_async(gpudata *dst, size_t dstoff,
+                                        const void *src, size_t sz,
+                                        gpuevent **ev);
+
+/**
+ * Wait for the transfer of an event to be done.
+ *
+ * \param ev event
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpuevent_wait(gpuevent *ev);
+
+/**
+ * Check if the transfer of an event is done without waiting.
+ *
+ * \param ev event
+ * \param done set to 1 if the transfer is done and 0 otherwise
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpuevent_query(gpuevent *ev, int *done);
+
+/**
+ * Release an event.
+ *
+ * If the transfer is not done yet, this waits for it.
+ *
+ * \param ev event
+ */
+GPUARRAY_PUBLIC void gpuevent_release(gpuevent *ev);
+
 /**
  * Fetch a buffer property.
  *
@@ -439,6 +575,52 @@ GPUARRAY_PUBLIC gpukernel *gpukernel_init(gpucontext *ctx, unsigned int count,
                                           const int *typecodes, int flags, int *ret,
                                           char **err_str);
 
+/**
+ * Start compiling a kernel in the background.
+ *
+ * This takes the same arguments as gpukernel_init() and returns a
+ * kernel that can be used like any other.  The compilation happens
+ * in a pool of worker threads and the first call that needs the
+ * compiled code waits for it.  This means that compilation errors
+ * may be reported by a later call like gpukernel_call().  Use
+ * gpukernel_wait() to get them along with the compiler output.
+ *
+ * Starting the compilation of a number of kernels before using any
+ * of them lets them compile in parallel.
+ *
+ * The number of worker threads defaults to the number of processors
+ * (up to 8) and can be set with the GPUARRAY_COMPILE_THREADS
+ * environment variable.  Backends that don't support this compile
+ * the kernel right away.
+ *
+ * \returns Allocated kernel structure or NULL if an error occured.
+ * `ret` will be updated with the error code if not NULL.
+ */
+GPUARRAY_PUBLIC gpukernel *gpukernel_init_async(gpucontext *ctx,
+                                                unsigned int count,
+                                                const char **strings,
+                                                const size_t *lengths,
+                                                const char *fname,
+                                                unsigned int numargs,
+                                                const int *typecodes,
+                                                int flags, int *ret);
+
+/**
+ * Wait for the compilation of a kernel to finish.
+ *
+ * This does nothing for kernels that are already compiled.
+ *
+ * \param k kernel
+ * \param err_str returns pointer to debug message from GPU backend
+ *        (if provided a non-NULL err_str)
+ *
+ * If `*err_str` is not NULL on return, the caller must call
+ * `free(*err_str)` after use.
+ *
+ * \returns GA_NO_ERROR or an error code if the compilation failed.
+ */
+GPUARRAY_PUBLIC int gpukernel_wait(gpukernel *k, char **err_str);
+
 /**
  * Retain a kernel.
  *
@@ -694,6 +876,121 @@ GPUARRAY_PUBLIC gpucontext *gpukernel_context(gpukernel *k);
  */
 #define GA_CTX_PROP_LARGEST_MEMBLOCK 20
 
+/**
+ * Get statistics on the memory allocations of the context.
+ *
+ * This is only supported for the cuda backend.
+ *
+ * Type: `gpucontext_memstats`
+ */
+#define GA_CTX_PROP_MEMSTATS 21
+
+/**
+ * Memory allocation statistics for a context.
+ *
+ * The byte counts are in terms of the blocks handed out by the
+ * allocation cache which may be slightly bigger than the requested
+ * sizes.  The counters start at 0 when the context is created.
+ */
+typedef struct _gpucontext_memstats {
+  /** Bytes in buffers that are currently allocated */
+  size_t live_bytes;
+  /** Bytes kept in the allocation cache, ready for reuse */
+  size_t cached_bytes;
+  /** Highest value that `live_bytes` reached */
+  size_t peak_bytes;
+  /** Bytes obtained from the driver (`live_bytes + cached_bytes`) */
+  size_t reserved_bytes;
+  /** Number of allocations obtained from the driver */
+  size_t blocks;
+  /** Number of blocks kept in the allocation cache */
+  size_t free_blocks;
+  /** Size of the largest block in the allocation cache */
+  size_t largest_free;
+  /** Number of buffer allocations */
+  size_t allocs;
+  /** Number of buffer releases */
+  size_t frees;
+  /** Number of times a cached block was split to fit a request */
+  size_t splits;
+  /** Number of times a released block was merged with a neighbour */
+  size_t merges;
+} gpucontext_memstats;
+
+/**
+ * Get the allocation policy of the context.
+ *
+ * This is only supported for the cuda backend.
+ *
+ * Type: `gpucontext_alloc_policy`
+ */
+#define GA_CTX_PROP_ALLOC_POLICY 22
+
+/**
+ * Allocation cache policy for a context.
+ *
+ * The cache gets memory from the driver in blocks of at least
+ * `block_size` bytes which are split to serve smaller requests.  The
+ * size of those blocks doubles as the memory reserved by the context
+ * grows, up to `max_block_size`.
+ *
+ * Requests of `large_threshold` bytes or more get memory of their own
+ * from the driver which is cached apart when released and only reused
+ * for requests of about the same size.  A value of 0 disables this.
+ */
+typedef struct _gpucontext_alloc_policy {
+  /** Smallest block to get from the driver */
+  size_t block_size;
+  /** Biggest block to get from the driver for small requests */
+  size_t max_block_size;
+  /** Size from which requests go to the large pool */
+  size_t large_threshold;
+} gpucontext_alloc_policy;
+
+/**
+ * Get statistics on the caches of the context.
+ *
+ * Type: `gpucontext_cachestats`
+ */
+#define GA_CTX_PROP_CACHESTATS 23
+
+/**
+ * Statistics for one cache.
+ *
+ * The counters start at 0 when the cache is created.
+ */
+typedef struct _gpucache_stats {
+  /** Lookups that found an entry */
+  size_t hits;
+  /** Lookups that didn't find an entry */
+  size_t misses;
+  /** Entries added */
+  size_t inserts;
+  /** Entries dropped to stay under the size limit */
+  size_t evictions;
+  /** Bytes read from disk (disk cache only) */
+  size_t bytes_read;
+  /** Bytes written to disk (disk cache only) */
+  size_t bytes_written;
+  /** Seconds spent looking up and writing entries on disk (disk
+      cache only) */
+  double io_time;
+} gpucache_stats;
+
+/**
+ * Statistics for the caches of a context.
+ *
+ * The statistics for a cache that is not in use are all 0.
+ */
+typedef struct _gpucontext_cachestats {
+  /** Compiled kernels, by source */
+  gpucache_stats kernel;
+  /** Kernel binaries on disk (enabled with GPUARRAY_CACHE_PATH) */
+  gpucache_stats disk;
+  /** Kernels for copies between arrays of different layouts */
+  gpucache_stats extcopy;
+} gpucontext_cachestats;
+
 /* Start at 512 for GA_BUFFER_PROP_ */
 #define GA_BUFFER_PROP_START  512
 
@@ -721,6 +1018,30 @@ GPUARRAY_PUBLIC gpucontext *gpukernel_context(gpukernel *k);
  */
 #define GA_BUFFER_PROP_SIZE  514
 
+/**
+ * Host address of a buffer allocated with GA_BUFFER_HOST.
+ *
+ * The memory can be accessed directly from the host, but it is up to
+ * you to make sure that no device operation on the buffer is in
+ * flight (with gpudata_sync() for example).
+ *
+ * This is only supported for the cuda backend.
+ *
+ * Type: `void *`
+ */
+#define GA_BUFFER_PROP_HOSTPOINTER 515
+
+/**
+ * Alignment in bytes of the start of the buffer on the device.
+ *
+ * This is a power of two, at most 256.  Buffers from the library
+ * allocators are always aligned to at least 64 bytes but those that
+ * wrap memory from elsewhere may not be.
+ *
+ * Type: `size_t`
+ */
+#define GA_BUFFER_PROP_ALIGN 516
+
 /* Start at 1024 for GA_KERNEL_PROP_ */
 #define GA_KERNEL_PROP_START     1024
 
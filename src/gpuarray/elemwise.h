@@ -22,6 +22,15 @@ struct _GpuElemwise;
  */
 typedef struct _GpuElemwise GpuElemwise;
 
+struct _GpuElemwisePlan;
+
+/**
+ * Call plan for a GpuElemwise, see GpuElemwisePlan_new().
+ *
+ * The contents are private.
+ */
+typedef struct _GpuElemwisePlan GpuElemwisePlan;
+
 /**
  * Argument information structure for GpuElemwise.
  */
@@ -85,12 +94,25 @@ typedef struct _gpuelemwise_arg {
  * the indexing and selection of the right values is handled by the
  * GpuElemwise code.
  *
+ * Only the contiguous kernel is compiled here, which reports errors
+ * in the expression.  The other variants (vectorized, number of
+ * dimensions, 32 or 64-bit addressing) are compiled the first time
+ * GpuElemwise_call() needs them, unless GE_PRECOMPILE is given.
+ * Instances with the same expression and arguments in a context
+ * share the compiled kernels.
+ *
+ * Contiguous calls on 16384 elements or more use a kernel that
+ * processes several elements per thread with wide loads and stores
+ * when the offsets of all the arrays are aligned to that many
+ * elements.
+ *
  * \param ctx the context in which to run the operations
  * \param preamble code to be inserted before the kernel code
  * \param expr the expression to compute
  * \param n the number of arguments
  * \param args the argument descriptors
- * \param nd the number of dimensions to precompile for
+ * \param nd the expected number of dimensions (more are handled, this
+ *           only sizes some internal buffers)
  * \param flags see \ref elem_flags "GpuElemwise flags"
  *
  * \returns a new GpuElemwise object or NULL
@@ -103,6 +125,71 @@ GPUARRAY_PUBLIC GpuElemwise *GpuElemwise_new(gpucontext *ctx,
                                              unsigned int nd,
                                              int flags);
 
+/**
+ * Stage of a fused operation for GpuElemwise_fuse().
+ */
+typedef struct _gpuelemwise_stage {
+  /**
+   * Name of the value computed by this stage, mandatory.  This is
+   * either an array argument with GE_WRITE or an intermediate value
+   * that is only used by other stages.
+   */
+  const char *name;
+
+  /**
+   * Expression for the value (without the assignment), mandatory.
+   */
+  const char *expr;
+
+  /**
+   * Type of the intermediate value (ignored for arguments).
+   */
+  int typecode;
+} gpuelemwise_stage;
+
+/**
+ * Create a GpuElemwise that runs several expressions in one kernel.
+ *
+ * The stages form a graph through the names they use: a stage whose
+ * expression mentions the name of another uses its value.  They are
+ * run in an order where each comes after the ones it uses, whatever
+ * the order they are given in.  Intermediate values stay in
+ * registers instead of going through memory and the stages that no
+ * output needs are dropped.
+ *
+ * In its own expression, the name of a stage that computes an
+ * argument with GE_READ is the value that was read.  Elsewhere it is
+ * the computed value.
+ *
+ * For example `y = a * x + b` (an intermediate) followed by `z = y >
+ * 0 ? y : 0` (an output) reads a, x and b and writes z without
+ * storing y.
+ *
+ * The result is used like one from GpuElemwise_new().
+ *
+ * \param ctx the context in which to run the operations
+ * \param preamble code to be inserted before the kernel code
+ * \param nstages the number of stages
+ * \param stages the stages
+ * \param n the number of arguments
+ * \param args the argument descriptors
+ * \param nd the expected number of dimensions
+ * \param flags see \ref elem_flags "GpuElemwise flags"
+ *
+ * \returns a new GpuElemwise object or NULL if the stages have a
+ * cycle, compute the same value twice, compute something that is not
+ * an output array, leave a write-only output without a stage or on
+ * allocation failure.
+ */
+GPUARRAY_PUBLIC GpuElemwise *GpuElemwise_fuse(gpucontext *ctx,
+                                              const char *preamble,
+                                              unsigned int nstages,
+                                              gpuelemwise_stage *stages,
+                                              unsigned int n,
+                                              gpuelemwise_arg *args,
+                                              unsigned int nd,
+                                              int flags);
+
 /**
  * \defgroup elem_flags GpuElemwise flags
  * @{
@@ -110,6 +197,8 @@ GPUARRAY_PUBLIC GpuElemwise *GpuElemwise_new(gpucontext *ctx,
 
 /**
  * Don't precompile kernels for 64-bits addressing.
+ *
+ * This only matters with GE_PRECOMPILE.
  */
 #define GE_NOADDR64    0x0001
 
@@ -118,6 +207,16 @@ GPUARRAY_PUBLIC GpuElemwise *GpuElemwise_new(gpucontext *ctx,
  */
 #define GE_CONVERT_F16 0x0002
 
+/**
+ * Compile the kernels for up to `nd` dimensions when the GpuElemwise
+ * is created instead of on first use.
+ *
+ * This is how GpuElemwise_new() used to behave.  It takes longer but
+ * GpuElemwise_call() then never has to wait for a compilation for
+ * arrays of at most `nd` dimensions.
+ */
+#define GE_PRECOMPILE  0x0004
+
 /**
  * @}
  */
@@ -132,6 +231,9 @@ GPUARRAY_PUBLIC void GpuElemwise_free(GpuElemwise *ge);
 /**
  * Run a GpuElemwise on some inputs.
  *
+ * A GpuElemwise can be called from multiple threads at the same time
+ * provided its context was created with GA_CTX_MULTI_THREAD.
+ *
  * \param ge the GpuElemwise to run
  * \param args pointers to the arguments (must macth what was described by
  *             the argument descriptors)
@@ -139,6 +241,81 @@ GPUARRAY_PUBLIC void GpuElemwise_free(GpuElemwise *ge);
  */
 GPUARRAY_PUBLIC int GpuElemwise_call(GpuElemwise *ge, void **args, int flags);
 
+/**
+ * Bind a GpuElemwise to the geometry of a set of arguments.
+ *
+ * This does the work of GpuElemwise_call() that only depends on the
+ * shapes and strides of the arrays once: the checks, the dimension
+ * collapsing, the choice of kernel (which is built if needed) and
+ * the launch configuration.  GpuElemwisePlan_call() then only sets
+ * the buffers, offsets and scalars before launching.  This matters
+ * for small arrays where that work costs more than the kernel.
+ *
+ * The GpuElemwise must not be freed before the plan.
+ *
+ * \param ge the GpuElemwise to bind
+ * \param args arguments with the geometry to bind (like for
+ *             GpuElemwise_call())
+ * \param flags see \ref elem_call_flags "GpuElemwise call flags"
+ * \param ret error code if the plan can't be made (can be NULL)
+ *
+ * \returns a new plan or NULL on error
+ */
+GPUARRAY_PUBLIC GpuElemwisePlan *GpuElemwisePlan_new(GpuElemwise *ge,
+                                                     void **args,
+                                                     int flags, int *ret);
+
+/**
+ * Run a GpuElemwise through a plan.
+ *
+ * The arrays must have the same number of dimensions, shapes and
+ * strides as the ones the plan was made with.  This isn't checked.
+ * Their buffers, offsets and the values of scalars can change.  If
+ * the offsets don't allow the kernel that was chosen, this does a
+ * regular GpuElemwise_call().
+ *
+ * The buffers must also be at least as aligned on the device as the
+ * ones the plan was made with.  All the buffers allocated by a context
+ * are, this only matters for buffers that wrap outside memory.
+ *
+ * A plan keeps the arguments of the last call, it must only be used
+ * by one thread at a time.
+ *
+ * \param plan the plan
+ * \param args pointers to the arguments
+ */
+GPUARRAY_PUBLIC int GpuElemwisePlan_call(GpuElemwisePlan *plan, void **args);
+
+/**
+ * Free a plan.
+ *
+ * \param plan the plan to free
+ */
+GPUARRAY_PUBLIC void GpuElemwisePlan_free(GpuElemwisePlan *plan);
+
+/**
+ * Kernel variants for GpuElemwise_built().
+ */
+#define GE_VARIANT_CONTIG   0
+#define GE_VARIANT_BASIC    1
+#define GE_VARIANT_BASIC_32 2
+#define GE_VARIANT_CONTIG_VEC 3
+
+/**
+ * Check if a kernel variant was built for a GpuElemwise.
+ *
+ * \param ge the GpuElemwise object
+ * \param variant one of GE_VARIANT_CONTIG, GE_VARIANT_CONTIG_VEC
+ *                (vectorized contiguous), GE_VARIANT_BASIC (64-bit
+ *                addressing) or GE_VARIANT_BASIC_32 (32-bit
+ *                addressing)
+ * \param nd number of dimensions of the variant (ignored for the
+ *           contiguous variants)
+ *
+ * \returns 1 if the variant was built, 0 otherwise
+ */
+GPUARRAY_PUBLIC int GpuElemwise_built(GpuElemwise *ge, int variant,
+                                      unsigned int nd);
 
 /**
  * \defgroup elem_call_flags GpuElemwise call flags
@@ -55,6 +55,40 @@ GPUARRAY_PUBLIC int GpuKernel_init(GpuKernel *k, gpucontext *ctx,
                                    unsigned int argcount, const int *types,
                                    int flags, char **err_str);
 
+/**
+ * Initialize a kernel structure and start compiling in the background.
+ *
+ * This is like GpuKernel_init() except that the compilation errors
+ * are only reported by GpuKernel_wait() or by the first call that
+ * needs the compiled kernel.  See gpukernel_init_async() for
+ * details.
+ *
+ * The kernel must be cleared with GpuKernel_clear() even if the
+ * compilation fails.
+ *
+ * \return GA_NO_ERROR if the compilation could be started
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuKernel_init_async(GpuKernel *k, gpucontext *ctx,
+                                         unsigned int count,
+                                         const char **strs,
+                                         const size_t *lens, const char *name,
+                                         unsigned int argcount,
+                                         const int *types, int flags);
+
+/**
+ * Wait for the compilation of a kernel to finish.
+ *
+ * \param k a kernel structure
+ * \param err_str (if not NULL) location to write GPU-backend provided debug info
+ *
+ * If `*err_str` is returned not NULL then it must be free()d by the caller
+ *
+ * \return GA_NO_ERROR if the kernel was compiled successfully
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuKernel_wait(GpuKernel *k, char **err_str);
+
 /**
  * Clear and release data associated with a kernel.
  *
@@ -17,6 +17,7 @@
 #include "gpuarray/util.h"
 
 #include "util/strb.h"
+#include "util/thread.h"
 #include "util/xxhash.h"
 
 struct extcopy_args {
@@ -38,15 +39,23 @@ static uint32_t extcopy_hash(cache_key_t k) {
   return XXH32(k, sizeof(struct extcopy_args), 42);
 }
 
-static int ga_extcopy(GpuArray *dst, const GpuArray *src) {
+/*
+ * The extcopy caches and the GpuElemwise in them are shared by the
+ * threads of a context.  They are only used under this lock, which
+ * also keeps an entry from being evicted while it runs.
+ */
+static ga_once extcopy_once = GA_ONCE_INIT;
+static ga_mutex extcopy_lock;
+
+static void extcopy_init(void) {
+  ga_mutex_init(&extcopy_lock);
+}
+
+static int extcopy_call(gpucontext *ctx, GpuArray *dst, const GpuArray *src) {
   struct extcopy_args a, *aa;
-  gpucontext *ctx = gpudata_context(dst->data);
   GpuElemwise *k = NULL;
   void *args[2];
 
-  if (ctx != gpudata_context(src->data))
-    return GA_INVALID_ERROR;
-
   a.itype = src->typecode;
   a.otype = dst->typecode;
 
@@ -60,6 +69,13 @@ static int ga_extcopy(GpuArray *dst, const GpuArray *src) {
     gargs[1].name = "dst";
     gargs[1].typecode = dst->typecode;
     gargs[1].flags = GE_WRITE;
+    if (ctx->extcopy_cache == NULL)
+      ctx->extcopy_cache = cache_twoq(4, 8, 8, 2, extcopy_eq, extcopy_hash,
+                                      extcopy_free,
+                                      (cache_freev_fn)GpuElemwise_free,
+                                      ctx->err);
+    if (ctx->extcopy_cache == NULL)
+      return GA_MISC_ERROR;
     k = GpuElemwise_new(ctx, "", "dst = src", 2, gargs, 0, 0);
     if (k == NULL)
       return GA_MISC_ERROR;
@@ -68,13 +84,6 @@ static int ga_extcopy(GpuArray *dst, const GpuArray *src) {
       GpuElemwise_free(k);
       return GA_MEMORY_ERROR;
     }
-    if (ctx->extcopy_cache == NULL)
-      ctx->extcopy_cache = cache_twoq(4, 8, 8, 2, extcopy_eq, extcopy_hash,
-                                      extcopy_free,
-                                      (cache_freev_fn)GpuElemwise_free,
-                                      ctx->err);
-    if (ctx->extcopy_cache == NULL)
-      return GA_MISC_ERROR;
     if (cache_add(ctx->extcopy_cache, aa, k) != 0)
       return GA_MISC_ERROR;
   }
@@ -83,6 +92,20 @@ static int ga_extcopy(GpuArray *dst, const GpuArray *src) {
   return GpuElemwise_call(k, args, GE_BROADCAST);
 }
 
+static int ga_extcopy(GpuArray *dst, const GpuArray *src) {
+  gpucontext *ctx = gpudata_context(dst->data);
+  int err;
+
+  if (ctx != gpudata_context(src->data))
+    return GA_INVALID_ERROR;
+
+  ga_call_once(&extcopy_once, extcopy_init);
+  ga_mutex_lock(&extcopy_lock);
+  err = extcopy_call(ctx, dst, src);
+  ga_mutex_unlock(&extcopy_lock);
+  return err;
+}
+
 /* Value below which a size_t multiplication will never overflow. */
 #define MUL_NO_OVERFLOW (1ULL << (sizeof(size_t) * 4))
 
@@ -863,6 +886,22 @@ int GpuArray_read(void *dst, size_t dst_sz, const GpuArray *src) {
   return gpudata_read(dst, src->data, src->offset, dst_sz);
 }
 
+int GpuArray_write_async(GpuArray *dst, const void *src, size_t src_sz,
+                         gpuevent **ev) {
+  if (!GpuArray_ISWRITEABLE(dst))
+    return GA_VALUE_ERROR;
+  if (!GpuArray_ISONESEGMENT(dst))
+    return GA_UNSUPPORTED_ERROR;
+  return gpudata_write_async(dst->data, dst->offset, src, src_sz, ev);
+}
+
+int GpuArray_read_async(void *dst, size_t dst_sz, const GpuArray *src,
+                        gpuevent **ev) {
+  if (!GpuArray_ISONESEGMENT(src))
+    return GA_UNSUPPORTED_ERROR;
+  return gpudata_read_async(dst, src->data, src->offset, dst_sz, ev);
+}
+
 int GpuArray_memset(GpuArray *a, int data) {
   if (!GpuArray_ISONESEGMENT(a))
     return GA_UNSUPPORTED_ERROR;
@@ -66,6 +66,15 @@ int gpucontext_property(gpucontext *ctx, int prop_id, void *res) {
   return ctx->ops->property(ctx, NULL, NULL, prop_id, res);
 }
 
+int gpucontext_trim_cache(gpucontext *ctx) {
+  return ctx->ops->ctx_trim_cache(ctx);
+}
+
+int gpucontext_set_alloc_policy(gpucontext *ctx,
+                                const gpucontext_alloc_policy *policy) {
+  return ctx->ops->ctx_set_alloc_policy(ctx, policy);
+}
+
 const char *gpucontext_error(gpucontext *ctx, int err) {
   if (ctx == NULL)
     return global_err->msg;
@@ -149,6 +158,30 @@ int gpudata_sync(gpudata *b) {
   return ((partial_gpudata *)b)->ctx->ops->buffer_sync(b);
 }
 
+int gpudata_read_async(void *dst, gpudata *src, size_t srcoff, size_t sz,
+                       gpuevent **ev) {
+  return ((partial_gpudata *)src)->ctx->ops->buffer_read_async(dst, src,
+                                                               srcoff, sz, ev);
+}
+
+int gpudata_write_async(gpudata *dst, size_t dstoff, const void *src,
+                        size_t sz, gpuevent **ev) {
+  return ((partial_gpudata *)dst)->ctx->ops->buffer_write_async(dst, dstoff,
+                                                                src, sz, ev);
+}
+
+int gpuevent_wait(gpuevent *ev) {
+  return ((partial_gpuevent *)ev)->ctx->ops->event_wait(ev);
+}
+
+int gpuevent_query(gpuevent *ev, int *done) {
+  return ((partial_gpuevent *)ev)->ctx->ops->event_query(ev, done);
+}
+
+void gpuevent_release(gpuevent *ev) {
+  ((partial_gpuevent *)ev)->ctx->ops->event_release(ev);
+}
+
 int gpudata_property(gpudata *b, int prop_id, void *res) {
   return ((partial_gpudata *)b)->ctx->ops->property(NULL, b, NULL, prop_id,
                                                     res);
@@ -167,6 +200,28 @@ gpukernel *gpukernel_init(gpucontext *ctx, unsigned int count,
   return res;
 }
 
+gpukernel *gpukernel_init_async(gpucontext *ctx, unsigned int count,
+                                const char **strings, const size_t *lengths,
+                                const char *fname, unsigned int numargs,
+                                const int *typecodes, int flags, int *ret) {
+  gpukernel *res;
+  if (ctx->ops->kernel_alloc_async == NULL)
+    return gpukernel_init(ctx, count, strings, lengths, fname, numargs,
+                          typecodes, flags, ret, NULL);
+  res = ctx->ops->kernel_alloc_async(ctx, count, strings, lengths, fname,
+                                     numargs, typecodes, flags);
+  if (res == NULL && ret)
+    *ret = ctx->err->code;
+  return res;
+}
+
+int gpukernel_wait(gpukernel *k, char **err_str) {
+  gpucontext *ctx = ((partial_gpukernel *)k)->ctx;
+  if (ctx->ops->kernel_wait == NULL)
+    return GA_NO_ERROR;
+  return ctx->ops->kernel_wait(k, err_str);
+}
+
 void gpukernel_retain(gpukernel *k) {
   ((partial_gpukernel *)k)->ctx->ops->kernel_retain(k);
 }
@@ -9,10 +9,16 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include <cache.h>
 
+#include "util/alloc_trace.h"
 #include "util/strb.h"
+#include "util/suballoc.h"
+#include "util/workq.h"
 #include "util/xxhash.h"
 
 #include "gpuarray/buffer.h"
@@ -30,6 +36,16 @@ STATIC_ASSERT(sizeof(GpuArrayIpcMemHandle) == sizeof(CUipcMemHandle), cuda_ipcme
 /* Allocations will be made in blocks of at least this size */
 #define BLOCK_SIZE (4 * 1024 * 1024)
 
+/* Host mapped allocations (GA_BUFFER_HOST) are made in blocks of
+ * this size */
+#define HOST_BLOCK_SIZE (1024 * 1024)
+
+/* The block size grows with the memory used by the context up to this */
+#define MAX_BLOCK_SIZE (64 * 1024 * 1024)
+
+/* Allocations of at least this size are cached apart and never split */
+#define LARGE_THRESHOLD (16 * 1024 * 1024)
+
 /* No returned allocations will be smaller than this size.  Also, they
  * will be aligned to this size.
  *
@@ -37,6 +53,9 @@ STATIC_ASSERT(sizeof(GpuArrayIpcMemHandle) == sizeof(CUipcMemHandle), cuda_ipcme
  */
 #define FRAG_SIZE (64)
 
+/* File in the cache directory that lists the kernels to preload */
+#define MANIFEST_NAME "preload.manifest"
+
 const gpuarray_buffer_ops cuda_ops;
 
 static void cuda_freekernel(gpukernel *);
@@ -46,6 +65,55 @@ static int cuda_records(gpudata *, int, CUstream);
 
 static int detect_arch(const char *prefix, char *ret, error *e);
 static gpudata *new_gpudata(cuda_context *ctx, CUdeviceptr ptr, size_t size);
+static void deallocate(gpudata *);
+static void staging_free(cuda_context *);
+static void manifest_preload(cuda_context *);
+static workq *compile_queue(void);
+
+/*
+ * Kernel sources are identified by a 128-bit fingerprint computed
+ * once when the source is built (see kernel_source()).  The caches
+ * hash and compare the fingerprints and only compare the full text
+ * when they match.
+ */
+#define FP_SEED 0x9e3779b97f4a7c15ULL
+
+/* Key of the kernel cache */
+typedef struct _src_key {
+  cache_fp fp;
+  strb src;
+} src_key;
+
+static void src_fingerprint(src_key *k) {
+  k->fp.h[0] = XXH64(k->src.s, k->src.l, 0);
+  k->fp.h[1] = XXH64(k->src.s, k->src.l, FP_SEED);
+}
+
+static void src_key_free(cache_key_t _k) {
+  src_key *k = (src_key *)_k;
+  strb_clear(&k->src);
+  free(k);
+}
+
+static int strb_eq(const strb *k1, const strb *k2) {
+  return (k1->l == k2->l &&
+          memcmp(k1->s, k2->s, k1->l) == 0);
+}
+
+static int src_key_eq(src_key *k1, src_key *k2) {
+  return (memcmp(&k1->fp, &k2->fp, sizeof(cache_fp)) == 0 &&
+          strb_eq(&k1->src, &k2->src));
+}
+
+static uint32_t src_key_hash(src_key *k) {
+  return (uint32_t)k->fp.h[0];
+}
+
+static void src_key_fp(src_key *k, cache_fp *fp) {
+  *fp = k->fp;
+}
+
+#define KERNEL_KEY_VERSION 1
 
 typedef struct _kernel_key {
   uint8_t version;
@@ -54,6 +122,7 @@ typedef struct _kernel_key {
   uint8_t minor;
   uint32_t reserved;
   char bin_id[64];
+  cache_fp fp; /* of the source */
   strb src;
 } kernel_key;
 
@@ -66,26 +135,19 @@ static void key_free(cache_key_t _k) {
   free(k);
 }
 
-static int strb_eq(strb *k1, strb *k2) {
-  return (k1->l == k2->l &&
-          memcmp(k1->s, k2->s, k1->l) == 0);
-}
-
-static uint32_t strb_hash(strb *k) {
-  return XXH32(k->s, k->l, 42);
-}
-
 static int key_eq(kernel_key *k1, kernel_key *k2) {
   return (memcmp(k1, k2, KERNEL_KEY_MM) == 0 &&
           strb_eq(&k1->src, &k2->src));
 }
 
 static int key_hash(kernel_key *k) {
-  XXH32_state_t state;
-  XXH32_reset(&state, 42);
-  XXH32_update(&state, k, KERNEL_KEY_MM);
-  XXH32_update(&state, k->src.s, k->src.l);
-  return XXH32_digest(&state);
+  return XXH32(k, KERNEL_KEY_MM, 42);
+}
+
+/* Places the entries of the disk cache */
+static void key_fp(kernel_key *k, cache_fp *fp) {
+  fp->h[0] = XXH64(k, KERNEL_KEY_MM, k->fp.h[0]);
+  fp->h[1] = XXH64(k, KERNEL_KEY_MM, k->fp.h[1]);
 }
 
 static int key_write(strb *res, kernel_key *k) {
@@ -100,7 +162,7 @@ static kernel_key *key_read(const strb *b) {
   k = calloc(1, sizeof(*k));
   if (k == NULL) return NULL;
   memcpy(k, b->s, KERNEL_KEY_MM);
-  if (k->version != 0) {
+  if (k->version != KERNEL_KEY_VERSION) {
     free(k);
     return NULL;
   }
@@ -179,9 +241,271 @@ static int cuda_get_device_count(unsigned int platform,
   return GA_NO_ERROR;
 }
 
+/* Glue for the allocation cache (see util/suballoc.h) */
+
+#define BLK_BUF(b) ((gpudata *)((char *)(b) - offsetof(gpudata, blk)))
+
+static int cuda_raw_alloc(void *ud, size_t sz, size_t *ptr) {
+  cuda_context *ctx = (cuda_context *)ud;
+  CUdeviceptr p;
+  CUresult err;
+
+  cuda_enter(ctx);
+  err = cuMemAlloc(&p, sz);
+  cuda_exit(ctx);
+  if (err != CUDA_SUCCESS)
+    return error_cuda(ctx->err, "cuMemAlloc", err);
+  *ptr = (size_t)p;
+  return GA_NO_ERROR;
+}
+
+static void cuda_raw_free(void *ud, size_t ptr, size_t sz) {
+  cuda_context *ctx = (cuda_context *)ud;
+  cuda_enter(ctx);
+  cuMemFree((CUdeviceptr)ptr);
+  cuda_exit(ctx);
+}
+
+static sa_block *cuda_block_new(void *ud, size_t ptr, size_t sz) {
+  gpudata *res = new_gpudata((cuda_context *)ud, (CUdeviceptr)ptr, sz);
+  if (res == NULL)
+    return NULL;
+  return &res->blk;
+}
+
+static void cuda_block_free(void *ud, sa_block *b) {
+  deallocate(BLK_BUF(b));
+}
+
+/*
+ * The split and merge hooks only carry over the stream of the
+ * previous work on the memory.  The events are only recorded if the
+ * block is used on some other stream (see cuda_waits()).
+ */
+static void cuda_block_split(void *ud, sa_block *b, sa_block *rest) {
+  gpudata *d = BLK_BUF(rest);
+  d->ls = BLK_BUF(b)->ls;
+  if (d->ls != NULL)
+    d->flags |= CUDA_STALE_EVENTS;
+}
+
+static void cuda_block_merge(void *ud, sa_block *into, sa_block *from) {
+  gpudata *d = BLK_BUF(into);
+  gpudata *f = BLK_BUF(from);
+
+  if (f->ls == NULL)
+    return;
+  if (d->ls == NULL || d->ls == f->ls) {
+    d->ls = f->ls;
+    d->flags |= CUDA_STALE_EVENTS;
+  } else {
+    /* Pending blocks are only released once their work is done so
+       this shouldn't happen, but play safe */
+    cuda_waits(f, CUDA_WAIT_ALL, d->ls);
+    cuda_records(d, CUDA_WAIT_ALL, d->ls);
+  }
+}
+
+static const suballoc_ops cuda_suballoc_ops = {
+  cuda_raw_alloc,
+  cuda_raw_free,
+  cuda_block_new,
+  cuda_block_free,
+  cuda_block_split,
+  cuda_block_merge,
+};
+
+/*
+ * Pinned host memory mapped in the device address space.  We rely on
+ * unified addressing to use the same pointer on both sides like for
+ * errbuf.
+ */
+static int cuda_host_raw_alloc(void *ud, size_t sz, size_t *ptr) {
+  cuda_context *ctx = (cuda_context *)ud;
+  CUdeviceptr dp;
+  void *p;
+  CUresult err;
+
+  cuda_enter(ctx);
+  err = cuMemHostAlloc(&p, sz, CU_MEMHOSTALLOC_DEVICEMAP);
+  if (err != CUDA_SUCCESS) {
+    cuda_exit(ctx);
+    return error_cuda(ctx->err, "cuMemHostAlloc", err);
+  }
+  err = cuMemHostGetDevicePointer(&dp, p, 0);
+  if (err != CUDA_SUCCESS) {
+    cuMemFreeHost(p);
+    cuda_exit(ctx);
+    return error_cuda(ctx->err, "cuMemHostGetDevicePointer", err);
+  }
+  if (dp != (CUdeviceptr)p) {
+    cuMemFreeHost(p);
+    cuda_exit(ctx);
+    return error_set(ctx->err, GA_DEVSUP_ERROR,
+                     "Host mapped allocations need unified addressing");
+  }
+  cuda_exit(ctx);
+  *ptr = (size_t)p;
+  return GA_NO_ERROR;
+}
+
+static void cuda_host_raw_free(void *ud, size_t ptr, size_t sz) {
+  cuda_context *ctx = (cuda_context *)ud;
+  cuda_enter(ctx);
+  cuMemFreeHost((void *)ptr);
+  cuda_exit(ctx);
+}
+
+static sa_block *cuda_host_block_new(void *ud, size_t ptr, size_t sz) {
+  sa_block *res = cuda_block_new(ud, ptr, sz);
+  if (res != NULL)
+    BLK_BUF(res)->flags |= CUDA_MAPPED_PTR;
+  return res;
+}
+
+static const suballoc_ops cuda_host_suballoc_ops = {
+  cuda_host_raw_alloc,
+  cuda_host_raw_free,
+  cuda_host_block_new,
+  cuda_block_free,
+  cuda_block_split,
+  cuda_block_merge,
+};
+
+static inline suballoc *buf_allocator(gpudata *d) {
+  return (d->flags & CUDA_MAPPED_PTR) ? d->ctx->host_allocator :
+    d->ctx->allocator;
+}
+
+/* See "About threads" in private_cuda.h */
+static cuda_locks *locks_new(error *e) {
+  cuda_locks *res = malloc(sizeof(*res));
+
+  if (res == NULL) {
+    error_sys(e, "malloc");
+    return NULL;
+  }
+  if (ga_mutex_init(&res->alloc)) {
+    free(res);
+    error_set(e, GA_SYS_ERROR, "Could not create mutex");
+    return NULL;
+  }
+  if (ga_mutex_init(&res->kernel)) {
+    ga_mutex_destroy(&res->alloc);
+    free(res);
+    error_set(e, GA_SYS_ERROR, "Could not create mutex");
+    return NULL;
+  }
+  return res;
+}
+
+static void locks_free(cuda_locks *l) {
+  if (l == NULL)
+    return;
+  ga_mutex_destroy(&l->kernel);
+  ga_mutex_destroy(&l->alloc);
+  free(l);
+}
+
+static inline void alloc_lock(cuda_context *ctx) {
+  if (ctx->locks != NULL)
+    ga_mutex_lock(&ctx->locks->alloc);
+}
+
+static inline void alloc_unlock(cuda_context *ctx) {
+  if (ctx->locks != NULL)
+    ga_mutex_unlock(&ctx->locks->alloc);
+}
+
+/*
+ * Give the pending blocks whose work is done back to the allocator.
+ * If `wait` is set, wait for all of them.
+ *
+ * The context must be entered and the allocation lock held.
+ */
+static void reclaim_pending(cuda_context *ctx, int wait) {
+  gpudata **p = &ctx->pending;
+  gpudata *d;
+
+  while (*p != NULL) {
+    d = *p;
+    if (wait)
+      cuEventSynchronize(d->wev);
+    else if (cuEventQuery(d->wev) != CUDA_SUCCESS) {
+      p = &d->pending_next;
+      continue;
+    }
+    *p = d->pending_next;
+    d->pending_next = NULL;
+    /* Nothing is left to wait for on this memory */
+    d->ls = NULL;
+    d->flags &= ~CUDA_STALE_EVENTS;
+    suballoc_free(buf_allocator(d), &d->blk);
+  }
+}
+
+/* Lookups in the kernel cache take a reference */
+static gpukernel *kernel_ref(gpukernel *k) {
+  ga_atomic_inc(&k->refcnt);
+  return k;
+}
+
+static strb *bin_copy(strb *b) {
+  strb *res = strb_alloc(b->l);
+  if (res == NULL)
+    return NULL;
+  strb_appendb(res, b);
+  if (strb_error(res)) {
+    strb_free(res);
+    return NULL;
+  }
+  return res;
+}
+
+#define KERNEL_STRIPES 8
+#define KERNEL_CACHE_SIZE 256
+
+static cache *kernel_cache_new(int flags, error *e) {
+  cache *parts[KERNEL_STRIPES];
+  cache *res, *traced;
+  unsigned int n = (flags & GA_CTX_MULTI_THREAD) ? KERNEL_STRIPES : 1;
+  unsigned int i;
+  const char *trace;
+
+  for (i = 0; i < n; i++) {
+    /* The bursts of one-off kernels from reductions on new shapes
+       would flush an LRU */
+    parts[i] = cache_tinylfu(KERNEL_CACHE_SIZE / n,
+                             (cache_eq_fn)src_key_eq,
+                             (cache_hash_fn)src_key_hash,
+                             (cache_freek_fn)src_key_free,
+                             (cache_freev_fn)cuda_freekernel, e);
+    if (parts[i] == NULL)
+      break;
+  }
+  res = (i == n) ? cache_striped(parts, n, (cache_refv_fn)kernel_ref, e) :
+    NULL;
+  if (res == NULL) {
+    while (i > 0)
+      cache_destroy(parts[--i]);
+    return NULL;
+  }
+
+  trace = getenv("GPUARRAY_CACHE_TRACE");
+  if (trace != NULL && trace[0] != '\0') {
+    traced = cache_trace(res, trace, (kfp_fn)src_key_fp, e);
+    if (traced == NULL)
+      fprintf(stderr, "Error opening kernel cache trace: %s\n", e->msg);
+    else
+      res = traced;
+  }
+  return res;
+}
+
 cuda_context *cuda_make_ctx(CUcontext ctx, int flags) {
   cuda_context *res;
-  cache *mem_cache;
+  gpucontext_alloc_policy policy;
+  cache *mem_cache, *locked;
   char *cache_path;
   void *p;
   CUresult err;
@@ -201,9 +525,32 @@ cuda_context *cuda_make_ctx(CUcontext ctx, int flags) {
   res->refcnt = 1;
   res->flags = flags;
   res->enter = 0;
+  res->pending = NULL;
+  res->staging = NULL;
   res->major = major;
   res->minor = minor;
-  res->freeblocks = NULL;
+  if (flags & GA_CTX_MULTI_THREAD) {
+    res->locks = locks_new(global_err);
+    if (res->locks == NULL)
+      goto fail_allocator;
+  }
+  res->allocator = suballoc_new(&cuda_suballoc_ops, res,
+                                (flags & GA_CTX_DISABLE_ALLOCATION_CACHE) ?
+                                0 : BLOCK_SIZE, FRAG_SIZE, global_err);
+  if (res->allocator == NULL)
+    goto fail_allocator;
+  if (!(flags & GA_CTX_DISABLE_ALLOCATION_CACHE)) {
+    policy.block_size = BLOCK_SIZE;
+    policy.max_block_size = MAX_BLOCK_SIZE;
+    policy.large_threshold = LARGE_THRESHOLD;
+    /* This can't fail with those values */
+    suballoc_set_policy(res->allocator, &policy, global_err);
+  }
+  res->host_allocator = suballoc_new(&cuda_host_suballoc_ops, res,
+                                     (flags & GA_CTX_DISABLE_ALLOCATION_CACHE) ?
+                                     0 : HOST_BLOCK_SIZE, FRAG_SIZE, global_err);
+  if (res->host_allocator == NULL)
+    goto fail_host_allocator;
   if (error_alloc(&res->err)) {
     error_set(global_err, GA_SYS_ERROR, "Could not create error context");
     goto fail_errmsg;
@@ -230,15 +577,9 @@ cuda_context *cuda_make_ctx(CUcontext ctx, int flags) {
     }
   }
 
-  res->kernel_cache = cache_twoq(64, 128, 64, 8,
-                                 (cache_eq_fn)strb_eq,
-                                 (cache_hash_fn)strb_hash,
-                                 (cache_freek_fn)strb_free,
-                                 (cache_freev_fn)cuda_freekernel, global_err);
-  if (res->kernel_cache == NULL) {
-    error_cuda(global_err, "cuStreamCreate", err);
+  res->kernel_cache = kernel_cache_new(flags, global_err);
+  if (res->kernel_cache == NULL)
     goto fail_cache;
-  }
 
   cache_path = getenv("GPUARRAY_CACHE_PATH");
   if (cache_path != NULL) {
@@ -253,18 +594,29 @@ cuda_context *cuda_make_ctx(CUcontext ctx, int flags) {
               global_err->msg);
       goto fail_disk_cache;
     }
-    res->disk_cache = cache_disk(cache_path, mem_cache,
-                                 (kwrite_fn)key_write,
-                                 (vwrite_fn)kernel_write,
-                                 (kread_fn)key_read,
-                                 (vread_fn)kernel_read,
-                                 res->err);
+    res->disk_cache = cache_disk_env(cache_path, mem_cache,
+                                     (kwrite_fn)key_write,
+                                     (vwrite_fn)kernel_write,
+                                     (kread_fn)key_read,
+                                     (vread_fn)kernel_read,
+                                     res->err);
     if (res->disk_cache == NULL) {
       // TODO use better error messages when they are available.
       fprintf(stderr, "Error initializing disk cache, disabling\n");
       cache_destroy(mem_cache);
       goto fail_disk_cache;
     }
+    cache_disk_fingerprint(res->disk_cache, (kfp_fn)key_fp);
+    /* Lookups get a copy of the binary */
+    locked = cache_striped(&res->disk_cache, 1, (cache_refv_fn)bin_copy,
+                           global_err);
+    if (locked == NULL) {
+      fprintf(stderr, "Error initializing disk cache: %s\n",
+              global_err->msg);
+      cache_destroy(res->disk_cache);
+      goto fail_disk_cache;
+    }
+    res->disk_cache = locked;
   } else {
   fail_disk_cache:
     res->disk_cache = NULL;
@@ -285,6 +637,17 @@ cuda_context *cuda_make_ctx(CUcontext ctx, int flags) {
     goto fail_end;
   }
   res->errbuf->flags |= CUDA_MAPPED_PTR;
+
+  /* Only when preloading to keep the manifest from growing forever */
+  if (res->disk_cache != NULL && getenv("GPUARRAY_CACHE_PRELOAD") != NULL &&
+      strcmp(getenv("GPUARRAY_CACHE_PRELOAD"), "0") != 0) {
+    res->manifest = malloc(strlen(cache_path) + sizeof(MANIFEST_NAME) + 1);
+    if (res->manifest != NULL) {
+      strcpy(res->manifest, cache_path);
+      strcat(res->manifest, "/" MANIFEST_NAME);
+      manifest_preload(res);
+    }
+  }
   return res;
  fail_end:
   cuMemFreeHost(p);
@@ -300,20 +663,21 @@ cuda_context *cuda_make_ctx(CUcontext ctx, int flags) {
  fail_stream:
   error_free(res->err);
  fail_errmsg:
+  suballoc_destroy(res->host_allocator);
+ fail_host_allocator:
+  suballoc_destroy(res->allocator);
+ fail_allocator:
+  locks_free(res->locks);
   free(res);
   return NULL;
 }
 
-static void deallocate(gpudata *);
-
 static void cuda_free_ctx(cuda_context *ctx) {
   gpuarray_blas_ops *blas_ops;
-  gpudata *next, *curr;
   CUdevice dev;
 
   ASSERT_CTX(ctx);
-  ctx->refcnt--;
-  if (ctx->refcnt == 0) {
+  if (ga_atomic_dec(&ctx->refcnt) == 0) {
     assert(ctx->enter == 0 && "Context was active when freed!");
     if (ctx->blas_handle != NULL) {
       cuda_property((gpucontext *)ctx, NULL, NULL, GA_CTX_PROP_BLAS_OPS,
@@ -323,20 +687,26 @@ static void cuda_free_ctx(cuda_context *ctx) {
     cuMemFreeHost((void *)ctx->errbuf->ptr);
     deallocate(ctx->errbuf);
 
+    cuda_enter(ctx);
+    reclaim_pending(ctx, 1);
+    staging_free(ctx);
+    cuda_exit(ctx);
+
     if (ISCLR(ctx->flags, GA_CTX_SINGLE_STREAM))
       cuStreamDestroy(ctx->mem_s);
     cuStreamDestroy(ctx->s);
 
-    /* Clear out the freelist */
-    for (curr = ctx->freeblocks; curr != NULL; curr = next) {
-      next = curr->next;
-      cuMemFree(curr->ptr);
-      deallocate(curr);
-    }
+    /* Clear out the allocation cache */
+    suballoc_destroy(ctx->allocator);
+    suballoc_destroy(ctx->host_allocator);
     cache_destroy(ctx->kernel_cache);
     if (ctx->disk_cache)
       cache_destroy(ctx->disk_cache);
+    free(ctx->manifest);
+    locks_free(ctx->locks);
     error_free(ctx->err);
+    /* Nothing is left to record for this context */
+    alloc_trace_flush();
 
     if (!(ctx->flags & DONTFREE)) {
       cuCtxPushCurrent(ctx->ctx);
@@ -356,6 +726,12 @@ CUstream cuda_get_stream(cuda_context *ctx) {
 
 void cuda_enter(cuda_context *ctx) {
   ASSERT_CTX(ctx);
+  /* The count is shared, each thread needs its own push */
+  if (ctx->locks != NULL) {
+    ga_atomic_inc(&ctx->enter);
+    cuCtxPushCurrent(ctx->ctx);
+    return;
+  }
   if (!ctx->enter)
     cuCtxPushCurrent(ctx->ctx);
   ctx->enter++;
@@ -363,6 +739,11 @@ void cuda_enter(cuda_context *ctx) {
 
 void cuda_exit(cuda_context *ctx) {
   ASSERT_CTX(ctx);
+  if (ctx->locks != NULL) {
+    cuCtxPopCurrent(NULL);
+    ga_atomic_dec(&ctx->enter);
+    return;
+  }
   assert(ctx->enter > 0);
   ctx->enter--;
   if (!ctx->enter)
@@ -385,6 +766,7 @@ static gpudata *new_gpudata(cuda_context *ctx, CUdeviceptr ptr, size_t size) {
 
   res->flags = 0;
   res->ls = NULL;
+  res->pending_next = NULL;
 
   cuda_enter(ctx);
 
@@ -410,7 +792,6 @@ static gpudata *new_gpudata(cuda_context *ctx, CUdeviceptr ptr, size_t size) {
   cuda_exit(ctx);
 
   res->ptr = ptr;
-  res->next = NULL;
   res->ctx = ctx;
   TAG_BUF(res);
 
@@ -424,7 +805,7 @@ gpudata *cuda_make_buf(cuda_context *ctx, CUdeviceptr p, size_t sz) {
 
   res->refcnt = 1;
   res->flags |= DONTFREE;
-  res->ctx->refcnt++;
+  ga_atomic_inc(&res->ctx->refcnt);
 
   return res;
 }
@@ -479,6 +860,8 @@ static const char CUDA_PREAMBLE[] =
     "#define ga_half ga_ushort\n"
     "#define ga_size size_t\n"
     "#define ga_ssize ptrdiff_t\n"
+    "#define ga_uint2 uint2\n"
+    "#define ga_uint4 uint4\n"
     "#define load_half(p) __half2float(*(p))\n"
     "#define store_half(p, v) (*(p) = __float2half_rn(v))\n"
     "#define GA_DECL_SHARED_PARAM(type, name)\n"
@@ -570,26 +953,8 @@ static void cuda_deinit(gpucontext *c) {
   cuda_free_ctx((cuda_context *)c);
 }
 
-/*
- * Find the block in the free list that is the best fit for the size
- * we want, which means the smallest that can still fit the size.
- */
-static void find_best(cuda_context *ctx, gpudata **best, gpudata **prev,
-                     size_t size) {
-  gpudata *temp, *tempPrev = NULL;
-  *best = NULL;
-
-  for (temp = ctx->freeblocks; temp; temp = temp->next) {
-    if (temp->sz >= size && (!*best || temp->sz < (*best)->sz)) {
-      *best = temp;
-      *prev = tempPrev;
-    }
-    tempPrev = temp;
-  }
-}
-
 static size_t largest_size(cuda_context *ctx) {
-  gpudata *temp;
+  gpucontext_memstats st;
   size_t sz, dummy;
   cuda_enter(ctx);
   cuMemGetInfo(&sz, &dummy);
@@ -597,108 +962,49 @@ static size_t largest_size(cuda_context *ctx) {
    /* We guess that we can allocate at least a quarter of the free size
      in a single block. This might be wrong though. */
   sz /= 4;
-  for (temp = ctx->freeblocks; temp; temp = temp->next) {
-    if (temp->sz > sz) sz = temp->sz;
-  }
+  alloc_lock(ctx);
+  suballoc_stats(ctx->allocator, &st);
+  alloc_unlock(ctx);
+  if (st.largest_free > sz) sz = st.largest_free;
   return sz;
 }
 
-/*
- * Allocate a new block and place in on the freelist. Will allocate
- * the bigger of the requested size and BLOCK_SIZE to avoid allocating
- * multiple small blocks.
- */
-static int allocate(cuda_context *ctx, gpudata **res, gpudata **prev,
-                    size_t size) {
-  CUdeviceptr ptr;
-  gpudata *next;
-  CUresult err;
-
-  *prev = NULL;
-
-  if (!(ctx->flags & GA_CTX_DISABLE_ALLOCATION_CACHE))
-    if (size < BLOCK_SIZE) size = BLOCK_SIZE;
+static int cuda_trim_cache(gpucontext *c) {
+  cuda_context *ctx = (cuda_context *)c;
 
+  ASSERT_CTX(ctx);
   cuda_enter(ctx);
-
-  err = cuMemAlloc(&ptr, size);
-  if (err != CUDA_SUCCESS) {
-    cuda_exit(ctx);
-    return error_cuda(ctx->err, "cuMemAlloc", err);
-  }
-
-  *res = new_gpudata(ctx, ptr, size);
-
+  alloc_lock(ctx);
+  reclaim_pending(ctx, 1);
+  staging_free(ctx);
+  suballoc_trim(ctx->allocator);
+  suballoc_trim(ctx->host_allocator);
+  alloc_unlock(ctx);
   cuda_exit(ctx);
-
-  if (*res == NULL) {
-    cuMemFree(ptr);
-    return ctx->err->code;
-  }
-
-  (*res)->flags |= CUDA_HEAD_ALLOC;
-
-  /* Now that the block is allocated, enter it in the freelist */
-  next = ctx->freeblocks;
-  for (; next && next->ptr < (*res)->ptr; next = next->next) {
-    *prev = next;
-  }
-  (*res)->next = next;
-  if (*prev)
-    (*prev)->next = *res;
-  else
-    ctx->freeblocks = *res;
-
   return GA_NO_ERROR;
 }
 
-/*
- * Extract the `curr` block from the freelist, possibly splitting it
- * if it's too big for the requested size.  The remaining block will
- * stay on the freelist if there is a split.  `prev` is only to
- * facilitate the extraction so we don't have to go through the list
- * again.
- */
-static int extract(gpudata *curr, gpudata *prev, size_t size) {
-  gpudata *next, *split;
-  size_t remaining = curr->sz - size;
-
-  if (remaining < FRAG_SIZE) {
-    /* No need to split, the remaining block would be too small */
-    next = curr->next;
-  } else {
-    split = new_gpudata(curr->ctx, curr->ptr + size, remaining);
-    if (split == NULL)
-      return curr->ctx->err->code;
-    /* Make sure the chain keeps going */
-    split->next = curr->next;
-    curr->next = NULL;
-    /* Make sure we don't start using the split buffer too soon */
-    cuda_records(split, CUDA_WAIT_ALL, curr->ls);
-    next = split;
-    curr->sz = size;
-  }
-
-  if (prev != NULL)
-    prev->next = next;
-  else
-    curr->ctx->freeblocks = next;
+static int cuda_set_alloc_policy(gpucontext *c,
+                                 const gpucontext_alloc_policy *policy) {
+  cuda_context *ctx = (cuda_context *)c;
+  int res;
 
-  return GA_NO_ERROR;
+  ASSERT_CTX(ctx);
+  alloc_lock(ctx);
+  res = suballoc_set_policy(ctx->allocator, policy, ctx->err);
+  alloc_unlock(ctx);
+  return res;
 }
 
 static void cuda_free(gpudata *);
 static int cuda_write(gpudata *dst, size_t dstoff, const void *src,
                       size_t sz);
 
-static inline size_t roundup(size_t s, size_t m) {
-  return ((s + (m - 1)) / m) * m;
-}
-
 static gpudata *cuda_alloc(gpucontext *c, size_t size, void *data, int flags) {
-  gpudata *res = NULL, *prev = NULL;
+  gpudata *res;
+  sa_block *blk;
+  suballoc *sa;
   cuda_context *ctx = (cuda_context *)c;
-  size_t asize;
 
   if ((flags & GA_BUFFER_INIT) && data == NULL) {
     error_set(ctx->err, GA_VALUE_ERROR, "Requested buffer initialisation but no data given");
@@ -710,33 +1016,32 @@ static gpudata *cuda_alloc(gpucontext *c, size_t size, void *data, int flags) {
     return NULL;
   }
 
-  /* TODO: figure out how to make this work */
-  if (flags & GA_BUFFER_HOST) {
-    error_set(ctx->err, GA_DEVSUP_ERROR, "Host mapped allocations are not supported yet");
-    return NULL;
-  }
+  sa = (flags & GA_BUFFER_HOST) ? ctx->host_allocator : ctx->allocator;
 
-  /* We don't want to manage really small allocations so we round up
-   * to a multiple of FRAG_SIZE.  This also ensures that if we split a
-   * block, the next block starts properly aligned for any data type.
-   */
-  if (!(ctx->flags & GA_CTX_DISABLE_ALLOCATION_CACHE)) {
-    asize = roundup(size, FRAG_SIZE);
-    find_best(ctx, &res, &prev, asize);
-  } else {
-    asize = size;
+  cuda_enter(ctx);
+  alloc_lock(ctx);
+  if (ctx->pending != NULL)
+    reclaim_pending(ctx, 0);
+  blk = suballoc_alloc(sa, size);
+  if (blk == NULL && ctx->pending != NULL &&
+      ctx->err->code == GA_MEMORY_ERROR) {
+    reclaim_pending(ctx, 1);
+    blk = suballoc_alloc(sa, size);
   }
-
-  if (res == NULL && allocate(ctx, &res, &prev, asize) != GA_NO_ERROR)
-    return NULL;
-
-  if (extract(res, prev, asize) != GA_NO_ERROR)
+  alloc_unlock(ctx);
+  cuda_exit(ctx);
+  if (blk == NULL)
     return NULL;
+  res = BLK_BUF(blk);
+  res->sz = blk->sz;
 
   /* It's out of the freelist, so add a ref */
-  res->ctx->refcnt++;
+  ga_atomic_inc(&res->ctx->refcnt);
   /* We consider this buffer allocated and ready to go */
   res->refcnt = 1;
+  /* Only the device allocations are traced */
+  if (!(flags & GA_BUFFER_HOST))
+    alloc_trace_alloc(ctx, res, size, flags);
 
   if (flags & GA_BUFFER_INIT) {
     if (cuda_write(res, 0, data, size) != GA_NO_ERROR) {
@@ -779,7 +1084,11 @@ gpudata *cuda_open_ipc_handle(gpucontext *c, GpuArrayIpcMemHandle *h, size_t sz)
 
 static void cuda_retain(gpudata *d) {
   ASSERT_BUF(d);
-  d->refcnt++;
+  /* Views of the same buffer can be taken from several threads */
+  if (d->ctx->locks != NULL)
+    ga_atomic_inc(&d->refcnt);
+  else
+    d->refcnt++;
 }
 
 static void deallocate(gpudata *d) {
@@ -794,8 +1103,7 @@ static void deallocate(gpudata *d) {
 static void cuda_free(gpudata *d) {
   /* We ignore errors on free */
   ASSERT_BUF(d);
-  d->refcnt--;
-  if (d->refcnt == 0) {
+  if ((d->ctx->locks != NULL ? ga_atomic_dec(&d->refcnt) : --d->refcnt) == 0) {
     /* Keep a reference to the context since we deallocate the gpudata
      * object */
     cuda_context *ctx = d->ctx;
@@ -805,44 +1113,21 @@ static void cuda_free(gpudata *d) {
     } else if (d->flags & CUDA_IPC_MEMORY) {
       cuIpcCloseMemHandle(d->ptr);
       deallocate(d);
-    } else if (ctx->flags & GA_CTX_DISABLE_ALLOCATION_CACHE) {
-      /* Just free the pointer */
-      cuMemFree(d->ptr);
-      deallocate(d);
     } else {
-      /* Find the position in the freelist.  Freelist is kept in order
-         of allocation address */
-      gpudata *next = d->ctx->freeblocks, *prev = NULL;
-      for (; next && next->ptr < d->ptr; next = next->next) {
-        prev = next;
-      }
-      next = prev != NULL ? prev->next : d->ctx->freeblocks;
-
-      /* See if we can merge the block with the previous one */
-      if (!(d->flags & CUDA_HEAD_ALLOC) &&
-            prev != NULL && prev->ptr + prev->sz == d->ptr) {
-        prev->sz = prev->sz + d->sz;
-        cuda_waits(d, CUDA_WAIT_ALL, prev->ls);
-        cuda_records(prev, CUDA_WAIT_ALL, prev->ls);
-        deallocate(d);
-        d = prev;
-      } else if (prev != NULL) {
-        prev->next = d;
-      } else {
-        d->ctx->freeblocks = d;
-      }
-
-      /* See if we can merge with next */
-      if (next && !(next->flags & CUDA_HEAD_ALLOC) &&
-          d->ptr + d->sz == next->ptr) {
-        d->sz = d->sz + next->sz;
-        d->next = next->next;
-        cuda_wait(next, CUDA_WAIT_ALL);
-        cuda_record(d, CUDA_WAIT_ALL);
-        deallocate(next);
+      if (!(d->flags & CUDA_MAPPED_PTR))
+        alloc_trace_free(ctx, d);
+      cuda_enter(ctx);
+      alloc_lock(ctx);
+      if (d->ls != NULL && d->ls != ctx->s &&
+          ISCLR(ctx->flags, GA_CTX_SINGLE_STREAM) &&
+          cuEventRecord(d->wev, d->ls) == CUDA_SUCCESS) {
+        d->pending_next = ctx->pending;
+        ctx->pending = d;
       } else {
-        d->next = next;
+        suballoc_free(buf_allocator(d), &d->blk);
       }
+      alloc_unlock(ctx);
+      cuda_exit(ctx);
     }
     /* We keep this at the end since the freed buffer could be the
      * last reference to the context and therefore clearing the
@@ -860,6 +1145,20 @@ static int cuda_share(gpudata *a, gpudata *b) {
            (b->ptr <= a->ptr && b->ptr + b->sz > a->ptr)));
 }
 
+/*
+ * Record the events of a block that was reused without them (see
+ * "About allocator" in private_cuda.h) so that they cover the work
+ * of the previous owner.
+ */
+static int sync_events(gpudata *a) {
+  if (a->ls != NULL) {
+    CUDA_EXIT_ON_ERROR(a->ctx, cuEventRecord(a->rev, a->ls));
+    CUDA_EXIT_ON_ERROR(a->ctx, cuEventRecord(a->wev, a->ls));
+  }
+  a->flags &= ~CUDA_STALE_EVENTS;
+  return GA_NO_ERROR;
+}
+
 static int cuda_waits(gpudata *a, int flags, CUstream s) {
   ASSERT_BUF(a);
 
@@ -875,6 +1174,8 @@ static int cuda_waits(gpudata *a, int flags, CUstream s) {
   }
 
   cuda_enter(a->ctx);
+  if (ISSET(a->flags, CUDA_STALE_EVENTS))
+    GA_CHECK(sync_events(a));
   /* We wait for writes that happened before since multiple reads at
    * the same time are fine */
   if (ISSET(flags, CUDA_WAIT_READ) || ISSET(flags, CUDA_WAIT_WRITE))
@@ -896,6 +1197,14 @@ static int cuda_records(gpudata *a, int flags, CUstream s) {
       ISSET(a->ctx->flags, GA_CTX_SINGLE_STREAM))
     return GA_NO_ERROR;
   cuda_enter(a->ctx);
+  if (ISSET(a->flags, CUDA_STALE_EVENTS)) {
+    /* The event we don't record here must still cover the work of
+       the previous owner */
+    if (a->ls != s || (flags & CUDA_WAIT_ALL) != CUDA_WAIT_ALL)
+      GA_CHECK(sync_events(a));
+    else
+      a->flags &= ~CUDA_STALE_EVENTS;
+  }
   if (ISSET(flags, CUDA_WAIT_READ))
     CUDA_EXIT_ON_ERROR(a->ctx, cuEventRecord(a->rev, s));
   if (ISSET(flags, CUDA_WAIT_WRITE))
@@ -944,32 +1253,187 @@ static int cuda_move(gpudata *dst, size_t dstoff, gpudata *src,
     return res;
 }
 
-static int cuda_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
-    cuda_context *ctx = src->ctx;
+/*
+ * Staging of transfers from and to pageable host memory.
+ *
+ * The driver can only DMA from pinned memory, so copies with pageable
+ * memory go through its own staging and are synchronous.  Instead we
+ * split large transfers in chunks that go through a ring of pinned
+ * buffers on the memory stream.  This way the host copy of a chunk
+ * overlaps with the DMA of the previous one and writes return as soon
+ * as the data is out of the caller's memory.
+ *
+ * The ring is allocated on the first transfer that uses it and
+ * released by gpucontext_trim_cache().  If it can't be allocated, we
+ * use the direct copies.  Contexts used from multiple threads
+ * (GA_CTX_MULTI_THREAD) always use the direct copies.
+ */
+#define STAGING_CHUNK (1024 * 1024)
+#define STAGING_COUNT 4
+/* Smaller transfers are not worth splitting */
+#define STAGING_MIN (64 * 1024)
+
+typedef struct _cuda_staging {
+  void *buf[STAGING_COUNT];
+  /* Recorded after the last copy from/to the matching buffer */
+  CUevent ev[STAGING_COUNT];
+  unsigned int next;
+} cuda_staging;
+
+static void staging_free(cuda_context *ctx) {
+  cuda_staging *st = ctx->staging;
+  unsigned int i;
+
+  if (st == NULL)
+    return;
+  for (i = 0; i < STAGING_COUNT; i++) {
+    if (st->ev[i] != NULL) {
+      cuEventSynchronize(st->ev[i]);
+      cuEventDestroy(st->ev[i]);
+    }
+    if (st->buf[i] != NULL)
+      cuMemFreeHost(st->buf[i]);
+  }
+  free(st);
+  ctx->staging = NULL;
+}
 
-    ASSERT_BUF(src);
+/* Is `p` host memory that the driver can DMA from/to directly? */
+static int is_pinned(const void *p) {
+  unsigned int type;
+  return cuPointerGetAttribute(&type, CU_POINTER_ATTRIBUTE_MEMORY_TYPE,
+                               (CUdeviceptr)p) == CUDA_SUCCESS;
+}
 
-    if (sz == 0) return GA_NO_ERROR;
+/*
+ * Returns the staging ring to use for a transfer with host memory `p`
+ * or NULL if the transfer should be done directly.  Must be called
+ * with the context entered.
+ */
+static cuda_staging *staging_get(cuda_context *ctx, const void *p,
+                                 size_t sz) {
+  cuda_staging *st;
+  unsigned int i;
 
-    if ((src->sz - srcoff) < sz)
-      return error_set(ctx->err, GA_VALUE_ERROR, "source is smaller than the read size");
+  /* The ring can't be shared between threads */
+  if (sz < STAGING_MIN || ctx->locks != NULL || is_pinned(p))
+    return NULL;
+  if (ctx->staging != NULL)
+    return ctx->staging;
 
-    cuda_enter(ctx);
+  st = calloc(1, sizeof(*st));
+  if (st == NULL)
+    return NULL;
+  ctx->staging = st;
+  for (i = 0; i < STAGING_COUNT; i++) {
+    if (cuMemHostAlloc(&st->buf[i], STAGING_CHUNK, 0) != CUDA_SUCCESS ||
+        cuEventCreate(&st->ev[i], CU_EVENT_DISABLE_TIMING) != CUDA_SUCCESS) {
+      staging_free(ctx);
+      return NULL;
+    }
+  }
+  return st;
+}
 
-    if (src->flags & CUDA_MAPPED_PTR) {
+static int staged_write(cuda_context *ctx, cuda_staging *st, CUdeviceptr dst,
+                        const char *src, size_t sz) {
+  size_t off, n;
+  unsigned int i;
 
-      if (ISSET(ctx->flags, GA_CTX_SINGLE_STREAM))
-        CUDA_EXIT_ON_ERROR(ctx, cuStreamSynchronize(ctx->s));
-      else
-        CUDA_EXIT_ON_ERROR(ctx, cuEventSynchronize(src->wev));
+  cuda_enter(ctx);
+  for (off = 0; off < sz; off += n) {
+    n = sz - off;
+    if (n > STAGING_CHUNK)
+      n = STAGING_CHUNK;
+    i = st->next;
+    st->next = (i + 1) % STAGING_COUNT;
+    /* Wait for the previous DMA from this buffer */
+    CUDA_EXIT_ON_ERROR(ctx, cuEventSynchronize(st->ev[i]));
+    memcpy(st->buf[i], src + off, n);
+    CUDA_EXIT_ON_ERROR(ctx,
+        cuMemcpyHtoDAsync(dst + off, st->buf[i], n, ctx->mem_s));
+    CUDA_EXIT_ON_ERROR(ctx, cuEventRecord(st->ev[i], ctx->mem_s));
+  }
+  cuda_exit(ctx);
+  return GA_NO_ERROR;
+}
+
+static int staged_read(cuda_context *ctx, cuda_staging *st, char *dst,
+                       CUdeviceptr src, size_t sz) {
+  size_t nchunks = (sz + STAGING_CHUNK - 1) / STAGING_CHUNK;
+  size_t k, j, n;
+  unsigned int first = st->next;
+  unsigned int i;
+
+  cuda_enter(ctx);
+  /* Keep up to STAGING_COUNT chunks in flight.  Chunk k uses buffer
+     (first + k) % STAGING_COUNT and is copied out before chunk k +
+     STAGING_COUNT is queued in the same buffer.  The DMA into a
+     buffer is queued after any previous one from it on the stream so
+     it doesn't need to wait for them. */
+  for (k = 0; k < nchunks + STAGING_COUNT; k++) {
+    if (k >= STAGING_COUNT) {
+      j = k - STAGING_COUNT;
+      if (j >= nchunks)
+        continue;
+      i = (first + j) % STAGING_COUNT;
+      n = sz - j * STAGING_CHUNK;
+      if (n > STAGING_CHUNK)
+        n = STAGING_CHUNK;
+      CUDA_EXIT_ON_ERROR(ctx, cuEventSynchronize(st->ev[i]));
+      memcpy(dst + j * STAGING_CHUNK, st->buf[i], n);
+    }
+    if (k < nchunks) {
+      i = (first + k) % STAGING_COUNT;
+      n = sz - k * STAGING_CHUNK;
+      if (n > STAGING_CHUNK)
+        n = STAGING_CHUNK;
+      CUDA_EXIT_ON_ERROR(ctx,
+          cuMemcpyDtoHAsync(st->buf[i], src + k * STAGING_CHUNK, n,
+                            ctx->mem_s));
+      CUDA_EXIT_ON_ERROR(ctx, cuEventRecord(st->ev[i], ctx->mem_s));
+    }
+  }
+  st->next = (first + nchunks) % STAGING_COUNT;
+  cuda_exit(ctx);
+  return GA_NO_ERROR;
+}
+
+static int cuda_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
+    cuda_context *ctx = src->ctx;
+    cuda_staging *st;
+
+    ASSERT_BUF(src);
+
+    if (sz == 0) return GA_NO_ERROR;
+
+    if ((src->sz - srcoff) < sz)
+      return error_set(ctx->err, GA_VALUE_ERROR, "source is smaller than the read size");
+
+    cuda_enter(ctx);
+
+    if (src->flags & CUDA_MAPPED_PTR) {
+
+      if (ISSET(ctx->flags, GA_CTX_SINGLE_STREAM))
+        CUDA_EXIT_ON_ERROR(ctx, cuStreamSynchronize(ctx->s));
+      else {
+        if (ISSET(src->flags, CUDA_STALE_EVENTS))
+          GA_CHECK(sync_events(src));
+        CUDA_EXIT_ON_ERROR(ctx, cuEventSynchronize(src->wev));
+      }
 
       memcpy(dst, (void *)(src->ptr + srcoff), sz);
     } else {
       GA_CUDA_EXIT_ON_ERROR(ctx,
           cuda_waits(src, CUDA_WAIT_READ, ctx->mem_s));
 
-      CUDA_EXIT_ON_ERROR(ctx,
-          cuMemcpyDtoHAsync(dst, src->ptr + srcoff, sz, ctx->mem_s));
+      st = staging_get(ctx, dst, sz);
+      if (st != NULL)
+        GA_CUDA_EXIT_ON_ERROR(ctx,
+            staged_read(ctx, st, dst, src->ptr + srcoff, sz));
+      else
+        CUDA_EXIT_ON_ERROR(ctx,
+            cuMemcpyDtoHAsync(dst, src->ptr + srcoff, sz, ctx->mem_s));
 
       GA_CUDA_EXIT_ON_ERROR(ctx,
           cuda_records(src, CUDA_WAIT_READ, ctx->mem_s));
@@ -981,6 +1445,7 @@ static int cuda_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
 static int cuda_write(gpudata *dst, size_t dstoff, const void *src,
                       size_t sz) {
     cuda_context *ctx = dst->ctx;
+    cuda_staging *st;
 
     ASSERT_BUF(dst);
 
@@ -995,16 +1460,24 @@ static int cuda_write(gpudata *dst, size_t dstoff, const void *src,
 
       if (ISSET(ctx->flags, GA_CTX_SINGLE_STREAM))
         CUDA_EXIT_ON_ERROR(ctx, cuStreamSynchronize(ctx->s));
-      else
+      else {
+        if (ISSET(dst->flags, CUDA_STALE_EVENTS))
+          GA_CHECK(sync_events(dst));
         CUDA_EXIT_ON_ERROR(ctx, cuEventSynchronize(dst->rev));
+      }
 
       memcpy((void *)(dst->ptr + dstoff), src, sz);
     } else {
       GA_CUDA_EXIT_ON_ERROR(ctx,
           cuda_waits(dst, CUDA_WAIT_WRITE, ctx->mem_s));
 
-      CUDA_EXIT_ON_ERROR(ctx,
-          cuMemcpyHtoDAsync(dst->ptr + dstoff, src, sz, ctx->mem_s));
+      st = staging_get(ctx, src, sz);
+      if (st != NULL)
+        GA_CUDA_EXIT_ON_ERROR(ctx,
+            staged_write(ctx, st, dst->ptr + dstoff, src, sz));
+      else
+        CUDA_EXIT_ON_ERROR(ctx,
+            cuMemcpyHtoDAsync(dst->ptr + dstoff, src, sz, ctx->mem_s));
 
       GA_CUDA_EXIT_ON_ERROR(ctx,
           cuda_records(dst, CUDA_WAIT_WRITE, ctx->mem_s));
@@ -1013,6 +1486,234 @@ static int cuda_write(gpudata *dst, size_t dstoff, const void *src,
     return GA_NO_ERROR;
 }
 
+/*
+ * Asynchronous transfers.
+ *
+ * These are queued on the memory stream like the others, followed by
+ * the event of the returned handle.  The driver can only do them
+ * asynchronously with pinned memory so pageable memory goes through
+ * a buffer from the pinned host allocator (GA_BUFFER_HOST).  For
+ * writes the data is copied to it right away.  For reads it is copied
+ * out once the transfer is seen to be done.  If we can't get such a
+ * buffer, the transfer is queued with the pageable memory, which
+ * works but won't overlap with the caller.
+ *
+ * Buffers mapped in host memory are accessed directly and there is
+ * nothing to wait for afterwards.
+ */
+static gpuevent *new_gpuevent(cuda_context *ctx) {
+  gpuevent *res;
+  CUresult err;
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL) {
+    error_sys(ctx->err, "calloc");
+    return NULL;
+  }
+  cuda_enter(ctx);
+  err = cuEventCreate(&res->ev, CU_EVENT_DISABLE_TIMING);
+  cuda_exit(ctx);
+  if (err != CUDA_SUCCESS) {
+    free(res);
+    error_cuda(ctx->err, "cuEventCreate", err);
+    return NULL;
+  }
+  res->ctx = ctx;
+  ga_atomic_inc(&ctx->refcnt);
+  TAG_EV(res);
+  return res;
+}
+
+static void cuda_event_release(gpuevent *ev);
+
+static int cuda_write_async(gpudata *dst, size_t dstoff, const void *src,
+                            size_t sz, gpuevent **ev) {
+  cuda_context *ctx = dst->ctx;
+  gpudata *bounce = NULL;
+  gpuevent *res;
+  CUresult cerr;
+  int err = GA_NO_ERROR;
+
+  ASSERT_BUF(dst);
+
+  if ((dst->sz - dstoff) < sz)
+    return error_set(ctx->err, GA_VALUE_ERROR, "Destination is smaller than the write size");
+
+  res = new_gpuevent(ctx);
+  if (res == NULL)
+    return ctx->err->code;
+
+  if (sz == 0 || (dst->flags & CUDA_MAPPED_PTR)) {
+    err = cuda_write(dst, dstoff, src, sz);
+    goto done;
+  }
+
+  if (!is_pinned(src)) {
+    bounce = cuda_alloc((gpucontext *)ctx, sz, NULL, GA_BUFFER_HOST);
+    if (bounce != NULL) {
+      err = cuda_write(bounce, 0, src, sz);
+      if (err != GA_NO_ERROR)
+        goto done;
+      src = (void *)bounce->ptr;
+    }
+  }
+
+  cuda_enter(ctx);
+  err = cuda_waits(dst, CUDA_WAIT_WRITE, ctx->mem_s);
+  if (err == GA_NO_ERROR && bounce != NULL)
+    err = cuda_waits(bounce, CUDA_WAIT_READ, ctx->mem_s);
+  if (err != GA_NO_ERROR) {
+    cuda_exit(ctx);
+    goto done;
+  }
+  cerr = cuMemcpyHtoDAsync(dst->ptr + dstoff, src, sz, ctx->mem_s);
+  if (cerr != CUDA_SUCCESS) {
+    cuda_exit(ctx);
+    err = error_cuda(ctx->err, "cuMemcpyHtoDAsync", cerr);
+    goto done;
+  }
+  err = cuda_records(dst, CUDA_WAIT_WRITE, ctx->mem_s);
+  if (err == GA_NO_ERROR && bounce != NULL)
+    err = cuda_records(bounce, CUDA_WAIT_READ, ctx->mem_s);
+  if (err == GA_NO_ERROR) {
+    cerr = cuEventRecord(res->ev, ctx->mem_s);
+    if (cerr != CUDA_SUCCESS)
+      err = error_cuda(ctx->err, "cuEventRecord", cerr);
+  }
+  cuda_exit(ctx);
+
+ done:
+  /* The allocator holds on to it until the copy is done */
+  if (bounce != NULL)
+    cuda_free(bounce);
+  if (err != GA_NO_ERROR) {
+    cuda_event_release(res);
+    return err;
+  }
+  *ev = res;
+  return GA_NO_ERROR;
+}
+
+static int cuda_read_async(void *dst, gpudata *src, size_t srcoff, size_t sz,
+                           gpuevent **ev) {
+  cuda_context *ctx = src->ctx;
+  gpudata *bounce = NULL;
+  gpuevent *res;
+  CUresult cerr;
+  int err = GA_NO_ERROR;
+
+  ASSERT_BUF(src);
+
+  if ((src->sz - srcoff) < sz)
+    return error_set(ctx->err, GA_VALUE_ERROR, "source is smaller than the read size");
+
+  res = new_gpuevent(ctx);
+  if (res == NULL)
+    return ctx->err->code;
+
+  if (sz == 0 || (src->flags & CUDA_MAPPED_PTR)) {
+    err = cuda_read(dst, src, srcoff, sz);
+    goto done;
+  }
+
+  if (!is_pinned(dst))
+    bounce = cuda_alloc((gpucontext *)ctx, sz, NULL, GA_BUFFER_HOST);
+
+  cuda_enter(ctx);
+  err = cuda_waits(src, CUDA_WAIT_READ, ctx->mem_s);
+  if (err == GA_NO_ERROR && bounce != NULL)
+    err = cuda_waits(bounce, CUDA_WAIT_WRITE, ctx->mem_s);
+  if (err != GA_NO_ERROR) {
+    cuda_exit(ctx);
+    goto done;
+  }
+  cerr = cuMemcpyDtoHAsync(bounce != NULL ? (void *)bounce->ptr : dst,
+                           src->ptr + srcoff, sz, ctx->mem_s);
+  if (cerr != CUDA_SUCCESS) {
+    cuda_exit(ctx);
+    err = error_cuda(ctx->err, "cuMemcpyDtoHAsync", cerr);
+    goto done;
+  }
+  err = cuda_records(src, CUDA_WAIT_READ, ctx->mem_s);
+  if (err == GA_NO_ERROR && bounce != NULL)
+    err = cuda_records(bounce, CUDA_WAIT_WRITE, ctx->mem_s);
+  if (err == GA_NO_ERROR) {
+    cerr = cuEventRecord(res->ev, ctx->mem_s);
+    if (cerr != CUDA_SUCCESS)
+      err = error_cuda(ctx->err, "cuEventRecord", cerr);
+  }
+  cuda_exit(ctx);
+
+ done:
+  if (err != GA_NO_ERROR) {
+    if (bounce != NULL)
+      cuda_free(bounce);
+    cuda_event_release(res);
+    return err;
+  }
+  res->bounce = bounce;
+  res->dst = dst;
+  res->sz = sz;
+  *ev = res;
+  return GA_NO_ERROR;
+}
+
+/* Called once the transfer is done */
+static void event_complete(gpuevent *ev) {
+  if (ev->bounce != NULL) {
+    memcpy(ev->dst, (void *)ev->bounce->ptr, ev->sz);
+    cuda_free(ev->bounce);
+    ev->bounce = NULL;
+  }
+}
+
+static int cuda_event_wait(gpuevent *ev) {
+  cuda_context *ctx = ev->ctx;
+
+  ASSERT_EV(ev);
+  cuda_enter(ctx);
+  CUDA_EXIT_ON_ERROR(ctx, cuEventSynchronize(ev->ev));
+  cuda_exit(ctx);
+  event_complete(ev);
+  return GA_NO_ERROR;
+}
+
+static int cuda_event_query(gpuevent *ev, int *done) {
+  cuda_context *ctx = ev->ctx;
+  CUresult err;
+
+  ASSERT_EV(ev);
+  cuda_enter(ctx);
+  err = cuEventQuery(ev->ev);
+  cuda_exit(ctx);
+  if (err == CUDA_ERROR_NOT_READY) {
+    *done = 0;
+    return GA_NO_ERROR;
+  }
+  if (err != CUDA_SUCCESS)
+    return error_cuda(ctx->err, "cuEventQuery", err);
+  event_complete(ev);
+  *done = 1;
+  return GA_NO_ERROR;
+}
+
+static void cuda_event_release(gpuevent *ev) {
+  cuda_context *ctx = ev->ctx;
+
+  ASSERT_EV(ev);
+  if (ev->bounce != NULL && cuda_event_wait(ev) != GA_NO_ERROR) {
+    /* Don't leave the data half-copied in there */
+    cuda_free(ev->bounce);
+    ev->bounce = NULL;
+  }
+  cuda_enter(ctx);
+  cuEventDestroy(ev->ev);
+  cuda_exit(ctx);
+  CLEAR(ev);
+  free(ev);
+  cuda_free_ctx(ctx);
+}
+
 static int cuda_memset(gpudata *dst, size_t dstoff, int data) {
     cuda_context *ctx = dst->ctx;
 
@@ -1069,7 +1770,8 @@ static inline int error_nvrtc(error *e, const char *msg, nvrtcResult err) {
   return error_fmt(e, GA_IMPL_ERROR, "%s: %s", msg, nvrtcGetErrorString(err));
 }
 
-static int call_compiler(cuda_context *ctx, strb *src, strb *ptx, strb *log) {
+static int call_compiler(const char *arch, strb *src, strb *ptx, strb *log,
+                         error *e) {
   nvrtcProgram prog;
   size_t buflen;
   const char *opts[4] = {
@@ -1078,11 +1780,11 @@ static int call_compiler(cuda_context *ctx, strb *src, strb *ptx, strb *log) {
   };
   nvrtcResult err;
 
-  opts[1] = ctx->bin_id;
+  opts[1] = arch;
 
   err = nvrtcCreateProgram(&prog, src->s, NULL, 0, NULL, NULL);
   if (err != NVRTC_SUCCESS)
-    return error_nvrtc(ctx->err, "nvrtcCreateProgram", err);
+    return error_nvrtc(e, "nvrtcCreateProgram", err);
 
   err = nvrtcCompileProgram(prog,
 #ifdef DEBUG
@@ -1103,20 +1805,20 @@ static int call_compiler(cuda_context *ctx, strb *src, strb *ptx, strb *log) {
 
   if (err != NVRTC_SUCCESS) {
     nvrtcDestroyProgram(&prog);
-    return error_nvrtc(ctx->err, "nvrtcCompileProgram", err);
+    return error_nvrtc(e, "nvrtcCompileProgram", err);
   }
 
   err = nvrtcGetPTXSize(prog, &buflen);
   if (err != NVRTC_SUCCESS) {
     nvrtcDestroyProgram(&prog);
-    return error_nvrtc(ctx->err, "nvrtcGetPTXSize", err);
+    return error_nvrtc(e, "nvrtcGetPTXSize", err);
   }
 
   if (strb_ensure(ptx, buflen) == 0) {
     err = nvrtcGetPTX(prog, ptx->s+ptx->l);
     if (err != NVRTC_SUCCESS) {
       nvrtcDestroyProgram(&prog);
-      return error_nvrtc(ctx->err, "nvrtcGetPTX", err);
+      return error_nvrtc(e, "nvrtcGetPTX", err);
     }
     ptx->l += buflen;
   }
@@ -1124,7 +1826,7 @@ static int call_compiler(cuda_context *ctx, strb *src, strb *ptx, strb *log) {
   return GA_NO_ERROR;
 }
 
-static int make_bin(cuda_context *ctx, const strb *ptx, strb *bin, strb *log) {
+static int make_bin(const strb *ptx, strb *bin, strb *log, error *e) {
   char info_log[2048] = "";
   char error_log[2048] = "";
   void *out;
@@ -1154,16 +1856,16 @@ static int make_bin(cuda_context *ctx, const strb *ptx, strb *bin, strb *log) {
   err = cuLinkCreate(sizeof(cujit_opts)/sizeof(cujit_opts[0]),
                           cujit_opts, cujit_opt_vals, &st);
   if (err != CUDA_SUCCESS)
-    return error_cuda(ctx->err, "cuLinkCreate", err);
+    return error_cuda(e, "cuLinkCreate", err);
   err = cuLinkAddData(st, CU_JIT_INPUT_PTX, ptx->s, ptx->l,
                            "kernel code", 0, NULL, NULL);
   if (err != CUDA_SUCCESS) {
-    res = error_cuda(ctx->err, "cuLinkAddData", err);
+    res = error_cuda(e, "cuLinkAddData", err);
     goto out;
   }
   err = cuLinkComplete(st, &out, &out_size);
   if (err != CUDA_SUCCESS) {
-    res = error_cuda(ctx->err, "cuLinkComplete", err);
+    res = error_cuda(e, "cuLinkComplete", err);
     goto out;
   }
   strb_appendn(bin, out, out_size);
@@ -1177,85 +1879,335 @@ out:
   return res;
 }
 
-static int compile(cuda_context *ctx, strb *src, strb* bin, strb *log) {
-  strb ptx = STRB_STATIC_INIT;
+static void key_init(kernel_key *k, int maj, int min, const char *bin_id,
+                     const src_key *src) {
+  memset(k, 0, sizeof(*k));
+  k->version = KERNEL_KEY_VERSION;
+#ifdef DEBUG
+  k->debug = 1;
+#endif
+  k->major = maj;
+  k->minor = min;
+  strncpy(k->bin_id, bin_id, 64);
+  k->fp = src->fp;
+  memcpy(&k->src, &src->src, sizeof(strb));
+}
+
+static void make_key(cuda_context *ctx, src_key *src, kernel_key *k) {
+  key_init(k, ctx->major, ctx->minor, ctx->bin_id, src);
+}
+
+/* Look up the binary in the disk cache.  Returns 1 if found. */
+static int disk_lookup(cuda_context *ctx, src_key *src, strb *bin) {
   strb *cbin;
   kernel_key k;
+
+  if (ctx->disk_cache == NULL)
+    return 0;
+  make_key(ctx, src, &k);
+  cbin = cache_get(ctx->disk_cache, &k);
+  if (cbin == NULL)
+    return 0;
+  strb_appendb(bin, cbin);
+  strb_free(cbin);
+  return 1;
+}
+
+/* Add a copy of `bin` under a copy of `k` */
+static int disk_add(cache *c, const kernel_key *k, const strb *bin,
+                    error *e) {
+  strb *cbin;
   kernel_key *pk;
 
-  memset(&k, 0, sizeof(k));
-  k.version = 0;
-#ifdef DEBUG
-  k.debug = 1;
-#endif
-  k.major = ctx->major;
-  k.minor = ctx->minor;
-  memcpy(k.bin_id, ctx->bin_id, 64);
-  memcpy(&k.src, src, sizeof(strb));
-
-  // Look up the binary in the disk cache
-  if (ctx->disk_cache) {
-    cbin = cache_get(ctx->disk_cache, &k);
-    if (cbin != NULL) {
-      strb_appendb(bin, cbin);
-      return GA_NO_ERROR;
-    }
+  pk = calloc(sizeof(kernel_key), 1);
+  if (pk == NULL)
+    return error_sys(e, "calloc");
+  memcpy(pk, k, KERNEL_KEY_MM);
+  strb_appendb(&pk->src, &k->src);
+  if (strb_error(&pk->src)) {
+    key_free((cache_key_t)pk);
+    return error_sys(e, "strb_appendb");
+  }
+  cbin = strb_alloc(bin->l);
+  if (cbin == NULL) {
+    key_free((cache_key_t)pk);
+    return error_sys(e, "strb_alloc");
+  }
+  strb_appendb(cbin, bin);
+  if (strb_error(cbin)) {
+    key_free((cache_key_t)pk);
+    strb_free(cbin);
+    return error_sys(e, "strb_appendb");
   }
+  // TODO use better error messages
+  if (cache_add(c, pk, cbin))
+    return error_set(e, GA_MISC_ERROR, "cache_add failed");
+  return GA_NO_ERROR;
+}
 
-  GA_CHECK(call_compiler(ctx, src, &ptx, log));
+/* Errors here only affect the disk cache so they are only reported */
+static void disk_store(cuda_context *ctx, src_key *src, strb *bin) {
+  kernel_key k;
 
-  GA_CHECK(make_bin(ctx, &ptx, bin, log));
+  if (ctx->disk_cache == NULL)
+    return;
+  make_key(ctx, src, &k);
+  if (disk_add(ctx->disk_cache, &k, bin, ctx->err) != GA_NO_ERROR)
+    fprintf(stderr, "Error adding kernel to disk cache: %s\n",
+            ctx->err->msg);
+}
 
-  if (ctx->disk_cache) {
-    pk = calloc(sizeof(kernel_key), 1);
-    if (pk == NULL) {
-      error_sys(ctx->err, "calloc");
-      fprintf(stderr, "Error adding kernel to disk cache: %s\n",
-              ctx->err->msg);
-      return GA_NO_ERROR;
-    }
-    memcpy(pk, &k, KERNEL_KEY_MM);
-    strb_appendb(&pk->src, src);
-    if (strb_error(&pk->src)) {
-      error_sys(ctx->err, "strb_appendb"); 
-      fprintf(stderr, "Error adding kernel to disk cache %s\n",
-              ctx->err->msg);
-      key_free((cache_key_t)pk);
-      return GA_NO_ERROR;
-    }
-    cbin = strb_alloc(bin->l);
-    if (cbin == NULL) {
-      error_sys(ctx->err, "strb_alloc"); 
-      fprintf(stderr, "Error adding kernel to disk cache: %s\n",
-              ctx->err->msg);
-      key_free((cache_key_t)pk);
-      return GA_NO_ERROR;
-    }
-    strb_appendb(cbin, bin);
-    if (strb_error(cbin)) {
-      error_sys(ctx->err, "strb_appendb"); 
-      fprintf(stderr, "Error adding kernel to disk cache %s\n",
-              ctx->err->msg);
-      key_free((cache_key_t)pk);
-      strb_free(cbin);
-      return GA_NO_ERROR;
-    }
-    if (cache_add(ctx->disk_cache, pk, cbin)) {
-      // TODO use better error messages
-      fprintf(stderr, "Error adding kernel to disk cache\n");
+static int compile(cuda_context *ctx, src_key *src, strb* bin, strb *log) {
+  strb ptx = STRB_STATIC_INIT;
+  int err;
+
+  if (disk_lookup(ctx, src, bin))
+    return GA_NO_ERROR;
+
+  err = call_compiler(ctx->bin_id, &src->src, &ptx, log, ctx->err);
+  if (err == GA_NO_ERROR)
+    err = make_bin(&ptx, bin, log, ctx->err);
+  strb_clear(&ptx);
+  if (err != GA_NO_ERROR)
+    return err;
+
+  disk_store(ctx, src, bin);
+  return GA_NO_ERROR;
+}
+
+/*
+ * Preload manifest.
+ *
+ * When GPUARRAY_CACHE_PRELOAD is set (and the disk cache is enabled)
+ * the kernels that a process builds or loads are appended to a file
+ * in the cache directory.  New contexts read it back and start
+ * loading the modules for those kernels in the background so that
+ * the first calls find them in the kernel cache.
+ *
+ * Each record is:
+ *  - the magic,
+ *  - the length of the body (32 bits),
+ *  - a checksum (XXH32) of the body,
+ *  - the body: the length of the function name, the number of
+ *    arguments (32 bits each), the function name, the argument
+ *    types (32 bits each) and the kernel source.
+ *
+ * All numbers are big-endian.  Records are written with a single
+ * call to an unbuffered stream opened for append so that concurrent
+ * processes don't interleave them.  Anything that doesn't check out
+ * ends the file for the reader.
+ */
+#define MANIFEST_MAGIC 0x47414d46 /* "GAMF" */
+#define MANIFEST_HEAD 12
+
+/*
+ * Preload at most a quarter of the kernel cache.  With
+ * GA_CTX_MULTI_THREAD the cache is split by hash in KERNEL_STRIPES
+ * parts (32 entries each) so this leaves room for an uneven spread
+ * and for the kernels that the program builds itself.
+ */
+#define MANIFEST_MAX (KERNEL_CACHE_SIZE / 4)
+
+static uint32_t get32(const char *_in) {
+  const unsigned char *in = (const unsigned char *)_in;
+  return ((uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 |
+          (uint32_t)in[2] << 8 | (uint32_t)in[3]);
+}
+
+static void put32(uint32_t in, char *out) {
+  out[0] = (unsigned char)(in >> 24);
+  out[1] = (unsigned char)(in >> 16);
+  out[2] = (unsigned char)(in >> 8);
+  out[3] = (unsigned char)(in);
+}
+
+static void append32(strb *b, uint32_t v) {
+  if (strb_ensure(b, 4)) return;
+  put32(v, b->s + b->l);
+  b->l += 4;
+}
+
+/* This is only a hint so errors are ignored */
+static void manifest_add(cuda_context *ctx, const char *fname,
+                         unsigned int argcount, const int *types,
+                         const strb *src) {
+  strb b = STRB_STATIC_INIT;
+  FILE *f;
+  size_t fl;
+  unsigned int i;
+
+  if (ctx->manifest == NULL)
+    return;
+
+  fl = strlen(fname);
+  append32(&b, MANIFEST_MAGIC);
+  append32(&b, 0);
+  append32(&b, 0);
+  append32(&b, (uint32_t)fl);
+  append32(&b, argcount);
+  strb_appendn(&b, fname, fl);
+  for (i = 0; i < argcount; i++)
+    append32(&b, (uint32_t)types[i]);
+  strb_appendb(&b, src);
+  if (strb_error(&b)) {
+    strb_clear(&b);
+    return;
+  }
+  put32((uint32_t)(b.l - MANIFEST_HEAD), b.s + 4);
+  put32(XXH32(b.s + MANIFEST_HEAD, b.l - MANIFEST_HEAD, 0), b.s + 8);
+
+  f = fopen(ctx->manifest, "ab");
+  if (f != NULL) {
+    setvbuf(f, NULL, _IONBF, 0);
+    fwrite(b.s, b.l, 1, f);
+    fclose(f);
+  }
+  strb_clear(&b);
+}
+
+static int manifest_read(const char *path, strb *data) {
+  char buf[4096];
+  FILE *f;
+  size_t n;
+
+  f = fopen(path, "rb");
+  if (f == NULL)
+    return -1;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    strb_appendn(data, buf, n);
+  fclose(f);
+  if (strb_error(data)) {
+    strb_clear(data);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Check the record at `off`.  Returns the length of its body or 0 if
+ * there is no valid record there.
+ */
+static uint32_t manifest_rec(const strb *data, size_t off) {
+  const char *rec = data->s + off;
+  uint32_t len, fl, na;
+
+  if (data->l - off < MANIFEST_HEAD || get32(rec) != MANIFEST_MAGIC)
+    return 0;
+  len = get32(rec + 4);
+  if (len < 8 || len > data->l - off - MANIFEST_HEAD ||
+      XXH32(rec + MANIFEST_HEAD, len, 0) != get32(rec + 8))
+    return 0;
+  fl = get32(rec + MANIFEST_HEAD);
+  na = get32(rec + MANIFEST_HEAD + 4);
+  if (fl > len - 8 || na > (len - 8 - fl) / 4)
+    return 0;
+  return len;
+}
+
+/* Offset of the source in the body of a record */
+static size_t manifest_src(const char *body) {
+  return 8 + (size_t)get32(body) + 4 * (size_t)get32(body + 4);
+}
+
+/*
+ * Background compilation.
+ *
+ * Compiling with NVRTC doesn't involve the context and linking only
+ * needs the CUDA context to be current, so that is done by the
+ * workers of a process-wide queue.  Everything that touches the
+ * library state (the caches, loading the module, the reference
+ * counts) stays in the thread that uses the kernel.
+ */
+struct _cuda_compile {
+  work w; /* Keep first */
+  CUcontext ctx;
+  char arch[64];
+  char *fname;
+  src_key src;
+  strb bin;
+  strb log;
+  error e;
+  int res;
+  int reported; /* The failure was handled, see kernel_resolve() */
+  /* For preloads, the module is loaded by the worker from `bin` */
+  int preload;
+  CUmodule m;
+  CUfunction f;
+};
+
+static workq *compile_q;
+static ga_once compile_q_once = GA_ONCE_INIT;
+
+/*
+ * The number of workers can be set with GPUARRAY_COMPILE_THREADS.  With
+ * 0 the compilations happen in the thread that waits for them.
+ */
+static void compile_queue_init(void) {
+  const char *env;
+  unsigned int n;
+
+  env = getenv("GPUARRAY_COMPILE_THREADS");
+  if (env != NULL) {
+    n = (unsigned int)strtoul(env, NULL, 10);
+  } else {
+    n = ga_ncpus();
+    if (n > 8) n = 8;
+  }
+  /* Without a queue, compile synchronously */
+  if (n != 0)
+    compile_q = workq_new(n, global_err);
+}
+
+static workq *compile_queue(void) {
+  ga_call_once(&compile_q_once, compile_queue_init);
+  return compile_q;
+}
+
+static void compile_work(work *w) {
+  cuda_compile *job = (cuda_compile *)w;
+  strb ptx = STRB_STATIC_INIT;
+  CUresult err;
+
+  job->res = call_compiler(job->arch, &job->src.src, &ptx, &job->log,
+                           &job->e);
+  if (job->res == GA_NO_ERROR) {
+    err = cuCtxPushCurrent(job->ctx);
+    if (err != CUDA_SUCCESS) {
+      job->res = error_cuda(&job->e, "cuCtxPushCurrent", err);
+    } else {
+      job->res = make_bin(&ptx, &job->bin, &job->log, &job->e);
+      cuCtxPopCurrent(NULL);
     }
   }
+  strb_clear(&ptx);
+}
 
-  return GA_NO_ERROR;
+static void compile_free(cuda_compile *job) {
+  strb_clear(&job->src.src);
+  strb_clear(&job->bin);
+  strb_clear(&job->log);
+  free(job->fname);
+  free(job);
 }
 
 static void _cuda_freekernel(gpukernel *k) {
-  k->refcnt--;
-  if (k->refcnt == 0) {
+  if (ga_atomic_dec(&k->refcnt) == 0) {
+    if (k->job != NULL) {
+      /* A worker could still be using it */
+      workq_wait(compile_queue(), &k->job->w);
+      if (k->job->m != NULL) {
+        cuda_enter(k->ctx);
+        cuModuleUnload(k->job->m);
+        cuda_exit(k->ctx);
+      }
+      compile_free(k->job);
+    }
     if (k->ctx != NULL) {
-      cuda_enter(k->ctx);
-      cuModuleUnload(k->m);
-      cuda_exit(k->ctx);
+      if (k->m != NULL) {
+        cuda_enter(k->ctx);
+        cuModuleUnload(k->m);
+        cuda_exit(k->ctx);
+      }
       cuda_free_ctx(k->ctx);
     }
     CLEAR(k);
@@ -1266,193 +2218,656 @@ static void _cuda_freekernel(gpukernel *k) {
   }
 }
 
-static gpukernel *cuda_newkernel(gpucontext *c, unsigned int count,
-                                 const char **strings, const size_t *lengths,
-                                 const char *fname, unsigned int argcount,
-                                 const int *types, int flags, char **err_str) {
-    cuda_context *ctx = (cuda_context *)c;
-    strb src = STRB_STATIC_INIT;
-    strb bin = STRB_STATIC_INIT;
-    strb log = STRB_STATIC_INIT;
-    strb *psrc;
-    gpukernel *res;
-    CUdevice dev;
-    CUresult err;
-    unsigned int i;
-    int major, minor;
+/* Build the full source in `key` after checking the flags */
+static int kernel_source(cuda_context *ctx, unsigned int count,
+                         const char **strings, const size_t *lengths,
+                         int flags, src_key *key) {
+  strb *src = &key->src;
+  CUdevice dev;
+  CUresult err;
+  unsigned int i;
+  int major, minor;
 
-    if (count == 0) {
-      error_set(ctx->err, GA_VALUE_ERROR, "String count is 0");
-      return NULL;
-    }
+  memset(key, 0, sizeof(*key));
 
-    if (flags & GA_USE_OPENCL) {
-      error_set(ctx->err, GA_DEVSUP_ERROR, "OpenCL kernel not supported on cuda devices");
-      return NULL;
+  if (count == 0)
+    return error_set(ctx->err, GA_VALUE_ERROR, "String count is 0");
+
+  if (flags & GA_USE_OPENCL)
+    return error_set(ctx->err, GA_DEVSUP_ERROR, "OpenCL kernel not supported on cuda devices");
+
+  if (flags & GA_USE_BINARY)
+    return error_set(ctx->err, GA_UNSUPPORTED_ERROR, "Binary mode not supported any more");
+
+  cuda_enter(ctx);
+  err = cuCtxGetDevice(&dev);
+  if (err != CUDA_SUCCESS) {
+    cuda_exit(ctx);
+    return error_cuda(ctx->err, "cuCtxGetDevice", err);
+  }
+  if (get_cc(dev, &major, &minor, ctx->err) != GA_NO_ERROR) {
+    cuda_exit(ctx);
+    return ctx->err->code;
+  }
+  cuda_exit(ctx);
+
+  // GA_USE_CLUDA is done later
+  // GA_USE_SMALL will always work
+  // GA_USE_HALF should always work
+  if (flags & GA_USE_DOUBLE) {
+    if (major < 1 || (major == 1 && minor < 3))
+      return error_set(ctx->err, GA_DEVSUP_ERROR, "Requested double support and current device doesn't support them");
+  }
+  if (flags & GA_USE_COMPLEX) {
+    // just for now since it is most likely broken
+    error_set(ctx->err, GA_UNSUPPORTED_ERROR, "Complex support is not there yet.");
+  }
+
+  if (flags & GA_USE_CLUDA) {
+    strb_appends(src, CUDA_PREAMBLE);
+  }
+
+  if (lengths == NULL) {
+    for (i = 0; i < count; i++)
+      strb_appends(src, strings[i]);
+  } else {
+    for (i = 0; i < count; i++) {
+      if (lengths[i] == 0)
+        strb_appends(src, strings[i]);
+      else
+        strb_appendn(src, strings[i], lengths[i]);
     }
+  }
 
-    if (flags & GA_USE_BINARY) {
-      error_set(ctx->err, GA_UNSUPPORTED_ERROR, "Binary mode not supported any more");
-      return NULL;
+  strb_append0(src);
+
+  if (strb_error(src)) {
+    strb_clear(src);
+    return error_sys(ctx->err, "strb");
+  }
+  src_fingerprint(key);
+  return GA_NO_ERROR;
+}
+
+static void compile_error_str(strb *src, strb *log, char **err_str) {
+  strb debug_msg = STRB_STATIC_INIT;
+  size_t l = src->l - 1; /* Without the final NUL */
+
+  strb_appends(&debug_msg, "CUDA kernel compile failure ::\n");
+  gpukernel_source_with_line_numbers(1, (const char **)&src->s,
+                                     &l, &debug_msg);
+  strb_appends(&debug_msg, "\nCompile log:\n");
+  strb_appendb(&debug_msg, log);
+  *err_str = strb_cstr(&debug_msg);
+}
+
+static gpukernel *kernel_alloc(cuda_context *ctx, unsigned int argcount,
+                               const int *types) {
+  gpukernel *res;
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL) {
+    error_sys(ctx->err, "calloc");
+    return NULL;
+  }
+  res->refcnt = 1;
+  res->argcount = argcount;
+  res->types = calloc(argcount, sizeof(int));
+  if (res->types == NULL) {
+    error_sys(ctx->err, "calloc");
+    _cuda_freekernel(res);
+    return NULL;
+  }
+  memcpy(res->types, types, argcount*sizeof(int));
+  res->args = calloc(argcount, sizeof(void *));
+  if (res->args == NULL) {
+    error_sys(ctx->err, "calloc");
+    _cuda_freekernel(res);
+    return NULL;
+  }
+  return res;
+}
+
+/* The kernel takes over the data of `bin` */
+static int kernel_load(cuda_context *ctx, gpukernel *k, strb *bin,
+                       const char *fname) {
+  CUresult err;
+
+  k->bin_sz = bin->l;
+  k->bin = bin->s;
+  memset(bin, 0, sizeof(*bin));
+
+  cuda_enter(ctx);
+  err = cuModuleLoadData(&k->m, k->bin);
+  if (err != CUDA_SUCCESS) {
+    cuda_exit(ctx);
+    return error_cuda(ctx->err, "cuModuleLoadData", err);
+  }
+
+  err = cuModuleGetFunction(&k->k, k->m, fname);
+  cuda_exit(ctx);
+  if (err != CUDA_SUCCESS)
+    return error_cuda(ctx->err, "cuModuleGetFunction", err);
+  return GA_NO_ERROR;
+}
+
+/* Create the kernel for a binary, this takes over `src` and `bin` */
+static gpukernel *kernel_finish(cuda_context *ctx, src_key *src, strb *bin,
+                                const char *fname, unsigned int argcount,
+                                const int *types) {
+  gpukernel *res;
+  src_key *psrc;
+
+  if (strb_error(bin)) {
+    error_sys(ctx->err, "strb");
+    strb_clear(&src->src);
+    strb_clear(bin);
+    return NULL;
+  }
+
+  res = kernel_alloc(ctx, argcount, types);
+  if (res == NULL) {
+    strb_clear(&src->src);
+    strb_clear(bin);
+    return NULL;
+  }
+
+  if (kernel_load(ctx, res, bin, fname) != GA_NO_ERROR) {
+    _cuda_freekernel(res);
+    strb_clear(&src->src);
+    return NULL;
+  }
+
+  res->ctx = ctx;
+  ga_atomic_inc(&ctx->refcnt);
+  TAG_KER(res);
+  psrc = memdup(src, sizeof(src_key));
+  if (psrc != NULL) {
+    /* One of the refs is for the cache */
+    res->refcnt++;
+    /* If this fails, it will free the key and remove a ref from the
+       kernel. */
+    manifest_add(ctx, fname, argcount, types, &src->src);
+    cache_add(ctx->kernel_cache, psrc, res);
+  } else {
+    strb_clear(&src->src);
+  }
+  return res;
+}
+
+static int resolve_job(gpukernel *k) {
+  cuda_context *ctx = k->ctx;
+  cuda_compile *job = k->job;
+  gpukernel *cur;
+
+  /* Another thread got there first */
+  if (job == NULL)
+    return GA_NO_ERROR;
+
+  workq_wait(compile_queue(), &job->w);
+  if (job->res == GA_NO_ERROR && job->preload) {
+    k->m = job->m;
+    k->k = job->f;
+    k->bin_sz = job->bin.l;
+    k->bin = job->bin.s;
+    job->m = NULL;
+    memset(&job->bin, 0, sizeof(strb));
+    ga_store_release((void **)&k->job, NULL);
+    compile_free(job);
+    return GA_NO_ERROR;
+  }
+  if (job->res == GA_NO_ERROR) {
+    disk_store(ctx, &job->src, &job->bin);
+    job->res = kernel_load(ctx, k, &job->bin, job->fname);
+    if (job->res == GA_NO_ERROR) {
+      manifest_add(ctx, job->fname, k->argcount, k->types, &job->src.src);
+      ga_store_release((void **)&k->job, NULL);
+      compile_free(job);
+      return GA_NO_ERROR;
     }
+    error_set(&job->e, ctx->err->code, ctx->err->msg);
+  }
+  if (!job->reported) {
+    job->reported = 1;
+    /* Make the next request for this source try again */
+    cur = (gpukernel *)cache_get(ctx->kernel_cache, &job->src);
+    if (cur == k)
+      cache_del(ctx->kernel_cache, &job->src);
+    if (cur != NULL)
+      _cuda_freekernel(cur);
+  }
+  return error_set(ctx->err, job->e.code, job->e.msg);
+}
 
-    cuda_enter(ctx);
+/*
+ * Finish a compilation started by cuda_newkernel_async() or a load
+ * started by manifest_preload().  k->job is cleared with a release
+ * store once the kernel is usable.
+ */
+static int kernel_resolve(gpukernel *k) {
+  cuda_context *ctx = k->ctx;
+  int res;
+
+  /* Pairs with the release in resolve_job() so that k->k is set */
+  if (ga_load_acquire((void **)&k->job) == NULL)
+    return GA_NO_ERROR;
+  if (ctx->locks == NULL)
+    return resolve_job(k);
+  ga_mutex_lock(&ctx->locks->kernel);
+  res = resolve_job(k);
+  ga_mutex_unlock(&ctx->locks->kernel);
+  return res;
+}
+
+static void preload_work(work *w) {
+  cuda_compile *job = (cuda_compile *)w;
+  CUresult err;
 
-    err = cuCtxGetDevice(&dev);
+  err = cuCtxPushCurrent(job->ctx);
+  if (err != CUDA_SUCCESS) {
+    job->res = error_cuda(&job->e, "cuCtxPushCurrent", err);
+    return;
+  }
+  err = cuModuleLoadData(&job->m, job->bin.s);
+  if (err != CUDA_SUCCESS) {
+    job->m = NULL;
+    job->res = error_cuda(&job->e, "cuModuleLoadData", err);
+  } else {
+    err = cuModuleGetFunction(&job->f, job->m, job->fname);
     if (err != CUDA_SUCCESS) {
-      cuda_exit(ctx);
-      error_cuda(ctx->err, "cuCtxGetDevice", err);
-      return NULL;
+      cuModuleUnload(job->m);
+      job->m = NULL;
+      job->res = error_cuda(&job->e, "cuModuleGetFunction", err);
     }
+  }
+  cuCtxPopCurrent(NULL);
+}
 
-    if (get_cc(dev, &major, &minor, ctx->err) != GA_NO_ERROR)
-      return NULL;
+/*
+ * Start loading the kernel for one record.  Returns 1 if the record
+ * should stay in the manifest.
+ */
+static int preload_one(cuda_context *ctx, const char *body, uint32_t len) {
+  src_key src;
+  strb bin = STRB_STATIC_INIT;
+  cuda_compile *job;
+  gpukernel *res;
+  src_key *psrc;
+  int *types;
+  uint32_t fl, na, i;
+
+  fl = get32(body);
+  na = get32(body + 4);
+  memset(&src, 0, sizeof(src));
+  strb_appendn(&src.src, body + manifest_src(body), len - manifest_src(body));
+  if (strb_error(&src.src))
+    return 1;
+  src_fingerprint(&src);
+
+  /* Already there (a duplicate) */
+  res = (gpukernel *)cache_get(ctx->kernel_cache, &src);
+  if (res != NULL) {
+    _cuda_freekernel(res);
+    strb_clear(&src.src);
+    return 0;
+  }
+  /* Not worth anything if the binary was dropped from the disk cache */
+  if (!disk_lookup(ctx, &src, &bin)) {
+    strb_clear(&src.src);
+    return 0;
+  }
 
-    // GA_USE_CLUDA is done later
-    // GA_USE_SMALL will always work
-    // GA_USE_HALF should always work
-    if (flags & GA_USE_DOUBLE) {
-      if (major < 1 || (major == 1 && minor < 3)) {
-        cuda_exit(ctx);
-        error_set(ctx->err, GA_DEVSUP_ERROR, "Requested double support and current device doesn't support them");
-        return NULL;
-      }
-    }
-    if (flags & GA_USE_COMPLEX) {
-      // just for now since it is most likely broken
-      cuda_exit(ctx);
-      error_set(ctx->err, GA_UNSUPPORTED_ERROR, "Complex support is not there yet.");
+  types = calloc(na, sizeof(int));
+  job = calloc(1, sizeof(*job));
+  if (types == NULL || job == NULL || strb_error(&bin)) {
+    free(types);
+    free(job);
+    strb_clear(&src.src);
+    strb_clear(&bin);
+    return 1;
+  }
+  for (i = 0; i < na; i++)
+    types[i] = (int)get32(body + 8 + fl + 4 * i);
+  res = kernel_alloc(ctx, na, types);
+  free(types);
+  job->fname = malloc(fl + 1);
+  strb_appendb(&job->src.src, &src.src);
+  job->src.fp = src.fp;
+  if (res == NULL || job->fname == NULL || strb_error(&job->src.src)) {
+    if (res != NULL)
+      _cuda_freekernel(res);
+    compile_free(job);
+    strb_clear(&src.src);
+    strb_clear(&bin);
+    return 1;
+  }
+  memcpy(job->fname, body + 8, fl);
+  job->fname[fl] = '\0';
+  memcpy(&job->bin, &bin, sizeof(strb));
+  job->ctx = ctx->ctx;
+  job->preload = 1;
+
+  res->ctx = ctx;
+  ga_atomic_inc(&ctx->refcnt);
+  res->job = job;
+  res->preload = 1;
+  TAG_KER(res);
+  workq_submit(compile_queue(), &job->w, preload_work);
+
+  /* The only reference goes to the cache */
+  psrc = memdup(&src, sizeof(src_key));
+  if (psrc == NULL) {
+    _cuda_freekernel(res);
+    strb_clear(&src.src);
+    return 1;
+  }
+  cache_add(ctx->kernel_cache, psrc, res);
+  return 1;
+}
+
+/*
+ * Start loading the kernels listed in the manifest.
+ *
+ * The records are appended as kernels are used, so the latest ones
+ * are preloaded first.  The older records for the same kernels then
+ * find it in the cache and are dropped.
+ *
+ * Records for binaries that are no longer in the disk cache are
+ * dropped by rewriting the file once they are the majority.  A process
+ * appending at the same time can lose its record, which only means
+ * that the kernel won't be preloaded next time.
+ */
+static void manifest_preload(cuda_context *ctx) {
+  strb data = STRB_STATIC_INIT;
+  strb live = STRB_STATIC_INIT;
+  size_t *recs = NULL, *tmp_recs;
+  const char *rec;
+  size_t off = 0;
+  uint32_t len;
+  unsigned int total = 0, kept = 0, loaded = 0, nrecs = 0, i;
+#ifndef _WIN32
+  char *tmp;
+  int fd;
+#endif
+
+  if (manifest_read(ctx->manifest, &data))
+    return;
+
+  /* The records can only be found walking forward */
+  while ((len = manifest_rec(&data, off)) != 0) {
+    if (total == nrecs) {
+      nrecs = nrecs ? nrecs * 2 : MANIFEST_MAX;
+      tmp_recs = realloc(recs, nrecs * sizeof(size_t));
+      if (tmp_recs == NULL)
+        goto done;
+      recs = tmp_recs;
     }
+    recs[total++] = off;
+    off += MANIFEST_HEAD + len;
+  }
+
+  for (i = total; i > 0 && loaded < MANIFEST_MAX; i--) {
+    rec = data.s + recs[i - 1];
+    if (preload_one(ctx, rec + MANIFEST_HEAD, get32(rec + 4)))
+      loaded++;
+    else
+      recs[i - 1] = (size_t)-1;
+  }
 
-    if (flags & GA_USE_CLUDA) {
-      strb_appends(&src, CUDA_PREAMBLE);
+  for (i = 0; i < total; i++) {
+    if (recs[i] != (size_t)-1) {
+      rec = data.s + recs[i];
+      strb_appendn(&live, rec, MANIFEST_HEAD + get32(rec + 4));
+      kept++;
     }
+  }
 
-    if (lengths == NULL) {
-      for (i = 0; i < count; i++)
-        strb_appends(&src, strings[i]);
-    } else {
-      for (i = 0; i < count; i++) {
-        if (lengths[i] == 0)
-          strb_appends(&src, strings[i]);
-        else
-          strb_appendn(&src, strings[i], lengths[i]);
+#ifndef _WIN32
+  if ((off != data.l || (total - kept) * 2 > total) && !strb_error(&live)) {
+    tmp = malloc(strlen(ctx->manifest) + 8);
+    if (tmp != NULL) {
+      strcpy(tmp, ctx->manifest);
+      strcat(tmp, ".XXXXXX");
+      fd = mkstemp(tmp);
+      if (fd != -1) {
+        if (strb_write(fd, &live) != 0) {
+          close(fd);
+          unlink(tmp);
+        } else {
+          close(fd);
+          if (rename(tmp, ctx->manifest) != 0)
+            unlink(tmp);
+        }
       }
+      free(tmp);
     }
+  }
+#endif
+ done:
+  free(recs);
+  strb_clear(&live);
+  strb_clear(&data);
+}
+
+/*
+ * Offline compilation, for bin/gpuarray-precompile.
+ *
+ * Linking the PTX to a binary needs a context (and a device) so the
+ * PTX itself goes in the cache.  cuModuleLoadData() accepts it and the
+ * driver finishes the job when it is loaded.
+ */
+int cuda_precompile_setup(int maj, int min, error *e) {
+  if (maj > 9 || maj < 0 || min > 9 || min < 0)
+    return error_fmt(e, GA_VALUE_ERROR, "Invalid cuda version: %d.%d",
+                     maj, min);
+  return load_libnvrtc(maj, min, e);
+}
 
-    strb_append0(&src);
+cache *cuda_precompile_cache(const char *path, int pack, error *e) {
+  cache *mem, *res;
 
-    if (strb_error(&src)) {
-      error_sys(ctx->err, "strb");
-      strb_clear(&src);
-      cuda_exit(ctx);
+  mem = cache_lru(64, 8,
+                  (cache_eq_fn)key_eq,
+                  (cache_hash_fn)key_hash,
+                  (cache_freek_fn)key_free,
+                  (cache_freev_fn)strb_free, e);
+  if (mem == NULL)
+    return NULL;
+  res = (pack ? cache_disk_pack : cache_disk)(path, mem,
+                                              (kwrite_fn)key_write,
+                                              (vwrite_fn)kernel_write,
+                                              (kread_fn)key_read,
+                                              (vread_fn)kernel_read, e);
+  if (res == NULL) {
+    cache_destroy(mem);
+    return NULL;
+  }
+  cache_disk_fingerprint(res, (kfp_fn)key_fp);
+  return res;
+}
+
+void cuda_precompile_preamble(strb *src) {
+  strb_appends(src, CUDA_PREAMBLE);
+}
+
+int cuda_precompile(const char *arch, strb *src, strb *bin, strb *log,
+                    error *e) {
+  return call_compiler(arch, src, bin, log, e);
+}
+
+int cuda_precompile_store(cache *c, int maj, int min, const char *arch,
+                          const strb *src, const strb *bin, error *e) {
+  kernel_key k;
+  src_key sk;
+
+  memcpy(&sk.src, src, sizeof(strb));
+  src_fingerprint(&sk);
+  key_init(&k, maj, min, arch, &sk);
+  return disk_add(c, &k, bin, e);
+}
+
+int cuda_manifest_sources(const char *path,
+                          void (*fn)(void *ud, const strb *src), void *ud) {
+  strb data = STRB_STATIC_INIT;
+  strb src;
+  size_t off = 0, so;
+  uint32_t len;
+
+  if (manifest_read(path, &data))
+    return -1;
+  while ((len = manifest_rec(&data, off)) != 0) {
+    so = manifest_src(data.s + off + MANIFEST_HEAD);
+    src.s = data.s + off + MANIFEST_HEAD + so;
+    src.l = len - so;
+    src.a = src.l;
+    fn(ud, &src);
+    off += MANIFEST_HEAD + len;
+  }
+  strb_clear(&data);
+  return 0;
+}
+
+static gpukernel *cuda_newkernel(gpucontext *c, unsigned int count,
+                                 const char **strings, const size_t *lengths,
+                                 const char *fname, unsigned int argcount,
+                                 const int *types, int flags, char **err_str) {
+    cuda_context *ctx = (cuda_context *)c;
+    src_key src;
+    strb bin = STRB_STATIC_INIT;
+    strb log = STRB_STATIC_INIT;
+    gpukernel *res;
+
+    if (kernel_source(ctx, count, strings, lengths, flags, &src) != GA_NO_ERROR)
       return NULL;
-    }
 
     res = (gpukernel *)cache_get(ctx->kernel_cache, &src);
     if (res != NULL) {
-      res->refcnt++;
-      strb_clear(&src);
-      return res;
+      /* It may come from cuda_newkernel_async() or manifest_preload() */
+      if (kernel_resolve(res) == GA_NO_ERROR) {
+        strb_clear(&src.src);
+        return res;
+      }
+      if (!res->preload) {
+        if (err_str != NULL)
+          compile_error_str(&res->job->src.src, &res->job->log, err_str);
+        _cuda_freekernel(res);
+        strb_clear(&src.src);
+        return NULL;
+      }
+      /* A failed preload is not an error, build it normally */
+      _cuda_freekernel(res);
     }
 
+    cuda_enter(ctx);
     if (compile(ctx, &src, &bin, &log) != GA_NO_ERROR) {
-      if (err_str != NULL) {
-        strb debug_msg = STRB_STATIC_INIT;
-        strb_appends(&debug_msg, "CUDA kernel compile failure ::\n");
-        src.l--;
-        gpukernel_source_with_line_numbers(1, (const char **)&src.s,
-                                           &src.l, &debug_msg);
-        strb_appends(&debug_msg, "\nCompile log:\n");
-        strb_appendb(&debug_msg, &log);
-        *err_str = strb_cstr(&debug_msg);
-      }
-      strb_clear(&src);
+      cuda_exit(ctx);
+      if (err_str != NULL)
+        compile_error_str(&src.src, &log, err_str);
+      strb_clear(&src.src);
       strb_clear(&bin);
       strb_clear(&log);
-      cuda_exit(ctx);
       return NULL;
     }
     strb_clear(&log);
 
-    if (strb_error(&bin)) {
-      error_sys(ctx->err, "strb");
-      strb_clear(&src);
-      strb_clear(&bin);
-      cuda_exit(ctx);
-      return NULL;
-    }
+    res = kernel_finish(ctx, &src, &bin, fname, argcount, types);
+    cuda_exit(ctx);
+    return res;
+}
 
-    res = calloc(1, sizeof(*res));
-    if (res == NULL) {
-      error_sys(ctx->err, "calloc");
-      strb_clear(&src);
-      strb_clear(&bin);
-      cuda_exit(ctx);
+/*
+ * Start compiling a kernel in the background.
+ *
+ * The returned kernel can be used right away, the first operation
+ * that needs the module waits for the compilation to finish.  Other
+ * requests for the same source get the same kernel, even before it
+ * is ready.
+ */
+static gpukernel *cuda_newkernel_async(gpucontext *c, unsigned int count,
+                                       const char **strings,
+                                       const size_t *lengths,
+                                       const char *fname,
+                                       unsigned int argcount,
+                                       const int *types, int flags) {
+    cuda_context *ctx = (cuda_context *)c;
+    src_key src;
+    strb bin = STRB_STATIC_INIT;
+    cuda_compile *job;
+    gpukernel *res;
+    src_key *psrc;
+
+    if (kernel_source(ctx, count, strings, lengths, flags, &src) != GA_NO_ERROR)
       return NULL;
-    }
 
-    /* Don't clear bin after this */
-    res->bin_sz = bin.l;
-    res->bin = bin.s;
-    res->refcnt = 1;
-    res->argcount = argcount;
-    res->types = calloc(argcount, sizeof(int));
-    if (res->types == NULL) {
-      error_sys(ctx->err, "calloc");
+    res = (gpukernel *)cache_get(ctx->kernel_cache, &src);
+    if (res != NULL) {
+      /* Don't hand out a preload that failed, it would stick.  This
+         doesn't look at the job, another thread may be freeing it. */
+      if (!res->preload || kernel_resolve(res) == GA_NO_ERROR) {
+        strb_clear(&src.src);
+        return res;
+      }
       _cuda_freekernel(res);
-      strb_clear(&src);
-      cuda_exit(ctx);
-      return NULL;
     }
-    memcpy(res->types, types, argcount*sizeof(int));
-    res->args = calloc(argcount, sizeof(void *));
-    if (res->args == NULL) {
-      error_sys(ctx->err, "calloc");
-      _cuda_freekernel(res);
-      strb_clear(&src);
-      cuda_exit(ctx);
+
+    /* Loading a cached binary doesn't take long enough to bother */
+    if (disk_lookup(ctx, &src, &bin))
+      return kernel_finish(ctx, &src, &bin, fname, argcount, types);
+
+    res = kernel_alloc(ctx, argcount, types);
+    if (res == NULL) {
+      strb_clear(&src.src);
       return NULL;
     }
-
-    err = cuModuleLoadData(&res->m, bin.s);
-    if (err != CUDA_SUCCESS) {
-      error_cuda(ctx->err, "cuModuleLoadData", err);
+    job = calloc(1, sizeof(*job));
+    if (job == NULL) {
+      error_sys(ctx->err, "calloc");
       _cuda_freekernel(res);
-      strb_clear(&src);
-      cuda_exit(ctx);
+      strb_clear(&src.src);
       return NULL;
     }
-
-    err = cuModuleGetFunction(&res->k, res->m, fname);
-    if (err != CUDA_SUCCESS) {
-      error_cuda(ctx->err, "cuModuleGetFunction", err);
+    job->fname = strdup(fname);
+    strb_appendb(&job->src.src, &src.src);
+    job->src.fp = src.fp;
+    if (job->fname == NULL || strb_error(&job->src.src)) {
+      error_sys(ctx->err, "strdup");
+      compile_free(job);
       _cuda_freekernel(res);
-      strb_clear(&src);
-      cuda_exit(ctx);
+      strb_clear(&src.src);
       return NULL;
     }
+    job->ctx = ctx->ctx;
+    memcpy(job->arch, ctx->bin_id, 64);
 
     res->ctx = ctx;
-    ctx->refcnt++;
-    cuda_exit(ctx);
+    ga_atomic_inc(&ctx->refcnt);
+    res->job = job;
     TAG_KER(res);
-    psrc = memdup(&src, sizeof(strb));
+    workq_submit(compile_queue(), &job->w, compile_work);
+
+    psrc = memdup(&src, sizeof(src_key));
     if (psrc != NULL) {
-      /* One of the refs is for the cache */
       res->refcnt++;
-      /* If this fails, it will free the key and remove a ref from the
-         kernel. */
       cache_add(ctx->kernel_cache, psrc, res);
     } else {
-      strb_clear(&src);
+      strb_clear(&src.src);
     }
     return res;
 }
 
+static int cuda_waitkernel(gpukernel *k, char **err_str) {
+  int err;
+
+  ASSERT_KER(k);
+  err = kernel_resolve(k);
+  if (err != GA_NO_ERROR && err_str != NULL)
+    compile_error_str(&k->job->src.src, &k->job->log, err_str);
+  return err;
+}
+
 static void cuda_retainkernel(gpukernel *k) {
   ASSERT_KER(k);
-  k->refcnt++;
+  ga_atomic_inc(&k->refcnt);
 }
 
 static void cuda_freekernel(gpukernel *k) {
@@ -1475,6 +2890,7 @@ static int cuda_callkernel(gpukernel *k, unsigned int n,
     unsigned int i;
 
     ASSERT_KER(k);
+    GA_CHECK(kernel_resolve(k));
     cuda_enter(ctx);
 
     if (args == NULL)
@@ -1521,7 +2937,9 @@ static int cuda_callkernel(gpukernel *k, unsigned int n,
 }
 
 static int cuda_kernelbin(gpukernel *k, size_t *sz, void **obj) {
-  void *res = malloc(k->bin_sz);
+  void *res;
+  GA_CHECK(kernel_resolve(k));
+  res = malloc(k->bin_sz);
   if (res == NULL)
     return error_sys(k->ctx->err, "malloc");
   memcpy(res, k->bin, k->bin_sz);
@@ -1539,6 +2957,8 @@ static int cuda_sync(gpudata *b) {
   if (ctx->flags & GA_CTX_SINGLE_STREAM) {
     CUDA_EXIT_ON_ERROR(ctx, cuStreamSynchronize(ctx->s));
   } else {
+    if (ISSET(b->flags, CUDA_STALE_EVENTS))
+      GA_CHECK(sync_events(b));
     CUDA_EXIT_ON_ERROR(ctx, cuEventSynchronize(b->wev));
     CUDA_EXIT_ON_ERROR(ctx, cuEventSynchronize(b->rev));
   }
@@ -1648,6 +3068,30 @@ static int cuda_property(gpucontext *c, gpudata *buf, gpukernel *k, int prop_id,
     *((size_t *)res) = largest_size(ctx);
     return GA_NO_ERROR;
 
+  case GA_CTX_PROP_MEMSTATS:
+    cuda_enter(ctx);
+    alloc_lock(ctx);
+    reclaim_pending(ctx, 0);
+    suballoc_stats(ctx->allocator, (gpucontext_memstats *)res);
+    alloc_unlock(ctx);
+    cuda_exit(ctx);
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_ALLOC_POLICY:
+    alloc_lock(ctx);
+    suballoc_get_policy(ctx->allocator, (gpucontext_alloc_policy *)res);
+    alloc_unlock(ctx);
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_CACHESTATS:
+    {
+      gpucontext_cachestats *st = (gpucontext_cachestats *)res;
+      cache_get_stats(ctx->kernel_cache, &st->kernel);
+      cache_get_stats(ctx->disk_cache, &st->disk);
+      cache_get_stats(ctx->extcopy_cache, &st->extcopy);
+    }
+    return GA_NO_ERROR;
+
   case GA_CTX_PROP_MAXLSIZE:
     GETPROP(CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_X, size_t);
     return GA_NO_ERROR;
@@ -1730,12 +3174,28 @@ static int cuda_property(gpucontext *c, gpudata *buf, gpukernel *k, int prop_id,
     *((size_t *)res) = buf->sz;
     return GA_NO_ERROR;
 
+  case GA_BUFFER_PROP_HOSTPOINTER:
+    if (!(buf->flags & CUDA_MAPPED_PTR))
+      return error_set(ctx->err, GA_INVALID_ERROR,
+                       "Buffer is not mapped in host memory");
+    *((void **)res) = (void *)buf->ptr;
+    return GA_NO_ERROR;
+
+  case GA_BUFFER_PROP_ALIGN:
+    /* The lowest bit set in the address */
+    if (buf->ptr == 0 || (buf->ptr & -buf->ptr) > 256)
+      *((size_t *)res) = 256;
+    else
+      *((size_t *)res) = (size_t)(buf->ptr & -buf->ptr);
+    return GA_NO_ERROR;
+
   case GA_BUFFER_PROP_CTX:
   case GA_KERNEL_PROP_CTX:
     *((gpucontext **)res) = (gpucontext *)ctx;
     return GA_NO_ERROR;
 
   case GA_KERNEL_PROP_MAXLSIZE:
+    GA_CHECK(kernel_resolve(k));
     cuda_enter(ctx);
     CUDA_EXIT_ON_ERROR(ctx, cuFuncGetAttribute(&i, CU_FUNC_ATTRIBUTE_MAX_THREADS_PER_BLOCK, k->k));
     cuda_exit(ctx);
@@ -1794,4 +3254,13 @@ const gpuarray_buffer_ops cuda_ops = {cuda_get_platform_count,
                                       cuda_sync,
                                       cuda_transfer,
                                       cuda_property,
-                                      cuda_error};
+                                      cuda_error,
+                                      cuda_trim_cache,
+                                      cuda_set_alloc_policy,
+                                      cuda_read_async,
+                                      cuda_write_async,
+                                      cuda_event_wait,
+                                      cuda_event_query,
+                                      cuda_event_release,
+                                      cuda_newkernel_async,
+                                      cuda_waitkernel};
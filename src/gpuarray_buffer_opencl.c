@@ -8,12 +8,14 @@
 #include "gpuarray/buffer_blas.h"
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 
 #include "loaders/libclblas.h"
 #include "loaders/libclblast.h"
+#include "util/xxhash.h"
 
 #ifdef _MSC_VER
 #define strdup _strdup
@@ -35,6 +37,92 @@ static gpukernel *cl_newkernel(gpucontext *ctx, unsigned int count,
 static const char CL_CONTEXT_PREAMBLE[] =
 "#define GA_WARP_SIZE %lu\n";  // to be filled by cl_make_ctx()
 
+/*
+ * Key for the disk cache of program binaries.  The build options are
+ * not part of it since we always build with the defaults, the version
+ * has to change if that changes.
+ */
+typedef struct _kernel_key {
+  uint8_t version;
+  uint8_t debug;
+  uint8_t reserved[6];
+  char bin_id[64];
+  char dev_name[64];
+  strb src;
+} kernel_key;
+
+/* Size of the kernel_key that we can memcopy to duplicate */
+#define KERNEL_KEY_MM (sizeof(kernel_key) - sizeof(strb))
+
+static void key_free(cache_key_t _k) {
+  kernel_key *k = (kernel_key *)_k;
+  strb_clear(&k->src);
+  free(k);
+}
+
+static int strb_eq(strb *k1, strb *k2) {
+  return (k1->l == k2->l &&
+          memcmp(k1->s, k2->s, k1->l) == 0);
+}
+
+static uint32_t strb_hash(strb *k) {
+  return XXH32(k->s, k->l, 42);
+}
+
+static int key_eq(kernel_key *k1, kernel_key *k2) {
+  return (memcmp(k1, k2, KERNEL_KEY_MM) == 0 &&
+          strb_eq(&k1->src, &k2->src));
+}
+
+static int key_hash(kernel_key *k) {
+  XXH32_state_t state;
+  XXH32_reset(&state, 42);
+  XXH32_update(&state, k, KERNEL_KEY_MM);
+  XXH32_update(&state, k->src.s, k->src.l);
+  return XXH32_digest(&state);
+}
+
+static int key_write(strb *res, kernel_key *k) {
+  strb_appendn(res, (const char *)k, KERNEL_KEY_MM);
+  strb_appendb(res, &k->src);
+  return strb_error(res);
+}
+
+static kernel_key *key_read(const strb *b) {
+  kernel_key *k;
+  if (b->l < KERNEL_KEY_MM) return NULL;
+  k = calloc(1, sizeof(*k));
+  if (k == NULL) return NULL;
+  memcpy(k, b->s, KERNEL_KEY_MM);
+  if (k->version != 0) {
+    free(k);
+    return NULL;
+  }
+  if (strb_ensure(&k->src, b->l - KERNEL_KEY_MM) != 0) {
+    strb_clear(&k->src);
+    free(k);
+    return NULL;
+  }
+  strb_appendn(&k->src, b->s + KERNEL_KEY_MM, b->l - KERNEL_KEY_MM);
+  return k;
+}
+
+static int kernel_write(strb *res, strb *bin) {
+  strb_appendb(res, bin);
+  return strb_error(res);
+}
+
+static strb *kernel_read(const strb *b) {
+  strb *res = strb_alloc(b->l);
+  if (res != NULL)
+    strb_appendb(res, b);
+  return res;
+}
+
+static void program_free(cl_program p) {
+  clReleaseProgram(p);
+}
+
 static int setup_done = 0;
 static int setup_lib(error *e) {
   if (setup_done)
@@ -113,6 +201,7 @@ cl_ctx *cl_make_ctx(cl_context ctx, int flags) {
   char vendor[32];
   char driver_version[64];
   cl_uint vendor_id;
+  char *cache_path;
   cl_int err;
   size_t len;
   int64_t v = 0;
@@ -158,6 +247,8 @@ cl_ctx *cl_make_ctx(cl_context ctx, int flags) {
   res->exts = NULL;
   res->blas_handle = NULL;
   res->preamble = NULL;
+  res->kernel_cache = NULL;
+  res->disk_cache = NULL;
   res->q = clCreateCommandQueue(
     ctx, id,
     ISSET(flags, GA_CTX_SINGLE_STREAM) ? 0 : qprop&CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
@@ -181,6 +272,22 @@ cl_ctx *cl_make_ctx(cl_context ctx, int flags) {
     goto fail;
   res->refcnt--; /* Prevent ref loop */
 
+  res->kernel_cache = cache_tinylfu(256,
+                                    (cache_eq_fn)strb_eq,
+                                    (cache_hash_fn)strb_hash,
+                                    (cache_freek_fn)strb_free,
+                                    (cache_freev_fn)program_free, res->err);
+  if (res->kernel_cache == NULL)
+    goto fail;
+
+  cache_path = getenv("GPUARRAY_CACHE_PATH");
+  if (cache_path != NULL) {
+    res->disk_cache = cl_disk_cache(cache_path, res->err);
+    if (res->disk_cache == NULL)
+      fprintf(stderr, "Error initializing disk cache, disabling: %s\n",
+              res->err->msg);
+  }
+
   /* Create per-context OpenCL preamble */
 
   // Create a dummy kernel and check GA_KERNEL_PROP_PREFLSIZE
@@ -223,6 +330,10 @@ static void cl_free_ctx(cl_ctx *ctx) {
       ctx->refcnt = 2; /* Avoid recursive release */
       cl_release(ctx->errbuf);
     }
+    if (ctx->kernel_cache != NULL)
+      cache_destroy(ctx->kernel_cache);
+    if (ctx->disk_cache != NULL)
+      cache_destroy(ctx->disk_cache);
     clReleaseCommandQueue(ctx->q);
     clReleaseContext(ctx->ctx);
     if (ctx->preamble != NULL)
@@ -319,6 +430,8 @@ static const char CL_PREAMBLE[] =
   "#define ga_half half\n"
   "#define ga_size ulong\n"
   "#define ga_ssize long\n"
+  "#define ga_uint2 uint2\n"
+  "#define ga_uint4 uint4\n"
   "#define load_half(p) vload_half(0, p)\n"
   "#define store_half(p, v) vstore_half_rtn(v, 0, p)\n"
   "#define GA_DECL_SHARED_PARAM(type, name) , __local type *name\n"
@@ -694,6 +807,137 @@ static int cl_write(gpudata *dst, size_t dstoff, const void *src, size_t sz) {
   return GA_NO_ERROR;
 }
 
+/*
+ * Asynchronous transfers are the non-blocking versions of the above.
+ * The event of the transfer becomes the event of the buffer so that
+ * later operations on it wait for the transfer.
+ */
+static gpuevent *new_gpuevent(cl_ctx *ctx) {
+  gpuevent *res = malloc(sizeof(*res));
+  if (res == NULL) {
+    error_sys(ctx->err, "malloc");
+    return NULL;
+  }
+  res->ctx = ctx;
+  res->ev = NULL;
+  ctx->refcnt++;
+  TAG_EV(res);
+  return res;
+}
+
+static void cl_event_release(gpuevent *ev);
+
+static int cl_read_async(void *dst, gpudata *src, size_t srcoff, size_t sz,
+                         gpuevent **ev) {
+  cl_ctx *ctx = src->ctx;
+  gpuevent *res;
+  cl_event evw[1];
+  cl_event *evl = NULL;
+  cl_uint num_ev = 0;
+  cl_int err;
+
+  ASSERT_BUF(src);
+  ASSERT_CTX(ctx);
+
+  res = new_gpuevent(ctx);
+  if (res == NULL)
+    return ctx->err->code;
+
+  if (sz != 0) {
+    if (src->ev != NULL) {
+      evw[0] = src->ev;
+      evl = evw;
+      num_ev = 1;
+    }
+
+    err = clEnqueueReadBuffer(ctx->q, src->buf, CL_FALSE, srcoff, sz,
+                              dst, num_ev, evl, &res->ev);
+    if (err != CL_SUCCESS) {
+      cl_event_release(res);
+      return error_cl(ctx->err, "clEnqueueReadBuffer", err);
+    }
+
+    if (src->ev != NULL) clReleaseEvent(src->ev);
+    src->ev = res->ev;
+    clRetainEvent(src->ev);
+  }
+  *ev = res;
+  return GA_NO_ERROR;
+}
+
+static int cl_write_async(gpudata *dst, size_t dstoff, const void *src,
+                          size_t sz, gpuevent **ev) {
+  cl_ctx *ctx = dst->ctx;
+  gpuevent *res;
+  cl_event evw[1];
+  cl_event *evl = NULL;
+  cl_uint num_ev = 0;
+  cl_int err;
+
+  ASSERT_BUF(dst);
+  ASSERT_CTX(ctx);
+
+  res = new_gpuevent(ctx);
+  if (res == NULL)
+    return ctx->err->code;
+
+  if (sz != 0) {
+    if (dst->ev != NULL) {
+      evw[0] = dst->ev;
+      evl = evw;
+      num_ev = 1;
+    }
+
+    err = clEnqueueWriteBuffer(ctx->q, dst->buf, CL_FALSE, dstoff, sz,
+                               src, num_ev, evl, &res->ev);
+    if (err != CL_SUCCESS) {
+      cl_event_release(res);
+      return error_cl(ctx->err, "clEnqueueWriteBuffer", err);
+    }
+
+    if (dst->ev != NULL) clReleaseEvent(dst->ev);
+    dst->ev = res->ev;
+    clRetainEvent(dst->ev);
+  }
+  *ev = res;
+  return GA_NO_ERROR;
+}
+
+static int cl_event_wait(gpuevent *ev) {
+  ASSERT_EV(ev);
+  if (ev->ev != NULL)
+    CL_CHECK(ev->ctx->err, clWaitForEvents(1, &ev->ev));
+  return GA_NO_ERROR;
+}
+
+static int cl_event_query(gpuevent *ev, int *done) {
+  cl_int status = CL_COMPLETE;
+
+  ASSERT_EV(ev);
+  if (ev->ev != NULL)
+    CL_CHECK(ev->ctx->err,
+             clGetEventInfo(ev->ev, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                            sizeof(status), &status, NULL));
+  /* Negative values are errors */
+  if (status < 0)
+    return error_cl(ev->ctx->err, "transfer", status);
+  *done = (status == CL_COMPLETE);
+  return GA_NO_ERROR;
+}
+
+static void cl_event_release(gpuevent *ev) {
+  cl_ctx *ctx = ev->ctx;
+
+  ASSERT_EV(ev);
+  if (ev->ev != NULL) {
+    clWaitForEvents(1, &ev->ev);
+    clReleaseEvent(ev->ev);
+  }
+  CLEAR(ev);
+  free(ev);
+  cl_free_ctx(ctx);
+}
+
 static int cl_memset(gpudata *dst, size_t offset, int data) {
   char local_kern[256];
   cl_ctx *ctx = dst->ctx;
@@ -822,6 +1066,235 @@ static int cl_check_extensions(const char **preamble, unsigned int *count,
   return GA_NO_ERROR;
 }
 
+/* Fill *err_str with the build log and the source (if any) */
+static void build_log(cl_program p, cl_device_id dev, unsigned int count,
+                      const char **strings, size_t *lengths,
+                      char **err_str) {
+  strb debug_msg = STRB_STATIC_INIT;
+  size_t log_size;
+
+  *err_str = NULL;  // Fallback, in case there's an error
+
+  // We're substituting debug_msg for a string with this first line:
+  strb_appends(&debug_msg, "Program build failure ::\n");
+
+  // Determine the size of the log
+  clGetProgramBuildInfo(p, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+
+  if (strb_ensure(&debug_msg, log_size)!=-1 && log_size>=1) { // Checks strb has enough space
+    // Get the log directly into the debug_msg
+    clGetProgramBuildInfo(p, dev, CL_PROGRAM_BUILD_LOG, log_size, debug_msg.s+debug_msg.l, NULL);
+    debug_msg.l += (log_size-1); // Back off to before final '\0'
+  }
+
+  // Not clear what to do with binary 'source' - the log will have to suffice
+  if (count != 0)
+    gpukernel_source_with_line_numbers(count, strings, lengths, &debug_msg);
+
+  strb_append0(&debug_msg); // Make sure a final '\0' is present
+
+  if (!strb_error(&debug_msg)) { // Make sure the strb is in a valid state
+    *err_str = memdup(debug_msg.s, debug_msg.l);
+    // If there's a memory alloc error, fall-through : announcing a compile error is more important
+  }
+  strb_clear(&debug_msg);
+  // *err_str will be free()d by the caller (see docs in kernel.h)
+}
+
+/*
+ * The platform and device strings are copied up to their NUL so that
+ * the garbage that may follow doesn't end up in the key.
+ */
+static void key_init(kernel_key *k, const char *bin_id, const char *dev_name,
+                     const strb *src) {
+  memset(k, 0, sizeof(*k));
+  k->version = 0;
+#ifdef DEBUG
+  k->debug = 1;
+#endif
+  strncpy(k->bin_id, bin_id, sizeof(k->bin_id) - 1);
+  strncpy(k->dev_name, dev_name, sizeof(k->dev_name) - 1);
+  memcpy(&k->src, src, sizeof(strb));
+}
+
+/*
+ * A device name that doesn't fit in the key could be mistaken for
+ * another so those devices don't use the disk cache.
+ */
+static int make_key(cl_ctx *ctx, cl_device_id dev, strb *src, kernel_key *k,
+                    error *e) {
+  char *dev_name;
+  size_t sz;
+  cl_int err;
+
+  CL_CHECK(e, clGetDeviceInfo(dev, CL_DEVICE_NAME, 0, NULL, &sz));
+  if (sz > sizeof(k->dev_name))
+    return error_set(e, GA_UNSUPPORTED_ERROR,
+                     "Device name too long for the disk cache");
+  dev_name = malloc(sz);
+  if (dev_name == NULL)
+    return error_sys(e, "malloc");
+  err = clGetDeviceInfo(dev, CL_DEVICE_NAME, sz, dev_name, NULL);
+  if (err != CL_SUCCESS) {
+    free(dev_name);
+    return error_cl(e, "clGetDeviceInfo", err);
+  }
+  key_init(k, ctx->bin_id, dev_name, src);
+  free(dev_name);
+  return GA_NO_ERROR;
+}
+
+/*
+ * Add a binary to the disk cache under a copy of `k`.  This takes
+ * ownership of `bin`, even on failure.
+ */
+static int disk_add(cache *c, const kernel_key *k, strb *bin, error *e) {
+  kernel_key *pk;
+
+  pk = calloc(sizeof(kernel_key), 1);
+  if (pk == NULL) {
+    strb_free(bin);
+    return error_sys(e, "calloc");
+  }
+  memcpy(pk, k, KERNEL_KEY_MM);
+  strb_appendb(&pk->src, &k->src);
+  if (strb_error(&pk->src)) {
+    key_free((cache_key_t)pk);
+    strb_free(bin);
+    return error_set(e, GA_MEMORY_ERROR,
+                     "Could not copy program source for the disk cache");
+  }
+  /* This takes ownership of pk and bin even on failure */
+  if (cache_add(c, pk, bin))
+    return error_set(e, GA_MISC_ERROR,
+                     "Could not add program to the disk cache");
+  return GA_NO_ERROR;
+}
+
+/*
+ * Save the binary of a program in the disk cache.  Errors are
+ * reported through `e` but the program is still usable.
+ */
+static int save_binary(cl_ctx *ctx, cl_program p, kernel_key *k, error *e) {
+  strb *cbin;
+  size_t sz;
+  cl_int err;
+
+  err = clGetProgramInfo(p, CL_PROGRAM_BINARY_SIZES, sizeof(sz), &sz, NULL);
+  if (err != CL_SUCCESS)
+    return error_cl(e, "clGetProgramInfo", err);
+  if (sz == 0)
+    return error_set(e, GA_DEVSUP_ERROR, "Program has no binary to cache");
+  cbin = strb_alloc(sz);
+  if (cbin == NULL)
+    return error_sys(e, "strb_alloc");
+  err = clGetProgramInfo(p, CL_PROGRAM_BINARIES, sizeof(cbin->s), &cbin->s,
+                         NULL);
+  if (err != CL_SUCCESS) {
+    strb_free(cbin);
+    return error_cl(e, "clGetProgramInfo", err);
+  }
+  cbin->l = sz;
+  return disk_add(ctx->disk_cache, k, cbin, e);
+}
+
+cache *cl_disk_cache(const char *path, error *e) {
+  cache *mem, *res;
+
+  mem = cache_lru(64, 8,
+                  (cache_eq_fn)key_eq,
+                  (cache_hash_fn)key_hash,
+                  (cache_freek_fn)key_free,
+                  (cache_freev_fn)strb_free, e);
+  if (mem == NULL)
+    return NULL;
+  res = cache_disk_env(path, mem,
+                       (kwrite_fn)key_write,
+                       (vwrite_fn)kernel_write,
+                       (kread_fn)key_read,
+                       (vread_fn)kernel_read, e);
+  if (res == NULL)
+    cache_destroy(mem);
+  return res;
+}
+
+int cl_disk_store(cache *c, const char *bin_id, const char *dev_name,
+                  const strb *src, const strb *bin, error *e) {
+  kernel_key k;
+  strb *cbin;
+
+  cbin = strb_alloc(bin->l);
+  if (cbin == NULL)
+    return error_sys(e, "strb_alloc");
+  strb_appendb(cbin, bin);
+  key_init(&k, bin_id, dev_name, src);
+  return disk_add(c, &k, cbin, e);
+}
+
+strb *cl_disk_load(cache *c, const char *bin_id, const char *dev_name,
+                   const strb *src) {
+  kernel_key k;
+
+  key_init(&k, bin_id, dev_name, src);
+  return cache_get(c, &k);
+}
+
+/*
+ * Get a built program for the source, from the disk cache if possible.
+ *
+ * The disk cache is only an optimization so its errors go to `derr`
+ * and leave ctx->err alone.
+ */
+static cl_program build_program(cl_ctx *ctx, cl_device_id dev, strb *src,
+                                char **err_str) {
+  kernel_key k;
+  error derr;
+  strb *cbin;
+  cl_program p;
+  cl_int err, status;
+  int use_disk = 0;
+
+  if (ctx->disk_cache != NULL &&
+      make_key(ctx, dev, src, &k, &derr) == GA_NO_ERROR) {
+    use_disk = 1;
+    cbin = cache_get(ctx->disk_cache, &k);
+    if (cbin != NULL) {
+      p = clCreateProgramWithBinary(ctx->ctx, 1, &dev, &cbin->l,
+                                    (const unsigned char **)&cbin->s,
+                                    &status, &err);
+      if (err == CL_SUCCESS && status == CL_SUCCESS &&
+          clBuildProgram(p, 0, NULL, NULL, NULL, NULL) == CL_SUCCESS)
+        return p;
+      /* The driver doesn't want it anymore, build from source and
+         replace it */
+      if (err == CL_SUCCESS)
+        clReleaseProgram(p);
+    }
+  }
+
+  p = clCreateProgramWithSource(ctx->ctx, 1, (const char **)&src->s, &src->l,
+                                &err);
+  if (err != CL_SUCCESS) {
+    error_cl(ctx->err, "clCreateProgramWithSource", err);
+    return NULL;
+  }
+
+  err = clBuildProgram(p, 0, NULL, NULL, NULL, NULL);
+  if (err != CL_SUCCESS) {
+    if (err == CL_BUILD_PROGRAM_FAILURE && err_str != NULL)
+      build_log(p, dev, 1, (const char **)&src->s, &src->l, err_str);
+    clReleaseProgram(p);
+    error_cl(ctx->err, "clBuildProgram", err);
+    return NULL;
+  }
+
+  /* A program that can't be cached is still good to use */
+  if (use_disk)
+    (void)save_binary(ctx, p, &k, &derr);
+
+  return p;
+}
+
 static gpukernel *cl_newkernel(gpucontext *c, unsigned int count,
                                const char **strings, const size_t *lengths,
                                const char *fname, unsigned int argcount,
@@ -833,12 +1306,11 @@ static gpukernel *cl_newkernel(gpucontext *c, unsigned int count,
   // Sync this table size with the number of flags that can add stuff
   // at the beginning
   const char *preamble[5];
-  size_t *newl = NULL;
-  const char **news = NULL;
+  strb src = STRB_STATIC_INIT;
+  strb *psrc;
   cl_int err;
+  unsigned int i;
   unsigned int n = 0;
-  strb debug_msg = STRB_STATIC_INIT;
-  size_t log_size;
 
   ASSERT_CTX(ctx);
 
@@ -866,95 +1338,61 @@ static gpukernel *cl_newkernel(gpucontext *c, unsigned int count,
       error_cl(ctx->err, "clCreateProgramWithBinary", err);
       return NULL;
     }
+    err = clBuildProgram(p, 0, NULL, NULL, NULL, NULL);
+    if (err != CL_SUCCESS) {
+      if (err == CL_BUILD_PROGRAM_FAILURE && err_str != NULL)
+        build_log(p, dev, 0, NULL, NULL, err_str);
+      clReleaseProgram(p);
+      error_cl(ctx->err, "clBuildProgram", err);
+      return NULL;
+    }
   } else {
 
     if (cl_check_extensions(preamble, &n, flags, ctx))
       return NULL;
 
-    if (n != 0) {
-      news = calloc(count+n, sizeof(const char *));
-      if (news == NULL) {
-        error_sys(ctx->err, "calloc");
-        return NULL;
-      }
-      memcpy(news, preamble, n*sizeof(const char *));
-      memcpy(news+n, strings, count*sizeof(const char *));
-      if (lengths == NULL) {
-        newl = NULL;
-      } else {
-        newl = calloc(count+n, sizeof(size_t));
-        if (newl == NULL) {
-          free(news);
-          error_sys(ctx->err, "calloc");
-          return NULL;
-        }
-        memcpy(newl+n, lengths, count*sizeof(size_t));
-      }
-    } else {
-      news = strings;
-      newl = (size_t *)lengths;
+    for (i = 0; i < n; i++)
+      strb_appends(&src, preamble[i]);
+    for (i = 0; i < count; i++) {
+      if (lengths == NULL || lengths[i] == 0)
+        strb_appends(&src, strings[i]);
+      else
+        strb_appendn(&src, strings[i], lengths[i]);
     }
-
-    p = clCreateProgramWithSource(ctx->ctx, count+n, news, newl, &err);
-    if (err != CL_SUCCESS) {
-      if (n != 0) {
-        free(news);
-        free(newl);
-      }
-      error_cl(ctx->err, "clCreateProgramWithSource", err);
+    if (strb_error(&src)) {
+      error_sys(ctx->err, "strb");
+      strb_clear(&src);
       return NULL;
     }
-  }
-
-  err = clBuildProgram(p, 0, NULL, NULL, NULL, NULL);
-  if (err != CL_SUCCESS) {
-    if (err == CL_BUILD_PROGRAM_FAILURE && err_str != NULL) {
-      *err_str = NULL;  // Fallback, in case there's an error
 
-      // We're substituting debug_msg for a string with this first line:
-      strb_appends(&debug_msg, "Program build failure ::\n");
-
-      // Determine the size of the log
-      clGetProgramBuildInfo(p, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-
-      if (strb_ensure(&debug_msg, log_size)!=-1 && log_size>=1) { // Checks strb has enough space
-        // Get the log directly into the debug_msg
-        clGetProgramBuildInfo(p, dev, CL_PROGRAM_BUILD_LOG, log_size, debug_msg.s+debug_msg.l, NULL);
-        debug_msg.l += (log_size-1); // Back off to before final '\0'
+    /* The cache holds programs rather than kernels since the kernel
+       objects keep the arguments. */
+    p = (cl_program)cache_get(ctx->kernel_cache, &src);
+    if (p != NULL) {
+      clRetainProgram(p);
+      strb_clear(&src);
+    } else {
+      p = build_program(ctx, dev, &src, err_str);
+      if (p == NULL) {
+        strb_clear(&src);
+        return NULL;
       }
-
-      if (flags & GA_USE_BINARY) {
-        // Not clear what to do with binary 'source' - the log will have to suffice
+      psrc = memdup(&src, sizeof(strb));
+      if (psrc != NULL) {
+        /* One of the refs is for the cache */
+        clRetainProgram(p);
+        /* If this fails, it will free the key and release the
+           program. */
+        cache_add(ctx->kernel_cache, psrc, p);
       } else {
-        gpukernel_source_with_line_numbers(count+n, news, newl, &debug_msg);
-      }
-
-      strb_append0(&debug_msg); // Make sure a final '\0' is present
-
-      if (!strb_error(&debug_msg)) { // Make sure the strb is in a valid state
-        *err_str = memdup(debug_msg.s, debug_msg.l);
-        // If there's a memory alloc error, fall-through : announcing a compile error is more important
+        strb_clear(&src);
       }
-      strb_clear(&debug_msg);
-      // *err_str will be free()d by the caller (see docs in kernel.h)
-    }
-
-    clReleaseProgram(p);
-    if (n != 0) {
-      free(news);
-      free(newl);
     }
-    error_cl(ctx->err, "clBuildProgram", err);
-    return NULL;
-  }
-
-  if (n != 0) {
-    free(news);
-    free(newl);
   }
 
   res = malloc(sizeof(*res));
   if (res == NULL) {
+    clReleaseProgram(p);
     error_sys(ctx->err, "malloc");
     return NULL;
   }
@@ -1299,6 +1737,22 @@ static int cl_property(gpucontext *c, gpudata *buf, gpukernel *k, int prop_id,
     *((size_t *)res) = sz;
     return GA_NO_ERROR;
 
+  case GA_CTX_PROP_MEMSTATS:
+    /* OpenCL does its own memory management. */
+    return error_set(ctx->err, GA_DEVSUP_ERROR, "Can't get memory statistics on OpenCL");
+
+  case GA_CTX_PROP_ALLOC_POLICY:
+    return error_set(ctx->err, GA_DEVSUP_ERROR, "There is no allocation cache on OpenCL");
+
+  case GA_CTX_PROP_CACHESTATS:
+    {
+      gpucontext_cachestats *st = (gpucontext_cachestats *)res;
+      cache_get_stats(ctx->kernel_cache, &st->kernel);
+      cache_get_stats(ctx->disk_cache, &st->disk);
+      cache_get_stats(ctx->extcopy_cache, &st->extcopy);
+    }
+    return GA_NO_ERROR;
+
   case GA_CTX_PROP_NATIVE_FLOAT16:
     *((int *)res) = 0;
     return GA_NO_ERROR;
@@ -1358,6 +1812,20 @@ static int cl_property(gpucontext *c, gpudata *buf, gpukernel *k, int prop_id,
     *((size_t *)res) = sz;
     return GA_NO_ERROR;
 
+  case GA_BUFFER_PROP_HOSTPOINTER:
+    /* The memory is only reachable through clEnqueueMapBuffer() */
+    return error_set(ctx->err, GA_DEVSUP_ERROR, "Can't get a host pointer on OpenCL");
+
+  case GA_BUFFER_PROP_ALIGN:
+    /* Buffers and sub-buffers start on this (given in bits) */
+    CL_CHECK(ctx->err, clGetContextInfo(ctx->ctx, CL_CONTEXT_DEVICES,
+                                        sizeof(id), &id, NULL));
+    CL_CHECK(ctx->err, clGetDeviceInfo(id, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                                       sizeof(ui), &ui, NULL));
+    ui /= 8;
+    *((size_t *)res) = (ui == 0 || ui > 256) ? 256 : ui;
+    return GA_NO_ERROR;
+
   /* GA_BUFFER_PROP_CTX is not ordered to simplify code */
   case GA_BUFFER_PROP_CTX:
   case GA_KERNEL_PROP_CTX:
@@ -1405,6 +1873,19 @@ static const char *cl_error(gpucontext *c) {
   }
 }
 
+static int cl_trim_cache(gpucontext *c) {
+  /* There is no allocation cache for OpenCL */
+  ASSERT_CTX((cl_ctx *)c);
+  return GA_NO_ERROR;
+}
+
+static int cl_set_alloc_policy(gpucontext *c,
+                               const gpucontext_alloc_policy *policy) {
+  cl_ctx *ctx = (cl_ctx *)c;
+  ASSERT_CTX(ctx);
+  return error_set(ctx->err, GA_DEVSUP_ERROR, "There is no allocation cache on OpenCL");
+}
+
 const gpuarray_buffer_ops opencl_ops = {cl_get_platform_count,
                                         cl_get_device_count,
                                         cl_init,
@@ -1426,4 +1907,13 @@ const gpuarray_buffer_ops opencl_ops = {cl_get_platform_count,
                                         cl_sync,
                                         cl_transfer,
                                         cl_property,
-                                        cl_error};
+                                        cl_error,
+                                        cl_trim_cache,
+                                        cl_set_alloc_policy,
+                                        cl_read_async,
+                                        cl_write_async,
+                                        cl_event_wait,
+                                        cl_event_query,
+                                        cl_event_release,
+                                        NULL,
+                                        NULL};
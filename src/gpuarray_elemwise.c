@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <ctype.h>
 
 #include <gpuarray/elemwise.h>
 #include <gpuarray/array.h>
@@ -8,12 +9,20 @@
 
 #include "private.h"
 #include "util/strb.h"
+#include "util/thread.h"
+
+extern const gpuarray_buffer_ops opencl_ops;
 
 struct _GpuElemwise {
+  gpucontext *ctx; /* Context for the kernels */
   const char *expr; /* Expression code (to be able to build kernels on-demand) */
   const char *preamble; /* Preamble code */
   gpuelemwise_arg *args; /* Argument descriptors */
+  /* The kernels are built on first use.  Instances with the same
+     expression and arguments share them through the kernel cache of
+     the context since they generate the same source. */
   GpuKernel k_contig; /* Contiguous kernel */
+  GpuKernel k_contig_vec; /* Vectorized contiguous kernel */
   GpuKernel *k_basic; /* Normal basic kernels */
   GpuKernel *k_basic_32; /* 32-bit address basic kernels */
   size_t *dims; /* Preallocated shape buffer for dimension collapsing */
@@ -21,12 +30,40 @@ struct _GpuElemwise {
   unsigned int nd; /* Current maximum number of dimensions allocated */
   unsigned int n; /* Number of arguments */
   unsigned int narray; /* Number of array arguments */
+  unsigned int vec; /* Elements per thread for k_contig_vec (0 if not usable) */
   int flags; /* Flags for the operation (none at the moment */
+  int kflags; /* Kernel flags for the types of fused intermediates */
+  /* Held by calls and plan creation since they build kernels and use
+     the shape buffers above */
+  ga_mutex lock;
+};
+
+struct _GpuElemwisePlan {
+  GpuElemwise *ge; /* Operation the plan is for */
+  GpuKernel k; /* Kernel chosen for the bound geometry (own reference) */
+  void **kargs; /* Kernel arguments, the arguments of each call are set in it */
+  unsigned int *pos; /* Index in kargs of each argument */
+  size_t n; /* Number of elements */
+  size_t *dims; /* Collapsed dimensions (basic kernels) */
+  ssize_t *strides; /* Collapsed strides, nd per array (basic kernels) */
+  size_t gs; /* Launch configuration */
+  size_t ls;
+  unsigned int nd; /* Number of collapsed dimensions (0 if contiguous) */
+  unsigned int vec; /* Elements per thread if vectorized, 0 otherwise */
+  int call32; /* The kernel uses 32-bit addressing */
+  int flags; /* Call flags the plan was made with */
 };
 
 #define GEN_ADDR32      0x1
 #define GEN_CONVERT_F16 0x2
 
+/* Smallest size for which the vectorized contiguous kernel is used.
+   Below that the launch dominates and it isn't worth compiling. */
+#define CONTIG_VEC_MIN 16384
+
+/* Kernel arguments of a call are on the stack up to this many */
+#define KARGS_STACK 64
+
 /* This makes sure we have the same value for those flags since we use some shortcuts */
 STATIC_ASSERT(GEN_CONVERT_F16 == GE_CONVERT_F16, same_flags_value_elem1);
 
@@ -37,6 +74,20 @@ static inline int k_initialized(GpuKernel *k) {
   return k->k != NULL;
 }
 
+/* Wait for a kernel from gen_elemwise_*_kernel() to be compiled */
+static int wait_kernel(GpuKernel *k) {
+#ifdef DEBUG
+  char *errstr = NULL;
+  int err = GpuKernel_wait(k, &errstr);
+  if (errstr != NULL)
+    fprintf(stderr, "%s\n", errstr);
+  free(errstr);
+  return err;
+#else
+  return GpuKernel_wait(k, NULL);
+#endif
+}
+
 static inline const char *ctype(int typecode) {
   return gpuarray_get_type(typecode)->cluda_name;
 }
@@ -121,13 +172,13 @@ static int ge_grow(GpuElemwise *ge, unsigned int nd) {
 }
 
 static int gen_elemwise_basic_kernel(GpuKernel *k, gpucontext *ctx,
-                                     char **err_str,
                                      const char *preamble,
                                      const char *expr,
                                      unsigned int nd, /* Number of dims */
                                      unsigned int n, /* Length of args */
                                      gpuelemwise_arg *args,
-                                     int gen_flags) {
+                                     int gen_flags,
+                                     int kflags) {
   strb sb = STRB_STATIC_INIT;
   unsigned int i, _i, j;
   int *ktypes;
@@ -141,7 +192,7 @@ static int gen_elemwise_basic_kernel(GpuKernel *k, gpucontext *ctx,
     ssize = "ga_int";
   }
 
-  flags |= gpuarray_type_flagsa(n, args);
+  flags |= gpuarray_type_flagsa(n, args) | kflags;
 
   p = 1 + nd;
   for (j = 0; j < n; j++) {
@@ -240,8 +291,8 @@ static int gen_elemwise_basic_kernel(GpuKernel *k, gpucontext *ctx,
     goto bail;
   }
 
-  res = GpuKernel_init(k, ctx, 1, (const char **)&sb.s, &sb.l, "elem",
-                       p, ktypes, flags, err_str);
+  res = GpuKernel_init_async(k, ctx, 1, (const char **)&sb.s, &sb.l, "elem",
+                             p, ktypes, flags);
  bail:
   free(ktypes);
   strb_clear(&sb);
@@ -363,11 +414,10 @@ static int check_basic(GpuElemwise *ge, void **args, int flags,
   return GA_NO_ERROR;
 }
 
-static int call_basic(GpuElemwise *ge, void **args, size_t n, unsigned int nd,
-                      size_t *dims, ssize_t **strs, int call32) {
+/* Get the basic kernel for `nd` dimensions, building it if needed */
+static int basic_kernel(GpuElemwise *ge, unsigned int nd, int call32,
+                        GpuKernel **_k) {
   GpuKernel *k;
-  size_t ls = 0, gs = 0;
-  unsigned int p = 0, i, j, l;
   int err;
 
   if (nd == 0) return GA_VALUE_ERROR;
@@ -378,57 +428,174 @@ static int call_basic(GpuElemwise *ge, void **args, size_t n, unsigned int nd,
     k = &ge->k_basic[nd-1];
 
   if (!k_initialized(k)) {
-    err = gen_elemwise_basic_kernel(k, GpuKernel_context(&ge->k_contig), NULL,
+    err = gen_elemwise_basic_kernel(k, ge->ctx,
                                     ge->preamble, ge->expr, nd, ge->n,
                                     ge->args, ((call32 ? GEN_ADDR32 : 0) |
-                                               (ge->flags & GE_CONVERT_F16)));
+                                               (ge->flags & GE_CONVERT_F16)),
+                                    ge->kflags);
     if (err != GA_NO_ERROR)
       return err;
+    err = wait_kernel(k);
+    if (err != GA_NO_ERROR) {
+      GpuKernel_clear(k);
+      return err;
+    }
   }
+  *_k = k;
+  return GA_NO_ERROR;
+}
 
-  err = GpuKernel_setarg(k, p++, &n);
-  if (err != GA_NO_ERROR) goto error;
+/*
+ * The kernels are shared with other instances through the cache so
+ * the arguments are passed to each call rather than set on them.
+ */
+static int call_basic(GpuElemwise *ge, void **args, size_t n, unsigned int nd,
+                      size_t *dims, ssize_t **strs, int call32) {
+  GpuKernel *k;
+  void *sargs[KARGS_STACK], **kargs = sargs;
+  size_t ls = 0, gs = 0;
+  unsigned int p = 0, i, j, l;
+  int err;
 
-  for (i = 0; i < nd; i++) {
-    err = GpuKernel_setarg(k, p++, &dims[i]);
-    if (err != GA_NO_ERROR) goto error;
+  err = basic_kernel(ge, nd, call32, &k);
+  if (err != GA_NO_ERROR)
+    return err;
+
+  p = 1 + nd + ge->n + ge->narray * (1 + nd);
+  if (p > KARGS_STACK) {
+    kargs = calloc(p, sizeof(void *));
+    if (kargs == NULL)
+      return GA_MEMORY_ERROR;
   }
 
+  p = 0;
+  kargs[p++] = &n;
+  for (i = 0; i < nd; i++)
+    kargs[p++] = &dims[i];
+
   /* l is the number of arrays to date */
   l = 0;
   for (j = 0; j < ge->n; j++) {
     if (is_array(ge->args[j])) {
       GpuArray *v = (GpuArray *)args[j];
-      err = GpuKernel_setarg(k, p++, v->data);
-      if (err != GA_NO_ERROR) goto error;
-      err = GpuKernel_setarg(k, p++, &v->offset);
-      if (err != GA_NO_ERROR) goto error;
-      for (i = 0; i < nd; i++) {
-        err = GpuKernel_setarg(k, p++, &strs[l][i]);
-        if (err != GA_NO_ERROR) goto error;
-      }
+      kargs[p++] = v->data;
+      kargs[p++] = &v->offset;
+      for (i = 0; i < nd; i++)
+        kargs[p++] = &strs[l][i];
       l++;
     } else {
-      err = GpuKernel_setarg(k, p++, args[j]);
-      if (err != GA_NO_ERROR) goto error;
+      kargs[p++] = args[j];
     }
   }
 
   err = GpuKernel_sched(k, n, &gs, &ls);
-  if (err != GA_NO_ERROR) goto error;
-
-  err = GpuKernel_call(k, 1, &gs, &ls, 0, NULL);
- error:
+  if (err == GA_NO_ERROR)
+    err = GpuKernel_call(k, 1, &gs, &ls, 0, kargs);
+  if (kargs != sargs)
+    free(kargs);
   return err;
 }
 
+/* Load, compute and store one element of the contiguous kernels.
+   The element of an array is its name between `pre` and `post`. */
+static void gen_contig_elem(strb *sb, const char *expr, unsigned int n,
+                            gpuelemwise_arg *args, int gen_flags,
+                            const char *pre, const char *post) {
+  unsigned int j;
+
+  for (j = 0; j < n; j++) {
+    if (is_array(args[j])) {
+      strb_appendf(sb, "%s %s;\n", ctype(ISSET(gen_flags, GEN_CONVERT_F16) && args[j].typecode == GA_HALF ?
+                                          GA_FLOAT : args[j].typecode), args[j].name);
+      if (ISSET(args[j].flags, GE_READ)) {
+        if (args[j].typecode == GA_HALF && ISSET(gen_flags, GEN_CONVERT_F16)) {
+          strb_appendf(sb, "%s = load_half(&%s%s%s);\n", args[j].name, pre, args[j].name, post);
+        } else {
+          strb_appendf(sb, "%s = %s%s%s;\n", args[j].name, pre, args[j].name, post);
+        }
+      }
+    }
+  }
+  strb_appends(sb, expr);
+  strb_appends(sb, ";\n");
+
+  for (j = 0; j < n; j++) {
+    if (is_array(args[j])) {
+      if (ISSET(args[j].flags, GE_WRITE)) {
+        if (args[j].typecode == GA_HALF && ISSET(gen_flags, GEN_CONVERT_F16)) {
+          strb_appendf(sb, "store_half(&%s%s%s, %s);\n", pre, args[j].name, post, args[j].name);
+        } else {
+          strb_appendf(sb, "%s%s%s = %s;\n", pre, args[j].name, post, args[j].name);
+        }
+      }
+    }
+  }
+}
+
+/* Unsigned type to move `sz` bytes in one access */
+static const char *vec_unit(size_t sz) {
+  switch (sz) {
+  case 2:
+    return "ga_ushort";
+  case 4:
+    return "ga_uint";
+  case 8:
+    return "ga_uint2";
+  case 16:
+    return "ga_uint4";
+  default:
+    assert(0 && "unexpected vector size");
+    return NULL;
+  }
+}
+
+/*
+ * Number of elements per thread for the vectorized contiguous kernel.
+ *
+ * This is as many as fit in 16 bytes for the largest type (up to 8),
+ * so that every array is accessed with loads and stores of 2 to 16
+ * bytes.  Returns 0 if that would be less than 2 elements.
+ *
+ * OpenCL doesn't allow `half` values in private memory without the
+ * cl_khr_fp16 extension so the unions can't hold them there.
+ */
+static unsigned int contig_vec(gpucontext *ctx, unsigned int n,
+                               gpuelemwise_arg *args) {
+  size_t sz = 0;
+  unsigned int j;
+
+  for (j = 0; j < n; j++) {
+    if (is_array(args[j])) {
+      if (args[j].typecode >= GA_NBASE ||
+          gpuarray_get_elsize(args[j].typecode) > 8)
+        return 0;
+      if (args[j].typecode == GA_HALF && ctx->ops == &opencl_ops)
+        return 0;
+      if (gpuarray_get_elsize(args[j].typecode) > sz)
+        sz = gpuarray_get_elsize(args[j].typecode);
+    }
+  }
+  if (sz == 0)
+    return 0;
+  return sz == 1 ? 8 : (unsigned int)(16 / sz);
+}
+
+/*
+ * With vec > 1, each thread handles `vec` consecutive elements per
+ * iteration, moving them in one access per array through a union.
+ * The arrays must then be aligned to `vec` elements.  The elements
+ * past the last multiple of `vec` are done one by one at the end.
+ * The names it adds start with ga__ to stay clear of the arguments.
+ */
 static int gen_elemwise_contig_kernel(GpuKernel *k,
-                                      gpucontext *ctx, char **err_str,
+                                      gpucontext *ctx,
                                       const char *preamble,
                                       const char *expr,
                                       unsigned int n,
                                       gpuelemwise_arg *args,
-                                      int gen_flags) {
+                                      unsigned int vec,
+                                      int gen_flags,
+                                      int kflags) {
   strb sb = STRB_STATIC_INIT;
   int *ktypes = NULL;
   unsigned int p;
@@ -436,7 +603,7 @@ static int gen_elemwise_contig_kernel(GpuKernel *k,
   int flags = GA_USE_CLUDA;
   int res = GA_MEMORY_ERROR;
 
-  flags |= gpuarray_type_flagsa(n, args);
+  flags |= gpuarray_type_flagsa(n, args) | kflags;
 
   p = 1;
   for (j = 0; j < n; j++)
@@ -479,49 +646,73 @@ static int gen_elemwise_contig_kernel(GpuKernel *k,
     }
   }
 
-  strb_appends(&sb, "for (i = idx; i < n; i += numThreads) {\n");
-  for (j = 0; j < n; j++) {
-    if (is_array(args[j])) {
-      strb_appendf(&sb, "%s %s;\n", ctype(ISSET(gen_flags, GEN_CONVERT_F16) && args[j].typecode == GA_HALF ?
-                                          GA_FLOAT : args[j].typecode), args[j].name);
-      if (ISSET(args[j].flags, GE_READ)) {
-        if (args[j].typecode == GA_HALF && ISSET(gen_flags, GEN_CONVERT_F16)) {
-          strb_appendf(&sb, "%s = load_half(&%s_p[i]);\n", args[j].name, args[j].name);
-        } else {
-          strb_appendf(&sb, "%s = %s_p[i];\n", args[j].name, args[j].name);
-        }
-      }
+  if (vec > 1) {
+    strb_appendf(&sb, "\nconst ga_size ga__nvec = n / %u;\n"
+                 "unsigned int ga__lane;\n", vec);
+    for (j = 0; j < n; j++) {
+      if (is_array(args[j]))
+        strb_appendf(&sb, "union { %s w; %s e[%u]; } ga__v_%s;\n",
+                     vec_unit(vec * gpuarray_get_elsize(args[j].typecode)),
+                     ctype(args[j].typecode), vec, args[j].name);
     }
-  }
-  strb_appends(&sb, expr);
-  strb_appends(&sb, ";\n");
-
-  for (j = 0; j < n; j++) {
-    if (is_array(args[j])) {
-      if (ISSET(args[j].flags, GE_WRITE)) {
-        if (args[j].typecode == GA_HALF && ISSET(gen_flags, GEN_CONVERT_F16)) {
-          strb_appendf(&sb, "store_half(&%s_p[i], %s);\n", args[j].name, args[j].name);
-        } else {
-          strb_appendf(&sb, "%s_p[i] = %s;\n", args[j].name, args[j].name);
-        }
-      }
+    strb_appends(&sb, "for (i = idx; i < ga__nvec; i += numThreads) {\n");
+    for (j = 0; j < n; j++) {
+      if (is_array(args[j]) && ISSET(args[j].flags, GE_READ))
+        strb_appendf(&sb, "ga__v_%s.w = ((GLOBAL_MEM %s *)%s_p)[i];\n",
+                     args[j].name,
+                     vec_unit(vec * gpuarray_get_elsize(args[j].typecode)),
+                     args[j].name);
+    }
+    strb_appendf(&sb, "for (ga__lane = 0; ga__lane < %u; ga__lane++) {\n",
+                 vec);
+    gen_contig_elem(&sb, expr, n, args, gen_flags, "ga__v_", ".e[ga__lane]");
+    strb_appends(&sb, "}\n");
+    for (j = 0; j < n; j++) {
+      if (is_array(args[j]) && ISSET(args[j].flags, GE_WRITE))
+        strb_appendf(&sb, "((GLOBAL_MEM %s *)%s_p)[i] = ga__v_%s.w;\n",
+                     vec_unit(vec * gpuarray_get_elsize(args[j].typecode)),
+                     args[j].name, args[j].name);
     }
+    strb_appendf(&sb, "}\nfor (i = ga__nvec * %u + idx; i < n; i += numThreads) {\n",
+                 vec);
+  } else {
+    strb_appends(&sb, "for (i = idx; i < n; i += numThreads) {\n");
   }
+  gen_contig_elem(&sb, expr, n, args, gen_flags, "", "_p[i]");
   strb_appends(&sb, "}\n}\n");
 
   if (strb_error(&sb))
     goto bail;
 
-  res = GpuKernel_init(k, ctx, 1, (const char **)&sb.s, &sb.l, "elem",
-                       p, ktypes, flags, err_str);
+  res = GpuKernel_init_async(k, ctx, 1, (const char **)&sb.s, &sb.l, "elem",
+                             p, ktypes, flags);
  bail:
   strb_clear(&sb);
   free(ktypes);
   return res;
 }
 
+/*
+ * Does the data of `v` start on a multiple of `unit` bytes on the
+ * device?  The buffer may wrap memory from elsewhere (like with
+ * cuda_make_buf()) so its own alignment has to be checked too.
+ */
+static int is_aligned(GpuArray *v, size_t unit) {
+  size_t align;
+
+  if (v->offset % unit != 0)
+    return 0;
+  if (gpudata_property(v->data, GA_BUFFER_PROP_ALIGN, &align) != GA_NO_ERROR)
+    return 0;
+  return align % unit == 0;
+}
+
+/*
+ * Also tells if the vectorized kernel can be used: the arrays are big
+ * enough and their data is aligned to the vector size.
+ */
 static int check_contig(GpuElemwise *ge, void **args,
-                        size_t *_n, int *contig) {
+                        size_t *_n, int *contig, int *vec) {
   GpuArray *a = NULL, *v;
   size_t n = 1;
   unsigned int i, j;
@@ -547,51 +738,152 @@ static int check_contig(GpuElemwise *ge, void **args,
     }
   }
   *contig = f_contig || c_contig;
+  *vec = ge->vec > 1 && n >= CONTIG_VEC_MIN;
+  for (i = 0; *vec && i < ge->n; i++) {
+    if (is_array(ge->args[i])) {
+      v = (GpuArray *)args[i];
+      *vec = is_aligned(v, ge->vec * GpuArray_ITEMSIZE(v));
+    }
+  }
   *_n = n;
   return GA_NO_ERROR;
 }
 
-static int call_contig(GpuElemwise *ge, void **args, size_t n) {
+static int build_contig(GpuElemwise *ge, GpuKernel *k, unsigned int vec) {
+  int err;
+
+  err = gen_elemwise_contig_kernel(k, ge->ctx, ge->preamble, ge->expr,
+                                   ge->n, ge->args, vec,
+                                   (ge->flags & GE_CONVERT_F16), ge->kflags);
+  if (err != GA_NO_ERROR)
+    return err;
+  err = wait_kernel(k);
+  if (err != GA_NO_ERROR)
+    GpuKernel_clear(k);
+  return err;
+}
+
+/*
+ * Get the contiguous kernel (vectorized or not), building it if needed.
+ *
+ * If the vectorized kernel doesn't build (the device may not take
+ * some of the unions) this falls back to the scalar kernel, clears
+ * `*vec` and doesn't try vectorizing again for this GpuElemwise.
+ */
+static int contig_kernel(GpuElemwise *ge, int *vec, GpuKernel **_k) {
+  int err;
+
+  if (*vec && !k_initialized(&ge->k_contig_vec)) {
+    if (build_contig(ge, &ge->k_contig_vec, ge->vec) != GA_NO_ERROR) {
+      ge->vec = 0;
+      *vec = 0;
+    }
+  }
+  if (*vec) {
+    *_k = &ge->k_contig_vec;
+    return GA_NO_ERROR;
+  }
+  if (!k_initialized(&ge->k_contig)) {
+    err = build_contig(ge, &ge->k_contig, 1);
+    if (err != GA_NO_ERROR)
+      return err;
+  }
+  *_k = &ge->k_contig;
+  return GA_NO_ERROR;
+}
+
+static int call_contig(GpuElemwise *ge, void **args, size_t n, int vec) {
+  GpuKernel *k;
   GpuArray *a;
+  void *sargs[KARGS_STACK], **kargs = sargs;
   size_t ls = 0, gs = 0;
   unsigned int i, p;
   int err;
 
+  err = contig_kernel(ge, &vec, &k);
+  if (err != GA_NO_ERROR)
+    return err;
+
+  p = 1 + ge->n + ge->narray;
+  if (p > KARGS_STACK) {
+    kargs = calloc(p, sizeof(void *));
+    if (kargs == NULL)
+      return GA_MEMORY_ERROR;
+  }
+
   p = 0;
-  err = GpuKernel_setarg(&ge->k_contig, p++, &n);
-  if (err != GA_NO_ERROR) return err;
+  kargs[p++] = &n;
   for (i = 0; i < ge->n; i++) {
     if (is_array(ge->args[i])) {
       a = (GpuArray *)args[i];
-      err = GpuKernel_setarg(&ge->k_contig, p++, a->data);
-      if (err != GA_NO_ERROR) return err;
-      err = GpuKernel_setarg(&ge->k_contig, p++, &a->offset);
-      if (err != GA_NO_ERROR) return err;
+      kargs[p++] = a->data;
+      kargs[p++] = &a->offset;
     } else {
-      err = GpuKernel_setarg(&ge->k_contig, p++, args[i]);
-      if (err != GA_NO_ERROR) return err;
+      kargs[p++] = args[i];
     }
   }
-  err = GpuKernel_sched(&ge->k_contig, n, &gs, &ls);
-  if (err != GA_NO_ERROR) return err;
-  return GpuKernel_call(&ge->k_contig, 1, &gs, &ls, 0, NULL);
+  err = GpuKernel_sched(k, vec ? n / ge->vec : n, &gs, &ls);
+  if (err == GA_NO_ERROR)
+    err = GpuKernel_call(k, 1, &gs, &ls, 0, kargs);
+  if (kargs != sargs)
+    free(kargs);
+  return err;
 }
 
-GpuElemwise *GpuElemwise_new(gpucontext *ctx,
-                             const char *preamble, const char *expr,
-                             unsigned int n, gpuelemwise_arg *args,
-                             unsigned int nd, int flags) {
+/*
+ * Start building the basic kernels for up to `nd` dimensions and wait
+ * for all of them, like GpuElemwise_new() used to.
+ */
+static int ge_precompile(GpuElemwise *ge, unsigned int nd) {
+  unsigned int i;
+  int flags = ge->flags & GE_CONVERT_F16;
+  int err = GA_NO_ERROR;
+
+  for (i = 0; i < nd && err == GA_NO_ERROR; i++) {
+    err = gen_elemwise_basic_kernel(&ge->k_basic_32[i], ge->ctx,
+                                    ge->preamble, ge->expr, i+1, ge->n,
+                                    ge->args, GEN_ADDR32 | flags,
+                                    ge->kflags);
+    if (err == GA_NO_ERROR && ISCLR(ge->flags, GE_NOADDR64))
+      err = gen_elemwise_basic_kernel(&ge->k_basic[i], ge->ctx,
+                                      ge->preamble, ge->expr, i+1, ge->n,
+                                      ge->args, flags, ge->kflags);
+  }
+  /* Wait for all that were started, even after an error */
+  for (i = 0; i < nd; i++) {
+    if (k_initialized(&ge->k_basic_32[i]) &&
+        wait_kernel(&ge->k_basic_32[i]) != GA_NO_ERROR) {
+      GpuKernel_clear(&ge->k_basic_32[i]);
+      err = GA_MISC_ERROR;
+    }
+    if (k_initialized(&ge->k_basic[i]) &&
+        wait_kernel(&ge->k_basic[i]) != GA_NO_ERROR) {
+      GpuKernel_clear(&ge->k_basic[i]);
+      err = GA_MISC_ERROR;
+    }
+  }
+  return err;
+}
+
+static GpuElemwise *ge_new(gpucontext *ctx,
+                           const char *preamble, const char *expr,
+                           unsigned int n, gpuelemwise_arg *args,
+                           unsigned int nd, int flags, int kflags) {
   GpuElemwise *res;
-#ifdef DEBUG
-  char *errstr = NULL;
-#endif
+  GpuKernel *k;
+  int vec = 0;
   unsigned int i;
-  int ret;
 
   res = calloc(1, sizeof(*res));
   if (res == NULL) return NULL;
+  if (ga_mutex_init(&res->lock) != 0) {
+    free(res);
+    return NULL;
+  }
 
+  res->ctx = ctx;
   res->flags = flags;
+  res->kflags = kflags;
   res->nd = 8;
   res->n = n;
 
@@ -612,6 +904,7 @@ GpuElemwise *GpuElemwise_new(gpucontext *ctx,
   res->narray = 0;
   for (i = 0; i < res->n; i++)
     if (is_array(res->args[i])) res->narray++;
+  res->vec = contig_vec(ctx, res->n, res->args);
 
   while (res->nd < nd) res->nd *= 2;
   res->dims = calloc(res->nd, sizeof(size_t));
@@ -628,71 +921,165 @@ GpuElemwise *GpuElemwise_new(gpucontext *ctx,
   if (res->k_basic_32 == NULL)
     goto fail;
 
-  ret = gen_elemwise_contig_kernel(&res->k_contig, ctx,
-#ifdef DEBUG
-                                   &errstr,
-#else
-                                   NULL,
-#endif
-                                   res->preamble, res->expr,
-                                   res->n, res->args,
-                                   (res->flags & GE_CONVERT_F16));
-  if (ret != GA_NO_ERROR) {
-#ifdef DEBUG
-    if (errstr != NULL)
-      fprintf(stderr, "%s\n", errstr);
-    free(errstr);
-#endif
+  /* This one is always built to report errors in the expression */
+  if (contig_kernel(res, &vec, &k) != GA_NO_ERROR)
+    goto fail;
+  if (ISSET(flags, GE_PRECOMPILE) && ge_precompile(res, nd) != GA_NO_ERROR)
     goto fail;
+
+  return res;
+
+ fail:
+  GpuElemwise_free(res);
+  return NULL;
+}
+
+GpuElemwise *GpuElemwise_new(gpucontext *ctx,
+                             const char *preamble, const char *expr,
+                             unsigned int n, gpuelemwise_arg *args,
+                             unsigned int nd, int flags) {
+  return ge_new(ctx, preamble, expr, n, args, nd, flags, 0);
+}
+
+/* Index of the argument called `name` (of length `len`) or -1 */
+static int find_arg(unsigned int n, gpuelemwise_arg *args,
+                    const char *name, size_t len) {
+  unsigned int i;
+
+  for (i = 0; i < n; i++)
+    if (strncmp(args[i].name, name, len) == 0 && args[i].name[len] == '\0')
+      return i;
+  return -1;
+}
+
+/* Index of the stage that computes `name` (of length `len`) or -1 */
+static int find_stage(unsigned int nstages, gpuelemwise_stage *stages,
+                      const char *name, size_t len) {
+  unsigned int i;
+
+  for (i = 0; i < nstages; i++)
+    if (strncmp(stages[i].name, name, len) == 0 &&
+        stages[i].name[len] == '\0')
+      return i;
+  return -1;
+}
+
+#define FUSE_TODO 0
+#define FUSE_ACTIVE 1
+#define FUSE_DONE 2
+
+/*
+ * Append the code of stage `s` after that of the stages it uses.
+ *
+ * The stages used are found by looking for their names among the
+ * identifiers of the expression (skipping numbers and member
+ * accesses).  Returns -1 if there is a cycle.
+ */
+static int fuse_stage(strb *sb, unsigned int s, unsigned int nstages,
+                      gpuelemwise_stage *stages, char *state,
+                      unsigned int n, gpuelemwise_arg *args, int flags) {
+  const char *expr = stages[s].expr;
+  const char *p = expr, *id;
+  int i, typecode;
+
+  if (state[s] == FUSE_DONE)
+    return 0;
+  if (state[s] == FUSE_ACTIVE)
+    return -1;
+  state[s] = FUSE_ACTIVE;
+
+  while (*p != '\0') {
+    if (isalpha((unsigned char)*p) || *p == '_') {
+      id = p;
+      while (isalnum((unsigned char)*p) || *p == '_') p++;
+      if (id > expr && (id[-1] == '.' ||
+                        (id[-1] == '>' && id - 1 > expr && id[-2] == '-')))
+        continue;
+      i = find_stage(nstages, stages, id, p - id);
+      /* Its own name in an expression is the value that was read */
+      if (i >= 0 && (unsigned int)i != s &&
+          fuse_stage(sb, i, nstages, stages, state, n, args, flags))
+        return -1;
+    } else if (isdigit((unsigned char)*p)) {
+      while (isalnum((unsigned char)*p) || *p == '_' || *p == '.') p++;
+    } else {
+      p++;
+    }
   }
 
-  if (ISCLR(flags, GE_NOADDR64)) {
-    for (i = 0; i < nd; i++) {
-      ret = gen_elemwise_basic_kernel(&res->k_basic[i], ctx,
-#ifdef DEBUG
-                                      &errstr,
-#else
-                                      NULL,
-#endif
-                                      res->preamble, res->expr,
-                                      i+1, res->n, res->args,
-                                      (res->flags & GE_CONVERT_F16));
-      if (ret != GA_NO_ERROR) {
-#ifdef DEBUG
-        if (errstr != NULL)
-          fprintf(stderr, "%s\n", errstr);
-        free(errstr);
-#endif
+  if (find_arg(n, args, stages[s].name, strlen(stages[s].name)) < 0) {
+    typecode = stages[s].typecode;
+    if (ISSET(flags, GE_CONVERT_F16) && typecode == GA_HALF)
+      typecode = GA_FLOAT;
+    strb_appendf(sb, "%s %s = (%s);\n", ctype(typecode), stages[s].name,
+                 expr);
+  } else {
+    strb_appendf(sb, "%s = (%s);\n", stages[s].name, expr);
+  }
+  state[s] = FUSE_DONE;
+  return 0;
+}
+
+GpuElemwise *GpuElemwise_fuse(gpucontext *ctx, const char *preamble,
+                              unsigned int nstages,
+                              gpuelemwise_stage *stages,
+                              unsigned int n, gpuelemwise_arg *args,
+                              unsigned int nd, int flags) {
+  strb sb = STRB_STATIC_INIT;
+  GpuElemwise *res = NULL;
+  char *state;
+  unsigned int i, j;
+  int kflags = 0;
+  int a, typecode;
+
+  if (nstages == 0)
+    return NULL;
+  state = calloc(nstages, sizeof(char));
+  if (state == NULL)
+    return NULL;
+
+  for (i = 0; i < nstages; i++) {
+    for (j = 0; j < i; j++)
+      if (strcmp(stages[j].name, stages[i].name) == 0)
         goto fail;
-      }
+    a = find_arg(n, args, stages[i].name, strlen(stages[i].name));
+    if (a >= 0) {
+      /* Only outputs can be computed by a stage */
+      if (!is_array(args[a]) || !is_output(args[a]))
+        goto fail;
+    } else {
+      typecode = stages[i].typecode;
+      if (ISSET(flags, GE_CONVERT_F16) && typecode == GA_HALF)
+        typecode = GA_FLOAT;
+      if (ctype(typecode) == NULL)
+        goto fail;
+      kflags |= gpuarray_type_flags(typecode, -1);
     }
   }
 
-  for (i = 0; i < nd; i++) {
-    ret = gen_elemwise_basic_kernel(&res->k_basic_32[i], ctx,
-#ifdef DEBUG
-                                    &errstr,
-#else
-                                    NULL,
-#endif
-                                    res->preamble, res->expr,
-                                    i+1, res->n, res->args,
-                                    GEN_ADDR32 | (res->flags & GE_CONVERT_F16));
-    if (ret != GA_NO_ERROR) {
-#ifdef DEBUG
-      if (errstr != NULL)
-        fprintf(stderr, "%s\n", errstr);
-      free(errstr);
-#endif
-      goto fail;
+  /* Only the stages that lead to an output are kept */
+  for (j = 0; j < n; j++) {
+    if (is_array(args[j]) && is_output(args[j])) {
+      a = find_stage(nstages, stages, args[j].name, strlen(args[j].name));
+      if (a < 0) {
+        /* Write-only outputs must be computed */
+        if (!ISSET(args[j].flags, GE_READ))
+          goto fail;
+        continue;
+      }
+      if (fuse_stage(&sb, a, nstages, stages, state, n, args, flags))
+        goto fail;
     }
   }
+  strb_append0(&sb);
+  if (strb_error(&sb))
+    goto fail;
 
-  return res;
-
+  res = ge_new(ctx, preamble, sb.s, n, args, nd, flags, kflags);
  fail:
-  GpuElemwise_free(res);
-  return NULL;
+  strb_clear(&sb);
+  free(state);
+  return res;
 }
 
 void GpuElemwise_free(GpuElemwise *ge) {
@@ -709,27 +1096,55 @@ void GpuElemwise_free(GpuElemwise *ge) {
     }
   if (k_initialized(&ge->k_contig))
     GpuKernel_clear(&ge->k_contig);
+  if (k_initialized(&ge->k_contig_vec))
+    GpuKernel_clear(&ge->k_contig_vec);
   free_args(ge->n, ge->args);
   free((void *)ge->preamble);
   free((void *)ge->expr);
   free(ge->dims);
   free(ge->strides);
+  ga_mutex_destroy(&ge->lock);
   free(ge);
 }
 
-int GpuElemwise_call(GpuElemwise *ge, void **args, int flags) {
+int GpuElemwise_built(GpuElemwise *ge, int variant, unsigned int nd) {
+  int res;
+
+  ga_mutex_lock(&ge->lock);
+  switch (variant) {
+  case GE_VARIANT_CONTIG:
+    res = k_initialized(&ge->k_contig);
+    break;
+  case GE_VARIANT_CONTIG_VEC:
+    res = k_initialized(&ge->k_contig_vec);
+    break;
+  case GE_VARIANT_BASIC:
+    res = nd != 0 && nd <= ge->nd && k_initialized(&ge->k_basic[nd-1]);
+    break;
+  case GE_VARIANT_BASIC_32:
+    res = nd != 0 && nd <= ge->nd && k_initialized(&ge->k_basic_32[nd-1]);
+    break;
+  default:
+    res = 0;
+  }
+  ga_mutex_unlock(&ge->lock);
+  return res;
+}
+
+static int ge_call(GpuElemwise *ge, void **args, int flags) {
   size_t n;
   size_t *dims;
   ssize_t **strides;
   unsigned int nd;
   int contig;
+  int vec;
   int call32;
   int err;
 
-  err = check_contig(ge, args, &n, &contig);
+  err = check_contig(ge, args, &n, &contig, &vec);
   if (err == GA_NO_ERROR && contig) {
     if (n == 0) return GA_NO_ERROR;
-    return call_contig(ge, args, n);
+    return call_contig(ge, args, n, vec);
   }
   err = check_basic(ge, args, flags, &n, &nd, &dims, &strides, &call32);
   if (err == GA_NO_ERROR) {
@@ -738,3 +1153,148 @@ int GpuElemwise_call(GpuElemwise *ge, void **args, int flags) {
   }
   return err;
 }
+
+int GpuElemwise_call(GpuElemwise *ge, void **args, int flags) {
+  int err;
+
+  ga_mutex_lock(&ge->lock);
+  err = ge_call(ge, args, flags);
+  ga_mutex_unlock(&ge->lock);
+  return err;
+}
+
+static GpuElemwisePlan *plan_new(GpuElemwise *ge, void **args, int flags,
+                                 int *ret) {
+  GpuElemwisePlan *res;
+  GpuKernel *k;
+  size_t *dims;
+  ssize_t **strides;
+  unsigned int i, j, l, p, nkargs;
+  int contig, vec;
+  int err;
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL) {
+    err = GA_MEMORY_ERROR;
+    goto fail;
+  }
+  res->ge = ge;
+  res->flags = flags;
+
+  err = check_contig(ge, args, &res->n, &contig, &vec);
+  if (err == GA_NO_ERROR && contig) {
+    if (res->n == 0) goto done;
+    err = contig_kernel(ge, &vec, &k);
+    if (err != GA_NO_ERROR) goto fail;
+    res->vec = vec ? ge->vec : 0;
+  } else {
+    err = check_basic(ge, args, flags, &res->n, &res->nd, &dims, &strides,
+                      &res->call32);
+    if (err != GA_NO_ERROR) goto fail;
+    if (res->n == 0) goto done;
+    err = basic_kernel(ge, res->nd, res->call32, &k);
+    if (err != GA_NO_ERROR) goto fail;
+    /* The buffers of ge are overwritten by the next call */
+    res->dims = calloc(res->nd, sizeof(size_t));
+    res->strides = calloc(ge->narray * res->nd, sizeof(ssize_t));
+    if (res->dims == NULL || res->strides == NULL) {
+      err = GA_MEMORY_ERROR;
+      goto fail;
+    }
+    memcpy(res->dims, dims, res->nd * sizeof(size_t));
+    for (l = 0; l < ge->narray; l++)
+      memcpy(&res->strides[l * res->nd], strides[l],
+             res->nd * sizeof(ssize_t));
+  }
+
+  /* The basic kernels of ge move when it grows for more dimensions */
+  res->k.k = k->k;
+  gpukernel_retain(res->k.k);
+
+  nkargs = 1 + res->nd;
+  for (i = 0; i < ge->n; i++)
+    nkargs += is_array(ge->args[i]) ? 2 + res->nd : 1;
+  res->kargs = calloc(nkargs, sizeof(void *));
+  res->pos = calloc(ge->n, sizeof(unsigned int));
+  if (res->kargs == NULL || res->pos == NULL) {
+    err = GA_MEMORY_ERROR;
+    goto fail;
+  }
+
+  /* Everything but the data, offsets and scalars is set once */
+  p = 0;
+  res->kargs[p++] = &res->n;
+  for (j = 0; j < res->nd; j++)
+    res->kargs[p++] = &res->dims[j];
+  l = 0;
+  for (i = 0; i < ge->n; i++) {
+    res->pos[i] = p;
+    if (is_array(ge->args[i])) {
+      p += 2;
+      for (j = 0; j < res->nd; j++)
+        res->kargs[p++] = &res->strides[l * res->nd + j];
+      l++;
+    } else {
+      p++;
+    }
+  }
+
+  err = GpuKernel_sched(&res->k, res->vec ? res->n / res->vec : res->n,
+                        &res->gs, &res->ls);
+  if (err != GA_NO_ERROR) goto fail;
+
+ done:
+  if (ret != NULL) *ret = GA_NO_ERROR;
+  return res;
+
+ fail:
+  GpuElemwisePlan_free(res);
+  if (ret != NULL) *ret = err;
+  return NULL;
+}
+
+GpuElemwisePlan *GpuElemwisePlan_new(GpuElemwise *ge, void **args, int flags,
+                                     int *ret) {
+  GpuElemwisePlan *res;
+
+  ga_mutex_lock(&ge->lock);
+  res = plan_new(ge, args, flags, ret);
+  ga_mutex_unlock(&ge->lock);
+  return res;
+}
+
+void GpuElemwisePlan_free(GpuElemwisePlan *plan) {
+  if (plan == NULL)
+    return;
+  GpuKernel_clear(&plan->k);
+  free(plan->kargs);
+  free(plan->pos);
+  free(plan->dims);
+  free(plan->strides);
+  free(plan);
+}
+
+int GpuElemwisePlan_call(GpuElemwisePlan *plan, void **args) {
+  GpuElemwise *ge = plan->ge;
+  GpuArray *v;
+  unsigned int i;
+
+  if (plan->n == 0) return GA_NO_ERROR;
+
+  for (i = 0; i < ge->n; i++) {
+    if (is_array(ge->args[i])) {
+      v = (GpuArray *)args[i];
+      /* The buffers are taken to be aligned like the bound ones,
+         only the offsets can make the kernel unusable */
+      if ((plan->vec != 0 &&
+           v->offset % (plan->vec * GpuArray_ITEMSIZE(v)) != 0) ||
+          (plan->call32 && v->offset >= ADDR32_MAX))
+        return GpuElemwise_call(ge, args, plan->flags);
+      plan->kargs[plan->pos[i]] = v->data;
+      plan->kargs[plan->pos[i] + 1] = &v->offset;
+    } else {
+      plan->kargs[plan->pos[i]] = args[i];
+    }
+  }
+  return GpuKernel_call(&plan->k, 1, &plan->gs, &plan->ls, 0, plan->kargs);
+}
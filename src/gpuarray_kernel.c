@@ -20,6 +20,26 @@ int GpuKernel_init(GpuKernel *k, gpucontext *ctx, unsigned int count,
   return res;
 }
 
+int GpuKernel_init_async(GpuKernel *k, gpucontext *ctx, unsigned int count,
+                         const char **strs, const size_t *lens,
+                         const char *name, unsigned int argcount,
+                         const int *types, int flags) {
+  int res = GA_NO_ERROR;
+
+  k->args = calloc(argcount, sizeof(void *));
+  if (k->args == NULL)
+    return GA_MEMORY_ERROR;
+  k->k = gpukernel_init_async(ctx, count, strs, lens, name, argcount, types,
+                              flags, &res);
+  if (res != GA_NO_ERROR)
+    GpuKernel_clear(k);
+  return res;
+}
+
+int GpuKernel_wait(GpuKernel *k, char **err_str) {
+  return gpukernel_wait(k->k, err_str);
+}
+
 void GpuKernel_clear(GpuKernel *k) {
   if (k->k)
     gpukernel_release(k->k);
@@ -10,7 +10,9 @@
 #endif
 
 typedef enum {
-  CUDA_SUCCESS = 0
+  CUDA_SUCCESS = 0,
+  CUDA_ERROR_OUT_OF_MEMORY = 2,
+  CUDA_ERROR_NOT_READY = 600
 } CUresult;
 
 #if defined(_WIN64) || defined(__LP64__)
@@ -34,6 +36,8 @@ typedef enum CUctx_flags_enum CUctx_flags;
 typedef enum CUipcMem_flags_enum CUipcMem_flags;
 typedef enum CUjit_option_enum CUjit_option;
 typedef enum CUjitInputType_enum CUjitInputType;
+typedef enum CUpointer_attribute_enum CUpointer_attribute;
+typedef enum CUmemorytype_enum CUmemorytype;
 
 #define CU_IPC_HANDLE_SIZE 64
 
@@ -51,6 +55,8 @@ int load_libcuda(error *);
 #undef DEF_PROC_V2
 #undef DEF_PROC
 
+/* Stub libraries (for testing) define the functions themselves */
+#ifndef LOADER_STUB
 #define DEF_PROC(name, args) extern t##name *name
 #define DEF_PROC_V2(name, args) DEF_PROC(name, args)
 
@@ -58,6 +64,7 @@ int load_libcuda(error *);
 
 #undef DEF_PROC_V2
 #undef DEF_PROC
+#endif
 
 enum CUdevice_attribute_enum {
   CU_DEVICE_ATTRIBUTE_MAX_THREADS_PER_BLOCK = 1,
@@ -176,6 +183,23 @@ enum CUevent_flags_enum {
   CU_EVENT_INTERPROCESS   = 0x4
 };
 
+enum CUmemhostalloc_flags_enum {
+  CU_MEMHOSTALLOC_PORTABLE  = 0x01,
+  CU_MEMHOSTALLOC_DEVICEMAP = 0x02
+};
+
+enum CUpointer_attribute_enum {
+  CU_POINTER_ATTRIBUTE_CONTEXT     = 1,
+  CU_POINTER_ATTRIBUTE_MEMORY_TYPE = 2
+};
+
+enum CUmemorytype_enum {
+  CU_MEMORYTYPE_HOST    = 0x01,
+  CU_MEMORYTYPE_DEVICE  = 0x02,
+  CU_MEMORYTYPE_ARRAY   = 0x03,
+  CU_MEMORYTYPE_UNIFIED = 0x04
+};
+
 enum CUctx_flags_enum {
   CU_CTX_SCHED_AUTO          = 0x00,
   CU_CTX_SCHED_SPIN          = 0x01,
@@ -17,10 +17,13 @@ int load_libnvrtc(int major, int minor, error *e);
 
 #undef DEF_PROC
 
+/* Stub libraries (for testing) define the functions themselves */
+#ifndef LOADER_STUB
 #define DEF_PROC(rt, name, args) extern t##name *name
 
 #include "libnvrtc.fn"
 
 #undef DEF_PROC
+#endif
 
 #endif
@@ -55,6 +55,7 @@ typedef cl_uint cl_program_info;
 typedef cl_uint cl_program_build_info;
 typedef cl_uint cl_kernel_info;
 typedef cl_uint cl_kernel_work_group_info;
+typedef cl_uint cl_event_info;
 
 int load_libopencl(error *);
 
@@ -318,6 +319,12 @@ int load_libopencl(error *);
 #define CL_PROGRAM_KERNEL_NAMES                     0x1168
 #define CL_PROGRAM_IL                              0x1169
 
+/* cl_event_info */
+#define CL_EVENT_COMMAND_EXECUTION_STATUS           0x11D3
+
+/* command execution status */
+#define CL_COMPLETE                                 0x0
+
 /* cl_kernel_work_group_info */
 #define CL_KERNEL_WORK_GROUP_SIZE                   0x11B0
 #define CL_KERNEL_COMPILE_WORK_GROUP_SIZE           0x11B1
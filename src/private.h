@@ -70,6 +70,10 @@ typedef struct _partial_gpukernel {
   gpucontext *ctx;
 } partial_gpukernel;
 
+typedef struct _partial_gpuevent {
+  gpucontext *ctx;
+} partial_gpuevent;
+
 typedef struct _partial_gpucomm {
   gpucontext* ctx;
 } partial_gpucomm;
@@ -106,6 +110,23 @@ struct _gpuarray_buffer_ops {
   int (*property)(gpucontext *ctx, gpudata *buf, gpukernel *k, int prop_id,
                   void *res);
   const char *(*ctx_error)(gpucontext *ctx);
+  int (*ctx_trim_cache)(gpucontext *ctx);
+  int (*ctx_set_alloc_policy)(gpucontext *ctx,
+                              const gpucontext_alloc_policy *policy);
+  int (*buffer_read_async)(void *dst, gpudata *src, size_t srcoff, size_t sz,
+                           gpuevent **ev);
+  int (*buffer_write_async)(gpudata *dst, size_t dstoff, const void *src,
+                            size_t sz, gpuevent **ev);
+  int (*event_wait)(gpuevent *ev);
+  int (*event_query)(gpuevent *ev, int *done);
+  void (*event_release)(gpuevent *ev);
+  /* These two can be NULL if the backend only compiles synchronously */
+  gpukernel *(*kernel_alloc_async)(gpucontext *ctx, unsigned int count,
+                                   const char **strings,
+                                   const size_t *lengths, const char *fname,
+                                   unsigned int numargs, const int *typecodes,
+                                   int flags);
+  int (*kernel_wait)(gpukernel *k, char **err_str);
 };
 
 struct _gpuarray_blas_ops {
@@ -9,6 +9,9 @@
 
 #include "gpuarray/buffer.h"
 
+#include "util/suballoc.h"
+#include "util/thread.h"
+
 #ifdef DEBUG
 #include <assert.h>
 
@@ -16,15 +19,18 @@
 #define BUF_TAG "cudabuf "
 #define KER_TAG "cudakern"
 #define COMM_TAG "cudacomm"
+#define EV_TAG "cudaev  "
 
 #define TAG_CTX(c) memcpy((c)->tag, CTX_TAG, 8)
 #define TAG_BUF(b) memcpy((b)->tag, BUF_TAG, 8)
 #define TAG_KER(k) memcpy((k)->tag, KER_TAG, 8)
 #define TAG_COMM(co) memcpy((co)->tag, COMM_TAG, 8)
+#define TAG_EV(e) memcpy((e)->tag, EV_TAG, 8)
 #define ASSERT_CTX(c) assert(memcmp((c)->tag, CTX_TAG, 8) == 0)
 #define ASSERT_BUF(b) assert(memcmp((b)->tag, BUF_TAG, 8) == 0)
 #define ASSERT_KER(k) assert(memcmp((k)->tag, KER_TAG, 8) == 0)
 #define ASSERT_COMM(co) assert(memcmp((co)->tag, COMM_TAG, 8) == 0)
+#define ASSERT_EV(e) assert(memcmp((e)->tag, EV_TAG, 8) == 0)
 #define CLEAR(o) memset((o)->tag, 0, 8);
 
 #else
@@ -32,10 +38,12 @@
 #define TAG_BUF(b)
 #define TAG_KER(k)
 #define TAG_COMM(k)
+#define TAG_EV(e)
 #define ASSERT_CTX(c)
 #define ASSERT_BUF(b)
 #define ASSERT_KER(k)
 #define ASSERT_COMM(k)
+#define ASSERT_EV(e)
 #define CLEAR(o)
 #endif
 
@@ -46,7 +54,8 @@ static inline int error_cuda(error *e, const char *msg, CUresult err) {
   const char *name, *descr;
   cuGetErrorName(err, &name);
   cuGetErrorString(err, &descr);
-  return error_fmt(e, GA_IMPL_ERROR, "%s: %s: %s", msg, name, descr);
+  return error_fmt(e, err == CUDA_ERROR_OUT_OF_MEMORY ? GA_MEMORY_ERROR : GA_IMPL_ERROR,
+                   "%s: %s: %s", msg, name, descr);
 }
 
 #define GA_CUDA_EXIT_ON_ERROR(ctx, cmd) \
@@ -72,9 +81,14 @@ typedef struct _cuda_context {
   CUcontext ctx;
   CUstream s;
   CUstream mem_s;
-  gpudata *freeblocks;
+  suballoc *allocator;
+  suballoc *host_allocator; /* for GA_BUFFER_HOST */
+  gpudata *pending; /* released buffers waiting on another stream */
+  struct _cuda_staging *staging; /* allocated on first use */
   cache *kernel_cache;
   cache *disk_cache; // This is per-context to avoid lock contention
+  char *manifest; /* path of the preload manifest, NULL if not used */
+  struct _cuda_locks *locks; /* NULL unless GA_CTX_MULTI_THREAD */
   unsigned int enter;
   unsigned char major;
   unsigned char minor;
@@ -84,20 +98,54 @@ STATIC_ASSERT(sizeof(cuda_context) <= sizeof(gpucontext),
               sizeof_struct_gpucontext_cuda);
 
 /*
- * About freeblocks.
+ * About allocator.
+ *
+ * This caches and reuses device allocations so that we can avoid the
+ * heavy cost and synchronization of cuMemAlloc() and cuMemFree().
+ * See util/suballoc.h for how it works.  The blocks it manages are
+ * embedded in gpudata instances (as the blk member).
+ *
+ * Each context has two of them: `allocator` for device memory and
+ * `host_allocator` for mapped pinned host memory (GA_BUFFER_HOST),
+ * which gets its memory from cuMemHostAlloc().  The blocks of the
+ * second one are flagged with CUDA_MAPPED_PTR.
  *
- * Freeblocks is a linked list of gpudata instances that are
- * considrered to be "free".  That is they are not in use anywhere
- * else in the program.  It is used to cache and reuse allocations so
- * that we can avoid the heavy cost and synchronization of
- * cuMemAlloc() and cuMemFree().
+ * Reuse is stream-ordered: a block released after being last used on
+ * the context stream goes back to the allocator right away since
+ * anything that reuses it will be queued after that work.  Events
+ * are not recorded for this.  Instead the block is marked with
+ * CUDA_STALE_EVENTS and its events are only brought up to date if it
+ * ends up being used on another stream (see cuda_waits()).
  *
- * It is ordered by pointer address.  When adding back to it, blocks
- * will be merged with their neighbours, but not across original
- * allocation lines (which are kept track of with the CUDA_HEAD_ALLOC
- * flag.
+ * A block released after being used on another stream is put on the
+ * pending list of the context and only goes back to the allocator
+ * once an event recorded on that stream has completed.  This is
+ * polled with cuEventQuery() when allocating.
  */
 
+/*
+ * About threads.
+ *
+ * The kernel and disk caches can always be used from multiple threads
+ * (see cache_striped()).  A lookup takes a reference on the kernel it
+ * finds.  The reference counts of contexts and kernels are atomic.
+ *
+ * With GA_CTX_MULTI_THREAD the kernel cache is split in KERNEL_STRIPES
+ * parts and the context gets its own locks (in `locks`):
+ *  - `alloc` for the allocators and the pending list,
+ *  - `kernel` to finish the background compilations (kernel_resolve()).
+ * Every cuda_enter() then pushes the context on the calling thread
+ * since the enter count is shared.  The staging ring is not used,
+ * transfers with pageable memory are direct.
+ *
+ * Without the flag, none of this is locked and the context must only
+ * be used by one thread at a time.
+ */
+typedef struct _cuda_locks {
+  ga_mutex alloc;
+  ga_mutex kernel;
+} cuda_locks;
+
 #define ARCH_PREFIX "compute_"
 
 cuda_context *cuda_make_ctx(CUcontext ctx, int flags);
@@ -105,6 +153,30 @@ CUstream cuda_get_stream(cuda_context *ctx);
 void cuda_enter(cuda_context *ctx);
 void cuda_exit(cuda_context *ctx);
 
+/*
+ * For bin/gpuarray-precompile.  These only need NVRTC, not a device.
+ *
+ * cuda_precompile_setup() loads NVRTC for a cuda version.
+ * cuda_precompile() compiles the full source of a kernel (as built
+ * from the flags, see cuda_precompile_preamble() for GA_USE_CLUDA) for
+ * an architecture (like "compute_35") and
+ * cuda_precompile_store() adds the result to a disk cache opened with
+ * cuda_precompile_cache() under the key that a context with the same
+ * cuda version and architecture would look for.
+ *
+ * cuda_manifest_sources() calls `fn` with the source of every kernel
+ * recorded in a preload manifest.  Returns -1 if it can't be read.
+ */
+int cuda_precompile_setup(int maj, int min, error *e);
+cache *cuda_precompile_cache(const char *path, int pack, error *e);
+void cuda_precompile_preamble(strb *src);
+int cuda_precompile(const char *arch, strb *src, strb *bin, strb *log,
+                    error *e);
+int cuda_precompile_store(cache *c, int maj, int min, const char *arch,
+                          const strb *src, const strb *bin, error *e);
+int cuda_manifest_sources(const char *path,
+                          void (*fn)(void *ud, const strb *src), void *ud);
+
 struct _gpudata {
   CUdeviceptr ptr;
   cuda_context *ctx;
@@ -116,7 +188,8 @@ struct _gpudata {
   unsigned int refcnt;
   int flags;
   size_t sz;
-  gpudata *next;
+  sa_block blk; /* allocator bookkeeping */
+  gpudata *pending_next;
 #ifdef DEBUG
   char tag[8];
 #endif
@@ -135,13 +208,17 @@ int cuda_record(gpudata *, int);
 #define CUDA_WAIT_ALL   (CUDA_WAIT_READ|CUDA_WAIT_WRITE)
 
 #define CUDA_IPC_MEMORY 0x100000
-#define CUDA_HEAD_ALLOC 0x200000
+#define CUDA_STALE_EVENTS 0x200000
 #define CUDA_MAPPED_PTR 0x400000
 
+typedef struct _cuda_compile cuda_compile;
+
 struct _gpukernel {
   cuda_context *ctx; /* Keep the context first */
   CUmodule m;
   CUfunction k;
+  cuda_compile *job; /* Compilation in progress or failed, if not NULL */
+  int preload; /* The job is a load from manifest_preload() */
   void **args;
   size_t bin_sz;
   void *bin;
@@ -153,4 +230,17 @@ struct _gpukernel {
 #endif
 };
 
+struct _gpuevent {
+  cuda_context *ctx; /* Keep the context first */
+  CUevent ev; /* recorded on mem_s after the transfer */
+  /* Reads into pageable memory go through a pinned buffer which is
+     copied to dst once the transfer is done */
+  gpudata *bounce;
+  void *dst;
+  size_t sz;
+#ifdef DEBUG
+  char tag[8];
+#endif
+};
+
 #endif
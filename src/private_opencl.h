@@ -3,6 +3,8 @@
 
 #include "private.h"
 
+#include <cache.h>
+
 #include "loaders/libopencl.h"
 
 #ifdef DEBUG
@@ -11,22 +13,27 @@
 #define CTX_TAG "ocl ctx "
 #define BUF_TAG "ocl buf "
 #define KER_TAG "ocl kern"
+#define EV_TAG "ocl ev  "
 
 #define TAG_CTX(c) memcpy((c)->tag, CTX_TAG, 8)
 #define TAG_BUF(b) memcpy((b)->tag, BUF_TAG, 8)
 #define TAG_KER(k) memcpy((k)->tag, KER_TAG, 8)
+#define TAG_EV(e) memcpy((e)->tag, EV_TAG, 8)
 #define ASSERT_CTX(c) assert(memcmp((c)->tag, CTX_TAG, 8) == 0)
 #define ASSERT_BUF(b) assert(memcmp((b)->tag, BUF_TAG, 8) == 0)
 #define ASSERT_KER(k) assert(memcmp((k)->tag, KER_TAG, 8) == 0)
+#define ASSERT_EV(e) assert(memcmp((e)->tag, EV_TAG, 8) == 0)
 #define CLEAR(o) memset((o)->tag, 0, 8);
 
 #else
 #define TAG_CTX(c)
 #define TAG_BUF(b)
 #define TAG_KER(k)
+#define TAG_EV(e)
 #define ASSERT_CTX(c)
 #define ASSERT_BUF(b)
 #define ASSERT_KER(k)
+#define ASSERT_EV(e)
 #define CLEAR(o)
 #endif
 
@@ -70,6 +77,8 @@ typedef struct _cl_ctx {
   cl_command_queue q;
   char *exts;
   char *preamble;
+  cache *kernel_cache;
+  cache *disk_cache;
 } cl_ctx;
 
 STATIC_ASSERT(sizeof(cl_ctx) <= sizeof(gpucontext), sizeof_struct_gpucontext_cl);
@@ -100,7 +109,31 @@ struct _gpukernel {
 #endif
 };
 
+struct _gpuevent {
+  cl_ctx *ctx; /* Keep the context first */
+  cl_event ev; /* NULL if there was nothing to do */
+#ifdef DEBUG
+  char tag[8];
+#endif
+};
+
 cl_ctx *cl_make_ctx(cl_context ctx, int flags);
+
+/*
+ * The disk cache of program binaries.  These don't need a device.
+ *
+ * cl_disk_cache() opens the cache at `path` like a context does for
+ * GPUARRAY_CACHE_PATH.  cl_disk_store() adds a copy of `bin` under
+ * the key for `src` built on the device named `dev_name` of the
+ * platform described by `bin_id` (see GA_CTX_PROP_BIN_ID) and
+ * cl_disk_load() looks it up.  The result of cl_disk_load() belongs
+ * to the cache.
+ */
+cache *cl_disk_cache(const char *path, error *e);
+int cl_disk_store(cache *c, const char *bin_id, const char *dev_name,
+                  const strb *src, const strb *bin, error *e);
+strb *cl_disk_load(cache *c, const char *bin_id, const char *dev_name,
+                   const strb *src);
 cl_command_queue cl_get_stream(gpucontext *ctx);
 gpudata *cl_make_buf(gpucontext *c, cl_mem buf);
 cl_mem cl_get_buf(gpudata *g);
@@ -0,0 +1,109 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "util/alloc_trace.h"
+#include "util/thread.h"
+
+/*
+ * trace_init() runs once, after that trace_file and the records are
+ * protected by trace_lock.
+ */
+static ga_once trace_once = GA_ONCE_INIT;
+static ga_mutex trace_lock;
+static int trace_on;
+static FILE *trace_file;
+static uint64_t trace_start;
+
+static uint64_t now_ns(void) {
+#ifdef _WIN32
+  LARGE_INTEGER c, f;
+  QueryPerformanceCounter(&c);
+  QueryPerformanceFrequency(&f);
+  return (uint64_t)((double)c.QuadPart * 1e9 / f.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static void trace_init(void) {
+  const char *path;
+
+  path = getenv("GPUARRAY_ALLOC_TRACE");
+  if (path == NULL || path[0] == '\0')
+    return;
+  if (ga_mutex_init(&trace_lock) != 0)
+    return;
+  trace_file = fopen(path, "wb");
+  if (trace_file == NULL) {
+    fprintf(stderr, "Could not open allocation trace file %s, "
+            "tracing disabled\n", path);
+    return;
+  }
+  /* Records are small, buffer a good number of them */
+  setvbuf(trace_file, NULL, _IOFBF, 1 << 16);
+  if (fwrite(ALLOC_TRACE_MAGIC, 8, 1, trace_file) != 1) {
+    fclose(trace_file);
+    trace_file = NULL;
+    return;
+  }
+  trace_start = now_ns();
+  trace_on = 1;
+}
+
+static void trace_write(uint32_t op, const void *ctx, const void *buf,
+                        size_t sz, int flags) {
+  alloc_trace_rec r;
+
+  ga_call_once(&trace_once, trace_init);
+  if (!trace_on)
+    return;
+  memset(&r, 0, sizeof(r));
+  r.ctx = (uint64_t)(uintptr_t)ctx;
+  r.buf = (uint64_t)(uintptr_t)buf;
+  r.size = sz;
+  r.op = op;
+  r.flags = (uint32_t)flags;
+  ga_mutex_lock(&trace_lock);
+  /* Take the time under the lock to keep the records in order */
+  r.time = now_ns() - trace_start;
+  if (trace_file != NULL && fwrite(&r, sizeof(r), 1, trace_file) != 1) {
+    /* Don't leave a trace with holes in it around */
+    fprintf(stderr, "Error writing allocation trace, tracing disabled\n");
+    fclose(trace_file);
+    trace_file = NULL;
+  }
+  ga_mutex_unlock(&trace_lock);
+}
+
+void alloc_trace_alloc(const void *ctx, const void *buf, size_t sz,
+                       int flags) {
+  trace_write(ALLOC_TRACE_ALLOC, ctx, buf, sz, flags);
+}
+
+void alloc_trace_free(const void *ctx, const void *buf) {
+  trace_write(ALLOC_TRACE_FREE, ctx, buf, 0, 0);
+}
+
+void alloc_trace_flush(void) {
+  ga_call_once(&trace_once, trace_init);
+  if (!trace_on)
+    return;
+  ga_mutex_lock(&trace_lock);
+  if (trace_file != NULL && fflush(trace_file) != 0) {
+    fprintf(stderr, "Error writing allocation trace, tracing disabled\n");
+    fclose(trace_file);
+    trace_file = NULL;
+  }
+  ga_mutex_unlock(&trace_lock);
+}
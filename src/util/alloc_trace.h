@@ -0,0 +1,65 @@
+#ifndef UTIL_ALLOC_TRACE_H
+#define UTIL_ALLOC_TRACE_H
+
+#include <stddef.h>
+
+#include "gpuarray/config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifdef CONFUSE_EMACS
+}
+#endif
+
+/*
+ * Allocation traces.
+ *
+ * If the GPUARRAY_ALLOC_TRACE environment variable is set to a file
+ * name, every buffer allocation and release that goes through the
+ * allocation cache is recorded in that file.  The trace can then be
+ * replayed offline with bin/gpuarray-alloc-replay to compare
+ * allocator settings.
+ *
+ * The file starts with the 8 bytes ALLOC_TRACE_MAGIC followed by
+ * alloc_trace_rec records in the native byte order.
+ */
+
+#define ALLOC_TRACE_MAGIC "GAATRC01"
+
+#define ALLOC_TRACE_ALLOC 1
+#define ALLOC_TRACE_FREE  2
+
+typedef struct _alloc_trace_rec {
+  uint64_t time;  /* nanoseconds since the start of the trace */
+  uint64_t ctx;   /* context identifier */
+  uint64_t buf;   /* buffer identifier, unique among live buffers */
+  uint64_t size;  /* requested size (0 for releases) */
+  uint32_t op;    /* ALLOC_TRACE_ALLOC or ALLOC_TRACE_FREE */
+  uint32_t flags; /* allocation flags */
+} alloc_trace_rec;
+
+/*
+ * Record an allocation of `sz` bytes.
+ *
+ * This does nothing if tracing is not enabled.
+ */
+void alloc_trace_alloc(const void *ctx, const void *buf, size_t sz,
+                       int flags);
+
+/* Record the release of `buf` */
+void alloc_trace_free(const void *ctx, const void *buf);
+
+/*
+ * Write out the buffered records.
+ *
+ * Called when a context is freed so that the trace is complete even
+ * if the process doesn't exit normally afterwards.
+ */
+void alloc_trace_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
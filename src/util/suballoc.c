@@ -0,0 +1,534 @@
+#include <stdlib.h>
+
+#include "util/suballoc.h"
+
+/* Number of size classes per power of two in the freelist */
+#define SA_SL_LOG2 4
+#define SA_SL_COUNT (1 << SA_SL_LOG2)
+/* Number of power of two classes in the freelist */
+#define SA_FL_COUNT (sizeof(size_t) * 8)
+/* The block size grows to keep it above reserved_bytes / SA_GROWTH_DIV */
+#define SA_GROWTH_DIV 8
+/* A cached large block is reused for requests that are at most
+   1/SA_LARGE_SLACK smaller than it */
+#define SA_LARGE_SLACK 8
+
+struct _suballoc {
+  const suballoc_ops *ops;
+  void *ud;
+  size_t block_size;
+  size_t max_block_size;
+  size_t large_threshold;
+  size_t frag_size;
+  /* Bit i is set if any of the bins of power class i is non-empty */
+  size_t fl_map;
+  /* Bit j of sl_map[i] is set if bin (i, j) is non-empty */
+  unsigned int sl_map[SA_FL_COUNT];
+  sa_block *bins[SA_FL_COUNT * SA_SL_COUNT];
+  /* Free large blocks (through next/prev), never split or merged */
+  sa_block *large;
+  /* Kept up to date as we go, except largest_free which is computed
+     on request */
+  gpucontext_memstats stats;
+};
+
+/* Index of the lowest set bit of a non-zero value */
+static inline unsigned int lowest_bit(size_t v) {
+#ifdef __GNUC__
+  return __builtin_ctzll(v);
+#else
+  unsigned int r = 0;
+  while (!(v & 1)) {
+    v >>= 1;
+    r++;
+  }
+  return r;
+#endif
+}
+
+/* Index of the highest set bit of a non-zero value */
+static inline unsigned int highest_bit(size_t v) {
+#ifdef __GNUC__
+  return (sizeof(unsigned long long) * 8 - 1) - __builtin_clzll(v);
+#else
+  unsigned int r = 0;
+  while (v >>= 1)
+    r++;
+  return r;
+#endif
+}
+
+/* Map a block size to its freelist bin */
+static inline void bin_mapping(size_t sz, unsigned int *fl, unsigned int *sl) {
+  /* Zero-sized blocks share the first bin */
+  if (sz == 0) {
+    *fl = 0;
+    *sl = 0;
+    return;
+  }
+  *fl = highest_bit(sz);
+  if (*fl >= SA_SL_LOG2)
+    *sl = (sz >> (*fl - SA_SL_LOG2)) - SA_SL_COUNT;
+  else
+    *sl = (sz << (SA_SL_LOG2 - *fl)) - SA_SL_COUNT;
+}
+
+#define BIN(fl, sl) ((fl) * SA_SL_COUNT + (sl))
+
+static void freelist_insert(suballoc *sa, sa_block *b) {
+  unsigned int fl, sl;
+
+  bin_mapping(b->sz, &fl, &sl);
+  b->prev = NULL;
+  b->next = sa->bins[BIN(fl, sl)];
+  if (b->next != NULL)
+    b->next->prev = b;
+  sa->bins[BIN(fl, sl)] = b;
+  sa->fl_map |= (size_t)1 << fl;
+  sa->sl_map[fl] |= 1U << sl;
+  b->flags |= SA_FREE_BLOCK;
+  sa->stats.cached_bytes += b->sz;
+  sa->stats.free_blocks++;
+}
+
+/* This must be called before any change to the size of the block */
+static void freelist_remove(suballoc *sa, sa_block *b) {
+  unsigned int fl, sl;
+
+  bin_mapping(b->sz, &fl, &sl);
+  if (b->next != NULL)
+    b->next->prev = b->prev;
+  if (b->prev != NULL) {
+    b->prev->next = b->next;
+  } else {
+    sa->bins[BIN(fl, sl)] = b->next;
+    if (b->next == NULL) {
+      sa->sl_map[fl] &= ~(1U << sl);
+      if (sa->sl_map[fl] == 0)
+        sa->fl_map &= ~((size_t)1 << fl);
+    }
+  }
+  b->next = NULL;
+  b->prev = NULL;
+  b->flags &= ~SA_FREE_BLOCK;
+  sa->stats.cached_bytes -= b->sz;
+  sa->stats.free_blocks--;
+}
+
+/*
+ * The large pool is a plain list since there are never many large
+ * blocks cached at once.
+ */
+static void large_insert(suballoc *sa, sa_block *b) {
+  b->prev = NULL;
+  b->next = sa->large;
+  if (b->next != NULL)
+    b->next->prev = b;
+  sa->large = b;
+  b->flags |= SA_FREE_BLOCK;
+  sa->stats.cached_bytes += b->sz;
+  sa->stats.free_blocks++;
+}
+
+static void large_remove(suballoc *sa, sa_block *b) {
+  if (b->next != NULL)
+    b->next->prev = b->prev;
+  if (b->prev != NULL)
+    b->prev->next = b->next;
+  else
+    sa->large = b->next;
+  b->next = NULL;
+  b->prev = NULL;
+  b->flags &= ~SA_FREE_BLOCK;
+  sa->stats.cached_bytes -= b->sz;
+  sa->stats.free_blocks--;
+}
+
+/*
+ * Find the smallest cached large block that fits `size` without
+ * wasting too much of it.  Large blocks are handed out whole.
+ */
+static sa_block *large_find(suballoc *sa, size_t size) {
+  sa_block *temp, *best = NULL;
+
+  for (temp = sa->large; temp; temp = temp->next) {
+    if (temp->sz >= size && temp->sz - size <= size / SA_LARGE_SLACK &&
+        (!best || temp->sz < best->sz))
+      best = temp;
+  }
+  return best;
+}
+
+static sa_block *block_new(suballoc *sa, size_t ptr, size_t sz) {
+  sa_block *res = sa->ops->block_new(sa->ud, ptr, sz);
+  if (res == NULL)
+    return NULL;
+  res->ptr = ptr;
+  res->sz = sz;
+  res->next = NULL;
+  res->prev = NULL;
+  res->addr_next = NULL;
+  res->addr_prev = NULL;
+  res->flags = 0;
+  return res;
+}
+
+/*
+ * Find the block in the free list that is the best fit for the size
+ * we want, which means the smallest that can still fit the size.
+ *
+ * The bin for the size class of the request may hold blocks that are
+ * too small, so it is searched for the best fit.  Past that, any
+ * block in the next non-empty bin will fit and is at most one size
+ * class bigger than the best fit, so we take the first one.
+ */
+static sa_block *find_best(suballoc *sa, size_t size) {
+  sa_block *temp, *best = NULL;
+  unsigned int fl, sl;
+  unsigned int sl_map;
+  size_t fl_map;
+
+  bin_mapping(size, &fl, &sl);
+
+  for (temp = sa->bins[BIN(fl, sl)]; temp; temp = temp->next) {
+    if (temp->sz >= size && (!best || temp->sz < best->sz)) {
+      best = temp;
+      if (best->sz == size)
+        break;
+    }
+  }
+  if (best != NULL)
+    return best;
+
+  if (++sl == SA_SL_COUNT) {
+    sl = 0;
+    fl++;
+  }
+  sl_map = (fl < SA_FL_COUNT) ? sa->sl_map[fl] & (~0U << sl) : 0;
+  if (sl_map == 0) {
+    fl_map = (fl + 1 < SA_FL_COUNT) ?
+      sa->fl_map & (~(size_t)0 << (fl + 1)) : 0;
+    if (fl_map == 0)
+      return NULL;
+    fl = lowest_bit(fl_map);
+    sl_map = sa->sl_map[fl];
+  }
+  sl = lowest_bit(sl_map);
+  return sa->bins[BIN(fl, sl)];
+}
+
+static size_t largest_free(suballoc *sa) {
+  sa_block *temp;
+  size_t sz = 0;
+  unsigned int fl, sl;
+
+  /* The largest free block is in the highest non-empty bin */
+  if (sa->fl_map != 0) {
+    fl = highest_bit(sa->fl_map);
+    sl = highest_bit(sa->sl_map[fl]);
+    for (temp = sa->bins[BIN(fl, sl)]; temp; temp = temp->next) {
+      if (temp->sz > sz) sz = temp->sz;
+    }
+  }
+  for (temp = sa->large; temp; temp = temp->next) {
+    if (temp->sz > sz) sz = temp->sz;
+  }
+  return sz;
+}
+
+static void release_head(suballoc *sa, sa_block *b) {
+  sa->stats.reserved_bytes -= b->sz;
+  sa->stats.blocks--;
+  sa->ops->raw_free(sa->ud, b->ptr, b->sz);
+  sa->ops->block_free(sa->ud, b);
+}
+
+/*
+ * Size of the next raw allocation for the freelist.
+ *
+ * This starts at block_size and doubles as the reserved memory grows
+ * so that a context that uses a lot of memory doesn't go to the raw
+ * allocator for every few megabytes, up to max_block_size.
+ */
+static size_t block_size(suballoc *sa) {
+  size_t sz = sa->block_size;
+  size_t target = sa->stats.reserved_bytes / SA_GROWTH_DIV;
+
+  while (sz < target && sz < sa->max_block_size / 2)
+    sz *= 2;
+  if (sz < target && sz < sa->max_block_size)
+    sz = sa->max_block_size;
+  return sz;
+}
+
+/*
+ * Get a new block of at least `size` bytes from the raw allocator.
+ * If `grow` is set, the block may be bigger to be split later.  If
+ * the raw allocator is out of memory, we first drop the extra size,
+ * then release the cached allocations that are entirely free and try
+ * again.
+ *
+ * The new block is not placed on the freelist, extract() takes care
+ * of putting back whatever is not used.
+ */
+static sa_block *allocate(suballoc *sa, size_t size, int grow) {
+  sa_block *res;
+  size_t ptr, bsize;
+  int err;
+
+  if (grow) {
+    if (size < sa->block_size) size = sa->block_size;
+    bsize = block_size(sa);
+    if (size < bsize) {
+      err = sa->ops->raw_alloc(sa->ud, bsize, &ptr);
+      if (err == GA_NO_ERROR) {
+        size = bsize;
+        goto done;
+      }
+      if (err != GA_MEMORY_ERROR)
+        return NULL;
+    }
+  }
+
+  err = sa->ops->raw_alloc(sa->ud, size, &ptr);
+  if (err == GA_MEMORY_ERROR && suballoc_trim(sa) != 0)
+    err = sa->ops->raw_alloc(sa->ud, size, &ptr);
+  if (err != GA_NO_ERROR)
+    return NULL;
+
+ done:
+  res = block_new(sa, ptr, size);
+  if (res == NULL) {
+    sa->ops->raw_free(sa->ud, ptr, size);
+    return NULL;
+  }
+
+  res->flags |= SA_HEAD_BLOCK;
+  sa->stats.reserved_bytes += size;
+  sa->stats.blocks++;
+
+  return res;
+}
+
+/*
+ * Cut `curr` to the requested size, possibly splitting it if it's
+ * too big.  `curr` must not be on the freelist.  The remaining block
+ * will be put on the freelist if there is a split.  On error, `curr`
+ * is put back on the freelist.
+ */
+static int extract(suballoc *sa, sa_block *curr, size_t size) {
+  sa_block *split;
+  size_t remaining = curr->sz - size;
+
+  if (remaining >= sa->frag_size) {
+    split = block_new(sa, curr->ptr + size, remaining);
+    if (split == NULL) {
+      freelist_insert(sa, curr);
+      return -1;
+    }
+    /* Keep the address order */
+    split->addr_prev = curr;
+    split->addr_next = curr->addr_next;
+    if (split->addr_next != NULL)
+      split->addr_next->addr_prev = split;
+    curr->addr_next = split;
+    curr->sz = size;
+    if (sa->ops->split)
+      sa->ops->split(sa->ud, curr, split);
+    freelist_insert(sa, split);
+    sa->stats.splits++;
+  }
+  /* Otherwise no need to split, the remaining block would be too small */
+
+  return 0;
+}
+
+static inline size_t roundup(size_t s, size_t m) {
+  return ((s + (m - 1)) / m) * m;
+}
+
+suballoc *suballoc_new(const suballoc_ops *ops, void *ud,
+                       size_t block_size, size_t frag_size, error *e) {
+  suballoc *res;
+
+  if (frag_size == 0) {
+    error_set(e, GA_VALUE_ERROR, "suballoc_new: frag_size must not be 0");
+    return NULL;
+  }
+  res = calloc(1, sizeof(*res));
+  if (res == NULL) {
+    error_sys(e, "calloc");
+    return NULL;
+  }
+  res->ops = ops;
+  res->ud = ud;
+  res->block_size = block_size;
+  res->max_block_size = block_size;
+  res->large_threshold = 0;
+  res->frag_size = frag_size;
+  return res;
+}
+
+void suballoc_destroy(suballoc *sa) {
+  sa_block *next, *curr;
+  size_t i;
+
+  /* Since no blocks are left, every raw allocation has been merged
+     back into its head block. */
+  for (i = 0; i < SA_FL_COUNT * SA_SL_COUNT; i++) {
+    for (curr = sa->bins[i]; curr != NULL; curr = next) {
+      next = curr->next;
+      if (curr->flags & SA_HEAD_BLOCK)
+        sa->ops->raw_free(sa->ud, curr->ptr, curr->sz);
+      sa->ops->block_free(sa->ud, curr);
+    }
+  }
+  for (curr = sa->large; curr != NULL; curr = next) {
+    next = curr->next;
+    sa->ops->raw_free(sa->ud, curr->ptr, curr->sz);
+    sa->ops->block_free(sa->ud, curr);
+  }
+  free(sa);
+}
+
+int suballoc_set_policy(suballoc *sa, const gpucontext_alloc_policy *p,
+                        error *e) {
+  if (sa->block_size == 0)
+    return error_set(e, GA_UNSUPPORTED_ERROR,
+                     "The allocation cache is disabled");
+  if (p->block_size == 0 || p->max_block_size < p->block_size)
+    return error_set(e, GA_VALUE_ERROR,
+                     "Invalid allocation policy: need 0 < block_size <= "
+                     "max_block_size");
+  sa->block_size = p->block_size;
+  sa->max_block_size = p->max_block_size;
+  sa->large_threshold = p->large_threshold;
+  return GA_NO_ERROR;
+}
+
+void suballoc_get_policy(suballoc *sa, gpucontext_alloc_policy *p) {
+  p->block_size = sa->block_size;
+  p->max_block_size = sa->max_block_size;
+  p->large_threshold = sa->large_threshold;
+}
+
+sa_block *suballoc_alloc(suballoc *sa, size_t sz) {
+  sa_block *res = NULL;
+  size_t asize;
+
+  if (sa->block_size == 0) {
+    res = allocate(sa, sz, 0);
+    if (res == NULL)
+      return NULL;
+  } else if (sa->large_threshold != 0 && sz >= sa->large_threshold) {
+    /* Large requests get their own raw allocation which is cached
+       apart so that it can't be nibbled by small requests */
+    asize = roundup(sz, sa->frag_size);
+    res = large_find(sa, asize);
+    if (res != NULL) {
+      large_remove(sa, res);
+    } else {
+      if ((res = allocate(sa, asize, 0)) == NULL)
+        return NULL;
+      res->flags |= SA_LARGE_BLOCK;
+    }
+  } else {
+    /* We don't want to manage really small allocations so we round
+     * up to a multiple of frag_size.  If that is a multiple of the
+     * alignment we need, this also ensures that if we split a block,
+     * the next block starts properly aligned.
+     */
+    asize = roundup(sz, sa->frag_size);
+    res = find_best(sa, asize);
+
+    if (res != NULL)
+      freelist_remove(sa, res);
+    else if ((res = allocate(sa, asize, 1)) == NULL)
+      return NULL;
+
+    if (extract(sa, res, asize) != 0)
+      return NULL;
+  }
+
+  sa->stats.allocs++;
+  sa->stats.live_bytes += res->sz;
+  if (sa->stats.live_bytes > sa->stats.peak_bytes)
+    sa->stats.peak_bytes = sa->stats.live_bytes;
+
+  return res;
+}
+
+void suballoc_free(suballoc *sa, sa_block *b) {
+  sa_block *prev = b->addr_prev, *next = b->addr_next;
+
+  sa->stats.frees++;
+  sa->stats.live_bytes -= b->sz;
+
+  if (sa->block_size == 0) {
+    release_head(sa, b);
+    return;
+  }
+
+  if (b->flags & SA_LARGE_BLOCK) {
+    large_insert(sa, b);
+    return;
+  }
+
+  /* See if we can merge the block with the previous one */
+  if (prev != NULL && (prev->flags & SA_FREE_BLOCK)) {
+    freelist_remove(sa, prev);
+    if (sa->ops->merge)
+      sa->ops->merge(sa->ud, prev, b);
+    prev->sz = prev->sz + b->sz;
+    prev->addr_next = next;
+    if (next != NULL)
+      next->addr_prev = prev;
+    sa->ops->block_free(sa->ud, b);
+    b = prev;
+    sa->stats.merges++;
+  }
+
+  /* See if we can merge with next */
+  if (next != NULL && (next->flags & SA_FREE_BLOCK)) {
+    freelist_remove(sa, next);
+    if (sa->ops->merge)
+      sa->ops->merge(sa->ud, b, next);
+    b->sz = b->sz + next->sz;
+    b->addr_next = next->addr_next;
+    if (b->addr_next != NULL)
+      b->addr_next->addr_prev = b;
+    sa->ops->block_free(sa->ud, next);
+    sa->stats.merges++;
+  }
+
+  freelist_insert(sa, b);
+}
+
+size_t suballoc_trim(suballoc *sa) {
+  sa_block *curr, *next;
+  size_t released = 0;
+  size_t i;
+
+  for (i = 0; i < SA_FL_COUNT * SA_SL_COUNT; i++) {
+    for (curr = sa->bins[i]; curr != NULL; curr = next) {
+      next = curr->next;
+      if ((curr->flags & SA_HEAD_BLOCK) && curr->addr_next == NULL) {
+        freelist_remove(sa, curr);
+        released += curr->sz;
+        release_head(sa, curr);
+      }
+    }
+  }
+  while (sa->large != NULL) {
+    curr = sa->large;
+    large_remove(sa, curr);
+    released += curr->sz;
+    release_head(sa, curr);
+  }
+  return released;
+}
+
+void suballoc_stats(suballoc *sa, gpucontext_memstats *st) {
+  *st = sa->stats;
+  st->largest_free = largest_free(sa);
+}
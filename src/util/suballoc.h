@@ -0,0 +1,167 @@
+#ifndef UTIL_SUBALLOC_H
+#define UTIL_SUBALLOC_H
+
+#include <stddef.h>
+
+#include "gpuarray/buffer.h"
+#include "util/error.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifdef CONFUSE_EMACS
+}
+#endif
+
+/*
+ * Sub-allocator.
+ *
+ * This caches big allocations obtained from a "raw" allocator (like
+ * cuMemAlloc()) and carves the requests out of them to avoid the
+ * cost and synchronization of going to the raw allocator every time.
+ * It doesn't care what the memory is, addresses are only used for
+ * arithmetic and all the work on the memory itself is done through
+ * the callbacks in suballoc_ops.
+ *
+ * The free blocks are segregated in bins by size class: a power of
+ * two class which is further split into SA_SL_COUNT linear classes.
+ * Each bin is a doubly linked list (through next/prev) and bitmaps
+ * record which bins are non-empty so that finding a block that fits
+ * a request doesn't have to go through all of them.
+ *
+ * Independently of that, all the blocks (free or not) that were cut
+ * from the same raw allocation are linked in address order through
+ * addr_next/addr_prev.  When a block is released, it is merged with
+ * its neighbours in that list if they are free.  This never crosses
+ * raw allocation lines since the head block of a raw allocation has
+ * no addr_prev.
+ *
+ * Raw allocations for the freelist start at block_size and their size
+ * doubles as the total reserved memory grows, up to max_block_size.
+ *
+ * Requests of at least large_threshold bytes (if not 0) get a raw
+ * allocation of their own which is kept on a separate list when
+ * released.  Those blocks are never split or merged and are only
+ * reused for requests of about the same size.
+ */
+
+typedef struct _sa_block sa_block;
+
+/*
+ * Block descriptor.
+ *
+ * This is meant to be embedded in a bigger structure that is created
+ * by the block_new() callback.  All the fields belong to the
+ * allocator, but `ptr` and `sz` can be read.  Note that `sz` can be
+ * bigger than the requested size.
+ */
+struct _sa_block {
+  size_t ptr;
+  size_t sz;
+  sa_block *next; /* freelist bin links */
+  sa_block *prev;
+  sa_block *addr_next; /* neighbours in the same raw allocation */
+  sa_block *addr_prev;
+  int flags;
+};
+
+/* Start of a raw allocation */
+#define SA_HEAD_BLOCK 0x1
+/* On the freelist */
+#define SA_FREE_BLOCK 0x2
+/* In the large pool */
+#define SA_LARGE_BLOCK 0x4
+
+typedef struct _suballoc_ops {
+  /*
+   * Get `sz` bytes from the raw allocator and put the address in
+   * `ptr`.
+   *
+   * Returns GA_NO_ERROR on success, GA_MEMORY_ERROR if the raw
+   * allocator is out of memory (the allocator will release what it
+   * can and try again) or some other error code.
+   */
+  int (*raw_alloc)(void *ud, size_t sz, size_t *ptr);
+  /* Give back a raw allocation */
+  void (*raw_free)(void *ud, size_t ptr, size_t sz);
+  /* Create a block descriptor for the memory at `ptr`, NULL on error */
+  sa_block *(*block_new)(void *ud, size_t ptr, size_t sz);
+  /* Delete a block descriptor */
+  void (*block_free)(void *ud, sa_block *b);
+  /*
+   * Called when `rest` was split from the end of `b`. Optional.
+   */
+  void (*split)(void *ud, sa_block *b, sa_block *rest);
+  /*
+   * Called when `from` is about to be merged into `into`, `from`
+   * will be deleted afterwards. Optional.
+   */
+  void (*merge)(void *ud, sa_block *into, sa_block *from);
+} suballoc_ops;
+
+typedef struct _suballoc suballoc;
+
+/*
+ * Create an allocator.
+ *
+ * Raw allocations will be at least `block_size` bytes and requests
+ * are rounded up to a multiple of `frag_size`, which is also the
+ * smallest block that will be split off.  A `block_size` of 0
+ * disables caching: every request goes to the raw allocator for the
+ * exact size and is given back when released.
+ *
+ * `ud` is passed to all the callbacks.
+ *
+ * The block size doesn't grow and the large pool is disabled until
+ * changed with suballoc_set_policy().
+ *
+ * Returns NULL on error.
+ */
+suballoc *suballoc_new(const suballoc_ops *ops, void *ud,
+                       size_t block_size, size_t frag_size, error *e);
+
+/*
+ * Change the block sizes and large pool threshold.
+ *
+ * This can be done at any time, blocks already handed out keep their
+ * place.  This is not supported if caching is disabled.
+ */
+int suballoc_set_policy(suballoc *sa, const gpucontext_alloc_policy *p,
+                        error *e);
+
+/* Get the current policy */
+void suballoc_get_policy(suballoc *sa, gpucontext_alloc_policy *p);
+
+/*
+ * Give back all the cached memory and delete the allocator.
+ *
+ * All the blocks must have been released before calling this.
+ */
+void suballoc_destroy(suballoc *sa);
+
+/*
+ * Get a block of at least `sz` bytes.
+ *
+ * Returns NULL on error.  The callbacks are responsible for reporting
+ * the details of the error.
+ */
+sa_block *suballoc_alloc(suballoc *sa, size_t sz);
+
+/* Release a block obtained from suballoc_alloc() */
+void suballoc_free(suballoc *sa, sa_block *b);
+
+/*
+ * Give back all the raw allocations that are entirely free.
+ *
+ * Returns the number of bytes given back.
+ */
+size_t suballoc_trim(suballoc *sa);
+
+/* Get the statistics for the allocator */
+void suballoc_stats(suballoc *sa, gpucontext_memstats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "util/thread.h"
+
+struct thread_start {
+  ga_thread_fn fn;
+  void *arg;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI thread_main(LPVOID p) {
+#else
+static void *thread_main(void *p) {
+#endif
+  struct thread_start s = *(struct thread_start *)p;
+  free(p);
+  s.fn(s.arg);
+  return 0;
+}
+
+int ga_thread_start(ga_thread *t, ga_thread_fn fn, void *arg) {
+  struct thread_start *s = malloc(sizeof(*s));
+  if (s == NULL)
+    return -1;
+  s->fn = fn;
+  s->arg = arg;
+#ifdef _WIN32
+  *t = CreateThread(NULL, 0, thread_main, s, 0, NULL);
+  if (*t == NULL) {
+#else
+  if (pthread_create(t, NULL, thread_main, s)) {
+#endif
+    free(s);
+    return -1;
+  }
+  return 0;
+}
+
+void ga_thread_join(ga_thread t) {
+#ifdef _WIN32
+  WaitForSingleObject(t, INFINITE);
+  CloseHandle(t);
+#else
+  pthread_join(t, NULL);
+#endif
+}
+
+#ifdef _WIN32
+struct once_start {
+  void (*fn)(void);
+};
+
+static BOOL CALLBACK once_main(PINIT_ONCE o, PVOID p, PVOID *ctx) {
+  ((struct once_start *)p)->fn();
+  return TRUE;
+}
+#endif
+
+void ga_call_once(ga_once *o, void (*fn)(void)) {
+#ifdef _WIN32
+  struct once_start s;
+  s.fn = fn;
+  InitOnceExecuteOnce(o, once_main, &s, NULL);
+#else
+  pthread_once(o, fn);
+#endif
+}
+
+unsigned int ga_ncpus(void) {
+#ifdef _WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return si.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    return 1;
+  return (unsigned int)n;
+#endif
+}
@@ -0,0 +1,175 @@
+#ifndef UTIL_THREAD_H
+#define UTIL_THREAD_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifdef CONFUSE_EMACS
+}
+#endif
+
+/*
+ * Minimal wrappers over pthreads and the Win32 threads.
+ *
+ * The functions that can fail return 0 on success and -1 on error.
+ */
+
+#ifdef _WIN32
+typedef HANDLE ga_thread;
+typedef CRITICAL_SECTION ga_mutex;
+typedef CONDITION_VARIABLE ga_cond;
+typedef INIT_ONCE ga_once;
+#define GA_ONCE_INIT INIT_ONCE_STATIC_INIT
+#else
+typedef pthread_t ga_thread;
+typedef pthread_mutex_t ga_mutex;
+typedef pthread_cond_t ga_cond;
+typedef pthread_once_t ga_once;
+#define GA_ONCE_INIT PTHREAD_ONCE_INIT
+#endif
+
+typedef void (*ga_thread_fn)(void *arg);
+
+int ga_thread_start(ga_thread *t, ga_thread_fn fn, void *arg);
+void ga_thread_join(ga_thread t);
+
+/*
+ * Runs `fn` the first time it is called for `o` (which must start as
+ * GA_ONCE_INIT).  Concurrent callers wait until `fn` has returned.
+ */
+void ga_call_once(ga_once *o, void (*fn)(void));
+
+/* Number of processors online, at least 1 */
+unsigned int ga_ncpus(void);
+
+/*
+ * ga_atomic_inc() and ga_atomic_dec() change a counter atomically and
+ * return the new value.  They are full memory barriers.
+ *
+ * ga_load_acquire() and ga_store_release() read and write a pointer
+ * with acquire and release ordering, to publish what was written
+ * before the store to the threads that see the new value.
+ */
+
+#ifdef _WIN32
+
+static inline int ga_mutex_init(ga_mutex *m) {
+  InitializeCriticalSection(m);
+  return 0;
+}
+
+static inline void ga_mutex_destroy(ga_mutex *m) {
+  DeleteCriticalSection(m);
+}
+
+static inline void ga_mutex_lock(ga_mutex *m) {
+  EnterCriticalSection(m);
+}
+
+static inline void ga_mutex_unlock(ga_mutex *m) {
+  LeaveCriticalSection(m);
+}
+
+static inline int ga_cond_init(ga_cond *c) {
+  InitializeConditionVariable(c);
+  return 0;
+}
+
+static inline void ga_cond_destroy(ga_cond *c) {
+}
+
+static inline void ga_cond_wait(ga_cond *c, ga_mutex *m) {
+  SleepConditionVariableCS(c, m, INFINITE);
+}
+
+static inline void ga_cond_signal(ga_cond *c) {
+  WakeConditionVariable(c);
+}
+
+static inline void ga_cond_broadcast(ga_cond *c) {
+  WakeAllConditionVariable(c);
+}
+
+static inline unsigned int ga_atomic_inc(volatile unsigned int *p) {
+  return (unsigned int)InterlockedIncrement((volatile LONG *)p);
+}
+
+static inline unsigned int ga_atomic_dec(volatile unsigned int *p) {
+  return (unsigned int)InterlockedDecrement((volatile LONG *)p);
+}
+
+static inline void *ga_load_acquire(void *volatile *p) {
+  return InterlockedCompareExchangePointer(p, NULL, NULL);
+}
+
+static inline void ga_store_release(void *volatile *p, void *v) {
+  InterlockedExchangePointer(p, v);
+}
+
+#else
+
+static inline int ga_mutex_init(ga_mutex *m) {
+  return pthread_mutex_init(m, NULL) ? -1 : 0;
+}
+
+static inline void ga_mutex_destroy(ga_mutex *m) {
+  pthread_mutex_destroy(m);
+}
+
+static inline void ga_mutex_lock(ga_mutex *m) {
+  pthread_mutex_lock(m);
+}
+
+static inline void ga_mutex_unlock(ga_mutex *m) {
+  pthread_mutex_unlock(m);
+}
+
+static inline int ga_cond_init(ga_cond *c) {
+  return pthread_cond_init(c, NULL) ? -1 : 0;
+}
+
+static inline void ga_cond_destroy(ga_cond *c) {
+  pthread_cond_destroy(c);
+}
+
+static inline void ga_cond_wait(ga_cond *c, ga_mutex *m) {
+  pthread_cond_wait(c, m);
+}
+
+static inline void ga_cond_signal(ga_cond *c) {
+  pthread_cond_signal(c);
+}
+
+static inline void ga_cond_broadcast(ga_cond *c) {
+  pthread_cond_broadcast(c);
+}
+
+static inline unsigned int ga_atomic_inc(volatile unsigned int *p) {
+  return __sync_add_and_fetch(p, 1);
+}
+
+static inline unsigned int ga_atomic_dec(volatile unsigned int *p) {
+  return __sync_sub_and_fetch(p, 1);
+}
+
+static inline void *ga_load_acquire(void *volatile *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void ga_store_release(void *volatile *p, void *v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+
+#include "util/workq.h"
+
+#define WORK_QUEUED  0
+#define WORK_RUNNING 1
+#define WORK_DONE    2
+
+struct _workq {
+  ga_mutex lock;
+  /* Signaled when work is queued or when stopping */
+  ga_cond more;
+  /* Signaled when work is done */
+  ga_cond done;
+  work *head;
+  work *tail;
+  int stop;
+  unsigned int nthreads;
+  ga_thread *threads;
+};
+
+static void worker(void *arg) {
+  workq *q = (workq *)arg;
+  work *w;
+
+  ga_mutex_lock(&q->lock);
+  for (;;) {
+    while (q->head == NULL && !q->stop)
+      ga_cond_wait(&q->more, &q->lock);
+    if (q->head == NULL)
+      break;
+    w = q->head;
+    q->head = w->next;
+    if (q->head == NULL)
+      q->tail = NULL;
+    w->state = WORK_RUNNING;
+    ga_mutex_unlock(&q->lock);
+
+    w->fn(w);
+
+    ga_mutex_lock(&q->lock);
+    w->state = WORK_DONE;
+    ga_cond_broadcast(&q->done);
+  }
+  ga_mutex_unlock(&q->lock);
+}
+
+workq *workq_new(unsigned int nthreads, error *e) {
+  workq *q;
+
+  q = calloc(1, sizeof(*q));
+  if (q == NULL) {
+    error_sys(e, "calloc");
+    return NULL;
+  }
+  q->threads = calloc(nthreads, sizeof(ga_thread));
+  if (q->threads == NULL) {
+    free(q);
+    error_sys(e, "calloc");
+    return NULL;
+  }
+  if (ga_mutex_init(&q->lock)) {
+    free(q->threads);
+    free(q);
+    error_set(e, GA_SYS_ERROR, "Could not create mutex");
+    return NULL;
+  }
+  if (ga_cond_init(&q->more) || ga_cond_init(&q->done)) {
+    ga_mutex_destroy(&q->lock);
+    free(q->threads);
+    free(q);
+    error_set(e, GA_SYS_ERROR, "Could not create condition variable");
+    return NULL;
+  }
+  for (q->nthreads = 0; q->nthreads < nthreads; q->nthreads++) {
+    if (ga_thread_start(&q->threads[q->nthreads], worker, q)) {
+      workq_free(q);
+      error_set(e, GA_SYS_ERROR, "Could not start worker thread");
+      return NULL;
+    }
+  }
+  return q;
+}
+
+void workq_free(workq *q) {
+  unsigned int i;
+
+  ga_mutex_lock(&q->lock);
+  q->stop = 1;
+  ga_cond_broadcast(&q->more);
+  ga_mutex_unlock(&q->lock);
+  for (i = 0; i < q->nthreads; i++)
+    ga_thread_join(q->threads[i]);
+  ga_cond_destroy(&q->done);
+  ga_cond_destroy(&q->more);
+  ga_mutex_destroy(&q->lock);
+  free(q->threads);
+  free(q);
+}
+
+void workq_submit(workq *q, work *w, work_fn fn) {
+  w->fn = fn;
+  w->next = NULL;
+  if (q == NULL) {
+    fn(w);
+    w->state = WORK_DONE;
+    return;
+  }
+  ga_mutex_lock(&q->lock);
+  w->state = WORK_QUEUED;
+  if (q->tail == NULL)
+    q->head = w;
+  else
+    q->tail->next = w;
+  q->tail = w;
+  ga_cond_signal(&q->more);
+  ga_mutex_unlock(&q->lock);
+}
+
+int workq_done(workq *q, work *w) {
+  int res;
+
+  if (q == NULL)
+    return 1;
+  ga_mutex_lock(&q->lock);
+  res = (w->state == WORK_DONE);
+  ga_mutex_unlock(&q->lock);
+  return res;
+}
+
+void workq_wait(workq *q, work *w) {
+  work *p, *prev = NULL;
+
+  if (q == NULL)
+    return;
+  ga_mutex_lock(&q->lock);
+  if (w->state == WORK_QUEUED) {
+    /* Take it out of the queue and run it here */
+    for (p = q->head; p != w; p = p->next)
+      prev = p;
+    if (prev == NULL)
+      q->head = w->next;
+    else
+      prev->next = w->next;
+    if (q->tail == w)
+      q->tail = prev;
+    w->state = WORK_RUNNING;
+    ga_mutex_unlock(&q->lock);
+
+    w->fn(w);
+
+    ga_mutex_lock(&q->lock);
+    w->state = WORK_DONE;
+  }
+  while (w->state != WORK_DONE)
+    ga_cond_wait(&q->done, &q->lock);
+  ga_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,76 @@
+#ifndef UTIL_WORKQ_H
+#define UTIL_WORKQ_H
+
+#include "util/error.h"
+#include "util/thread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifdef CONFUSE_EMACS
+}
+#endif
+
+/*
+ * Work queue.
+ *
+ * A fixed set of worker threads that run the submitted work items in
+ * order.  Waiting on an item that no worker has picked up yet runs it
+ * in the waiting thread instead, so that a caller that needs a result
+ * right away never sits behind unrelated work.
+ *
+ * A work item is meant to be embedded at the start of a bigger
+ * structure that holds the inputs and the results.  The work function
+ * must not touch anything that other threads may use without locking
+ * (this includes most of the library).
+ */
+
+typedef struct _workq workq;
+typedef struct _work work;
+
+typedef void (*work_fn)(work *w);
+
+struct _work {
+  work_fn fn;
+  work *next;
+  int state;
+};
+
+/*
+ * Create a queue with `nthreads` workers.
+ *
+ * Returns NULL on error.
+ */
+workq *workq_new(unsigned int nthreads, error *e);
+
+/*
+ * Wait for all the submitted work to be done, then stop the workers
+ * and free the queue.
+ */
+void workq_free(workq *q);
+
+/*
+ * Queue `w` to be run by `fn`.
+ *
+ * If `q` is NULL the work is run right away in the calling thread.
+ */
+void workq_submit(workq *q, work *w, work_fn fn);
+
+/*
+ * Returns 1 if `w` has been run, 0 otherwise.
+ */
+int workq_done(workq *q, work *w);
+
+/*
+ * Wait until `w` has been run.
+ *
+ * After this returns, all the effects of the work function are
+ * visible to the caller.
+ */
+void workq_wait(workq *q, work *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,350 @@
+/*
+ * Benchmark for the in-memory caches (cache_lru(), cache_twoq() and
+ * cache_tinylfu()) on lookup-heavy workloads.
+ *
+ * Usage: bench_cache [-n ops] [-s size ...]
+ *
+ * The caches are compared to a copy of the layout they used before
+ * (chained buckets with a malloc() per entry, see chained_lru below)
+ * to measure the open-addressing table and node arena of
+ * src/cache/table.h.
+ *
+ * Each workload fills a cache of `size` entries then does `ops`
+ * lookups, adding the key on a miss like the kernel cache does:
+ *
+ *   hits     uniform over the cached keys
+ *   skewed   90% of the lookups on 10% of the keys, the rest over
+ *            twice as many keys as fit
+ *   misses   uniform over four times as many keys as fit
+ *
+ * The keys are the size of a fingerprint and are compared through
+ * their pointer like the keys of the kernel cache.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+
+typedef struct _bkey {
+  uint64_t a;
+  uint64_t b;
+} bkey;
+
+static int bkey_eq(bkey *k1, bkey *k2) {
+  return k1->a == k2->a && k1->b == k2->b;
+}
+
+static uint32_t bkey_hash(bkey *k) {
+  uint64_t h = (k->a ^ (k->b * 0x9E3779B97F4A7C15ULL)) *
+               0xC2B2AE3D27D4EB4FULL;
+  return (uint32_t)(h >> 32);
+}
+
+/* Keys come from a pool so there is no allocation in the loop */
+static void bkey_free(bkey *k) {
+}
+
+static void bval_free(void *v) {
+}
+
+/* The previous layout of cache_lru() */
+typedef struct _cnode cnode;
+
+struct _cnode {
+  cnode *prev;
+  cnode *next;
+  cnode *h_next;
+  cache_key_t key;
+  cache_value_t val;
+};
+
+typedef struct _chained_lru {
+  cache c;
+  cnode **buckets;
+  size_t mask;
+  cnode *head;
+  cnode *tail;
+  size_t size;
+  size_t max_size;
+} chained_lru;
+
+static void cnode_unlink(chained_lru *c, cnode *n) {
+  if (n->prev != NULL)
+    n->prev->next = n->next;
+  else
+    c->head = n->next;
+  if (n->next != NULL)
+    n->next->prev = n->prev;
+  else
+    c->tail = n->prev;
+}
+
+static void cnode_push(chained_lru *c, cnode *n) {
+  n->next = NULL;
+  n->prev = c->tail;
+  if (c->tail != NULL)
+    c->tail->next = n;
+  else
+    c->head = n;
+  c->tail = n;
+}
+
+static cnode *chained_find(chained_lru *c, const cache_key_t k) {
+  cnode *n = c->buckets[c->c.khash(k) & c->mask];
+  while (n != NULL && !c->c.keq(n->key, k))
+    n = n->h_next;
+  return n;
+}
+
+static void chained_remove(chained_lru *c, cnode *n) {
+  cnode **p = &c->buckets[c->c.khash(n->key) & c->mask];
+  while (*p != n)
+    p = &(*p)->h_next;
+  *p = n->h_next;
+  cnode_unlink(c, n);
+  c->c.kfree(n->key);
+  c->c.vfree(n->val);
+  free(n);
+  c->size--;
+}
+
+static int chained_del(cache *_c, const cache_key_t k) {
+  chained_lru *c = (chained_lru *)_c;
+  cnode *n = chained_find(c, k);
+  if (n == NULL)
+    return 0;
+  chained_remove(c, n);
+  return 1;
+}
+
+static int chained_add(cache *_c, cache_key_t k, cache_value_t v) {
+  chained_lru *c = (chained_lru *)_c;
+  cnode **b;
+  cnode *n;
+
+  chained_del(_c, k);
+  n = malloc(sizeof(cnode));
+  if (n == NULL) {
+    c->c.kfree(k);
+    c->c.vfree(v);
+    return -1;
+  }
+  n->key = k;
+  n->val = v;
+  b = &c->buckets[c->c.khash(k) & c->mask];
+  n->h_next = *b;
+  *b = n;
+  cnode_push(c, n);
+  c->size++;
+  c->c.stats.inserts++;
+  while (c->size > c->max_size) {
+    chained_remove(c, c->head);
+    c->c.stats.evictions++;
+  }
+  return 0;
+}
+
+static cache_value_t chained_get(cache *_c, const cache_key_t k) {
+  chained_lru *c = (chained_lru *)_c;
+  cnode *n = chained_find(c, k);
+  if (n == NULL) {
+    c->c.stats.misses++;
+    return NULL;
+  }
+  c->c.stats.hits++;
+  cnode_unlink(c, n);
+  cnode_push(c, n);
+  return n->val;
+}
+
+static void chained_destroy(cache *_c) {
+  chained_lru *c = (chained_lru *)_c;
+  while (c->head != NULL)
+    chained_remove(c, c->head);
+  free(c->buckets);
+}
+
+static cache *chained_lru_new(size_t max_size) {
+  chained_lru *res = calloc(1, sizeof(*res));
+  size_t n = 1;
+
+  if (res == NULL)
+    return NULL;
+  while (n < max_size + max_size / 6)
+    n <<= 1;
+  res->buckets = calloc(n, sizeof(cnode *));
+  if (res->buckets == NULL) {
+    free(res);
+    return NULL;
+  }
+  res->mask = n - 1;
+  res->max_size = max_size;
+  res->c.add = chained_add;
+  res->c.del = chained_del;
+  res->c.get = chained_get;
+  res->c.destroy = chained_destroy;
+  res->c.keq = (cache_eq_fn)bkey_eq;
+  res->c.khash = (cache_hash_fn)bkey_hash;
+  res->c.kfree = (cache_freek_fn)bkey_free;
+  res->c.vfree = (cache_freev_fn)bval_free;
+  return (cache *)res;
+}
+
+static cache *new_lru(size_t size) {
+  return cache_lru(size, 0, (cache_eq_fn)bkey_eq, (cache_hash_fn)bkey_hash,
+                   (cache_freek_fn)bkey_free, (cache_freev_fn)bval_free,
+                   NULL);
+}
+
+static cache *new_twoq(size_t size) {
+  /* The split the kernel cache used */
+  return cache_twoq(size / 4, size / 2, size / 4, 0, (cache_eq_fn)bkey_eq,
+                    (cache_hash_fn)bkey_hash, (cache_freek_fn)bkey_free,
+                    (cache_freev_fn)bval_free, NULL);
+}
+
+static cache *new_tinylfu(size_t size) {
+  return cache_tinylfu(size, (cache_eq_fn)bkey_eq, (cache_hash_fn)bkey_hash,
+                       (cache_freek_fn)bkey_free, (cache_freev_fn)bval_free,
+                       NULL);
+}
+
+static const struct {
+  const char *name;
+  cache *(*make)(size_t);
+} layouts[] = {
+  {"chained lru", chained_lru_new},
+  {"lru", new_lru},
+  {"twoq", new_twoq},
+  {"tinylfu", new_tinylfu},
+};
+
+typedef struct _workload {
+  const char *name;
+  size_t nkeys;
+  uint32_t *seq;
+} workload;
+
+static uint32_t rnd(uint64_t *s) {
+  /* xorshift64* */
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return (uint32_t)((*s * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static int gen(workload *w, const char *name, size_t size, size_t ops) {
+  uint64_t s = 88172645463325252ULL;
+  size_t i, hot = size / 10 ? size / 10 : 1;
+  uint32_t r;
+
+  w->name = name;
+  w->seq = malloc(ops * sizeof(uint32_t));
+  if (w->seq == NULL)
+    return -1;
+  if (strcmp(name, "hits") == 0)
+    w->nkeys = size;
+  else if (strcmp(name, "skewed") == 0)
+    w->nkeys = size * 2;
+  else
+    w->nkeys = size * 4;
+  for (i = 0; i < ops; i++) {
+    r = rnd(&s);
+    if (w->nkeys == size * 2 && r % 10 != 0)
+      w->seq[i] = rnd(&s) % hot;
+    else
+      w->seq[i] = rnd(&s) % w->nkeys;
+  }
+  return 0;
+}
+
+static double now(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static int run(const workload *w, size_t size, size_t ops) {
+  bkey *keys, probe;
+  gpucache_stats st;
+  cache *c;
+  size_t i, l;
+  double t;
+
+  keys = malloc(w->nkeys * sizeof(bkey));
+  if (keys == NULL)
+    return -1;
+  for (i = 0; i < w->nkeys; i++) {
+    keys[i].a = i * 0x100000001B3ULL;
+    keys[i].b = ~(uint64_t)i;
+  }
+
+  for (l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+    c = layouts[l].make(size);
+    if (c == NULL) {
+      fprintf(stderr, "%s: could not create cache\n", layouts[l].name);
+      free(keys);
+      return -1;
+    }
+    for (i = 0; i < size && i < w->nkeys; i++)
+      cache_add(c, &keys[i], &keys[i]);
+
+    t = now();
+    for (i = 0; i < ops; i++) {
+      /* Look up with a copy like the kernel cache */
+      probe = keys[w->seq[i]];
+      if (cache_get(c, &probe) == NULL)
+        cache_add(c, &keys[w->seq[i]], &keys[w->seq[i]]);
+    }
+    t = now() - t;
+
+    cache_get_stats(c, &st);
+    printf("%-8s %8zu entries  %-12s %8.2f Mops/s  hit rate %.3f\n",
+           w->name, size, layouts[l].name, ops / t / 1e6,
+           (double)st.hits / (st.hits + st.misses));
+    cache_destroy(c);
+  }
+  free(keys);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  static const char *names[] = {"hits", "skewed", "misses"};
+  size_t sizes[16] = {64, 4096, 262144};
+  size_t nsizes = 3, ops = 10000000;
+  workload w;
+  size_t i, j;
+  int a, user_sizes = 0, res = 0;
+
+  for (a = 1; a < argc; a++) {
+    if (strcmp(argv[a], "-n") == 0 && a + 1 < argc) {
+      ops = strtoull(argv[++a], NULL, 0);
+    } else if (strcmp(argv[a], "-s") == 0 && a + 1 < argc && nsizes < 16) {
+      if (!user_sizes)
+        nsizes = 0;
+      user_sizes = 1;
+      sizes[nsizes++] = strtoull(argv[++a], NULL, 0);
+    } else {
+      fprintf(stderr, "Usage: %s [-n ops] [-s size ...]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  for (i = 0; i < nsizes; i++) {
+    for (j = 0; j < sizeof(names) / sizeof(names[0]); j++) {
+      if (gen(&w, names[j], sizes[i], ops)) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+      }
+      res |= run(&w, sizes[i], ops);
+      free(w.seq);
+    }
+  }
+  return res == 0 ? 0 : 1;
+}
@@ -0,0 +1,381 @@
+/*
+ * Hit rates of the cache policies (cache_lru(), cache_twoq() and
+ * cache_tinylfu()) on key streams.
+ *
+ * Usage: bench_cache_policy [-s size ...] [trace ...]
+ *
+ * Without traces, a set of synthetic streams is run.  A trace is a
+ * text file with one key per line, any string without spaces.  The
+ * cuda backend writes the kernel lookups of a program in this format
+ * when GPUARRAY_CACHE_TRACE is set (see gpuarray/buffer.h).
+ *
+ * Each key is looked up and added on a miss, like the kernel cache
+ * does.  The caches have `size` entries (256 by default, which is the
+ * size of the kernel cache).  twoq is split like the kernel cache was
+ * before it used tinylfu.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+typedef struct _stream {
+  const char *name;
+  unsigned int *keys;
+  size_t n;
+  size_t alloc;
+} stream;
+
+static int key_eq(unsigned int *a, unsigned int *b) {
+  return *a == *b;
+}
+
+static uint32_t key_hash(unsigned int *k) {
+  uint32_t h = *k;
+  h ^= h >> 16;
+  h *= 0x85EBCA6BU;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35U;
+  h ^= h >> 16;
+  return h;
+}
+
+static void key_free(unsigned int *k) {
+  free(k);
+}
+
+static void val_free(void *v) {
+}
+
+static cache *new_lru(size_t size) {
+  return cache_lru(size, 0, (cache_eq_fn)key_eq, (cache_hash_fn)key_hash,
+                   (cache_freek_fn)key_free, (cache_freev_fn)val_free,
+                   NULL);
+}
+
+static cache *new_twoq(size_t size) {
+  return cache_twoq(size / 4, size / 2, size / 4, 0, (cache_eq_fn)key_eq,
+                    (cache_hash_fn)key_hash, (cache_freek_fn)key_free,
+                    (cache_freev_fn)val_free, NULL);
+}
+
+static cache *new_tinylfu(size_t size) {
+  return cache_tinylfu(size, (cache_eq_fn)key_eq, (cache_hash_fn)key_hash,
+                       (cache_freek_fn)key_free, (cache_freev_fn)val_free,
+                       NULL);
+}
+
+static const struct {
+  const char *name;
+  cache *(*make)(size_t);
+} policies[] = {
+  {"lru", new_lru},
+  {"twoq", new_twoq},
+  {"tinylfu", new_tinylfu},
+};
+
+#define NPOLICIES (sizeof(policies) / sizeof(policies[0]))
+
+static int push(stream *s, unsigned int k) {
+  unsigned int *tmp;
+
+  if (s->n == s->alloc) {
+    s->alloc = s->alloc ? s->alloc * 2 : 4096;
+    tmp = realloc(s->keys, s->alloc * sizeof(unsigned int));
+    if (tmp == NULL)
+      return -1;
+    s->keys = tmp;
+  }
+  s->keys[s->n++] = k;
+  return 0;
+}
+
+static unsigned int rnd(void) {
+  static uint64_t s = 88172645463325252ULL;
+  s ^= s >> 12;
+  s ^= s << 25;
+  s ^= s >> 27;
+  return (unsigned int)((s * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/* Zipf distributed ranks over `nkeys` keys */
+typedef struct _zipf {
+  double *cdf;
+  size_t n;
+} zipf;
+
+static int zipf_init(zipf *z, size_t nkeys) {
+  double sum = 0;
+  size_t i;
+
+  z->cdf = malloc(nkeys * sizeof(double));
+  if (z->cdf == NULL)
+    return -1;
+  for (i = 0; i < nkeys; i++) {
+    sum += 1.0 / (i + 1);
+    z->cdf[i] = sum;
+  }
+  for (i = 0; i < nkeys; i++)
+    z->cdf[i] /= sum;
+  z->n = nkeys;
+  return 0;
+}
+
+static unsigned int zipf_next(zipf *z) {
+  double u = rnd() / 4294967296.0;
+  size_t lo = 0, hi = z->n - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (z->cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (unsigned int)lo;
+}
+
+/*
+ * A hot set of kernels used over and over, with bursts of one-off
+ * keys (like reductions on new shapes) in between.
+ */
+static int gen_bursts(stream *s, size_t size) {
+  unsigned int once = 1u << 30;
+  zipf z;
+  size_t i, j;
+  int res = 0;
+
+  if (zipf_init(&z, size))
+    return -1;
+  for (i = 0; i < 200; i++) {
+    for (j = 0; j < 4 * size; j++)
+      res |= push(s, zipf_next(&z));
+    for (j = 0; j < size * (1 + rnd() % 2); j++)
+      res |= push(s, once++);
+  }
+  free(z.cdf);
+  return res;
+}
+
+/* Zipf popularity over ten times as many keys as fit */
+static int gen_zipf(stream *s, size_t size) {
+  zipf z;
+  size_t i;
+  int res = 0;
+
+  if (zipf_init(&z, size * 10))
+    return -1;
+  for (i = 0; i < size * 1000; i++)
+    res |= push(s, zipf_next(&z));
+  free(z.cdf);
+  return res;
+}
+
+/* A working set that moves, to check that old popularity fades */
+static int gen_shift(stream *s, size_t size) {
+  zipf z;
+  size_t i, j;
+  int res = 0;
+
+  if (zipf_init(&z, size))
+    return -1;
+  for (i = 0; i < 50; i++)
+    for (j = 0; j < 20 * size; j++)
+      res |= push(s, zipf_next(&z) + i * (unsigned int)size);
+  free(z.cdf);
+  return res;
+}
+
+/* A loop over a bit more than fits */
+static int gen_loop(stream *s, size_t size) {
+  size_t i;
+  int res = 0;
+
+  for (i = 0; i < size * 1000; i++)
+    res |= push(s, (unsigned int)(i % (size + size / 2)));
+  return res;
+}
+
+/* Key ids for the strings of a trace */
+typedef struct _ientry {
+  char *s;
+  unsigned int id;
+} ientry;
+
+typedef struct _intern {
+  ientry *e;
+  size_t mask;
+  unsigned int n;
+} intern;
+
+static uint32_t str_hash(const char *s) {
+  uint32_t h = 2166136261U;
+  while (*s)
+    h = (h ^ (unsigned char)*s++) * 16777619U;
+  return h;
+}
+
+static ientry *intern_slot(intern *t, const char *s) {
+  size_t i = str_hash(s) & t->mask;
+  while (t->e[i].s != NULL && strcmp(t->e[i].s, s) != 0)
+    i = (i + 1) & t->mask;
+  return &t->e[i];
+}
+
+static int intern_key(intern *t, const char *s, unsigned int *id) {
+  ientry *old, *e;
+  size_t i, n;
+
+  if (t->n * 2 >= t->mask + 1) {
+    old = t->e;
+    n = t->mask + 1;
+    t->e = calloc(n * 2, sizeof(ientry));
+    if (t->e == NULL) {
+      t->e = old;
+      return -1;
+    }
+    t->mask = n * 2 - 1;
+    for (i = 0; i < n; i++)
+      if (old[i].s != NULL)
+        *intern_slot(t, old[i].s) = old[i];
+    free(old);
+  }
+  e = intern_slot(t, s);
+  if (e->s == NULL) {
+    e->s = strdup(s);
+    if (e->s == NULL)
+      return -1;
+    e->id = t->n++;
+  }
+  *id = e->id;
+  return 0;
+}
+
+static int load_trace(stream *s, const char *fname) {
+  intern t;
+  char line[1024];
+  unsigned int id;
+  FILE *f;
+  size_t i;
+  int res = 0;
+
+  f = fopen(fname, "r");
+  if (f == NULL) {
+    perror(fname);
+    return -1;
+  }
+  t.mask = 1023;
+  t.n = 0;
+  t.e = calloc(t.mask + 1, sizeof(ientry));
+  if (t.e == NULL) {
+    fclose(f);
+    return -1;
+  }
+  while (res == 0 && fgets(line, sizeof(line), f) != NULL) {
+    line[strcspn(line, " \t\r\n")] = '\0';
+    if (line[0] == '\0')
+      continue;
+    res = intern_key(&t, line, &id);
+    if (res == 0)
+      res = push(s, id);
+  }
+  fclose(f);
+  for (i = 0; i <= t.mask; i++)
+    free(t.e[i].s);
+  free(t.e);
+  if (res)
+    fprintf(stderr, "%s: out of memory\n", fname);
+  else
+    printf("%s: %zu lookups, %u keys\n", fname, s->n, t.n);
+  return res;
+}
+
+static int run(const stream *s, size_t size) {
+  gpucache_stats st;
+  unsigned int *k;
+  cache *c;
+  size_t i, p;
+
+  printf("%-12s %6zu entries", s->name, size);
+  for (p = 0; p < NPOLICIES; p++) {
+    c = policies[p].make(size);
+    if (c == NULL) {
+      fprintf(stderr, "\n%s: could not create cache\n", policies[p].name);
+      return -1;
+    }
+    for (i = 0; i < s->n; i++) {
+      if (cache_get(c, &s->keys[i]) == NULL) {
+        k = malloc(sizeof(*k));
+        if (k == NULL) {
+          cache_destroy(c);
+          return -1;
+        }
+        *k = s->keys[i];
+        /* Any non-NULL value will do */
+        cache_add(c, k, k);
+      }
+    }
+    cache_get_stats(c, &st);
+    printf("  %s %.3f", policies[p].name,
+           (double)st.hits / (st.hits + st.misses));
+    cache_destroy(c);
+  }
+  printf("\n");
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  static const struct {
+    const char *name;
+    int (*gen)(stream *, size_t);
+  } gens[] = {
+    {"bursts", gen_bursts},
+    {"zipf", gen_zipf},
+    {"shift", gen_shift},
+    {"loop", gen_loop},
+  };
+  size_t sizes[16] = {256};
+  size_t nsizes = 1, i, j;
+  stream s;
+  int a, user_sizes = 0, res = 0;
+
+  for (a = 1; a < argc && argv[a][0] == '-'; a++) {
+    if (strcmp(argv[a], "-s") == 0 && a + 1 < argc && nsizes < 16) {
+      if (!user_sizes)
+        nsizes = 0;
+      user_sizes = 1;
+      sizes[nsizes++] = strtoull(argv[++a], NULL, 0);
+    } else {
+      fprintf(stderr, "Usage: %s [-s size ...] [trace ...]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if (a == argc) {
+    for (i = 0; i < nsizes; i++) {
+      for (j = 0; j < sizeof(gens) / sizeof(gens[0]); j++) {
+        memset(&s, 0, sizeof(s));
+        s.name = gens[j].name;
+        if (gens[j].gen(&s, sizes[i]) == 0)
+          res |= run(&s, sizes[i]);
+        else
+          res = -1;
+        free(s.keys);
+      }
+    }
+  }
+
+  for (; a < argc; a++) {
+    memset(&s, 0, sizeof(s));
+    s.name = argv[a];
+    if (load_trace(&s, argv[a]) == 0)
+      for (i = 0; i < nsizes; i++)
+        res |= run(&s, sizes[i]);
+    else
+      res = -1;
+    free(s.keys);
+  }
+
+  return res == 0 ? 0 : 1;
+}
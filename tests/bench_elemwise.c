@@ -0,0 +1,198 @@
+/*
+ * Host overhead of GpuElemwise_call() and GpuElemwisePlan_call().
+ *
+ * Usage: bench_elemwise [-n iters] device
+ *
+ * where device is cuda<n> or opencl<p>:<d>.  For a few small cases
+ * (contiguous, mixed C and F order, broadcasting) this reports the
+ * time per call in microseconds when going through GpuElemwise_call()
+ * and through a plan.  The kernels are tiny so this is mostly time
+ * spent on the host.
+ *
+ * Against the stub driver in tests/stub the launches do nothing and
+ * only the host overhead is measured:
+ *
+ *   LD_LIBRARY_PATH=tests/stub STUB_CUDA_MEMORY=16777216 \
+ *     ./bench_elemwise cuda0
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gpuarray/array.h"
+#include "gpuarray/buffer.h"
+#include "gpuarray/elemwise.h"
+#include "gpuarray/error.h"
+
+static double now(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static int parse_dev(const char *dev, const char **name) {
+  char *end;
+  long no, no2;
+  if (strncmp(dev, "cuda", 4) == 0) {
+    *name = "cuda";
+    no = strtol(dev + 4, &end, 10);
+    if (end == dev + 4 || *end != '\0' || no < 0 || no > INT_MAX)
+      return -1;
+    return (int)no;
+  }
+  if (strncmp(dev, "opencl", 6) == 0) {
+    *name = "opencl";
+    no = strtol(dev + 6, &end, 10);
+    if (end == dev + 6 || *end != ':' || no < 0 || no > 32768)
+      return -1;
+    dev = end + 1;
+    no2 = strtol(dev, &end, 10);
+    if (end == dev || *end != '\0' || no2 < 0 || no2 > 32768)
+      return -1;
+    return (int)((no << 16) | no2);
+  }
+  return -1;
+}
+
+typedef struct _bench_case {
+  const char *name;
+  unsigned int nd;
+  size_t dims[3];
+  ga_order border; /* Order of b */
+  int bcast; /* b has a size of 1 in its first dimension */
+  int flags;
+} bench_case;
+
+static const bench_case cases[] = {
+  {"contig", 1, {1000}, GA_C_ORDER, 0, 0},
+  {"c+f", 3, {8, 10, 12}, GA_F_ORDER, 0, 0},
+  {"broadcast", 2, {32, 32}, GA_C_ORDER, 1, GE_BROADCAST},
+};
+
+#define NCASES (sizeof(cases) / sizeof(cases[0]))
+
+/* Returns 0 on success and prints the times */
+static int run(gpucontext *ctx, const bench_case *bc, unsigned int n) {
+  GpuArray a, b, c;
+  GpuElemwise *ge;
+  GpuElemwisePlan *plan;
+  gpuelemwise_arg args[4];
+  void *rargs[4];
+  size_t bdims[3];
+  float x = 2;
+  double t;
+  unsigned int i;
+  int err;
+
+  memcpy(bdims, bc->dims, sizeof(bdims));
+  if (bc->bcast)
+    bdims[0] = 1;
+
+  if ((err = GpuArray_empty(&a, ctx, GA_FLOAT, bc->nd, bc->dims,
+                            GA_C_ORDER)) != GA_NO_ERROR)
+    return err;
+  if ((err = GpuArray_empty(&b, ctx, GA_FLOAT, bc->nd, bdims,
+                            bc->border)) != GA_NO_ERROR)
+    return err;
+  if ((err = GpuArray_empty(&c, ctx, GA_FLOAT, bc->nd, bc->dims,
+                            GA_C_ORDER)) != GA_NO_ERROR)
+    return err;
+
+  args[0].name = "a";
+  args[0].typecode = GA_FLOAT;
+  args[0].flags = GE_READ;
+  args[1].name = "b";
+  args[1].typecode = GA_FLOAT;
+  args[1].flags = GE_READ;
+  args[2].name = "x";
+  args[2].typecode = GA_FLOAT;
+  args[2].flags = GE_SCALAR;
+  args[3].name = "c";
+  args[3].typecode = GA_FLOAT;
+  args[3].flags = GE_WRITE;
+  rargs[0] = &a;
+  rargs[1] = &b;
+  rargs[2] = &x;
+  rargs[3] = &c;
+
+  ge = GpuElemwise_new(ctx, "", "c = a * x + b", 4, args, bc->nd, 0);
+  if (ge == NULL)
+    return GA_MEMORY_ERROR;
+
+  /* Warm up (and build the kernel) */
+  if ((err = GpuElemwise_call(ge, rargs, bc->flags)) != GA_NO_ERROR)
+    return err;
+
+  t = now();
+  for (i = 0; i < n; i++)
+    if ((err = GpuElemwise_call(ge, rargs, bc->flags)) != GA_NO_ERROR)
+      return err;
+  if ((err = GpuArray_sync(&c)) != GA_NO_ERROR)
+    return err;
+  t = now() - t;
+  printf("%-10s %9.3f", bc->name, t * 1e6 / n);
+
+  plan = GpuElemwisePlan_new(ge, rargs, bc->flags, &err);
+  if (plan == NULL)
+    return err;
+
+  t = now();
+  for (i = 0; i < n; i++)
+    if ((err = GpuElemwisePlan_call(plan, rargs)) != GA_NO_ERROR)
+      return err;
+  if ((err = GpuArray_sync(&c)) != GA_NO_ERROR)
+    return err;
+  t = now() - t;
+  printf(" %9.3f\n", t * 1e6 / n);
+
+  GpuElemwisePlan_free(plan);
+  GpuElemwise_free(ge);
+  GpuArray_clear(&c);
+  GpuArray_clear(&b);
+  GpuArray_clear(&a);
+  return GA_NO_ERROR;
+}
+
+int main(int argc, char *argv[]) {
+  gpucontext *ctx;
+  const char *name;
+  unsigned int n = 100000;
+  size_t i;
+  int a, dev, err;
+
+  for (a = 1; a < argc - 1; a++) {
+    if (strcmp(argv[a], "-n") == 0 && a + 2 < argc) {
+      n = (unsigned int)strtoul(argv[++a], NULL, 10);
+    } else {
+      break;
+    }
+  }
+  if (a != argc - 1 || n == 0 || (dev = parse_dev(argv[a], &name)) == -1) {
+    fprintf(stderr, "Usage: %s [-n iters] device\n", argv[0]);
+    return 2;
+  }
+
+  ctx = gpucontext_init(name, dev, 0, &err);
+  if (ctx == NULL) {
+    fprintf(stderr, "Could not open %s: %s\n", argv[a],
+            gpucontext_error(NULL, err));
+    return 1;
+  }
+
+  printf("%-10s %9s %9s  (us per call)\n", "case", "call", "plan");
+  for (i = 0; i < NCASES; i++) {
+    if ((err = run(ctx, &cases[i], n)) != GA_NO_ERROR) {
+      fprintf(stderr, "\nError: %s\n", gpucontext_error(ctx, err));
+      return 1;
+    }
+  }
+
+  gpucontext_deref(ctx);
+  return 0;
+}
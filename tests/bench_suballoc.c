@@ -0,0 +1,331 @@
+/*
+ * Benchmark for the sub-allocator (util/suballoc.h) on host memory.
+ *
+ * Usage: bench_suballoc [-b block_size] [-f frag_size] [trace ...]
+ *
+ * Without traces, a set of synthetic patterns is run.  A trace is a
+ * text file with one operation per line:
+ *
+ *   a <id> <size>   allocate a buffer of <size> bytes named <id>
+ *   f <id>          release buffer <id>
+ *
+ * where <id> is a number below 2^20.  Buffers still alive at the end
+ * are released.
+ *
+ * For each pattern this reports the throughput, the peak memory in
+ * use and obtained from the raw allocator and the fragmentation of
+ * the cache (1 - largest free block / cached bytes) averaged over the
+ * run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util/suballoc.h"
+
+#define MAX_IDS (1 << 20)
+
+typedef struct _bench_mem {
+  size_t used;
+  size_t peak;
+  size_t raw_allocs;
+} bench_mem;
+
+static int bench_raw_alloc(void *ud, size_t sz, size_t *ptr) {
+  bench_mem *m = (bench_mem *)ud;
+  void *p = malloc(sz == 0 ? 1 : sz);
+  if (p == NULL)
+    return GA_MEMORY_ERROR;
+  m->used += sz;
+  if (m->used > m->peak)
+    m->peak = m->used;
+  m->raw_allocs++;
+  *ptr = (size_t)p;
+  return GA_NO_ERROR;
+}
+
+static void bench_raw_free(void *ud, size_t ptr, size_t sz) {
+  ((bench_mem *)ud)->used -= sz;
+  free((void *)ptr);
+}
+
+static sa_block *bench_block_new(void *ud, size_t ptr, size_t sz) {
+  return malloc(sizeof(sa_block));
+}
+
+static void bench_block_free(void *ud, sa_block *b) {
+  free(b);
+}
+
+static const suballoc_ops bench_ops = {
+  bench_raw_alloc,
+  bench_raw_free,
+  bench_block_new,
+  bench_block_free,
+  NULL,
+  NULL,
+};
+
+typedef struct _op {
+  unsigned int id;
+  size_t sz; /* (size_t)-1 for a release */
+} op;
+
+#define OP_FREE ((size_t)-1)
+
+typedef struct _pattern {
+  const char *name;
+  op *ops;
+  size_t n;
+  size_t a;
+} pattern;
+
+static void add_op(pattern *p, unsigned int id, size_t sz) {
+  if (p->n == p->a) {
+    p->a = p->a ? p->a * 2 : 1024;
+    p->ops = realloc(p->ops, p->a * sizeof(op));
+    if (p->ops == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  p->ops[p->n].id = id;
+  p->ops[p->n].sz = sz;
+  p->n++;
+}
+
+static double now(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* Sizes spread over a few orders of magnitude, mostly small */
+static size_t rand_size(void) {
+  size_t r = rand();
+  switch (r % 10) {
+  case 0:
+    return 1 + rand() % (16 << 20);
+  case 1:
+  case 2:
+    return 1 + rand() % (1 << 20);
+  default:
+    return 1 + rand() % 4096;
+  }
+}
+
+/* Allocate and release at random */
+static void gen_random(pattern *p, size_t n) {
+  unsigned char alive[1024];
+  unsigned int i;
+  size_t k;
+
+  memset(alive, 0, sizeof(alive));
+  for (k = 0; k < n; k++) {
+    i = rand() % 1024;
+    add_op(p, i, alive[i] ? OP_FREE : rand_size());
+    alive[i] = !alive[i];
+  }
+}
+
+/* Batches allocated together and released in reverse order */
+static void gen_stack(pattern *p, size_t n) {
+  unsigned int i, depth;
+  size_t k = 0;
+
+  while (k < n) {
+    depth = 1 + rand() % 64;
+    for (i = 0; i < depth; i++)
+      add_op(p, i, rand_size());
+    for (i = depth; i > 0; i--)
+      add_op(p, i - 1, OP_FREE);
+    k += 2 * depth;
+  }
+}
+
+/*
+ * Something that looks like training a model: some long lived
+ * buffers (parameters) and for each step a series of temporaries of
+ * the same sizes every time, released in a different order than
+ * they were allocated.
+ */
+static void gen_training(pattern *p, size_t n) {
+  size_t params[32], temps[128];
+  unsigned int i;
+  size_t k = 0;
+
+  for (i = 0; i < 32; i++) {
+    params[i] = rand_size();
+    add_op(p, i, params[i]);
+  }
+  for (i = 0; i < 128; i++)
+    temps[i] = rand_size();
+  while (k < n) {
+    for (i = 0; i < 128; i++) {
+      add_op(p, 32 + i, temps[i]);
+      if (i >= 4)
+        add_op(p, 32 + i - 4, OP_FREE);
+    }
+    for (i = 124; i < 128; i++)
+      add_op(p, 32 + i, OP_FREE);
+    k += 256;
+  }
+  for (i = 0; i < 32; i++)
+    add_op(p, i, OP_FREE);
+}
+
+static int load_trace(pattern *p, const char *fname) {
+  FILE *f = fopen(fname, "r");
+  char line[256];
+  unsigned long id;
+  unsigned long long sz;
+  size_t lineno = 0;
+
+  if (f == NULL) {
+    perror(fname);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    if (sscanf(line, "a %lu %llu", &id, &sz) == 2 && id < MAX_IDS) {
+      add_op(p, (unsigned int)id, (size_t)sz);
+    } else if (sscanf(line, "f %lu", &id) == 1 && id < MAX_IDS) {
+      add_op(p, (unsigned int)id, OP_FREE);
+    } else if (line[0] != '\n' && line[0] != '#') {
+      fprintf(stderr, "%s:%zu: bad line\n", fname, lineno);
+      fclose(f);
+      return -1;
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+static int run(const pattern *p, size_t block_size, size_t frag_size) {
+  gpucontext_memstats st;
+  bench_mem mem;
+  suballoc *sa;
+  sa_block **live;
+  double t, frag = 0;
+  size_t samples = 0;
+  size_t peak_live = 0;
+  size_t i;
+
+  live = calloc(MAX_IDS, sizeof(sa_block *));
+  if (live == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  memset(&mem, 0, sizeof(mem));
+  sa = suballoc_new(&bench_ops, &mem, block_size, frag_size, global_err);
+  if (sa == NULL) {
+    fprintf(stderr, "%s\n", global_err->msg);
+    free(live);
+    return -1;
+  }
+
+  t = now();
+  for (i = 0; i < p->n; i++) {
+    const op *o = &p->ops[i];
+    if (o->sz == OP_FREE) {
+      if (live[o->id] == NULL)
+        continue;
+      suballoc_free(sa, live[o->id]);
+      live[o->id] = NULL;
+    } else {
+      if (live[o->id] != NULL)
+        suballoc_free(sa, live[o->id]);
+      live[o->id] = suballoc_alloc(sa, o->sz);
+      if (live[o->id] == NULL) {
+        fprintf(stderr, "%s: allocation of %zu bytes failed\n", p->name,
+                o->sz);
+        break;
+      }
+    }
+    /* Sampling is kept out of the timing as much as possible by
+       doing it rarely */
+    if ((i & 1023) == 0) {
+      suballoc_stats(sa, &st);
+      if (st.cached_bytes != 0)
+        frag += 1.0 - (double)st.largest_free / st.cached_bytes;
+      samples++;
+    }
+  }
+  t = now() - t;
+
+  suballoc_stats(sa, &st);
+  peak_live = st.peak_bytes;
+  for (i = 0; i < MAX_IDS; i++)
+    if (live[i] != NULL)
+      suballoc_free(sa, live[i]);
+  suballoc_destroy(sa);
+  free(live);
+
+  printf("%-12s %9zu ops %8.2f Mops/s  peak live %8.1f MB  "
+         "peak reserved %8.1f MB (x%.2f)  raw allocs %6zu  "
+         "fragmentation %.3f\n",
+         p->name, p->n, p->n / t / 1e6, peak_live / 1048576.0,
+         mem.peak / 1048576.0,
+         peak_live ? (double)mem.peak / peak_live : 0.0,
+         mem.raw_allocs, samples ? frag / samples : 0.0);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t block_size = 4 * 1024 * 1024;
+  size_t frag_size = 64;
+  pattern p;
+  int i, res = 0;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      block_size = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      frag_size = strtoull(argv[++i], NULL, 0);
+    } else {
+      fprintf(stderr, "Usage: %s [-b block_size] [-f frag_size] "
+              "[trace ...]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  printf("block size %zu, frag size %zu\n", block_size, frag_size);
+
+  if (i == argc) {
+    srand(42);
+    memset(&p, 0, sizeof(p));
+    p.name = "random";
+    gen_random(&p, 1000000);
+    res |= run(&p, block_size, frag_size);
+    free(p.ops);
+
+    memset(&p, 0, sizeof(p));
+    p.name = "stack";
+    gen_stack(&p, 1000000);
+    res |= run(&p, block_size, frag_size);
+    free(p.ops);
+
+    memset(&p, 0, sizeof(p));
+    p.name = "training";
+    gen_training(&p, 1000000);
+    res |= run(&p, block_size, frag_size);
+    free(p.ops);
+  }
+
+  for (; i < argc; i++) {
+    memset(&p, 0, sizeof(p));
+    p.name = argv[i];
+    if (load_trace(&p, argv[i]) == 0)
+      res |= run(&p, block_size, frag_size);
+    else
+      res = -1;
+    free(p.ops);
+  }
+
+  return res == 0 ? 0 : 1;
+}
@@ -0,0 +1,170 @@
+/*
+ * Host <-> device bandwidth benchmark for gpudata_write() and
+ * gpudata_read().
+ *
+ * Usage: bench_transfer [-n iters] [-s max_size] device
+ *
+ * where device is cuda<n> or opencl<p>:<d>.  For a range of sizes up
+ * to max_size (default 64M, K/M/G suffixes are accepted) this
+ * reports the bandwidth of transfers with pageable host memory
+ * (malloc) and, if the backend supports GA_BUFFER_HOST, with pinned
+ * host memory.  On cuda, the large pageable transfers go through the
+ * staging buffers of the context.
+ *
+ * This can be run against the stub driver in tests/stub to check the
+ * logic, the numbers are only meaningful on a real device.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gpuarray/buffer.h"
+#include "gpuarray/error.h"
+
+static double now(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static size_t parse_size(const char *s) {
+  char *end;
+  unsigned long long v = strtoull(s, &end, 10);
+  switch (*end) {
+  case 'G': case 'g': v *= 1024;
+  case 'M': case 'm': v *= 1024;
+  case 'K': case 'k': v *= 1024;
+    end++;
+  }
+  if (end == s || *end != '\0')
+    return 0;
+  return (size_t)v;
+}
+
+static int parse_dev(const char *dev, const char **name) {
+  char *end;
+  long no, no2;
+  if (strncmp(dev, "cuda", 4) == 0) {
+    *name = "cuda";
+    no = strtol(dev + 4, &end, 10);
+    if (end == dev + 4 || *end != '\0' || no < 0 || no > INT_MAX)
+      return -1;
+    return (int)no;
+  }
+  if (strncmp(dev, "opencl", 6) == 0) {
+    *name = "opencl";
+    no = strtol(dev + 6, &end, 10);
+    if (end == dev + 6 || *end != ':' || no < 0 || no > 32768)
+      return -1;
+    dev = end + 1;
+    no2 = strtol(dev, &end, 10);
+    if (end == dev || *end != '\0' || no2 < 0 || no2 > 32768)
+      return -1;
+    return (int)((no << 16) | no2);
+  }
+  return -1;
+}
+
+static double gbps(size_t sz, unsigned int n, double t) {
+  return t > 0 ? (double)sz * n / t / 1e9 : 0;
+}
+
+/* Returns 0 on success and prints the bandwidths */
+static int run(gpudata *d, char *host, size_t sz, unsigned int n) {
+  double t;
+  unsigned int i;
+  int err;
+
+  /* Warm up (and allocate the staging buffers) */
+  if ((err = gpudata_write(d, 0, host, sz)) != GA_NO_ERROR ||
+      (err = gpudata_read(host, d, 0, sz)) != GA_NO_ERROR)
+    return err;
+
+  t = now();
+  for (i = 0; i < n; i++)
+    if ((err = gpudata_write(d, 0, host, sz)) != GA_NO_ERROR)
+      return err;
+  if ((err = gpudata_sync(d)) != GA_NO_ERROR)
+    return err;
+  t = now() - t;
+  printf(" %9.2f", gbps(sz, n, t));
+
+  t = now();
+  for (i = 0; i < n; i++)
+    if ((err = gpudata_read(host, d, 0, sz)) != GA_NO_ERROR)
+      return err;
+  t = now() - t;
+  printf(" %9.2f", gbps(sz, n, t));
+  return GA_NO_ERROR;
+}
+
+int main(int argc, char *argv[]) {
+  gpucontext *ctx;
+  gpudata *d, *h;
+  const char *name;
+  char *pageable, *pinned;
+  size_t max_sz = 64 * 1024 * 1024;
+  size_t sz;
+  unsigned int n = 20;
+  int i, dev, err;
+
+  for (i = 1; i < argc - 1; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 2 < argc) {
+      n = (unsigned int)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 2 < argc) {
+      max_sz = parse_size(argv[++i]);
+    } else {
+      break;
+    }
+  }
+  if (i != argc - 1 || n == 0 || max_sz == 0 ||
+      (dev = parse_dev(argv[i], &name)) == -1) {
+    fprintf(stderr, "Usage: %s [-n iters] [-s max_size] device\n", argv[0]);
+    return 2;
+  }
+
+  ctx = gpucontext_init(name, dev, 0, &err);
+  if (ctx == NULL) {
+    fprintf(stderr, "Could not open %s: %s\n", argv[i],
+            gpucontext_error(NULL, err));
+    return 1;
+  }
+
+  d = gpudata_alloc(ctx, max_sz, NULL, 0, &err);
+  pageable = malloc(max_sz);
+  if (d == NULL || pageable == NULL) {
+    fprintf(stderr, "Could not allocate %zu bytes\n", max_sz);
+    return 1;
+  }
+  memset(pageable, 1, max_sz);
+  pinned = NULL;
+  h = gpudata_alloc(ctx, max_sz, NULL, GA_BUFFER_HOST, NULL);
+  if (h != NULL &&
+      gpudata_property(h, GA_BUFFER_PROP_HOSTPOINTER, &pinned) != GA_NO_ERROR)
+    pinned = NULL;
+
+  printf("%10s %9s %9s %9s %9s  (GB/s)\n", "size", "write", "read",
+         pinned ? "pin write" : "", pinned ? "pin read" : "");
+  for (sz = 4096; sz <= max_sz; sz *= 4) {
+    printf("%10zu", sz);
+    if ((err = run(d, pageable, sz, n)) != GA_NO_ERROR ||
+        (pinned != NULL && (err = run(d, pinned, sz, n)) != GA_NO_ERROR)) {
+      fprintf(stderr, "\nError: %s\n", gpucontext_error(ctx, err));
+      return 1;
+    }
+    printf("\n");
+  }
+
+  if (h != NULL)
+    gpudata_release(h);
+  gpudata_release(d);
+  free(pageable);
+  gpucontext_deref(ctx);
+  return 0;
+}
@@ -1,5 +1,7 @@
 #include <check.h>
 
+#include <stdlib.h>
+
 #include "gpuarray/buffer.h"
 #include "gpuarray/error.h"
 
@@ -136,6 +138,63 @@ START_TEST(test_buffer_read_write) {
 }
 END_TEST
 
+START_TEST(test_buffer_read_write_async) {
+  const int32_t data[] = {0, 1, 2, 3, 4, 5, 6, 7};
+  int32_t buf[nelems(data)];
+  gpudata *d;
+  gpuevent *ev;
+  int err, done;
+  unsigned int i;
+
+  d = gpudata_alloc(ctx, sizeof(data), NULL, 0, NULL);
+  ck_assert(d != NULL);
+
+  err = gpudata_write_async(d, 0, data, sizeof(data), &ev);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  do {
+    err = gpuevent_query(ev, &done);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+  } while (!done);
+  gpuevent_release(ev);
+
+  /* Queued after the write without waiting for it */
+  err = gpudata_write_async(d, sizeof(int32_t), data, sizeof(int32_t), &ev);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  gpuevent_release(ev);
+
+  memset(buf, 0, sizeof(data));
+  err = gpudata_read_async(buf, d, 0, sizeof(data), &ev);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  err = gpuevent_wait(ev);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  gpuevent_release(ev);
+  ck_assert_int_eq(buf[1], data[0]);
+  buf[1] = data[1];
+  for (i = 0; i < nelems(data); i++) {
+    ck_assert_int_eq(data[i], buf[i]);
+  }
+
+  /* Release also waits */
+  memset(buf, 0, sizeof(data));
+  err = gpudata_read_async(buf, d, sizeof(int32_t) * 2,
+                           sizeof(data) - sizeof(int32_t) * 2, &ev);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  gpuevent_release(ev);
+  for (i = 0; i < nelems(data) - 2; i++) {
+    ck_assert_int_eq(data[i + 2], buf[i]);
+  }
+
+  err = gpudata_read_async(buf, d, 0, 0, &ev);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  err = gpuevent_query(ev, &done);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert(done);
+  gpuevent_release(ev);
+
+  gpudata_release(d);
+}
+END_TEST
+
 START_TEST(test_buffer_move) {
   const int32_t data[] = {0, 1, 2, 3, 4, 5, 6, 7};
   int32_t buf[nelems(data)];
@@ -176,6 +235,158 @@ START_TEST(test_buffer_move) {
 }
 END_TEST
 
+START_TEST(test_buffer_reuse) {
+  const int32_t data[] = {0, 1, 2, 3, 4, 5, 6, 7};
+  int32_t buf[nelems(data)];
+  gpudata *d[16];
+  int err;
+  unsigned int i, j;
+
+  /* Interleave buffers of different sizes so that the freed ones get
+     split and merged back. */
+  for (i = 0; i < nelems(d); i++) {
+    d[i] = gpudata_alloc(ctx, sizeof(data) * (i + 1), NULL, 0, NULL);
+    ck_assert(d[i] != NULL);
+    err = gpudata_write(d[i], sizeof(data) * i, data, sizeof(data));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+  }
+  for (i = 0; i < nelems(d); i += 2)
+    gpudata_release(d[i]);
+  for (i = 0; i < nelems(d); i += 2) {
+    d[i] = gpudata_alloc(ctx, sizeof(data) * (i + 1), NULL, 0, NULL);
+    ck_assert(d[i] != NULL);
+    err = gpudata_write(d[i], sizeof(data) * i, data, sizeof(data));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+  }
+
+  for (i = 0; i < nelems(d); i++) {
+    memset(buf, 0, sizeof(data));
+    err = gpudata_read(buf, d[i], sizeof(data) * i, sizeof(data));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    for (j = 0; j < nelems(data); j++) {
+      ck_assert_int_eq(buf[j], data[j]);
+    }
+  }
+
+  for (i = 0; i < nelems(d); i++)
+    gpudata_release(d[i]);
+}
+END_TEST
+
+START_TEST(test_buffer_memstats) {
+  gpucontext_memstats st, st2;
+  gpudata *d, *d2;
+  int err;
+
+  err = gpucontext_property(ctx, GA_CTX_PROP_MEMSTATS, &st);
+  if (err == GA_DEVSUP_ERROR)
+    return;
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert(st.reserved_bytes == st.live_bytes + st.cached_bytes);
+
+  d = gpudata_alloc(ctx, 1024, NULL, 0, NULL);
+  ck_assert(d != NULL);
+  d2 = gpudata_alloc(ctx, 1024, NULL, 0, NULL);
+  ck_assert(d2 != NULL);
+
+  err = gpucontext_property(ctx, GA_CTX_PROP_MEMSTATS, &st2);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert(st2.allocs == st.allocs + 2);
+  ck_assert(st2.live_bytes >= st.live_bytes + 2048);
+  ck_assert(st2.peak_bytes >= st2.live_bytes);
+  ck_assert(st2.reserved_bytes == st2.live_bytes + st2.cached_bytes);
+
+  gpudata_release(d);
+  gpudata_release(d2);
+
+  err = gpucontext_property(ctx, GA_CTX_PROP_MEMSTATS, &st2);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert(st2.frees == st.frees + 2);
+  ck_assert(st2.live_bytes == st.live_bytes);
+  ck_assert(st2.reserved_bytes == st2.live_bytes + st2.cached_bytes);
+  ck_assert(st2.largest_free <= st2.cached_bytes);
+}
+END_TEST
+
+START_TEST(test_buffer_cachestats) {
+  static const char *src = "KERNEL void k(GLOBAL_MEM float *a) {}\n";
+  static const int types[] = {GA_BUFFER};
+  gpucontext_cachestats st, st2;
+  gpukernel *k, *k2;
+  int err;
+
+  err = gpucontext_property(ctx, GA_CTX_PROP_CACHESTATS, &st);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+
+  k = gpukernel_init(ctx, 1, &src, NULL, "k", 1, types, GA_USE_CLUDA,
+                     &err, NULL);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  k2 = gpukernel_init(ctx, 1, &src, NULL, "k", 1, types, GA_USE_CLUDA,
+                      &err, NULL);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+
+  err = gpucontext_property(ctx, GA_CTX_PROP_CACHESTATS, &st2);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert(st2.kernel.misses == st.kernel.misses + 1);
+  ck_assert(st2.kernel.inserts == st.kernel.inserts + 1);
+  ck_assert(st2.kernel.hits == st.kernel.hits + 1);
+
+  gpukernel_release(k);
+  gpukernel_release(k2);
+}
+END_TEST
+
+START_TEST(test_buffer_kernel_async) {
+  static const char *src[] = {
+    "KERNEL void k(GLOBAL_MEM float *a) {}\n",
+    "KERNEL void k(GLOBAL_MEM float *a) { a[0] = 1.0f; }\n",
+  };
+  static const char *bad = "#error this doesn't compile\n";
+  static const int types[] = {GA_BUFFER};
+  gpukernel *k[3];
+  char *errstr = NULL;
+  size_t sz;
+  int err;
+  unsigned int i;
+
+  for (i = 0; i < 2; i++) {
+    k[i] = gpukernel_init_async(ctx, 1, &src[i], NULL, "k", 1, types,
+                                GA_USE_CLUDA, &err);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(k[i] != NULL);
+  }
+  k[2] = gpukernel_init_async(ctx, 1, &src[0], NULL, "k", 1, types,
+                              GA_USE_CLUDA, &err);
+  ck_assert(k[2] != NULL);
+
+  /* Works without an explicit wait */
+  ck_assert_int_eq(gpukernel_property(k[1], GA_KERNEL_PROP_MAXLSIZE, &sz),
+                   GA_NO_ERROR);
+  ck_assert(sz > 0);
+  ck_assert_int_eq(gpukernel_wait(k[0], NULL), GA_NO_ERROR);
+  ck_assert_int_eq(gpukernel_wait(k[2], NULL), GA_NO_ERROR);
+  for (i = 0; i < 3; i++)
+    gpukernel_release(k[i]);
+
+  /* Errors are reported when waiting (or right away) */
+  for (i = 0; i < 2; i++) {
+    k[0] = gpukernel_init_async(ctx, 1, &bad, NULL, "k", 1, types,
+                                GA_USE_CLUDA, &err);
+    if (k[0] == NULL) {
+      ck_assert_int_ne(err, GA_NO_ERROR);
+      continue;
+    }
+    ck_assert_int_ne(gpukernel_wait(k[0], &errstr), GA_NO_ERROR);
+    ck_assert(errstr != NULL);
+    free(errstr);
+    errstr = NULL;
+    ck_assert_int_ne(gpukernel_property(k[0], GA_KERNEL_PROP_MAXLSIZE, &sz),
+                     GA_NO_ERROR);
+    gpukernel_release(k[0]);
+  }
+}
+END_TEST
+
 Suite *get_suite(void) {
   Suite *s = suite_create("buffer");
   TCase *tc = tcase_create("API");
@@ -184,7 +395,12 @@ Suite *get_suite(void) {
   tcase_add_test(tc, test_buffer_retain_release);
   tcase_add_test(tc, test_buffer_share);
   tcase_add_test(tc, test_buffer_read_write);
+  tcase_add_test(tc, test_buffer_read_write_async);
   tcase_add_test(tc, test_buffer_move);
+  tcase_add_test(tc, test_buffer_reuse);
+  tcase_add_test(tc, test_buffer_memstats);
+  tcase_add_test(tc, test_buffer_cachestats);
+  tcase_add_test(tc, test_buffer_kernel_async);
   suite_add_tcase(s, tc);
   return s;
 }
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+
+#include <check.h>
+
+#include "cache.h"
+#include "util/thread.h"
+
+#define NKEYS 256
+#define NTHREADS 8
+#define NITER 20000
+
+/* Values are reference counted like the kernels in the kernel cache */
+typedef struct _val {
+  unsigned int key;
+  unsigned int refcnt;
+} val;
+
+static unsigned int live;
+
+static int key_eq(unsigned int *a, unsigned int *b) {
+  return *a == *b;
+}
+
+static uint32_t key_hash(unsigned int *k) {
+  return *k;
+}
+
+static void key_free(unsigned int *k) {
+  free(k);
+}
+
+static val *val_ref(val *v) {
+  ga_atomic_inc(&v->refcnt);
+  return v;
+}
+
+static void val_release(val *v) {
+  if (ga_atomic_dec(&v->refcnt) == 0) {
+    free(v);
+    ga_atomic_dec(&live);
+  }
+}
+
+static cache *striped(unsigned int n, size_t size) {
+  cache *parts[NTHREADS];
+  cache *c;
+  unsigned int i;
+
+  for (i = 0; i < n; i++) {
+    parts[i] = cache_lru(size, 0, (cache_eq_fn)key_eq,
+                         (cache_hash_fn)key_hash,
+                         (cache_freek_fn)key_free,
+                         (cache_freev_fn)val_release, NULL);
+    ck_assert(parts[i] != NULL);
+  }
+  c = cache_striped(parts, n, (cache_refv_fn)val_ref, NULL);
+  ck_assert(c != NULL);
+  return c;
+}
+
+static int add(cache *c, unsigned int k) {
+  unsigned int *pk = malloc(sizeof(*pk));
+  val *v = malloc(sizeof(*v));
+
+  if (pk == NULL || v == NULL)
+    return -1;
+  ga_atomic_inc(&live);
+  *pk = k;
+  v->key = k;
+  v->refcnt = 1;
+  return cache_add(c, pk, v);
+}
+
+START_TEST(test_striped) {
+  gpucache_stats st;
+  cache *c = striped(4, NKEYS);
+  unsigned int i, k;
+  val *v;
+
+  for (i = 0; i < NKEYS; i++)
+    ck_assert_int_eq(add(c, i), 0);
+  for (i = 0; i < NKEYS; i++) {
+    v = cache_get(c, &i);
+    ck_assert(v != NULL);
+    ck_assert_int_eq(v->key, i);
+    /* The lookup took a reference */
+    ck_assert_int_eq(v->refcnt, 2);
+    val_release(v);
+  }
+  k = NKEYS;
+  ck_assert(cache_get(c, &k) == NULL);
+  k = 3;
+  ck_assert_int_eq(cache_del(c, &k), 1);
+  ck_assert(cache_get(c, &k) == NULL);
+
+  cache_get_stats(c, &st);
+  ck_assert(st.inserts == NKEYS);
+  ck_assert(st.hits == NKEYS);
+  ck_assert(st.misses == 2);
+
+  cache_destroy(c);
+  ck_assert_int_eq(live, 0);
+}
+END_TEST
+
+START_TEST(test_table) {
+  cache *c[2];
+  unsigned int i, k, n;
+  val *v;
+
+  /* Unbounded so the table and the node arena have to grow */
+  c[0] = cache_lru(0, 0, (cache_eq_fn)key_eq, (cache_hash_fn)key_hash,
+                   (cache_freek_fn)key_free, (cache_freev_fn)val_release,
+                   NULL);
+  c[1] = cache_twoq(NKEYS, NKEYS * 16, NKEYS * 16, 0, (cache_eq_fn)key_eq,
+                    (cache_hash_fn)key_hash, (cache_freek_fn)key_free,
+                    (cache_freev_fn)val_release, NULL);
+  for (n = 0; n < 2; n++) {
+    ck_assert(c[n] != NULL);
+    /* Keys that collide on the low bits make long probe sequences */
+    for (i = 0; i < NKEYS * 16; i++)
+      ck_assert_int_eq(add(c[n], i * 64), 0);
+    for (i = 0; i < NKEYS * 16; i += 2) {
+      k = i * 64;
+      ck_assert_int_eq(cache_del(c[n], &k), 1);
+    }
+    for (i = 0; i < NKEYS * 16; i++) {
+      k = i * 64;
+      v = cache_get(c[n], &k);
+      if (i % 2 == 0) {
+        ck_assert(v == NULL);
+      } else {
+        ck_assert(v != NULL);
+        ck_assert_int_eq(v->key, k);
+      }
+    }
+    /* Reuse the freed nodes */
+    for (i = 0; i < NKEYS * 16; i += 2)
+      ck_assert_int_eq(add(c[n], i * 64), 0);
+    for (i = 0; i < NKEYS * 16; i++) {
+      k = i * 64;
+      v = cache_get(c[n], &k);
+      ck_assert(v != NULL);
+      ck_assert_int_eq(v->key, k);
+    }
+    cache_destroy(c[n]);
+    ck_assert_int_eq(live, 0);
+  }
+}
+END_TEST
+
+START_TEST(test_tinylfu) {
+  gpucache_stats st;
+  cache *c;
+  unsigned int i, j, k;
+  val *v;
+
+  c = cache_tinylfu(NKEYS, (cache_eq_fn)key_eq, (cache_hash_fn)key_hash,
+                    (cache_freek_fn)key_free, (cache_freev_fn)val_release,
+                    NULL);
+  ck_assert(c != NULL);
+  /* A hot set looked up a few times */
+  for (j = 0; j < 4; j++) {
+    for (i = 0; i < NKEYS / 2; i++) {
+      v = cache_get(c, &i);
+      if (v == NULL)
+        ck_assert_int_eq(add(c, i), 0);
+    }
+  }
+  /* A scan of keys seen once shouldn't push it out */
+  for (i = NKEYS; i < NKEYS * 8; i++) {
+    ck_assert(cache_get(c, &i) == NULL);
+    ck_assert_int_eq(add(c, i), 0);
+  }
+  for (i = 0; i < NKEYS / 2; i++) {
+    v = cache_get(c, &i);
+    ck_assert(v != NULL);
+    ck_assert_int_eq(v->key, i);
+  }
+  cache_get_stats(c, &st);
+  ck_assert(st.inserts == NKEYS / 2 + NKEYS * 7);
+  ck_assert(st.evictions > 0);
+
+  /* Replacing and removing entries */
+  k = 3;
+  ck_assert_int_eq(add(c, k), 0);
+  v = cache_get(c, &k);
+  ck_assert(v != NULL);
+  ck_assert_int_eq(v->refcnt, 1);
+  ck_assert_int_eq(cache_del(c, &k), 1);
+  ck_assert(cache_get(c, &k) == NULL);
+  ck_assert_int_eq(cache_del(c, &k), 0);
+
+  cache_destroy(c);
+  ck_assert_int_eq(live, 0);
+}
+END_TEST
+
+typedef struct _stress {
+  cache *c;
+  unsigned int seed;
+  unsigned int bad;
+} stress;
+
+static void stress_run(void *arg) {
+  stress *s = (stress *)arg;
+  unsigned int i, k, r;
+  val *v;
+
+  for (i = 0; i < NITER; i++) {
+    /* xorshift */
+    r = s->seed;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    s->seed = r;
+    k = (r >> 8) % NKEYS;
+    switch (r % 8) {
+    case 0:
+      if (add(s->c, k))
+        s->bad++;
+      break;
+    case 1:
+      cache_del(s->c, &k);
+      break;
+    default:
+      v = cache_get(s->c, &k);
+      if (v != NULL) {
+        if (v->key != k)
+          s->bad++;
+        val_release(v);
+      }
+    }
+  }
+}
+
+START_TEST(test_striped_threads) {
+  ga_thread t[NTHREADS];
+  stress s[NTHREADS];
+  gpucache_stats st;
+  unsigned int i;
+  size_t gets;
+
+  /* Small enough that the threads evict each other's entries */
+  s[0].c = striped(NTHREADS, NKEYS / (4 * NTHREADS));
+  for (i = 0; i < NTHREADS; i++) {
+    s[i].c = s[0].c;
+    s[i].seed = 2463534242U + i;
+    s[i].bad = 0;
+    ck_assert_int_eq(ga_thread_start(&t[i], stress_run, &s[i]), 0);
+  }
+  for (i = 0; i < NTHREADS; i++)
+    ga_thread_join(t[i]);
+  for (i = 0; i < NTHREADS; i++)
+    ck_assert_int_eq(s[i].bad, 0);
+
+  cache_get_stats(s[0].c, &st);
+  gets = st.hits + st.misses;
+  ck_assert(gets > 0);
+  ck_assert(st.hits > 0);
+  ck_assert(st.evictions > 0);
+  ck_assert(gets + st.inserts <= (size_t)NTHREADS * NITER);
+
+  cache_destroy(s[0].c);
+  ck_assert_int_eq(live, 0);
+}
+END_TEST
+
+Suite *get_suite(void) {
+  Suite *s = suite_create("cache");
+  TCase *tc = tcase_create("All");
+  tcase_add_test(tc, test_table);
+  tcase_add_test(tc, test_tinylfu);
+  tcase_add_test(tc, test_striped);
+  tcase_add_test(tc, test_striped_threads);
+  suite_add_tcase(s, tc);
+  return s;
+}
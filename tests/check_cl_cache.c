@@ -0,0 +1,154 @@
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <string.h>
+
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <check.h>
+
+#include "private_opencl.h"
+
+static char dir[] = "/tmp/check_cl_cacheXXXXXX";
+
+static const char bin_id[] = "Vendor 0x1234 1.2.3";
+static const char dev_name[] = "Device";
+
+static int rm(const char *path, const struct stat *st, int flag,
+              struct FTW *f) {
+  return remove(path);
+}
+
+static void setup(void) {
+  ck_assert(mkdtemp(dir) != NULL);
+}
+
+static void teardown(void) {
+  nftw(dir, rm, 8, FTW_DEPTH|FTW_PHYS);
+  strcpy(dir + strlen(dir) - 6, "XXXXXX");
+}
+
+static cache *open_cache(void) {
+  cache *c = cl_disk_cache(dir, NULL);
+  ck_assert(c != NULL);
+  return c;
+}
+
+static void mkstrb(strb *s, const char *v) {
+  strb_appends(s, v);
+  ck_assert(!strb_error(s));
+}
+
+static int has(cache *c, const char *id, const char *name, const strb *src,
+               const strb *bin) {
+  strb *v = cl_disk_load(c, id, name, src);
+  if (v == NULL)
+    return 0;
+  ck_assert(v->l == bin->l && memcmp(v->s, bin->s, v->l) == 0);
+  return 1;
+}
+
+START_TEST(test_roundtrip) {
+  cache *c;
+  strb src = STRB_STATIC_INIT;
+  strb src2 = STRB_STATIC_INIT;
+  strb bin = STRB_STATIC_INIT;
+
+  mkstrb(&src, "__kernel void k(void) {}\n");
+  mkstrb(&src2, "__kernel void k2(void) {}\n");
+  /* Binaries are not strings */
+  strb_appendn(&bin, "binary\0with a nul", 18);
+
+  c = open_cache();
+  ck_assert_int_eq(cl_disk_store(c, bin_id, dev_name, &src, &bin, NULL),
+                   GA_NO_ERROR);
+  /* From the memory cache, so this only checks key_eq and key_hash */
+  ck_assert(has(c, bin_id, dev_name, &src, &bin));
+  cache_destroy(c);
+
+  /* Loading from disk goes through key_write and key_read */
+  c = open_cache();
+  ck_assert(has(c, bin_id, dev_name, &src, &bin));
+  ck_assert(!has(c, bin_id, dev_name, &src2, &bin));
+  ck_assert(!has(c, bin_id, "Other device", &src, &bin));
+  ck_assert(!has(c, "Vendor 0x1234 1.2.4", dev_name, &src, &bin));
+  cache_destroy(c);
+
+  strb_clear(&src);
+  strb_clear(&src2);
+  strb_clear(&bin);
+}
+END_TEST
+
+START_TEST(test_key_padding) {
+  cache *c;
+  char id[64], name[64];
+  strb src = STRB_STATIC_INIT;
+  strb bin = STRB_STATIC_INIT;
+
+  mkstrb(&src, "__kernel void k(void) {}\n");
+  mkstrb(&bin, "binary");
+
+  /* What follows the NUL in the strings is not part of the key */
+  memset(id, 'x', sizeof(id));
+  memset(name, 'y', sizeof(name));
+  strcpy(id, bin_id);
+  strcpy(name, dev_name);
+
+  c = open_cache();
+  ck_assert_int_eq(cl_disk_store(c, id, name, &src, &bin, NULL),
+                   GA_NO_ERROR);
+  cache_destroy(c);
+
+  memset(id, 'z', sizeof(id));
+  memset(name, 'w', sizeof(name));
+  strcpy(id, bin_id);
+  strcpy(name, dev_name);
+
+  c = open_cache();
+  ck_assert(has(c, id, name, &src, &bin));
+  cache_destroy(c);
+
+  strb_clear(&src);
+  strb_clear(&bin);
+}
+END_TEST
+
+START_TEST(test_long_names) {
+  cache *c;
+  char id[100];
+  strb src = STRB_STATIC_INIT;
+  strb bin = STRB_STATIC_INIT;
+
+  mkstrb(&src, "__kernel void k(void) {}\n");
+  mkstrb(&bin, "binary");
+
+  /* Names longer than the key are truncated, not overflowed */
+  memset(id, 'a', sizeof(id) - 1);
+  id[sizeof(id) - 1] = '\0';
+
+  c = open_cache();
+  ck_assert_int_eq(cl_disk_store(c, id, dev_name, &src, &bin, NULL),
+                   GA_NO_ERROR);
+  cache_destroy(c);
+
+  c = open_cache();
+  ck_assert(has(c, id, dev_name, &src, &bin));
+  cache_destroy(c);
+
+  strb_clear(&src);
+  strb_clear(&bin);
+}
+END_TEST
+
+Suite *get_suite(void) {
+  Suite *s = suite_create("cl_cache");
+  TCase *tc = tcase_create("All");
+  tcase_add_checked_fixture(tc, setup, teardown);
+  tcase_add_test(tc, test_roundtrip);
+  tcase_add_test(tc, test_key_padding);
+  tcase_add_test(tc, test_long_names);
+  suite_add_tcase(s, tc);
+  return s;
+}
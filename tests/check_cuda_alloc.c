@@ -0,0 +1,634 @@
+#define _XOPEN_SOURCE 700
+#include <check.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ftw.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "gpuarray/buffer.h"
+#include "gpuarray/error.h"
+#include "gpuarray/extension.h"
+#include "gpuarray/types.h"
+
+#include "util/alloc_trace.h"
+
+/*
+ * These tests run against the stub CUDA driver (stub_libcuda.c) with
+ * the memory capped to 16MB so that we can hit out of memory
+ * conditions.
+ */
+
+#define MB (1024 * 1024)
+
+extern void *ctx;
+
+int get_env_dev(const char **name);
+void setup(void);
+void teardown(void);
+
+static gpucontext_memstats memstats(void) {
+  gpucontext_memstats st;
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_MEMSTATS, &st),
+                   GA_NO_ERROR);
+  return st;
+}
+
+START_TEST(test_trim_cache) {
+  gpucontext_memstats st0, st;
+  gpudata *d;
+
+  /* The context may already have allocated some memory */
+  st0 = memstats();
+
+  d = gpudata_alloc(ctx, 6 * MB, NULL, 0, NULL);
+  ck_assert(d != NULL);
+  gpudata_release(d);
+
+  st = memstats();
+  ck_assert(st.blocks == st0.blocks + 1);
+  ck_assert(st.cached_bytes >= st0.cached_bytes + 6 * MB);
+
+  ck_assert_int_eq(gpucontext_trim_cache(ctx), GA_NO_ERROR);
+
+  /* The allocations that are still in use stay around */
+  st = memstats();
+  ck_assert(st.blocks == st0.blocks);
+  ck_assert(st.reserved_bytes == st0.reserved_bytes);
+  ck_assert(st.live_bytes == st0.live_bytes);
+}
+END_TEST
+
+START_TEST(test_oom_reclaim) {
+  gpudata *d, *d2;
+
+  d = gpudata_alloc(ctx, 5 * MB, NULL, 0, NULL);
+  ck_assert(d != NULL);
+  d2 = gpudata_alloc(ctx, 5 * MB, NULL, 0, NULL);
+  ck_assert(d2 != NULL);
+  gpudata_release(d);
+  gpudata_release(d2);
+
+  /* None of the cached blocks is big enough and the memory is full
+     of them, they have to be released for this to succeed. */
+  d = gpudata_alloc(ctx, 8 * MB, NULL, 0, NULL);
+  ck_assert(d != NULL);
+  gpudata_release(d);
+}
+END_TEST
+
+START_TEST(test_oom) {
+  gpudata *d, *d2;
+  int err;
+
+  d = gpudata_alloc(ctx, 10 * MB, NULL, 0, NULL);
+  ck_assert(d != NULL);
+
+  /* The cache has nothing to give back here */
+  d2 = gpudata_alloc(ctx, 10 * MB, NULL, 0, &err);
+  ck_assert(d2 == NULL);
+  ck_assert_int_eq(err, GA_MEMORY_ERROR);
+
+  gpudata_release(d);
+}
+END_TEST
+
+START_TEST(test_alloc_policy) {
+  gpucontext_alloc_policy p, p2;
+  gpucontext_memstats st;
+  gpudata *d, *d2;
+
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_ALLOC_POLICY, &p),
+                   GA_NO_ERROR);
+  ck_assert(p.block_size != 0);
+  ck_assert(p.max_block_size >= p.block_size);
+
+  p.block_size = 2 * MB;
+  p.max_block_size = 1 * MB;
+  ck_assert_int_eq(gpucontext_set_alloc_policy(ctx, &p), GA_VALUE_ERROR);
+
+  p.max_block_size = 2 * MB;
+  p.large_threshold = 4 * MB;
+  ck_assert_int_eq(gpucontext_set_alloc_policy(ctx, &p), GA_NO_ERROR);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_ALLOC_POLICY, &p2),
+                   GA_NO_ERROR);
+  ck_assert(p2.block_size == p.block_size);
+  ck_assert(p2.max_block_size == p.max_block_size);
+  ck_assert(p2.large_threshold == p.large_threshold);
+
+  /* A released large buffer is not split for small requests */
+  d = gpudata_alloc(ctx, 6 * MB, NULL, 0, NULL);
+  ck_assert(d != NULL);
+  gpudata_release(d);
+  d = gpudata_alloc(ctx, 1024, NULL, 0, NULL);
+  ck_assert(d != NULL);
+  st = memstats();
+  ck_assert(st.largest_free == 6 * MB);
+  d2 = gpudata_alloc(ctx, 6 * MB, NULL, 0, NULL);
+  ck_assert(d2 != NULL);
+  st = memstats();
+  ck_assert(st.blocks == 2);
+  gpudata_release(d2);
+  gpudata_release(d);
+}
+END_TEST
+
+START_TEST(test_deferred_free) {
+  gpucontext_memstats st0, st;
+  char host[1024];
+  gpudata *d, *d2;
+
+  st0 = memstats();
+
+  /* Last used on the transfer stream, so it can't be reused by the
+     context stream until that is done.  The stub driver reports the
+     work as not done on the first query. */
+  d = gpudata_alloc(ctx, 1024, NULL, 0, NULL);
+  ck_assert(d != NULL);
+  ck_assert_int_eq(gpudata_read(host, d, 0, 1024), GA_NO_ERROR);
+  gpudata_release(d);
+  st = memstats();
+  ck_assert(st.live_bytes == st0.live_bytes + 1024);
+
+  /* It's done now */
+  d2 = gpudata_alloc(ctx, 1024, NULL, 0, NULL);
+  ck_assert(d2 != NULL);
+  st = memstats();
+  ck_assert(st.live_bytes == st0.live_bytes + 1024);
+  ck_assert(st.frees == st0.frees + 1);
+
+  /* Trimming waits for everything */
+  ck_assert_int_eq(gpudata_read(host, d2, 0, 1024), GA_NO_ERROR);
+  gpudata_release(d2);
+  ck_assert_int_eq(gpucontext_trim_cache(ctx), GA_NO_ERROR);
+  st = memstats();
+  ck_assert(st.live_bytes == st0.live_bytes);
+  ck_assert(st.frees == st0.frees + 2);
+}
+END_TEST
+
+START_TEST(test_host_alloc) {
+  gpucontext_memstats st0, st;
+  char host[1024];
+  gpudata *d;
+  char *p, *p2;
+  unsigned int i;
+
+  st0 = memstats();
+
+  d = gpudata_alloc(ctx, 1024, NULL, GA_BUFFER_HOST, NULL);
+  ck_assert(d != NULL);
+  ck_assert_int_eq(gpudata_property(d, GA_BUFFER_PROP_HOSTPOINTER, &p),
+                   GA_NO_ERROR);
+  ck_assert(p != NULL);
+
+  for (i = 0; i < sizeof(host); i++)
+    host[i] = (char)i;
+  ck_assert_int_eq(gpudata_write(d, 0, host, sizeof(host)), GA_NO_ERROR);
+  ck_assert_int_eq(gpudata_sync(d), GA_NO_ERROR);
+  ck_assert(memcmp(p, host, sizeof(host)) == 0);
+
+  p[0] = 42;
+  ck_assert_int_eq(gpudata_read(host, d, 0, 1), GA_NO_ERROR);
+  ck_assert_int_eq(host[0], 42);
+  gpudata_release(d);
+
+  /* Host memory doesn't count as device memory */
+  st = memstats();
+  ck_assert(st.blocks == st0.blocks);
+
+  /* The pinned memory is reused */
+  d = gpudata_alloc(ctx, 1024, NULL, GA_BUFFER_HOST, NULL);
+  ck_assert(d != NULL);
+  ck_assert_int_eq(gpudata_property(d, GA_BUFFER_PROP_HOSTPOINTER, &p2),
+                   GA_NO_ERROR);
+  ck_assert(p2 == p);
+  gpudata_release(d);
+
+  d = gpudata_alloc(ctx, 1024, NULL, 0, NULL);
+  ck_assert(d != NULL);
+  ck_assert_int_eq(gpudata_property(d, GA_BUFFER_PROP_HOSTPOINTER, &p),
+                   GA_INVALID_ERROR);
+  gpudata_release(d);
+}
+END_TEST
+
+START_TEST(test_buffer_align) {
+  gpudata *(*make_buf)(void *, unsigned long long, size_t);
+  gpudata *d, *d2;
+  size_t align;
+
+  d = gpudata_alloc(ctx, 100, NULL, 0, NULL);
+  ck_assert(d != NULL);
+  d2 = gpudata_alloc(ctx, 100, NULL, 0, NULL);
+  ck_assert(d2 != NULL);
+  /* Sub-allocations keep the fragment alignment */
+  ck_assert_int_eq(gpudata_property(d2, GA_BUFFER_PROP_ALIGN, &align),
+                   GA_NO_ERROR);
+  ck_assert(align >= 64);
+  gpudata_release(d);
+  gpudata_release(d2);
+
+  /* Wrapped pointers can start anywhere (the stub never looks) */
+  make_buf = (gpudata *(*)(void *, unsigned long long, size_t))
+    gpuarray_get_extension("cuda_make_buf");
+  ck_assert(make_buf != NULL);
+  d = make_buf(ctx, 0x100004, 64);
+  ck_assert(d != NULL);
+  ck_assert_int_eq(gpudata_property(d, GA_BUFFER_PROP_ALIGN, &align),
+                   GA_NO_ERROR);
+  ck_assert_int_eq(align, 4);
+  gpudata_release(d);
+  d = make_buf(ctx, 0x100000, 64);
+  ck_assert(d != NULL);
+  ck_assert_int_eq(gpudata_property(d, GA_BUFFER_PROP_ALIGN, &align),
+                   GA_NO_ERROR);
+  ck_assert_int_eq(align, 256);
+  gpudata_release(d);
+}
+END_TEST
+
+START_TEST(test_staged_transfer) {
+  /* Big enough to go through the staging buffers, not a multiple of
+     their size */
+  const size_t sz = 3 * MB + MB / 2 + 3;
+  gpudata *d;
+  char *a, *b;
+  size_t i;
+
+  a = malloc(sz);
+  b = malloc(sz + 5);
+  ck_assert(a != NULL && b != NULL);
+  for (i = 0; i < sz; i++)
+    a[i] = (char)(i * 7);
+
+  d = gpudata_alloc(ctx, sz + 5, NULL, 0, NULL);
+  ck_assert(d != NULL);
+  ck_assert_int_eq(gpudata_write(d, 5, a, sz), GA_NO_ERROR);
+  ck_assert_int_eq(gpudata_read(b, d, 5, sz), GA_NO_ERROR);
+  ck_assert(memcmp(a, b, sz) == 0);
+
+  /* Back to back writes reuse the ring */
+  ck_assert_int_eq(gpudata_write(d, 0, a + 1, sz - 1), GA_NO_ERROR);
+  ck_assert_int_eq(gpudata_write(d, sz - 1, a, 6), GA_NO_ERROR);
+  memset(b, 0, sz + 5);
+  ck_assert_int_eq(gpudata_read(b, d, 0, sz - 1), GA_NO_ERROR);
+  ck_assert(memcmp(a + 1, b, sz - 1) == 0);
+
+  /* Releases the ring */
+  ck_assert_int_eq(gpucontext_trim_cache(ctx), GA_NO_ERROR);
+  memset(b, 0, sz + 5);
+  ck_assert_int_eq(gpudata_read(b, d, 0, sz + 5), GA_NO_ERROR);
+  ck_assert(memcmp(a + 1, b, sz - 1) == 0);
+  ck_assert(memcmp(a, b + sz - 1, 6) == 0);
+
+  gpudata_release(d);
+  free(a);
+  free(b);
+}
+END_TEST
+
+START_TEST(test_read_async) {
+  char *a, *b;
+  gpudata *d;
+  gpuevent *ev;
+  int done;
+
+  a = malloc(MB);
+  b = malloc(MB);
+  ck_assert(a != NULL && b != NULL);
+  memset(a, 7, MB);
+  memset(b, 0, MB);
+
+  d = gpudata_alloc(ctx, MB, NULL, 0, NULL);
+  ck_assert(d != NULL);
+  ck_assert_int_eq(gpudata_write(d, 0, a, MB), GA_NO_ERROR);
+
+  /* Pageable memory only gets the data once the transfer is seen to
+     be done (the stub reports it as pending on the first query). */
+  ck_assert_int_eq(gpudata_read_async(b, d, 0, MB, &ev), GA_NO_ERROR);
+  ck_assert_int_eq(gpuevent_query(ev, &done), GA_NO_ERROR);
+  ck_assert(!done);
+  ck_assert_int_eq(b[0], 0);
+  ck_assert_int_eq(gpuevent_query(ev, &done), GA_NO_ERROR);
+  ck_assert(done);
+  ck_assert(memcmp(a, b, MB) == 0);
+  gpuevent_release(ev);
+
+  /* The caller's memory can be reused as soon as a write returns */
+  ck_assert_int_eq(gpudata_write_async(d, 0, a, MB, &ev), GA_NO_ERROR);
+  memset(a, 3, MB);
+  ck_assert_int_eq(gpuevent_wait(ev), GA_NO_ERROR);
+  gpuevent_release(ev);
+  ck_assert_int_eq(gpudata_read(b, d, 0, MB), GA_NO_ERROR);
+  ck_assert_int_eq(b[0], 7);
+
+  gpudata_release(d);
+  free(a);
+  free(b);
+}
+END_TEST
+
+static char dir[] = "/tmp/check_preload_XXXXXX";
+
+static int rm(const char *path, const struct stat *st, int flag,
+              struct FTW *f) {
+  return remove(path);
+}
+
+START_TEST(test_preload) {
+  static const char *src = "KERNEL void k(GLOBAL_MEM float *a) {}\n";
+  static const int types[] = {GA_BUFFER};
+  gpucontext_cachestats st, st2;
+  gpukernel *k;
+  char manifest[64];
+  struct stat fst;
+  off_t sz;
+  FILE *f;
+  int err = GA_NO_ERROR;
+
+  ck_assert(mkdtemp(dir) != NULL);
+  setenv("GPUARRAY_CACHE_PATH", dir, 1);
+  setenv("GPUARRAY_CACHE_PRELOAD", "1", 1);
+  sprintf(manifest, "%s/preload.manifest", dir);
+
+  /* The first context builds the kernel and records it */
+  setup();
+  k = gpukernel_init(ctx, 1, &src, NULL, "k", 1, types, GA_USE_CLUDA,
+                     &err, NULL);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  gpukernel_release(k);
+  teardown();
+  ck_assert_int_eq(stat(manifest, &fst), 0);
+  sz = fst.st_size;
+  ck_assert(sz > 0);
+
+  /* A torn record at the end is dropped */
+  f = fopen(manifest, "ab");
+  ck_assert(f != NULL);
+  fputs("GAMF", f);
+  fclose(f);
+
+  /* The next one loads it from the disk cache before it is asked for */
+  setup();
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_CACHESTATS, &st),
+                   GA_NO_ERROR);
+  ck_assert(st.disk.hits == 1);
+  k = gpukernel_init(ctx, 1, &src, NULL, "k", 1, types, GA_USE_CLUDA,
+                     &err, NULL);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_CACHESTATS, &st2),
+                   GA_NO_ERROR);
+  ck_assert(st2.kernel.hits == st.kernel.hits + 1);
+  ck_assert(st2.kernel.misses == st.kernel.misses);
+  ck_assert(st2.disk.hits == st.disk.hits);
+  ck_assert(st2.disk.misses == st.disk.misses);
+  gpukernel_release(k);
+  teardown();
+  ck_assert_int_eq(stat(manifest, &fst), 0);
+  ck_assert(fst.st_size == sz);
+
+  unsetenv("GPUARRAY_CACHE_PRELOAD");
+  unsetenv("GPUARRAY_CACHE_PATH");
+  nftw(dir, rm, 8, FTW_DEPTH|FTW_PHYS);
+}
+END_TEST
+
+/* MANIFEST_MAX in gpuarray_buffer_cuda.c */
+#define PRELOAD_MAX 64
+#define NPRELOAD (PRELOAD_MAX + 6)
+
+static char dir2[] = "/tmp/check_preload_XXXXXX";
+
+static gpukernel *preload_kernel(unsigned int i, int *err) {
+  static const int types[] = {GA_BUFFER};
+  char buf[64];
+  const char *src = buf;
+
+  sprintf(buf, "KERNEL void k(GLOBAL_MEM float *a) { a[0] = %u; }\n", i);
+  return gpukernel_init(ctx, 1, &src, NULL, "k", 1, types, GA_USE_CLUDA,
+                        err, NULL);
+}
+
+/* Is kernel i found in the kernel cache? */
+static int preloaded(unsigned int i) {
+  gpucontext_cachestats st, st2;
+  gpukernel *k;
+  int err = GA_NO_ERROR;
+
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_CACHESTATS, &st),
+                   GA_NO_ERROR);
+  k = preload_kernel(i, &err);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  gpukernel_release(k);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_CACHESTATS, &st2),
+                   GA_NO_ERROR);
+  return st2.kernel.hits == st.kernel.hits + 1;
+}
+
+START_TEST(test_preload_latest) {
+  gpucontext_cachestats st;
+  gpukernel *k;
+  char manifest[64];
+  char *data;
+  size_t len;
+  FILE *f;
+  unsigned int i;
+  int err = GA_NO_ERROR;
+
+  ck_assert(mkdtemp(dir2) != NULL);
+  setenv("GPUARRAY_CACHE_PATH", dir2, 1);
+  setenv("GPUARRAY_CACHE_PRELOAD", "1", 1);
+  sprintf(manifest, "%s/preload.manifest", dir2);
+
+  setup();
+  for (i = 0; i < NPRELOAD; i++) {
+    k = preload_kernel(i, &err);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    gpukernel_release(k);
+  }
+  teardown();
+
+  /* Use kernel 0 again by copying its record (the first) to the end */
+  f = fopen(manifest, "rb");
+  ck_assert(f != NULL);
+  data = malloc(12);
+  ck_assert(data != NULL);
+  ck_assert_int_eq(fread(data, 1, 12, f), 12);
+  len = 12 + ((size_t)(unsigned char)data[4] << 24 |
+              (size_t)(unsigned char)data[5] << 16 |
+              (size_t)(unsigned char)data[6] << 8 |
+              (size_t)(unsigned char)data[7]);
+  data = realloc(data, len);
+  ck_assert(data != NULL);
+  ck_assert_int_eq(fread(data + 12, 1, len - 12, f), len - 12);
+  fclose(f);
+  f = fopen(manifest, "ab");
+  ck_assert(f != NULL);
+  ck_assert_int_eq(fwrite(data, 1, len, f), len);
+  fclose(f);
+  free(data);
+
+  /* Only the latest distinct kernels are preloaded */
+  setup();
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_CACHESTATS, &st),
+                   GA_NO_ERROR);
+  ck_assert(st.disk.hits == PRELOAD_MAX);
+  ck_assert(preloaded(0));
+  ck_assert(preloaded(NPRELOAD - 1));
+  ck_assert(preloaded(NPRELOAD - PRELOAD_MAX + 1));
+  ck_assert(!preloaded(NPRELOAD - PRELOAD_MAX));
+  ck_assert(!preloaded(1));
+  teardown();
+
+  unsetenv("GPUARRAY_CACHE_PRELOAD");
+  unsetenv("GPUARRAY_CACHE_PATH");
+  nftw(dir2, rm, 8, FTW_DEPTH|FTW_PHYS);
+}
+END_TEST
+
+START_TEST(test_alloc_trace) {
+  char path[] = "/tmp/check_alloc_traceXXXXXX";
+  struct stat st;
+  gpudata *d;
+  int fd;
+
+  fd = mkstemp(path);
+  ck_assert(fd != -1);
+  close(fd);
+  setenv("GPUARRAY_ALLOC_TRACE", path, 1);
+
+  setup();
+  d = gpudata_alloc(ctx, 100, NULL, 0, NULL);
+  ck_assert(d != NULL);
+  gpudata_release(d);
+  teardown();
+
+  /* The records are written out when the context goes away */
+  ck_assert_int_eq(stat(path, &st), 0);
+  ck_assert(st.st_size >= 8 + 2 * sizeof(alloc_trace_rec));
+  ck_assert((st.st_size - 8) % sizeof(alloc_trace_rec) == 0);
+
+  unsetenv("GPUARRAY_ALLOC_TRACE");
+  unlink(path);
+}
+END_TEST
+
+#define NTHREADS 4
+#define NITER 200
+
+static const char *mt_srcs[] = {
+  "KERNEL void k(GLOBAL_MEM float *a) {}\n",
+  "KERNEL void k(GLOBAL_MEM float *a) { a[0] = 1; }\n",
+  "KERNEL void k(GLOBAL_MEM float *a) { a[0] = 2; }\n",
+};
+
+static void *mt_run(void *arg) {
+  static const int types[] = {GA_BUFFER};
+  unsigned int *bad = (unsigned int *)arg;
+  size_t gs = 1, ls = 1;
+  char buf[256], out[256];
+  gpudata *d[3] = {NULL, NULL, NULL};
+  gpukernel *k;
+  void *args[1];
+  unsigned int i, j;
+  int err;
+
+  for (i = 0; i < NITER; i++) {
+    j = i % 3;
+    memset(buf, i & 0x7f, sizeof(buf));
+    if (d[j] != NULL)
+      gpudata_release(d[j]);
+    /* Mix sizes to split and merge blocks */
+    d[j] = gpudata_alloc(ctx, (i % 7 + 1) * 4096, NULL, 0, NULL);
+    if (d[j] == NULL) {
+      (*bad)++;
+      continue;
+    }
+    if (gpudata_write(d[j], 0, buf, sizeof(buf)) != GA_NO_ERROR ||
+        gpudata_read(out, d[j], 0, sizeof(out)) != GA_NO_ERROR ||
+        memcmp(buf, out, sizeof(buf)) != 0)
+      (*bad)++;
+
+    /* The threads share the kernels through the cache */
+    k = gpukernel_init(ctx, 1, &mt_srcs[i % 3], NULL, "k", 1, types,
+                       GA_USE_CLUDA, &err, NULL);
+    if (k == NULL) {
+      (*bad)++;
+      continue;
+    }
+    args[0] = d[j];
+    if (gpukernel_call(k, 1, &gs, &ls, 0, args) != GA_NO_ERROR)
+      (*bad)++;
+    gpukernel_release(k);
+  }
+  for (j = 0; j < 3; j++)
+    if (d[j] != NULL)
+      gpudata_release(d[j]);
+  return NULL;
+}
+
+START_TEST(test_threads) {
+  const char *name = NULL;
+  pthread_t t[NTHREADS];
+  unsigned int bad[NTHREADS];
+  gpucontext_cachestats cst;
+  gpucontext_memstats st;
+  int dev = get_env_dev(&name);
+  unsigned int i;
+
+  ctx = gpucontext_init(name, dev, GA_CTX_MULTI_THREAD, NULL);
+  ck_assert_ptr_ne(ctx, NULL);
+
+  for (i = 0; i < NTHREADS; i++) {
+    bad[i] = 0;
+    ck_assert_int_eq(pthread_create(&t[i], NULL, mt_run, &bad[i]), 0);
+  }
+  for (i = 0; i < NTHREADS; i++) {
+    pthread_join(t[i], NULL);
+    ck_assert_int_eq(bad[i], 0);
+  }
+
+  /* Everything that was allocated was given back */
+  st = memstats();
+  ck_assert(st.allocs == NTHREADS * NITER);
+  ck_assert(st.frees == st.allocs);
+  ck_assert(st.live_bytes == 0);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_CACHESTATS, &cst),
+                   GA_NO_ERROR);
+  ck_assert(cst.kernel.hits + cst.kernel.misses == NTHREADS * NITER);
+  ck_assert(cst.kernel.inserts >= 3);
+  teardown();
+}
+END_TEST
+
+Suite *get_suite(void) {
+  Suite *s = suite_create("cuda_alloc");
+  TCase *tc = tcase_create("All");
+  tcase_add_checked_fixture(tc, setup, teardown);
+  tcase_add_test(tc, test_trim_cache);
+  tcase_add_test(tc, test_oom_reclaim);
+  tcase_add_test(tc, test_oom);
+  tcase_add_test(tc, test_alloc_policy);
+  tcase_add_test(tc, test_deferred_free);
+  tcase_add_test(tc, test_host_alloc);
+  tcase_add_test(tc, test_buffer_align);
+  tcase_add_test(tc, test_staged_transfer);
+  tcase_add_test(tc, test_read_async);
+  suite_add_tcase(s, tc);
+  /* These make their own contexts */
+  tc = tcase_create("Preload");
+  tcase_add_test(tc, test_preload);
+  tcase_add_test(tc, test_preload_latest);
+  tcase_add_test(tc, test_alloc_trace);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Threads");
+  tcase_add_test(tc, test_threads);
+  suite_add_tcase(s, tc);
+  return s;
+}
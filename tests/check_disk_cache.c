@@ -0,0 +1,575 @@
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <check.h>
+
+#include "cache.h"
+#include "util/strb.h"
+
+#define NENTRIES 10
+
+static char dir[] = "/tmp/check_disk_cacheXXXXXX";
+
+static int strb_eq(strb *k1, strb *k2) {
+  return (k1->l == k2->l && memcmp(k1->s, k2->s, k1->l) == 0);
+}
+
+static uint32_t strb_hash(strb *k) {
+  uint32_t h = 5381;
+  size_t i;
+  for (i = 0; i < k->l; i++)
+    h = h * 33 + (unsigned char)k->s[i];
+  return h;
+}
+
+static int strb_write_fn(strb *res, strb *k) {
+  strb_appendb(res, k);
+  return strb_error(res);
+}
+
+static strb *strb_read_fn(const strb *b) {
+  strb *res = strb_alloc(b->l);
+  if (res != NULL)
+    strb_appendb(res, b);
+  return res;
+}
+
+static strb *mkstrb(const char *s) {
+  strb *res = strb_alloc(16);
+  ck_assert(res != NULL);
+  strb_appends(res, s);
+  return res;
+}
+
+static cache *open_cache_fmt(int pack) {
+  cache *mem, *c;
+  mem = cache_lru(64, 8, (cache_eq_fn)strb_eq, (cache_hash_fn)strb_hash,
+                  (cache_freek_fn)strb_free, (cache_freev_fn)strb_free,
+                  NULL);
+  ck_assert(mem != NULL);
+  if (pack)
+    c = cache_disk_pack(dir, mem, (kwrite_fn)strb_write_fn,
+                        (vwrite_fn)strb_write_fn, (kread_fn)strb_read_fn,
+                        (vread_fn)strb_read_fn, NULL);
+  else
+    c = cache_disk(dir, mem, (kwrite_fn)strb_write_fn,
+                   (vwrite_fn)strb_write_fn, (kread_fn)strb_read_fn,
+                   (vread_fn)strb_read_fn, NULL);
+  ck_assert(c != NULL);
+  return c;
+}
+
+static cache *open_cache(void) {
+  return open_cache_fmt(0);
+}
+
+static cache *open_pack(void) {
+  return open_cache_fmt(1);
+}
+
+static void add(cache *c, int i) {
+  char buf[16];
+
+  sprintf(buf, "key%d", i);
+  ck_assert_int_eq(cache_add(c, mkstrb(buf), mkstrb(buf + 3)), 0);
+}
+
+static int has(cache *c, int i) {
+  char buf[16];
+  strb *k;
+  int res;
+
+  sprintf(buf, "key%d", i);
+  k = mkstrb(buf);
+  res = (cache_get(c, k) != NULL);
+  strb_free(k);
+  return res;
+}
+
+/* Also checks the value that add() puts in */
+static int has_pack(cache *c, int i) {
+  char buf[16];
+  strb *k, *v;
+
+  sprintf(buf, "key%d", i);
+  k = mkstrb(buf);
+  v = cache_get(c, k);
+  strb_free(k);
+  if (v == NULL)
+    return 0;
+  ck_assert(v->l == strlen(buf + 3) && memcmp(v->s, buf + 3, v->l) == 0);
+  return 1;
+}
+
+static void del(cache *c, int i) {
+  char buf[16];
+  strb *k;
+
+  sprintf(buf, "key%d", i);
+  k = mkstrb(buf);
+  cache_del(c, k);
+  strb_free(k);
+}
+
+static time_t age_to;
+
+static int age(const char *path, const struct stat *st, int flag,
+               struct FTW *f) {
+  struct utimbuf t;
+  if (flag == FTW_F) {
+    t.actime = t.modtime = age_to;
+    utime(path, &t);
+  }
+  return 0;
+}
+
+static int count_entries;
+static size_t count_size;
+
+static int count(const char *path, const struct stat *st, int flag,
+                 struct FTW *f) {
+  if (flag == FTW_F && f->level == 2) {
+    count_entries++;
+    count_size += st->st_size;
+  }
+  return 0;
+}
+
+static int rm(const char *path, const struct stat *st, int flag,
+              struct FTW *f) {
+  return remove(path);
+}
+
+static int entries(void) {
+  count_entries = 0;
+  count_size = 0;
+  nftw(dir, count, 8, FTW_PHYS);
+  return count_entries;
+}
+
+static void setup(void) {
+  cache *c;
+  char buf[16];
+  int i;
+
+  ck_assert(mkdtemp(dir) != NULL);
+  c = open_cache();
+  for (i = 0; i < NENTRIES; i++) {
+    sprintf(buf, "key%d", i);
+    ck_assert_int_eq(cache_add(c, mkstrb(buf), mkstrb("value")), 0);
+  }
+  cache_destroy(c);
+  ck_assert_int_eq(entries(), NENTRIES);
+
+  /* Make everything look unused for a while */
+  age_to = time(NULL) - 1000;
+  nftw(dir, age, 8, FTW_PHYS);
+}
+
+static void pack_setup(void) {
+  ck_assert(mkdtemp(dir) != NULL);
+}
+
+static void teardown(void) {
+  nftw(dir, rm, 8, FTW_DEPTH|FTW_PHYS);
+  strcpy(dir + strlen(dir) - 6, "XXXXXX");
+}
+
+START_TEST(test_gc_entries) {
+  cache *c;
+  int i;
+
+  /* Mark some entries as recently used */
+  c = open_cache();
+  for (i = 0; i < 3; i++)
+    ck_assert(has(c, i));
+  cache_destroy(c);
+
+  c = open_cache();
+  ck_assert_int_eq(cache_disk_gc(c, 0, 4, 0), 0);
+  cache_destroy(c);
+  ck_assert(entries() <= 4);
+
+  c = open_cache();
+  for (i = 0; i < 3; i++)
+    ck_assert(has(c, i));
+  cache_destroy(c);
+}
+END_TEST
+
+START_TEST(test_gc_size) {
+  cache *c;
+  size_t sz;
+
+  c = open_cache();
+  ck_assert(has(c, 5));
+  cache_destroy(c);
+
+  /* Room for about half of the entries */
+  entries();
+  sz = count_size / NENTRIES;
+  c = open_cache();
+  ck_assert_int_eq(cache_disk_gc(c, sz * NENTRIES / 2, 0, 0), 0);
+  cache_destroy(c);
+  ck_assert(entries() > 0);
+  ck_assert(count_size <= sz * NENTRIES / 2);
+
+  c = open_cache();
+  ck_assert(has(c, 5));
+  cache_destroy(c);
+}
+END_TEST
+
+START_TEST(test_gc_nolimit) {
+  cache *c;
+
+  c = open_cache();
+  ck_assert_int_eq(cache_disk_gc(c, 0, 0, 0), 0);
+  cache_destroy(c);
+  ck_assert_int_eq(entries(), NENTRIES);
+}
+END_TEST
+
+START_TEST(test_gc_tmp) {
+  cache *c;
+  char path[64];
+  struct stat st;
+
+  /* Left by a process that died while writing */
+  strcpy(path, dir);
+  strcat(path, "/tmp.abcdefgh");
+  close(open(path, O_WRONLY|O_CREAT, 0666));
+  age_to = time(NULL) - 2 * 3600;
+  nftw(dir, age, 8, FTW_PHYS);
+
+  c = open_cache();
+  ck_assert_int_eq(cache_disk_gc(c, 0, NENTRIES, 0), 0);
+  cache_destroy(c);
+  ck_assert(stat(path, &st) != 0);
+  ck_assert_int_eq(entries(), NENTRIES);
+}
+END_TEST
+
+START_TEST(test_gc_interval) {
+  cache *c;
+
+  c = open_cache();
+  ck_assert_int_eq(cache_disk_gc(c, 0, NENTRIES, 0), 0);
+  /* A collection just ran, this is skipped */
+  ck_assert_int_eq(cache_disk_gc(c, 0, 2, 3600), 0);
+  ck_assert_int_eq(entries(), NENTRIES);
+  ck_assert_int_eq(cache_disk_gc(c, 0, 2, 0), 0);
+  ck_assert(entries() <= 2);
+  cache_destroy(c);
+}
+END_TEST
+
+START_TEST(test_pack_reopen) {
+  cache *c;
+  int i;
+
+  c = open_pack();
+  for (i = 0; i < NENTRIES; i++)
+    add(c, i);
+  cache_destroy(c);
+
+  /* Everything is in the pack */
+  ck_assert_int_eq(entries(), 0);
+
+  c = open_pack();
+  for (i = 0; i < NENTRIES; i++)
+    ck_assert(has_pack(c, i));
+  ck_assert(!has_pack(c, NENTRIES));
+  cache_destroy(c);
+}
+END_TEST
+
+START_TEST(test_pack_concurrent) {
+  cache *a, *b, *c;
+
+  a = open_pack();
+  b = open_pack();
+
+  /* Records appended after b mapped the pack */
+  add(a, 0);
+  add(a, 1);
+  ck_assert(has_pack(b, 0));
+  del(b, 1);
+  add(b, 2);
+  ck_assert(has_pack(a, 2));
+
+  c = open_pack();
+  ck_assert(has_pack(c, 0));
+  ck_assert(!has_pack(c, 1));
+  ck_assert(has_pack(c, 2));
+  cache_destroy(c);
+  cache_destroy(b);
+  cache_destroy(a);
+}
+END_TEST
+
+START_TEST(test_pack_gc) {
+  cache *c;
+  int i;
+
+  c = open_pack();
+  for (i = 0; i < NENTRIES; i++)
+    add(c, i);
+  ck_assert_int_eq(cache_disk_gc(c, 0, 4, 0), 0);
+  /* The compaction doesn't get in the way */
+  add(c, NENTRIES);
+  cache_destroy(c);
+
+  /* The oldest entries are gone */
+  c = open_pack();
+  for (i = 0; i < NENTRIES - 4; i++)
+    ck_assert(!has_pack(c, i));
+  for (; i <= NENTRIES; i++)
+    ck_assert(has_pack(c, i));
+  cache_destroy(c);
+}
+END_TEST
+
+#define NAPPEND 10000
+
+/* A large entry under a fixed key, replacing it makes garbage */
+static void add_big(cache *c) {
+  strb *v = strb_alloc(64 * 1024);
+
+  ck_assert(v != NULL);
+  memset(v->s, 'x', v->a);
+  v->l = v->a;
+  ck_assert_int_eq(cache_add(c, mkstrb("big"), v), 0);
+}
+
+START_TEST(test_pack_gc_append) {
+  cache *c;
+  pid_t pid;
+  int i, st;
+
+  /* Another process appends while this one compacts */
+  pid = fork();
+  ck_assert(pid != -1);
+  if (pid == 0) {
+    c = open_pack();
+    for (i = 0; i < NAPPEND; i++)
+      add(c, i);
+    cache_destroy(c);
+    _exit(0);
+  }
+
+  c = open_pack();
+  while (waitpid(pid, &st, WNOHANG) == 0) {
+    add_big(c);
+    ck_assert_int_eq(cache_disk_gc(c, 0, 0, 0), 0);
+  }
+  ck_assert(WIFEXITED(st) && WEXITSTATUS(st) == 0);
+  cache_destroy(c);
+
+  c = open_pack();
+  for (i = 0; i < NAPPEND; i++)
+    ck_assert(has_pack(c, i));
+  cache_destroy(c);
+}
+END_TEST
+
+START_TEST(test_pack_torn) {
+  char path[64];
+  char rec[24];
+  cache *c;
+  int fd, i;
+
+  c = open_pack();
+  for (i = 0; i < 3; i++)
+    add(c, i);
+  cache_destroy(c);
+
+  /* A record that was not completely written */
+  strcpy(path, dir);
+  strcat(path, "/kernels.pack");
+  memset(rec, 0, sizeof(rec));
+  rec[3] = 1;
+  rec[7] = 1;
+  fd = open(path, O_WRONLY|O_APPEND);
+  ck_assert(fd != -1);
+  ck_assert(write(fd, rec, sizeof(rec)) == sizeof(rec));
+  close(fd);
+
+  c = open_pack();
+  for (i = 0; i < 3; i++)
+    ck_assert(has_pack(c, i));
+  add(c, 3);
+  cache_destroy(c);
+
+  c = open_pack();
+  ck_assert(!has_pack(c, 3));
+  /* The collection rewrites the pack */
+  ck_assert_int_eq(cache_disk_gc(c, 0, 0, 0), 0);
+  add(c, 3);
+  cache_destroy(c);
+
+  c = open_pack();
+  for (i = 0; i < 4; i++)
+    ck_assert(has_pack(c, i));
+  cache_destroy(c);
+}
+END_TEST
+
+START_TEST(test_mem_stats) {
+  gpucache_stats st;
+  cache *c;
+  int i;
+
+  c = cache_lru(4, 2, (cache_eq_fn)strb_eq, (cache_hash_fn)strb_hash,
+                (cache_freek_fn)strb_free, (cache_freev_fn)strb_free, NULL);
+  ck_assert(c != NULL);
+  for (i = 0; i < NENTRIES; i++)
+    add(c, i);
+  ck_assert(has(c, NENTRIES - 1));
+  ck_assert(!has(c, 0));
+  cache_get_stats(c, &st);
+  ck_assert(st.inserts == NENTRIES);
+  ck_assert(st.hits == 1);
+  ck_assert(st.misses == 1);
+  ck_assert(st.evictions > 0);
+  cache_destroy(c);
+
+  c = cache_twoq(2, 2, 2, 2, (cache_eq_fn)strb_eq, (cache_hash_fn)strb_hash,
+                 (cache_freek_fn)strb_free, (cache_freev_fn)strb_free, NULL);
+  ck_assert(c != NULL);
+  for (i = 0; i < NENTRIES; i++)
+    add(c, i);
+  ck_assert(has(c, NENTRIES - 1));
+  cache_get_stats(c, &st);
+  ck_assert(st.inserts == NENTRIES);
+  ck_assert(st.hits == 1);
+  ck_assert(st.evictions > 0);
+  cache_destroy(c);
+}
+END_TEST
+
+START_TEST(test_stats) {
+  gpucache_stats st;
+  cache *c;
+
+  c = open_cache();
+  ck_assert(has(c, 0));
+  ck_assert(has(c, 0));
+  ck_assert(!has(c, NENTRIES));
+  add(c, NENTRIES);
+  cache_get_stats(c, &st);
+  ck_assert(st.hits == 2);
+  ck_assert(st.misses == 1);
+  ck_assert(st.inserts == 1);
+  ck_assert(st.bytes_read > 0);
+  ck_assert(st.bytes_written > 0);
+  ck_assert(st.evictions == 0);
+
+  ck_assert_int_eq(cache_disk_gc(c, 0, 4, 0), 0);
+  cache_get_stats(c, &st);
+  ck_assert(st.evictions >= NENTRIES + 1 - 4);
+  cache_destroy(c);
+}
+END_TEST
+
+/* Every key of the same length collides */
+static void same_fp(strb *k, cache_fp *fp) {
+  fp->h[0] = fp->h[1] = k->l;
+}
+
+START_TEST(test_fingerprint) {
+  cache *c;
+  int i;
+
+  /* Entries added without fingerprints are not found with them */
+  c = open_cache();
+  add(c, 0);
+  cache_destroy(c);
+  c = open_cache();
+  cache_disk_fingerprint(c, (kfp_fn)same_fp);
+  ck_assert(!has(c, 0));
+
+  /* Colliding keys share a file and the last one wins */
+  add(c, 1);
+  add(c, 2);
+  cache_destroy(c);
+  c = open_cache();
+  cache_disk_fingerprint(c, (kfp_fn)same_fp);
+  ck_assert(!has(c, 1));
+  ck_assert(has_pack(c, 2));
+  cache_destroy(c);
+
+  /* A pack keeps them all */
+  c = open_pack();
+  cache_disk_fingerprint(c, (kfp_fn)same_fp);
+  for (i = 0; i < NENTRIES; i++)
+    add(c, i);
+  cache_destroy(c);
+  c = open_pack();
+  cache_disk_fingerprint(c, (kfp_fn)same_fp);
+  for (i = 0; i < NENTRIES; i++)
+    ck_assert(has_pack(c, i));
+  ck_assert(!has_pack(c, NENTRIES));
+  cache_destroy(c);
+}
+END_TEST
+
+START_TEST(test_pack_stats) {
+  gpucache_stats st;
+  cache *c;
+  int i;
+
+  c = open_pack();
+  for (i = 0; i < NENTRIES; i++)
+    add(c, i);
+  cache_destroy(c);
+
+  c = open_pack();
+  ck_assert(has_pack(c, 0));
+  ck_assert(!has_pack(c, NENTRIES));
+  ck_assert_int_eq(cache_disk_gc(c, 0, 4, 0), 0);
+  cache_get_stats(c, &st);
+  ck_assert(st.hits == 1);
+  ck_assert(st.misses == 1);
+  ck_assert(st.inserts == 0);
+  ck_assert(st.bytes_read > 0);
+  ck_assert(st.evictions == NENTRIES - 4);
+  cache_destroy(c);
+}
+END_TEST
+
+Suite *get_suite(void) {
+  Suite *s = suite_create("disk_cache");
+  TCase *tc = tcase_create("All");
+  tcase_add_checked_fixture(tc, setup, teardown);
+  tcase_add_test(tc, test_gc_entries);
+  tcase_add_test(tc, test_gc_size);
+  tcase_add_test(tc, test_gc_nolimit);
+  tcase_add_test(tc, test_gc_tmp);
+  tcase_add_test(tc, test_gc_interval);
+  tcase_add_test(tc, test_stats);
+  suite_add_tcase(s, tc);
+  tc = tcase_create("Pack");
+  tcase_add_checked_fixture(tc, pack_setup, teardown);
+  tcase_add_test(tc, test_pack_reopen);
+  tcase_add_test(tc, test_pack_concurrent);
+  tcase_add_test(tc, test_pack_gc);
+  tcase_add_test(tc, test_pack_gc_append);
+  tcase_add_test(tc, test_pack_torn);
+  tcase_add_test(tc, test_pack_stats);
+  tcase_add_test(tc, test_fingerprint);
+  suite_add_tcase(s, tc);
+  tc = tcase_create("Memory");
+  tcase_add_test(tc, test_mem_stats);
+  suite_add_tcase(s, tc);
+  return s;
+}
@@ -178,6 +178,92 @@ START_TEST(test_contig_0) {
 }
 END_TEST
 
+/* Large enough for the vectorized kernel, with a tail */
+#define VEC_N (16384 + 3)
+
+START_TEST(test_contig_vec) {
+  GpuArray a;
+  GpuArray b;
+  GpuArray c;
+
+  GpuElemwise *ge;
+
+  static float data1[VEC_N];
+  static float data2[VEC_N];
+  static float data3[VEC_N];
+
+  size_t dims[1];
+  size_t i;
+
+  gpuelemwise_arg args[3] = {{0}};
+  void *rargs[3];
+
+  ssize_t starts[1];
+  ssize_t stops[1];
+  ssize_t steps[1];
+
+  for (i = 0; i < VEC_N; i++) {
+    data1[i] = (float)i;
+    data2[i] = (float)(2 * i);
+  }
+
+  dims[0] = VEC_N;
+
+  ga_assert_ok(GpuArray_empty(&a, ctx, GA_FLOAT, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&a, data1, sizeof(data1)));
+
+  ga_assert_ok(GpuArray_empty(&b, ctx, GA_FLOAT, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&b, data2, sizeof(data2)));
+
+  ga_assert_ok(GpuArray_empty(&c, ctx, GA_FLOAT, 1, dims, GA_C_ORDER));
+
+  args[0].name = "a";
+  args[0].typecode = GA_FLOAT;
+  args[0].flags = GE_READ;
+
+  args[1].name = "b";
+  args[1].typecode = GA_FLOAT;
+  args[1].flags = GE_READ;
+
+  args[2].name = "c";
+  args[2].typecode = GA_FLOAT;
+  args[2].flags = GE_WRITE;
+
+  ge = GpuElemwise_new(ctx, "", "c = a + b", 3, args, 1, 0);
+
+  ck_assert_ptr_ne(ge, NULL);
+
+  rargs[0] = &a;
+  rargs[1] = &b;
+  rargs[2] = &c;
+
+  ga_assert_ok(GpuElemwise_call(ge, rargs, 0));
+  ck_assert(GpuElemwise_built(ge, GE_VARIANT_CONTIG_VEC, 0));
+
+  ga_assert_ok(GpuArray_read(data3, sizeof(data3), &c));
+
+  for (i = 0; i < VEC_N; i++)
+    ck_assert(data3[i] == (float)(3 * i));
+
+  /* Offsets of one element are not aligned */
+  starts[0] = 1;
+  stops[0] = VEC_N;
+  steps[0] = 1;
+
+  ga_assert_ok(GpuArray_index_inplace(&a, starts, stops, steps));
+  ga_assert_ok(GpuArray_index_inplace(&b, starts, stops, steps));
+  ga_assert_ok(GpuArray_index_inplace(&c, starts, stops, steps));
+
+  ga_assert_ok(GpuElemwise_call(ge, rargs, 0));
+  ck_assert(GpuElemwise_built(ge, GE_VARIANT_CONTIG, 0));
+
+  GpuElemwise_free(ge);
+  GpuArray_clear(&c);
+  GpuArray_clear(&b);
+  GpuArray_clear(&a);
+}
+END_TEST
+
 START_TEST(test_basic_simple) {
   GpuArray a;
   GpuArray b;
@@ -738,6 +824,379 @@ START_TEST(test_basic_0) {
 }
 END_TEST
 
+START_TEST(test_lazy) {
+  GpuArray a, b, c;
+  GpuElemwise *ge, *ge2;
+  gpucontext_cachestats st, st2;
+  gpuelemwise_arg args[3] = {{0}};
+  void *rargs[3];
+  size_t dims[2];
+
+  dims[0] = 2;
+  dims[1] = 3;
+
+  ga_assert_ok(GpuArray_empty(&a, ctx, GA_UINT, 2, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_empty(&b, ctx, GA_UINT, 2, dims, GA_F_ORDER));
+  ga_assert_ok(GpuArray_empty(&c, ctx, GA_UINT, 2, dims, GA_C_ORDER));
+
+  args[0].name = "a";
+  args[0].typecode = GA_UINT;
+  args[0].flags = GE_READ;
+
+  args[1].name = "b";
+  args[1].typecode = GA_UINT;
+  args[1].flags = GE_READ;
+
+  args[2].name = "c";
+  args[2].typecode = GA_UINT;
+  args[2].flags = GE_WRITE;
+
+  ge = GpuElemwise_new(ctx, "", "c = a + b", 3, args, 2, 0);
+  ck_assert_ptr_ne(ge, NULL);
+  /* Only the contiguous kernel is built up front */
+  ck_assert(GpuElemwise_built(ge, GE_VARIANT_CONTIG, 0));
+  ck_assert(!GpuElemwise_built(ge, GE_VARIANT_BASIC_32, 2));
+
+  rargs[0] = &a;
+  rargs[1] = &a;
+  rargs[2] = &c;
+  ga_assert_ok(GpuElemwise_call(ge, rargs, 0));
+  ck_assert(GpuElemwise_built(ge, GE_VARIANT_CONTIG, 0));
+  ck_assert(!GpuElemwise_built(ge, GE_VARIANT_BASIC_32, 2));
+
+  rargs[1] = &b;
+  ga_assert_ok(GpuElemwise_call(ge, rargs, GE_NOCOLLAPSE));
+  ck_assert(GpuElemwise_built(ge, GE_VARIANT_BASIC_32, 2));
+  ck_assert(!GpuElemwise_built(ge, GE_VARIANT_BASIC_32, 1));
+  ck_assert(!GpuElemwise_built(ge, GE_VARIANT_BASIC, 2));
+
+  /* Another instance reuses the kernels of the first one */
+  ga_assert_ok(gpucontext_property(ctx, GA_CTX_PROP_CACHESTATS, &st));
+  ge2 = GpuElemwise_new(ctx, "", "c = a + b", 3, args, 2, 0);
+  ck_assert_ptr_ne(ge2, NULL);
+  ga_assert_ok(GpuElemwise_call(ge2, rargs, GE_NOCOLLAPSE));
+  ck_assert(GpuElemwise_built(ge2, GE_VARIANT_BASIC_32, 2));
+  ck_assert(!GpuElemwise_built(ge2, GE_VARIANT_BASIC_32, 1));
+  ga_assert_ok(gpucontext_property(ctx, GA_CTX_PROP_CACHESTATS, &st2));
+  ck_assert(st2.kernel.misses == st.kernel.misses);
+  ck_assert(st2.kernel.hits > st.kernel.hits);
+
+  GpuElemwise_free(ge2);
+  GpuElemwise_free(ge);
+  GpuArray_clear(&c);
+  GpuArray_clear(&b);
+  GpuArray_clear(&a);
+}
+END_TEST
+
+START_TEST(test_new_error) {
+  GpuElemwise *ge;
+  gpuelemwise_arg args[2] = {{0}};
+
+  args[0].name = "a";
+  args[0].typecode = GA_FLOAT;
+  args[0].flags = GE_READ;
+
+  args[1].name = "c";
+  args[1].typecode = GA_FLOAT;
+  args[1].flags = GE_WRITE;
+
+  /* Errors in the expression are reported on creation */
+  ge = GpuElemwise_new(ctx, "", "c = a;\n#error bad expression\n", 2, args,
+                       1, 0);
+  ck_assert_ptr_eq(ge, NULL);
+
+  ge = GpuElemwise_new(ctx, "", "c = a", 2, args, 2, GE_PRECOMPILE);
+  ck_assert_ptr_ne(ge, NULL);
+  ck_assert(GpuElemwise_built(ge, GE_VARIANT_BASIC_32, 1));
+  ck_assert(GpuElemwise_built(ge, GE_VARIANT_BASIC_32, 2));
+  ck_assert(GpuElemwise_built(ge, GE_VARIANT_BASIC, 2));
+  ck_assert(!GpuElemwise_built(ge, GE_VARIANT_BASIC_32, 3));
+  GpuElemwise_free(ge);
+
+  ge = GpuElemwise_new(ctx, "", "c = a", 2, args, 2,
+                       GE_PRECOMPILE | GE_NOADDR64);
+  ck_assert_ptr_ne(ge, NULL);
+  ck_assert(GpuElemwise_built(ge, GE_VARIANT_BASIC_32, 2));
+  ck_assert(!GpuElemwise_built(ge, GE_VARIANT_BASIC, 2));
+  GpuElemwise_free(ge);
+}
+END_TEST
+
+START_TEST(test_fuse) {
+  GpuArray a;
+  GpuArray x;
+  GpuArray z;
+
+  GpuElemwise *ge;
+
+  static const float data1[4] = {1, 2, 3, 4};
+  static const float data2[4] = {-2, 1, -1, 2};
+  float data3[4] = {0};
+  float b = 1;
+
+  size_t dims[1];
+
+  gpuelemwise_arg args[4] = {{0}};
+  /* Out of order, with a stage that no output needs */
+  gpuelemwise_stage stages[3] = {
+    {"z", "y > 0 ? y : 0", 0},
+    {"unused", "a * 3", GA_FLOAT},
+    {"y", "a * x + b", GA_FLOAT},
+  };
+  gpuelemwise_stage cycle[2] = {
+    {"z", "y", 0},
+    {"y", "z + 1", GA_FLOAT},
+  };
+  void *rargs[4];
+
+  dims[0] = 4;
+
+  ga_assert_ok(GpuArray_empty(&a, ctx, GA_FLOAT, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&a, data1, sizeof(data1)));
+
+  ga_assert_ok(GpuArray_empty(&x, ctx, GA_FLOAT, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&x, data2, sizeof(data2)));
+
+  ga_assert_ok(GpuArray_empty(&z, ctx, GA_FLOAT, 1, dims, GA_C_ORDER));
+
+  args[0].name = "a";
+  args[0].typecode = GA_FLOAT;
+  args[0].flags = GE_READ;
+
+  args[1].name = "x";
+  args[1].typecode = GA_FLOAT;
+  args[1].flags = GE_READ;
+
+  args[2].name = "b";
+  args[2].typecode = GA_FLOAT;
+  args[2].flags = GE_SCALAR;
+
+  args[3].name = "z";
+  args[3].typecode = GA_FLOAT;
+  args[3].flags = GE_WRITE;
+
+  ck_assert_ptr_eq(GpuElemwise_fuse(ctx, "", 2, cycle, 4, args, 1, 0), NULL);
+  /* z would be left unset */
+  ck_assert_ptr_eq(GpuElemwise_fuse(ctx, "", 1, &stages[2], 4, args, 1, 0),
+                   NULL);
+
+  ge = GpuElemwise_fuse(ctx, "", 3, stages, 4, args, 1, 0);
+
+  ck_assert_ptr_ne(ge, NULL);
+
+  rargs[0] = &a;
+  rargs[1] = &x;
+  rargs[2] = &b;
+  rargs[3] = &z;
+
+  ga_assert_ok(GpuElemwise_call(ge, rargs, 0));
+
+  ga_assert_ok(GpuArray_read(data3, sizeof(data3), &z));
+
+  ck_assert(data3[0] == 0);
+  ck_assert(data3[1] == 3);
+  ck_assert(data3[2] == 0);
+  ck_assert(data3[3] == 9);
+
+  GpuElemwise_free(ge);
+  GpuArray_clear(&z);
+  GpuArray_clear(&x);
+  GpuArray_clear(&a);
+}
+END_TEST
+
+START_TEST(test_plan) {
+  GpuArray a;
+  GpuArray b;
+  GpuArray c;
+  GpuArray c2;
+  GpuArray bad;
+
+  GpuElemwise *ge;
+  GpuElemwisePlan *plan;
+
+  static const uint32_t data1[6] = {1, 2, 3, 4, 5, 6};
+  /* F order */
+  static const uint32_t data2[6] = {10, 20, 30, 40, 50, 60};
+  uint32_t data3[6] = {0};
+  uint32_t data4[6] = {0};
+
+  size_t dims[2];
+  int err;
+
+  gpuelemwise_arg args[3] = {{0}};
+  void *rargs[3];
+
+  dims[0] = 2;
+  dims[1] = 3;
+
+  ga_assert_ok(GpuArray_empty(&a, ctx, GA_UINT, 2, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&a, data1, sizeof(data1)));
+
+  ga_assert_ok(GpuArray_empty(&b, ctx, GA_UINT, 2, dims, GA_F_ORDER));
+  ga_assert_ok(GpuArray_write(&b, data2, sizeof(data2)));
+
+  ga_assert_ok(GpuArray_empty(&c, ctx, GA_UINT, 2, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_empty(&c2, ctx, GA_UINT, 2, dims, GA_C_ORDER));
+
+  dims[1] = 4;
+  ga_assert_ok(GpuArray_empty(&bad, ctx, GA_UINT, 2, dims, GA_C_ORDER));
+
+  args[0].name = "a";
+  args[0].typecode = GA_UINT;
+  args[0].flags = GE_READ;
+
+  args[1].name = "b";
+  args[1].typecode = GA_UINT;
+  args[1].flags = GE_READ;
+
+  args[2].name = "c";
+  args[2].typecode = GA_UINT;
+  args[2].flags = GE_WRITE;
+
+  ge = GpuElemwise_new(ctx, "", "c = a + b", 3, args, 2, 0);
+
+  ck_assert_ptr_ne(ge, NULL);
+
+  rargs[0] = &a;
+  rargs[1] = &b;
+  rargs[2] = &bad;
+
+  plan = GpuElemwisePlan_new(ge, rargs, 0, &err);
+  ck_assert_ptr_eq(plan, NULL);
+  ck_assert_int_eq(err, GA_VALUE_ERROR);
+
+  rargs[2] = &c;
+
+  plan = GpuElemwisePlan_new(ge, rargs, 0, &err);
+  ck_assert_ptr_ne(plan, NULL);
+  ga_assert_ok(err);
+  ck_assert(GpuElemwise_built(ge, GE_VARIANT_BASIC_32, 2));
+
+  ga_assert_ok(GpuElemwisePlan_call(plan, rargs));
+
+  /* Same geometry, other buffer */
+  rargs[2] = &c2;
+  ga_assert_ok(GpuElemwisePlan_call(plan, rargs));
+
+  ga_assert_ok(GpuArray_read(data3, sizeof(data3), &c));
+
+  ck_assert_int_eq(data3[0], 11);
+  ck_assert_int_eq(data3[1], 32);
+  ck_assert_int_eq(data3[2], 53);
+  ck_assert_int_eq(data3[3], 24);
+  ck_assert_int_eq(data3[4], 45);
+  ck_assert_int_eq(data3[5], 66);
+
+  ga_assert_ok(GpuArray_read(data4, sizeof(data4), &c2));
+
+  ck_assert_int_eq(data4[0], 11);
+  ck_assert_int_eq(data4[5], 66);
+
+  GpuElemwisePlan_free(plan);
+  GpuElemwise_free(ge);
+  GpuArray_clear(&bad);
+  GpuArray_clear(&c2);
+  GpuArray_clear(&c);
+  GpuArray_clear(&b);
+  GpuArray_clear(&a);
+}
+END_TEST
+
+START_TEST(test_plan_grow) {
+  GpuArray a;
+  GpuArray c;
+  GpuArray a3;
+  GpuArray c3;
+
+  GpuElemwise *ge;
+  GpuElemwisePlan *plan;
+
+  static const uint32_t data1[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+  uint32_t data2[4] = {0};
+
+  size_t dims[3];
+  ssize_t starts[3];
+  ssize_t stops[3];
+  ssize_t steps[3];
+  int err;
+
+  gpuelemwise_arg args[2] = {{0}};
+  void *rargs[2];
+
+  dims[0] = 8;
+  ga_assert_ok(GpuArray_empty(&a, ctx, GA_UINT, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&a, data1, sizeof(data1)));
+
+  dims[0] = 4;
+  ga_assert_ok(GpuArray_empty(&c, ctx, GA_UINT, 1, dims, GA_C_ORDER));
+
+  dims[0] = 4;
+  dims[1] = 4;
+  dims[2] = 4;
+  ga_assert_ok(GpuArray_empty(&a3, ctx, GA_UINT, 3, dims, GA_C_ORDER));
+
+  dims[0] = 2;
+  dims[1] = 2;
+  dims[2] = 2;
+  ga_assert_ok(GpuArray_empty(&c3, ctx, GA_UINT, 3, dims, GA_C_ORDER));
+
+  /* Every other element, so that none of the dimensions collapse */
+  starts[0] = starts[1] = starts[2] = 0;
+  stops[0] = stops[1] = stops[2] = 4;
+  steps[0] = steps[1] = steps[2] = 2;
+
+  stops[0] = 8;
+  ga_assert_ok(GpuArray_index_inplace(&a, starts, stops, steps));
+  stops[0] = 4;
+  ga_assert_ok(GpuArray_index_inplace(&a3, starts, stops, steps));
+
+  args[0].name = "a";
+  args[0].typecode = GA_UINT;
+  args[0].flags = GE_READ;
+
+  args[1].name = "c";
+  args[1].typecode = GA_UINT;
+  args[1].flags = GE_WRITE;
+
+  ge = GpuElemwise_new(ctx, "", "c = a * 2", 2, args, 1, 0);
+
+  ck_assert_ptr_ne(ge, NULL);
+
+  rargs[0] = &a;
+  rargs[1] = &c;
+
+  plan = GpuElemwisePlan_new(ge, rargs, 0, &err);
+  ck_assert_ptr_ne(plan, NULL);
+  ga_assert_ok(err);
+
+  /* This grows ge for 3 dimensions, moving its basic kernels */
+  rargs[0] = &a3;
+  rargs[1] = &c3;
+  ga_assert_ok(GpuElemwise_call(ge, rargs, 0));
+  ck_assert(GpuElemwise_built(ge, GE_VARIANT_BASIC_32, 3));
+
+  rargs[0] = &a;
+  rargs[1] = &c;
+  ga_assert_ok(GpuElemwisePlan_call(plan, rargs));
+
+  ga_assert_ok(GpuArray_read(data2, sizeof(data2), &c));
+
+  ck_assert_int_eq(data2[0], 2);
+  ck_assert_int_eq(data2[1], 6);
+  ck_assert_int_eq(data2[2], 10);
+  ck_assert_int_eq(data2[3], 14);
+
+  GpuElemwisePlan_free(plan);
+  GpuElemwise_free(ge);
+  GpuArray_clear(&c3);
+  GpuArray_clear(&a3);
+  GpuArray_clear(&c);
+  GpuArray_clear(&a);
+}
+END_TEST
+
 Suite *get_suite(void) {
   Suite *s = suite_create("elemwise");
   TCase *tc = tcase_create("contig");
@@ -746,6 +1205,7 @@ Suite *get_suite(void) {
   tcase_add_test(tc, test_contig_simple);
   tcase_add_test(tc, test_contig_f16);
   tcase_add_test(tc, test_contig_0);
+  tcase_add_test(tc, test_contig_vec);
   suite_add_tcase(s, tc);
   tc = tcase_create("basic");
   tcase_set_timeout(tc, 8.0);
@@ -759,6 +1219,11 @@ Suite *get_suite(void) {
   tcase_add_test(tc, test_basic_collapse);
   tcase_add_test(tc, test_basic_neg_strides);
   tcase_add_test(tc, test_basic_0);
+  tcase_add_test(tc, test_lazy);
+  tcase_add_test(tc, test_new_error);
+  tcase_add_test(tc, test_fuse);
+  tcase_add_test(tc, test_plan);
+  tcase_add_test(tc, test_plan_grow);
   suite_add_tcase(s, tc);
   return s;
 }
@@ -0,0 +1,120 @@
+#define _XOPEN_SOURCE 700
+#include <check.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "private_cuda.h"
+
+/*
+ * These tests run against the stub CUDA driver and NVRTC
+ * (stub_libcuda.c and stub_libnvrtc.c), which say they are cuda 8.0 on
+ * a compute capability 3.5 device.
+ */
+
+extern void *ctx;
+
+void setup(void);
+void teardown(void);
+
+static const char *ksrc = "KERNEL void k(GLOBAL_MEM float *a) {}\n";
+static const int ktypes[] = {GA_BUFFER};
+
+static char dir[] = "/tmp/check_precompileXXXXXX";
+
+static int rm(const char *path, const struct stat *st, int flag,
+              struct FTW *f) {
+  return remove(path);
+}
+
+/* Does what gpuarray-precompile does for one source file with -c */
+static void precompile(const char *arch, int pack) {
+  strb src = STRB_STATIC_INIT;
+  strb bin = STRB_STATIC_INIT;
+  strb log = STRB_STATIC_INIT;
+  error *e;
+  cache *c;
+
+  ck_assert_int_eq(error_alloc(&e), 0);
+  ck_assert_int_eq(cuda_precompile_setup(8, 0, e), GA_NO_ERROR);
+  cuda_precompile_preamble(&src);
+  strb_appends(&src, ksrc);
+  strb_append0(&src);
+  ck_assert(!strb_error(&src));
+
+  c = cuda_precompile_cache(dir, pack, e);
+  ck_assert(c != NULL);
+  ck_assert_int_eq(cuda_precompile(arch, &src, &bin, &log, e), GA_NO_ERROR);
+  ck_assert_int_eq(cuda_precompile_store(c, 8, 0, arch, &src, &bin, e),
+                   GA_NO_ERROR);
+  cache_destroy(c);
+  strb_clear(&src);
+  strb_clear(&bin);
+  strb_clear(&log);
+  error_free(e);
+}
+
+/* Build the kernel in a new context and return whether it came from disk */
+static int from_disk(int pack) {
+  gpucontext_cachestats st;
+  gpukernel *k;
+  int err = GA_NO_ERROR;
+
+  setenv("GPUARRAY_CACHE_PATH", dir, 1);
+  if (pack)
+    setenv("GPUARRAY_CACHE_FORMAT", "pack", 1);
+  setup();
+  k = gpukernel_init(ctx, 1, &ksrc, NULL, "k", 1, ktypes, GA_USE_CLUDA,
+                     &err, NULL);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  gpukernel_release(k);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_CACHESTATS, &st),
+                   GA_NO_ERROR);
+  teardown();
+  unsetenv("GPUARRAY_CACHE_FORMAT");
+  unsetenv("GPUARRAY_CACHE_PATH");
+  return st.disk.hits == 1;
+}
+
+static void dir_setup(void) {
+  ck_assert(mkdtemp(dir) != NULL);
+}
+
+static void dir_teardown(void) {
+  nftw(dir, rm, 8, FTW_DEPTH|FTW_PHYS);
+  strcpy(dir + strlen(dir) - 6, "XXXXXX");
+}
+
+START_TEST(test_precompile) {
+  precompile("compute_35", 0);
+  ck_assert(from_disk(0));
+}
+END_TEST
+
+START_TEST(test_precompile_pack) {
+  precompile("compute_35", 1);
+  ck_assert(from_disk(1));
+}
+END_TEST
+
+START_TEST(test_precompile_other_arch) {
+  /* A context only looks for its own architecture */
+  precompile("compute_50", 0);
+  ck_assert(!from_disk(0));
+}
+END_TEST
+
+Suite *get_suite(void) {
+  Suite *s = suite_create("precompile");
+  TCase *tc = tcase_create("All");
+  tcase_add_checked_fixture(tc, dir_setup, dir_teardown);
+  tcase_add_test(tc, test_precompile);
+  tcase_add_test(tc, test_precompile_pack);
+  tcase_add_test(tc, test_precompile_other_arch);
+  suite_add_tcase(s, tc);
+  return s;
+}
@@ -0,0 +1,407 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "util/suballoc.h"
+
+/* Host memory backing for the allocator, with an optional cap */
+typedef struct _host_mem {
+  size_t limit;
+  size_t used;
+  size_t max_raw;
+  unsigned int raw_allocs;
+  unsigned int raw_frees;
+  unsigned int splits;
+  unsigned int merges;
+} host_mem;
+
+static int host_raw_alloc(void *ud, size_t sz, size_t *ptr) {
+  host_mem *m = (host_mem *)ud;
+  void *p;
+  if (m->limit != 0 && m->used + sz > m->limit)
+    return GA_MEMORY_ERROR;
+  p = malloc(sz == 0 ? 1 : sz);
+  if (p == NULL)
+    return GA_MEMORY_ERROR;
+  m->used += sz;
+  if (sz > m->max_raw)
+    m->max_raw = sz;
+  m->raw_allocs++;
+  *ptr = (size_t)p;
+  return GA_NO_ERROR;
+}
+
+static void host_raw_free(void *ud, size_t ptr, size_t sz) {
+  host_mem *m = (host_mem *)ud;
+  m->used -= sz;
+  m->raw_frees++;
+  free((void *)ptr);
+}
+
+static sa_block *host_block_new(void *ud, size_t ptr, size_t sz) {
+  return malloc(sizeof(sa_block));
+}
+
+static void host_block_free(void *ud, sa_block *b) {
+  free(b);
+}
+
+static void host_split(void *ud, sa_block *b, sa_block *rest) {
+  ((host_mem *)ud)->splits++;
+  ck_assert(b->ptr + b->sz == rest->ptr);
+}
+
+static void host_merge(void *ud, sa_block *into, sa_block *from) {
+  ((host_mem *)ud)->merges++;
+  ck_assert(into->ptr + into->sz == from->ptr ||
+            from->ptr + from->sz == into->ptr);
+}
+
+static const suballoc_ops host_ops = {
+  host_raw_alloc,
+  host_raw_free,
+  host_block_new,
+  host_block_free,
+  host_split,
+  host_merge,
+};
+
+#define BLOCK 4096
+#define FRAG 64
+
+static host_mem mem;
+static suballoc *sa;
+
+static void setup(void) {
+  memset(&mem, 0, sizeof(mem));
+  sa = suballoc_new(&host_ops, &mem, BLOCK, FRAG, global_err);
+  ck_assert_ptr_ne(sa, NULL);
+}
+
+static void teardown(void) {
+  suballoc_destroy(sa);
+  ck_assert_int_eq(mem.used, 0);
+  ck_assert_int_eq(mem.raw_allocs, mem.raw_frees);
+}
+
+static gpucontext_memstats stats(void) {
+  gpucontext_memstats st;
+  suballoc_stats(sa, &st);
+  ck_assert(st.reserved_bytes == st.live_bytes + st.cached_bytes);
+  return st;
+}
+
+START_TEST(test_suballoc_basic) {
+  gpucontext_memstats st;
+  sa_block *b;
+
+  b = suballoc_alloc(sa, 100);
+  ck_assert_ptr_ne(b, NULL);
+  ck_assert_int_eq(b->sz, 128);
+  ck_assert_int_eq(mem.raw_allocs, 1);
+
+  st = stats();
+  ck_assert_int_eq(st.live_bytes, 128);
+  ck_assert_int_eq(st.reserved_bytes, BLOCK);
+  ck_assert_int_eq(st.blocks, 1);
+  ck_assert_int_eq(st.free_blocks, 1);
+  ck_assert_int_eq(st.largest_free, BLOCK - 128);
+
+  suballoc_free(sa, b);
+  st = stats();
+  ck_assert_int_eq(st.live_bytes, 0);
+  ck_assert_int_eq(st.cached_bytes, BLOCK);
+  ck_assert_int_eq(st.free_blocks, 1);
+  ck_assert_int_eq(st.allocs, 1);
+  ck_assert_int_eq(st.frees, 1);
+}
+END_TEST
+
+START_TEST(test_suballoc_split_merge) {
+  gpucontext_memstats st;
+  sa_block *b[3];
+  unsigned int i;
+
+  for (i = 0; i < 3; i++) {
+    b[i] = suballoc_alloc(sa, 128);
+    ck_assert_ptr_ne(b[i], NULL);
+  }
+  ck_assert_int_eq(mem.raw_allocs, 1);
+  ck_assert(b[0]->ptr + 128 == b[1]->ptr);
+  ck_assert(b[1]->ptr + 128 == b[2]->ptr);
+  ck_assert_int_eq(mem.splits, 3);
+
+  /* No free neighbours */
+  suballoc_free(sa, b[1]);
+  ck_assert_int_eq(mem.merges, 0);
+  ck_assert_int_eq(stats().free_blocks, 2);
+
+  /* Merges with b[1] */
+  suballoc_free(sa, b[0]);
+  ck_assert_int_eq(mem.merges, 1);
+  ck_assert_int_eq(stats().free_blocks, 2);
+
+  /* Merges with both sides */
+  suballoc_free(sa, b[2]);
+  ck_assert_int_eq(mem.merges, 3);
+  st = stats();
+  ck_assert_int_eq(st.free_blocks, 1);
+  ck_assert_int_eq(st.largest_free, BLOCK);
+  ck_assert_int_eq(st.splits, 3);
+  ck_assert_int_eq(st.merges, 3);
+}
+END_TEST
+
+START_TEST(test_suballoc_best_fit) {
+  sa_block *a, *sep1, *c, *sep2, *d;
+  size_t cptr;
+
+  a = suballoc_alloc(sa, 1024);
+  sep1 = suballoc_alloc(sa, 64);
+  c = suballoc_alloc(sa, 512);
+  sep2 = suballoc_alloc(sa, 64);
+  ck_assert(a && sep1 && c && sep2);
+  cptr = c->ptr;
+
+  suballoc_free(sa, a);
+  suballoc_free(sa, c);
+
+  /* The 512 hole is the smallest that fits */
+  d = suballoc_alloc(sa, 500);
+  ck_assert_ptr_ne(d, NULL);
+  ck_assert(d->ptr == cptr);
+
+  suballoc_free(sa, d);
+  suballoc_free(sa, sep1);
+  suballoc_free(sa, sep2);
+  ck_assert_int_eq(stats().free_blocks, 1);
+}
+END_TEST
+
+START_TEST(test_suballoc_no_merge_across_raw) {
+  sa_block *a, *b;
+
+  /* Each of those needs its own raw allocation */
+  a = suballoc_alloc(sa, BLOCK);
+  b = suballoc_alloc(sa, BLOCK);
+  ck_assert(a && b);
+  ck_assert_int_eq(mem.raw_allocs, 2);
+  suballoc_free(sa, a);
+  suballoc_free(sa, b);
+  ck_assert_int_eq(stats().free_blocks, 2);
+  ck_assert_int_eq(mem.merges, 0);
+}
+END_TEST
+
+START_TEST(test_suballoc_large) {
+  gpucontext_memstats st;
+  sa_block *b;
+
+  b = suballoc_alloc(sa, 3 * BLOCK + 1);
+  ck_assert_ptr_ne(b, NULL);
+  st = stats();
+  ck_assert_int_eq(st.reserved_bytes, 3 * BLOCK + FRAG);
+  ck_assert_int_eq(st.live_bytes, 3 * BLOCK + FRAG);
+  suballoc_free(sa, b);
+}
+END_TEST
+
+START_TEST(test_suballoc_trim) {
+  gpucontext_memstats st;
+  sa_block *a, *b;
+
+  a = suballoc_alloc(sa, 100);
+  b = suballoc_alloc(sa, 2 * BLOCK);
+  ck_assert(a && b);
+  suballoc_free(sa, b);
+
+  /* Only the raw allocation that is entirely free goes away */
+  ck_assert_int_eq(suballoc_trim(sa), 2 * BLOCK);
+  st = stats();
+  ck_assert_int_eq(st.blocks, 1);
+  ck_assert_int_eq(st.reserved_bytes, BLOCK);
+  ck_assert_int_eq(mem.used, BLOCK);
+
+  suballoc_free(sa, a);
+  ck_assert_int_eq(suballoc_trim(sa), BLOCK);
+  st = stats();
+  ck_assert_int_eq(st.blocks, 0);
+  ck_assert_int_eq(st.reserved_bytes, 0);
+  ck_assert_int_eq(st.free_blocks, 0);
+}
+END_TEST
+
+START_TEST(test_suballoc_oom) {
+  sa_block *a, *b;
+
+  mem.limit = 3 * BLOCK;
+  a = suballoc_alloc(sa, BLOCK);
+  b = suballoc_alloc(sa, BLOCK);
+  ck_assert(a && b);
+  suballoc_free(sa, a);
+  suballoc_free(sa, b);
+
+  /* The cache has to be released for this to fit */
+  a = suballoc_alloc(sa, 2 * BLOCK);
+  ck_assert_ptr_ne(a, NULL);
+  ck_assert_int_eq(stats().blocks, 1);
+
+  /* And this can't fit at all */
+  b = suballoc_alloc(sa, 2 * BLOCK);
+  ck_assert_ptr_eq(b, NULL);
+
+  suballoc_free(sa, a);
+}
+END_TEST
+
+START_TEST(test_suballoc_nocache) {
+  gpucontext_alloc_policy p;
+  gpucontext_memstats st;
+  suballoc *nc;
+  sa_block *a, *b;
+
+  nc = suballoc_new(&host_ops, &mem, 0, FRAG, global_err);
+  ck_assert_ptr_ne(nc, NULL);
+
+  a = suballoc_alloc(nc, 100);
+  b = suballoc_alloc(nc, 100);
+  ck_assert(a && b);
+  ck_assert_int_eq(a->sz, 100);
+  ck_assert_int_eq(mem.raw_allocs, 2);
+  suballoc_free(nc, a);
+  suballoc_free(nc, b);
+  ck_assert_int_eq(mem.raw_frees, 2);
+
+  suballoc_stats(nc, &st);
+  ck_assert_int_eq(st.reserved_bytes, 0);
+  suballoc_get_policy(sa, &p);
+  ck_assert_int_eq(suballoc_set_policy(nc, &p, global_err),
+                   GA_UNSUPPORTED_ERROR);
+  ck_assert_int_eq(st.cached_bytes, 0);
+  ck_assert_int_eq(st.allocs, 2);
+  suballoc_destroy(nc);
+}
+END_TEST
+
+START_TEST(test_suballoc_growth) {
+  gpucontext_alloc_policy p;
+  sa_block *b[64];
+  unsigned int i;
+
+  p.block_size = BLOCK;
+  p.max_block_size = 8 * BLOCK;
+  p.large_threshold = 0;
+  ck_assert_int_eq(suballoc_set_policy(sa, &p, global_err), GA_NO_ERROR);
+
+  for (i = 0; i < 64; i++) {
+    b[i] = suballoc_alloc(sa, BLOCK);
+    ck_assert_ptr_ne(b[i], NULL);
+  }
+  /* Blocks got bigger, but not past the maximum */
+  ck_assert_int_lt(mem.raw_allocs, 32);
+  ck_assert_int_eq(mem.max_raw, 8 * BLOCK);
+  for (i = 0; i < 64; i++)
+    suballoc_free(sa, b[i]);
+  ck_assert_int_eq(stats().free_blocks, mem.raw_allocs);
+
+  p.max_block_size = BLOCK / 2;
+  ck_assert_int_eq(suballoc_set_policy(sa, &p, global_err), GA_VALUE_ERROR);
+}
+END_TEST
+
+START_TEST(test_suballoc_large_pool) {
+  gpucontext_alloc_policy p;
+  sa_block *a, *b, *c;
+  size_t aptr;
+
+  p.block_size = BLOCK;
+  p.max_block_size = BLOCK;
+  p.large_threshold = 2 * BLOCK;
+  ck_assert_int_eq(suballoc_set_policy(sa, &p, global_err), GA_NO_ERROR);
+
+  a = suballoc_alloc(sa, 4 * BLOCK);
+  ck_assert_ptr_ne(a, NULL);
+  aptr = a->ptr;
+  suballoc_free(sa, a);
+
+  /* Small requests don't touch the large pool */
+  c = suballoc_alloc(sa, 100);
+  ck_assert_ptr_ne(c, NULL);
+  ck_assert_int_eq(mem.raw_allocs, 2);
+
+  /* A request of about the same size gets the whole block */
+  a = suballoc_alloc(sa, 4 * BLOCK - 100);
+  ck_assert_ptr_ne(a, NULL);
+  ck_assert(a->ptr == aptr);
+  ck_assert_int_eq(a->sz, 4 * BLOCK);
+  ck_assert_int_eq(mem.raw_allocs, 2);
+  suballoc_free(sa, a);
+
+  /* But a much smaller one doesn't */
+  b = suballoc_alloc(sa, 2 * BLOCK);
+  ck_assert_ptr_ne(b, NULL);
+  ck_assert_int_eq(mem.raw_allocs, 3);
+  ck_assert_int_eq(stats().largest_free, 4 * BLOCK);
+  suballoc_free(sa, b);
+  suballoc_free(sa, c);
+  ck_assert_int_eq(mem.splits, 1);
+  ck_assert_int_eq(mem.merges, 1);
+
+  ck_assert_int_eq(suballoc_trim(sa), 7 * BLOCK);
+  ck_assert_int_eq(stats().blocks, 0);
+}
+END_TEST
+
+#define NBUF 200
+
+START_TEST(test_suballoc_random) {
+  gpucontext_memstats st;
+  sa_block *b[NBUF];
+  size_t i, j, k;
+
+  memset(b, 0, sizeof(b));
+  srand(1234);
+  for (k = 0; k < 20000; k++) {
+    i = rand() % NBUF;
+    if (b[i] != NULL) {
+      for (j = 0; j < b[i]->sz; j++)
+        ck_assert_int_eq(((unsigned char *)b[i]->ptr)[j], i);
+      suballoc_free(sa, b[i]);
+      b[i] = NULL;
+    } else {
+      b[i] = suballoc_alloc(sa, rand() % (rand() % 8 ? 512 : 3 * BLOCK));
+      ck_assert_ptr_ne(b[i], NULL);
+      memset((void *)b[i]->ptr, (int)i, b[i]->sz);
+    }
+  }
+  for (i = 0; i < NBUF; i++)
+    if (b[i] != NULL)
+      suballoc_free(sa, b[i]);
+
+  /* Everything should be merged back */
+  st = stats();
+  ck_assert_int_eq(st.live_bytes, 0);
+  ck_assert_int_eq(st.free_blocks, st.blocks);
+  ck_assert_int_eq(st.allocs, st.frees);
+}
+END_TEST
+
+Suite *get_suite(void) {
+  Suite *s = suite_create("suballoc");
+  TCase *tc = tcase_create("All");
+  tcase_add_checked_fixture(tc, setup, teardown);
+  tcase_add_test(tc, test_suballoc_basic);
+  tcase_add_test(tc, test_suballoc_split_merge);
+  tcase_add_test(tc, test_suballoc_best_fit);
+  tcase_add_test(tc, test_suballoc_no_merge_across_raw);
+  tcase_add_test(tc, test_suballoc_large);
+  tcase_add_test(tc, test_suballoc_trim);
+  tcase_add_test(tc, test_suballoc_oom);
+  tcase_add_test(tc, test_suballoc_nocache);
+  tcase_add_test(tc, test_suballoc_growth);
+  tcase_add_test(tc, test_suballoc_large_pool);
+  tcase_add_test(tc, test_suballoc_random);
+  suite_add_tcase(s, tc);
+  return s;
+}
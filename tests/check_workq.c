@@ -0,0 +1,126 @@
+#include <stdlib.h>
+
+#include <check.h>
+
+#include "util/workq.h"
+
+#define NWORK 64
+
+typedef struct _count_work {
+  work w;
+  ga_mutex *lock;
+  unsigned int *total;
+  unsigned int n;
+  unsigned int res;
+} count_work;
+
+static void count(work *w) {
+  count_work *c = (count_work *)w;
+  unsigned int i;
+
+  c->res = 0;
+  for (i = 0; i < c->n; i++)
+    c->res += i;
+  ga_mutex_lock(c->lock);
+  (*c->total)++;
+  ga_mutex_unlock(c->lock);
+}
+
+static void run(workq *q) {
+  count_work w[NWORK];
+  ga_mutex lock;
+  unsigned int total = 0;
+  unsigned int i;
+
+  ck_assert_int_eq(ga_mutex_init(&lock), 0);
+  for (i = 0; i < NWORK; i++) {
+    w[i].lock = &lock;
+    w[i].total = &total;
+    w[i].n = i * 1000;
+    workq_submit(q, &w[i].w, count);
+  }
+  /* Out of order, some of those will still be queued */
+  for (i = NWORK; i > 0; i--) {
+    workq_wait(q, &w[i-1].w);
+    ck_assert(workq_done(q, &w[i-1].w));
+    ck_assert(w[i-1].res == (i-1) * 1000 * ((i-1) * 1000 - 1) / 2);
+  }
+  ck_assert_int_eq(total, NWORK);
+  ga_mutex_destroy(&lock);
+}
+
+START_TEST(test_workq) {
+  workq *q;
+
+  q = workq_new(4, NULL);
+  ck_assert(q != NULL);
+  run(q);
+  /* The queue is still usable after it ran dry */
+  run(q);
+  workq_free(q);
+}
+END_TEST
+
+START_TEST(test_workq_single) {
+  workq *q;
+
+  q = workq_new(1, NULL);
+  ck_assert(q != NULL);
+  run(q);
+  workq_free(q);
+}
+END_TEST
+
+START_TEST(test_workq_sync) {
+  /* Without a queue everything runs on submit */
+  run(NULL);
+}
+END_TEST
+
+#define NTHREADS 8
+
+static ga_once once = GA_ONCE_INIT;
+static volatile unsigned int once_calls;
+static volatile unsigned int once_value;
+
+static void once_init(void) {
+  unsigned int i;
+
+  ga_atomic_inc(&once_calls);
+  /* Give the other threads time to get in */
+  for (i = 0; i < 1000000; i++)
+    once_value = i;
+  once_value = 42;
+}
+
+static void once_thread(void *arg) {
+  ga_call_once(&once, once_init);
+  *(unsigned int *)arg = once_value;
+}
+
+START_TEST(test_once) {
+  ga_thread t[NTHREADS];
+  unsigned int seen[NTHREADS];
+  unsigned int i;
+
+  for (i = 0; i < NTHREADS; i++)
+    ck_assert_int_eq(ga_thread_start(&t[i], once_thread, &seen[i]), 0);
+  for (i = 0; i < NTHREADS; i++)
+    ga_thread_join(t[i]);
+  ck_assert_int_eq(once_calls, 1);
+  /* Nobody got past before the init was done */
+  for (i = 0; i < NTHREADS; i++)
+    ck_assert_int_eq(seen[i], 42);
+}
+END_TEST
+
+Suite *get_suite(void) {
+  Suite *s = suite_create("workq");
+  TCase *tc = tcase_create("All");
+  tcase_add_test(tc, test_workq);
+  tcase_add_test(tc, test_workq_single);
+  tcase_add_test(tc, test_workq_sync);
+  tcase_add_test(tc, test_once);
+  suite_add_tcase(s, tc);
+  return s;
+}
@@ -0,0 +1,466 @@
+/*
+ * Stub CUDA driver library for testing without a GPU.
+ *
+ * This implements the functions listed in src/loaders/libcuda.fn on
+ * top of host memory so that the buffer management code of the cuda
+ * backend can be exercised anywhere.  Kernel launches don't do
+ * anything and all the copies are synchronous.
+ *
+ * The amount of "device" memory available can be capped by setting
+ * STUB_CUDA_MEMORY to a number of bytes (default is 1GB).
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#define LOADER_STUB
+#include "loaders/libcuda.h"
+
+#define CUDA_ERROR_INVALID_VALUE 1
+#define CUDA_ERROR_INVALID_DEVICE 101
+#define CUDA_ERROR_NOT_FOUND 500
+#define CUDA_ERROR_NOT_SUPPORTED 801
+
+/* Declare all the functions with the types from the loader so that
+   the compiler checks the definitions below against them. */
+#define DEF_PROC(name, args) t##name name
+#define DEF_PROC_V2(name, args) t##name name##_v2
+
+#include "loaders/libcuda.fn"
+
+#undef DEF_PROC_V2
+#undef DEF_PROC
+
+/*
+ * Each allocation is preceded by a header that records its size.  Like
+ * with the real driver, allocations are 256-byte aligned.
+ */
+#define HDR_SIZE 256
+
+static size_t mem_limit = 0;
+static size_t mem_used = 0;
+
+struct CUctx_st { int dummy; };
+struct CUmod_st { int dummy; };
+struct CUfunc_st { int dummy; };
+struct CUevent_st { int ready; };
+struct CUstream_st { int dummy; };
+struct CUlinkState_st {
+  void *data;
+  size_t size;
+};
+
+static struct CUctx_st the_ctx;
+static struct CUmod_st the_mod;
+static struct CUfunc_st the_func;
+
+static int primary_active = 0;
+static unsigned int primary_flags = 0;
+
+CUresult cuInit(int flags) {
+  const char *lim = getenv("STUB_CUDA_MEMORY");
+  mem_limit = (size_t)1 << 30;
+  if (lim != NULL)
+    mem_limit = (size_t)strtoull(lim, NULL, 10);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDriverGetVersion(int *driverVersion) {
+  *driverVersion = 8000;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuGetErrorName(CUresult error, const char **pStr) {
+  switch ((int)error) {
+  case CUDA_SUCCESS: *pStr = "CUDA_SUCCESS"; break;
+  case CUDA_ERROR_INVALID_VALUE: *pStr = "CUDA_ERROR_INVALID_VALUE"; break;
+  case CUDA_ERROR_OUT_OF_MEMORY: *pStr = "CUDA_ERROR_OUT_OF_MEMORY"; break;
+  case CUDA_ERROR_INVALID_DEVICE: *pStr = "CUDA_ERROR_INVALID_DEVICE"; break;
+  case CUDA_ERROR_NOT_FOUND: *pStr = "CUDA_ERROR_NOT_FOUND"; break;
+  case CUDA_ERROR_NOT_READY: *pStr = "CUDA_ERROR_NOT_READY"; break;
+  case CUDA_ERROR_NOT_SUPPORTED: *pStr = "CUDA_ERROR_NOT_SUPPORTED"; break;
+  default: *pStr = "CUDA_ERROR_UNKNOWN";
+  }
+  return CUDA_SUCCESS;
+}
+
+CUresult cuGetErrorString(CUresult error, const char **pStr) {
+  return cuGetErrorName(error, pStr);
+}
+
+CUresult cuDeviceGet(CUdevice *device, int ordinal) {
+  if (ordinal != 0)
+    return CUDA_ERROR_INVALID_DEVICE;
+  *device = 0;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetCount(int *count) {
+  *count = 1;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetName(char *name, int len, CUdevice dev) {
+  strncpy(name, "Stub device", len);
+  name[len - 1] = '\0';
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetAttribute(int *pi, CUdevice_attribute attrib,
+                              CUdevice dev) {
+  switch (attrib) {
+  case CU_DEVICE_ATTRIBUTE_MAX_THREADS_PER_BLOCK:
+  case CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_X:
+  case CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_Y:
+    *pi = 1024;
+    break;
+  case CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_Z:
+    *pi = 64;
+    break;
+  case CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_X:
+    *pi = 2147483647;
+    break;
+  case CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_Y:
+  case CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_Z:
+    *pi = 65535;
+    break;
+  case CU_DEVICE_ATTRIBUTE_MAX_SHARED_MEMORY_PER_BLOCK:
+    *pi = 49152;
+    break;
+  case CU_DEVICE_ATTRIBUTE_WARP_SIZE:
+    *pi = 32;
+    break;
+  case CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT:
+    *pi = 2;
+    break;
+  case CU_DEVICE_ATTRIBUTE_UNIFIED_ADDRESSING:
+  case CU_DEVICE_ATTRIBUTE_CAN_MAP_HOST_MEMORY:
+    *pi = 1;
+    break;
+  case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR:
+    *pi = 3;
+    break;
+  case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR:
+    *pi = 5;
+    break;
+  default:
+    *pi = 0;
+  }
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetPCIBusId(char *pciBusId, int len, CUdevice dev) {
+  strncpy(pciBusId, "0000:00:00.0", len);
+  pciBusId[len - 1] = '\0';
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDevicePrimaryCtxGetState(CUdevice dev, unsigned int *flags,
+                                    int *active) {
+  *flags = primary_flags;
+  *active = primary_active;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDevicePrimaryCtxSetFlags(CUdevice dev, unsigned int flags) {
+  primary_flags = flags;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDevicePrimaryCtxRelease(CUdevice dev) {
+  if (primary_active > 0)
+    primary_active--;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDevicePrimaryCtxRetain(CUcontext *pctx, CUdevice dev) {
+  primary_active++;
+  *pctx = &the_ctx;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuCtxGetDevice(CUdevice *device) {
+  *device = 0;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuCtxPushCurrent_v2(CUcontext ctx) {
+  return CUDA_SUCCESS;
+}
+
+CUresult cuCtxPopCurrent_v2(CUcontext *pctx) {
+  if (pctx != NULL)
+    *pctx = &the_ctx;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuLinkCreate(unsigned int numOptions, CUjit_option *options,
+                      void **optionValues, CUlinkState *stateOut) {
+  *stateOut = calloc(1, sizeof(struct CUlinkState_st));
+  if (*stateOut == NULL)
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuLinkAddData(CUlinkState state, CUjitInputType type, void *data,
+                       size_t size, const char *name,
+                       unsigned int numOptions, CUjit_option *options,
+                       void **optionValues) {
+  void *tmp = realloc(state->data, state->size + size);
+  if (tmp == NULL)
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  memcpy((char *)tmp + state->size, data, size);
+  state->data = tmp;
+  state->size += size;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuLinkComplete(CUlinkState state, void **cubinOut,
+                        size_t *sizeOut) {
+  *cubinOut = state->data;
+  *sizeOut = state->size;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuLinkDestroy(CUlinkState state) {
+  free(state->data);
+  free(state);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuModuleLoadData(CUmodule *module, const void *image) {
+  *module = &the_mod;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuModuleLoadDataEx(CUmodule *module, const void *image,
+                            unsigned int numOptions, CUjit_option *options,
+                            void **optionValues) {
+  return cuModuleLoadData(module, image);
+}
+
+CUresult cuModuleUnload(CUmodule hmod) {
+  return CUDA_SUCCESS;
+}
+
+CUresult cuModuleGetFunction(CUfunction *hfunc, CUmodule hmod,
+                             const char *name) {
+  *hfunc = &the_func;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemGetInfo_v2(size_t *free, size_t *total) {
+  *free = mem_limit - mem_used;
+  *total = mem_limit;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemAlloc_v2(CUdeviceptr *dptr, size_t bytesize) {
+  void *_p;
+  char *p;
+  if (bytesize == 0)
+    return CUDA_ERROR_INVALID_VALUE;
+  if (bytesize > mem_limit - mem_used)
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  if (posix_memalign(&_p, HDR_SIZE, bytesize + HDR_SIZE) != 0)
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  p = (char *)_p;
+  *(size_t *)p = bytesize;
+  mem_used += bytesize;
+  *dptr = (CUdeviceptr)(p + HDR_SIZE);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemFree_v2(CUdeviceptr dptr) {
+  char *p = (char *)dptr - HDR_SIZE;
+  mem_used -= *(size_t *)p;
+  free(p);
+  return CUDA_SUCCESS;
+}
+
+/* Pinned host allocations are remembered for cuPointerGetAttribute() */
+struct host_alloc {
+  char *p;
+  size_t sz;
+  struct host_alloc *next;
+};
+
+static struct host_alloc *host_allocs = NULL;
+
+CUresult cuMemAllocHost_v2(void **pp, size_t bytesize) {
+  struct host_alloc *h = malloc(sizeof(*h));
+  if (h == NULL)
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  *pp = malloc(bytesize);
+  if (*pp == NULL) {
+    free(h);
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  }
+  h->p = *pp;
+  h->sz = bytesize;
+  h->next = host_allocs;
+  host_allocs = h;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemFreeHost(void *p) {
+  struct host_alloc **h, *tmp;
+  for (h = &host_allocs; *h != NULL; h = &(*h)->next) {
+    if ((*h)->p == p) {
+      tmp = *h;
+      *h = tmp->next;
+      free(tmp);
+      break;
+    }
+  }
+  free(p);
+  return CUDA_SUCCESS;
+}
+
+/* Like the real driver, fails for pageable memory */
+CUresult cuPointerGetAttribute(void *data, CUpointer_attribute attribute,
+                               CUdeviceptr ptr) {
+  struct host_alloc *h;
+  if (attribute != CU_POINTER_ATTRIBUTE_MEMORY_TYPE)
+    return CUDA_ERROR_NOT_SUPPORTED;
+  for (h = host_allocs; h != NULL; h = h->next) {
+    if ((char *)ptr >= h->p && (char *)ptr < h->p + h->sz) {
+      *(unsigned int *)data = CU_MEMORYTYPE_HOST;
+      return CUDA_SUCCESS;
+    }
+  }
+  return CUDA_ERROR_INVALID_VALUE;
+}
+
+/* Host memory doesn't count against the device memory limit */
+CUresult cuMemHostAlloc(void **pp, size_t bytesize, unsigned int Flags) {
+  return cuMemAllocHost_v2(pp, bytesize);
+}
+
+CUresult cuMemHostGetDevicePointer_v2(CUdeviceptr *pdptr, void *p,
+                                      unsigned int Flags) {
+  *pdptr = (CUdeviceptr)p;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemcpyHtoDAsync_v2(CUdeviceptr dstDevice, const void *srcHost,
+                              size_t ByteCount, CUstream hStream) {
+  memcpy((void *)dstDevice, srcHost, ByteCount);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemcpyHtoD_v2(CUdeviceptr dstDevice, const void *srcHost,
+                         size_t ByteCount) {
+  memcpy((void *)dstDevice, srcHost, ByteCount);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemcpyDtoHAsync_v2(void *dstHost, CUdeviceptr srcDevice,
+                              size_t ByteCount, CUstream hStream) {
+  memcpy(dstHost, (void *)srcDevice, ByteCount);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemcpyDtoDAsync_v2(CUdeviceptr dstDevice, CUdeviceptr srcDevice,
+                              size_t ByteCount, CUstream hStream) {
+  memmove((void *)dstDevice, (void *)srcDevice, ByteCount);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemcpyPeerAsync(CUdeviceptr dstDevice, CUcontext dstContext,
+                           CUdeviceptr srcDevice, CUcontext srcContext,
+                           size_t ByteCount, CUstream hStream) {
+  memmove((void *)dstDevice, (void *)srcDevice, ByteCount);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemsetD8Async(CUdeviceptr dstDevice, unsigned char uc, size_t N,
+                         CUstream hStream) {
+  memset((void *)dstDevice, uc, N);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuLaunchKernel(CUfunction f, unsigned int gridDimX,
+                        unsigned int gridDimY, unsigned int gridDimZ,
+                        unsigned int blockDimX, unsigned int blockDimY,
+                        unsigned int blockDimZ, unsigned int sharedMemBytes,
+                        CUstream hStream, void **kernelParams, void **extra) {
+  return CUDA_SUCCESS;
+}
+
+CUresult cuFuncGetAttribute(int *pi, CUfunction_attribute attrib,
+                            CUfunction hfunc) {
+  switch (attrib) {
+  case CU_FUNC_ATTRIBUTE_MAX_THREADS_PER_BLOCK:
+    *pi = 1024;
+    break;
+  default:
+    *pi = 0;
+  }
+  return CUDA_SUCCESS;
+}
+
+CUresult cuEventCreate(CUevent *phEvent, unsigned int Flags) {
+  *phEvent = malloc(sizeof(struct CUevent_st));
+  if (*phEvent == NULL)
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  (*phEvent)->ready = 1;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuEventRecord(CUevent hEvent, CUstream hStream) {
+  hEvent->ready = 0;
+  return CUDA_SUCCESS;
+}
+
+/* Pretend that the work takes a while: the first query after a
+   record reports that it is still pending. */
+CUresult cuEventQuery(CUevent hEvent) {
+  if (hEvent->ready)
+    return CUDA_SUCCESS;
+  hEvent->ready = 1;
+  return CUDA_ERROR_NOT_READY;
+}
+
+CUresult cuEventSynchronize(CUevent hEvent) {
+  hEvent->ready = 1;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuEventDestroy_v2(CUevent hEvent) {
+  free(hEvent);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuStreamCreate(CUstream *phStream, unsigned int Flags) {
+  *phStream = malloc(sizeof(struct CUstream_st));
+  if (*phStream == NULL)
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuStreamWaitEvent(CUstream hStream, CUevent hEvent,
+                           unsigned int Flags) {
+  return CUDA_SUCCESS;
+}
+
+CUresult cuStreamSynchronize(CUstream hStream) {
+  return CUDA_SUCCESS;
+}
+
+CUresult cuStreamDestroy_v2(CUstream hStream) {
+  free(hStream);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuIpcGetMemHandle(CUipcMemHandle *pHandle, CUdeviceptr dptr) {
+  return CUDA_ERROR_NOT_SUPPORTED;
+}
+
+CUresult cuIpcOpenMemHandle(CUdeviceptr *pdptr, CUipcMemHandle handle,
+                            unsigned int Flags) {
+  return CUDA_ERROR_NOT_SUPPORTED;
+}
+
+CUresult cuIpcCloseMemHandle(CUdeviceptr dptr) {
+  return CUDA_ERROR_NOT_SUPPORTED;
+}
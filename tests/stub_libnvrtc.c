@@ -0,0 +1,79 @@
+/*
+ * Stub NVRTC library for testing without a GPU.
+ *
+ * "Compiling" a program just hands back the source as the PTX, which
+ * the stub CUDA driver will happily load.  Sources with an #error
+ * directive fail to compile.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#define LOADER_STUB
+#include "loaders/libcuda.h"
+#include "loaders/libnvrtc.h"
+
+#define DEF_PROC(rt, name, args) t##name name
+
+#include "loaders/libnvrtc.fn"
+
+#undef DEF_PROC
+
+struct _nvrtcProgram {
+  char *src;
+};
+
+nvrtcResult nvrtcCreateProgram(nvrtcProgram *prog, const char *src,
+                               const char *name, int numHeaders,
+                               const char **headers,
+                               const char **includeNames) {
+  nvrtcProgram p = malloc(sizeof(*p));
+  if (p == NULL)
+    return (nvrtcResult)1;
+  p->src = strdup(src);
+  if (p->src == NULL) {
+    free(p);
+    return (nvrtcResult)1;
+  }
+  *prog = p;
+  return NVRTC_SUCCESS;
+}
+
+nvrtcResult nvrtcCompileProgram(nvrtcProgram prog, int numOptions,
+                                const char **options) {
+  if (strstr(prog->src, "#error") != NULL)
+    return (nvrtcResult)6; /* NVRTC_ERROR_COMPILATION */
+  return NVRTC_SUCCESS;
+}
+
+nvrtcResult nvrtcDestroyProgram(nvrtcProgram *prog) {
+  free((*prog)->src);
+  free(*prog);
+  *prog = NULL;
+  return NVRTC_SUCCESS;
+}
+
+nvrtcResult nvrtcGetProgramLog(nvrtcProgram prog, char *log) {
+  log[0] = '\0';
+  return NVRTC_SUCCESS;
+}
+
+nvrtcResult nvrtcGetProgramLogSize(nvrtcProgram prog, size_t *logSizeRet) {
+  *logSizeRet = 1;
+  return NVRTC_SUCCESS;
+}
+
+nvrtcResult nvrtcGetPTX(nvrtcProgram prog, char *ptx) {
+  strcpy(ptx, prog->src);
+  return NVRTC_SUCCESS;
+}
+
+nvrtcResult nvrtcGetPTXSize(nvrtcProgram prog, size_t *ptxSizeRet) {
+  *ptxSizeRet = strlen(prog->src) + 1;
+  return NVRTC_SUCCESS;
+}
+
+const char *nvrtcGetErrorString(nvrtcResult result) {
+  if (result == NVRTC_SUCCESS)
+    return "NVRTC_SUCCESS";
+  return "NVRTC_ERROR";
+}